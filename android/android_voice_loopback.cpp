@@ -1,100 +1,379 @@
 // android_voice_loopback.cpp
 // Minimal low-latency Android voice loopback using Oboe (AAudio).
+// The output callback services both streams (see OboeEngine). The default
+// (generic) input preset gets no platform AEC, so capture runs through the
+// common echo canceller.
 // Requires Oboe library: https://github.com/google/oboe
 // Build via Android Studio + CMake with Oboe linked as submodule.
 //
 // JNI functions provided:
 //   Java_com_example_voice_Loopback_start
 //   Java_com_example_voice_Loopback_stop
+//   Java_com_example_voice_Loopback_measureLatency  (blocking; returns a report)
+//   Java_com_example_voice_Loopback_metrics         (JSON snapshot)
+//   Java_com_example_voice_Loopback_setControl      (id, value; see nuchat::Control)
+//   Java_com_example_voice_Loopback_control         (a control line, as on the CLIs)
+// Controls apply at the next period of the running stream.
 
 #include <oboe/Oboe.h>
+#include <android/log.h>
+#include <algorithm>
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <chrono>
+#include <jni.h>
+#include <mutex>
+#include <string>
 
-using namespace oboe;
+#include "../common/audio_engine.h"
+#include "../common/echo_canceller.h"
+#include "../common/latency_probe.h"
+#include "../common/processing_graph.h"
+#include "../common/stream_metrics.h"
 
-struct FloatFIFO {
-    std::vector<float> buf;
-    std::atomic<uint32_t> w{0}, r{0};
-    uint32_t mask;
-    explicit FloatFIFO(uint32_t frames) {
-        uint32_t p = 1; while (p < frames) p <<= 1;
-        buf.resize(p); mask = p - 1;
-    }
-    void push(const float* src, uint32_t n) {
-        auto wi = w.load(); auto ri = r.load();
-        auto free = ((mask + 1) - (wi - ri)) & mask;
-        if (n > free) n = free;
-        for (uint32_t i = 0; i < n; ++i)
-            buf[(wi + i) & mask] = src[i];
-        w.store((wi + n) & mask);
-    }
-    void pop(float* dst, uint32_t n) {
-        auto wi = w.load(); auto ri = r.load();
-        auto avail = (wi - ri) & mask;
-        auto got = n < avail ? n : avail;
-        for (uint32_t i = 0; i < got; ++i)
-            dst[i] = buf[(ri + i) & mask];
-        r.store((ri + got) & mask);
-        if (got < n) memset(dst + got, 0, (n - got) * sizeof(float));
-    }
-};
+using namespace oboe;
 
-static FloatFIFO gFifo(1 << 16);
+// Host time at which frame `index` of s passes the converter, extrapolated
+// from the stream's last hardware timestamp (CLOCK_MONOTONIC, the clock
+// std::chrono::steady_clock reads). False until the stream reports one.
+static bool frame_time(AudioStream* s, int64_t index, uint64_t& hostNs) {
+    auto ts = s->getTimestamp(CLOCK_MONOTONIC);
+    if (!ts || ts.value().timestamp <= 0) return false;
+    double ns = double(ts.value().timestamp) + double(index - ts.value().position) * 1e9 / s->getSampleRate();
+    if (ns <= 0) return false;
+    hostNs = uint64_t(ns);
+    return true;
+}
 
-class FullDuplex : public AudioStreamCallback {
+// By default the output stream's callback drives both directions: it reads
+// whatever input is ready with a non-blocking read and runs the processor on
+// it directly, so the two streams stay phase-aligned and there is no FIFO in
+// the path. splitCallbacks = true restores one callback per stream bridged
+// by the jitter buffer.
+//
+// A disconnected stream (headset unplugged, route change) is reopened from
+// Oboe's error callback at the rate the engine already runs at, so FIFO,
+// jitter buffer and DSP state carry over and the other stream never stops.
+// While the input is down the duplex callback renders it as silence.
+class OboeEngine : public nuchat::AudioEngine, public AudioStreamCallback {
 public:
-    std::shared_ptr<AudioStream> inputStream, outputStream;
+    bool splitCallbacks = false; // only changed while stopped
+
+    const char* name() const override { return splitCallbacks ? "oboe" : "oboe-duplex"; }
 
     DataCallbackResult onAudioReady(AudioStream* stream, void* audioData,
                                     int32_t numFrames) override {
-        if (stream == inputStream.get()) {
-            gFifo.push((float*)audioData, numFrames);
-        } else if (stream == outputStream.get()) {
-            gFifo.pop((float*)audioData, numFrames);
+        if (splitCallbacks) {
+            // By direction: either stream pointer may be swapped by a reopen.
+            uint64_t hostNs;
+            if (stream->getDirection() == Direction::Input) {
+                if (frame_time(stream, stream->getFramesRead(), hostNs)) noteCaptureTime(hostNs);
+                onCapture(static_cast<const float*>(audioData), numFrames);
+            } else {
+                if (frame_time(stream, stream->getFramesWritten(), hostNs)) noteRenderTime(hostNs);
+                onRender(static_cast<float*>(audioData), numFrames);
+            }
+        } else {
+            duplexCallback(static_cast<float*>(audioData), numFrames);
         }
         return DataCallbackResult::Continue;
     }
 
-    void start() {
+    // Oboe thread, before it closes a failed stream: stop reading input, and
+    // wait out a duplex callback that saw inputLive set and may still be in
+    // inputStream->read() or getAvailableFrames(). Both sides are seq_cst
+    // so that either the callback sees the flag cleared or this sees it busy.
+    void onErrorBeforeClose(AudioStream* stream, Result) override {
+        if (stream != inputStream.get())
+            return;
+        inputLive.store(false);
+        while (inputBusy.load())
+            std::this_thread::yield();
+    }
+
+    // Oboe thread, after the failed stream was closed.
+    void onErrorAfterClose(AudioStream* stream, Result error) override {
+        if (error != Result::ErrorDisconnected)
+            return;
+        std::lock_guard<std::mutex> lock(deviceLock);
+        if (!running)
+            return;
+        if (stream == outputStream.get())
+            reopenOutput();
+        else if (stream == inputStream.get())
+            reopenInput();
+    }
+
+    bool start(const nuchat::AudioFormat& want) override {
         AudioStreamBuilder inBuilder, outBuilder;
+        configureInput(inBuilder);
+        configureOutput(outBuilder);
 
-        inBuilder.setDirection(Direction::Input)
-                 .setPerformanceMode(PerformanceMode::LowLatency)
-                 .setSharingMode(SharingMode::Exclusive)
-                 .setFormat(AudioFormat::Float)
-                 .setChannelCount(ChannelCount::Mono)
-                 .setSampleRate(48000)
-                 .setCallback(this);
-
-        outBuilder.setDirection(Direction::Output)
-                  .setPerformanceMode(PerformanceMode::LowLatency)
-                  .setSharingMode(SharingMode::Exclusive)
-                  .setFormat(AudioFormat::Float)
-                  .setChannelCount(ChannelCount::Mono)
-                  .setSampleRate(48000)
-                  .setCallback(this);
-
-        inBuilder.openStream(inputStream);
-        outBuilder.openStream(outputStream);
+        // No rate is requested: asking for anything but the native rate puts
+        // a resampler in the framework and loses the fast mixer path. The
+        // graph then runs at whatever the output opened at. Open output first
+        // so the input can be asked for the same rate.
+        if (outBuilder.openStream(outputStream) != Result::OK) {
+            closeBlocking();
+            return false;
+        }
+        inBuilder.setSampleRate(outputStream->getSampleRate());
+        if (inBuilder.openStream(inputStream) != Result::OK) {
+            closeBlocking();
+            return false;
+        }
 
+        // Callbacks can be as large as the output buffer capacity.
+        capacity = (uint32_t)outputStream->getBufferCapacityInFrames();
+        burst = outputStream->getFramesPerBurst();
+        nuchat::AudioFormat granted = want;
+        granted.sampleRate = outputStream->getSampleRate();
+        granted.channels = 1;
+        granted.framesPerPeriod = (uint32_t)burst;
+        prepare(granted, capacity);
+        inputScratch.assign(capacity * 2, 0.0f); // block + room to drain backlog
+
+        // Start at two bursts of output buffering and let duplexCallback grow
+        // it one burst per xrun.
+        if (!splitCallbacks)
+            outputStream->setBufferSizeInFrames(burst * 2);
+        lastOutputXruns = 0;
+        inputPrimed = false;
+
+        // Input first, so the first output callback finds data waiting.
+        inputLive.store(true, std::memory_order_release);
         inputStream->requestStart();
         outputStream->requestStart();
+        std::lock_guard<std::mutex> lock(deviceLock);
+        running = true;
+        return true;
     }
 
-    void stop() {
-        if (inputStream) inputStream->requestStop();
+    void stop() override {
+        std::lock_guard<std::mutex> lock(deviceLock);
+        running = false;
         if (outputStream) outputStream->requestStop();
+        if (inputStream) inputStream->requestStop();
+    }
+
+    // Copies the xrun counts AAudio keeps per stream into the metrics.
+    void refreshXruns() {
+        if (inputStream) {
+            auto x = inputStream->getXRunCount();
+            if (x) capMetrics.setXruns(x.value());
+        }
+        if (outputStream) {
+            auto x = outputStream->getXRunCount();
+            if (x) renMetrics.setXruns(x.value());
+        }
     }
+
+    // Runs `trials` probe bursts through freshly opened streams and returns
+    // the statistics. Streams are left closed afterwards.
+    std::string measureLatency(uint32_t trials) {
+        closeBlocking();
+        nuchat::LatencyProbeConfig cfg;
+        cfg.trials = trials;
+        nuchat::LatencyProbe p(cfg);
+        setLatencyProbe(&p);
+        if (start(nuchat::AudioFormat{})) {
+            while (!p.step())
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        closeBlocking();
+        setLatencyProbe(nullptr);
+        return p.report();
+    }
+
+private:
+    // Output callback of the duplex mode. Input frames that are not ready yet
+    // are rendered as silence; a backlog beyond kMaxBacklogBursts is dropped
+    // so that round-trip latency cannot creep up after a hiccup.
+    void duplexCallback(float* out, int32_t numFrames) {
+        static const int32_t kMaxBacklogBursts = 2;
+        // A reopened output may call back with more than start() sized for.
+        if ((uint32_t)numFrames > capacity) {
+            std::fill(out, out + numFrames, 0.0f);
+            renMetrics.addXrun();
+            return;
+        }
+        inputBusy.store(true); // before looking at inputLive, see onErrorBeforeClose()
+        bool live = inputLive.load();
+        int32_t got = 0;
+        uint64_t hostNs;
+        if (live) {
+            int64_t first = inputStream->getFramesRead();
+            auto r = inputStream->read(inputScratch.data(), numFrames, 0);
+            if (r) got = r.value();
+            if (got > 0 && frame_time(inputStream.get(), first, hostNs)) noteCaptureTime(hostNs);
+        }
+        if (frame_time(outputStream.get(), outputStream->getFramesWritten(), hostNs)) noteRenderTime(hostNs);
+        if (got > 0) inputPrimed = true;
+        if (got < numFrames) {
+            std::fill(inputScratch.begin() + got, inputScratch.begin() + numFrames, 0.0f);
+            if (inputPrimed && live) renMetrics.addUnderflowFrames(numFrames - got);
+        }
+
+        auto backlog = live ? inputStream->getAvailableFrames() : ResultWithValue<int32_t>(0);
+        if (backlog) capMetrics.noteFill((uint32_t)backlog.value());
+        if (backlog && backlog.value() > burst * kMaxBacklogBursts) {
+            int32_t excess = backlog.value() - burst;
+            int32_t dropped = 0;
+            while (dropped < excess) {
+                int32_t chunk = std::min<int32_t>(excess - dropped, (int32_t)inputScratch.size() - numFrames);
+                auto d = inputStream->read(inputScratch.data() + numFrames, chunk, 0);
+                if (!d || d.value() <= 0) break;
+                dropped += d.value();
+            }
+            capMetrics.addOverflowDrops(dropped);
+        }
+        inputBusy.store(false, std::memory_order_release); // done with inputStream
+
+        // Grow the output buffer by a burst whenever AAudio reports new xruns.
+        auto x = outputStream->getXRunCount();
+        if (x && x.value() > lastOutputXruns) {
+            lastOutputXruns = x.value();
+            int32_t size = outputStream->getBufferSizeInFrames() + burst;
+            if (size <= outputStream->getBufferCapacityInFrames())
+                outputStream->setBufferSizeInFrames(size);
+        }
+
+        onDuplex(inputScratch.data(), out, (uint32_t)numFrames);
+    }
+
+    void configureInput(AudioStreamBuilder& b) {
+        b.setDirection(Direction::Input)
+         .setPerformanceMode(PerformanceMode::LowLatency)
+         .setSharingMode(SharingMode::Exclusive)
+         .setFormat(oboe::AudioFormat::Float)
+         .setChannelCount(ChannelCount::Mono);
+        if (splitCallbacks)
+            b.setCallback(this);
+        else
+            b.setErrorCallback(this); // no data callback, but disconnects still reported
+    }
+
+    void configureOutput(AudioStreamBuilder& b) {
+        b.setDirection(Direction::Output)
+         .setPerformanceMode(PerformanceMode::LowLatency)
+         .setSharingMode(SharingMode::Exclusive)
+         .setFormat(oboe::AudioFormat::Float)
+         .setChannelCount(ChannelCount::Mono)
+         .setCallback(this);
+    }
+
+    // The replacement runs at the engine's rate even if the new route does
+    // not (Oboe converts), so nothing downstream has to be re-prepared.
+    std::shared_ptr<AudioStream> reopen(AudioStreamBuilder& b, const char* which) {
+        b.setSampleRate((int32_t)fmt.sampleRate)
+         .setSampleRateConversionQuality(SampleRateConversionQuality::Medium);
+        std::shared_ptr<AudioStream> stream;
+        if (b.openStream(stream) != Result::OK) {
+            __android_log_print(ANDROID_LOG_WARN, "nuchat", "cannot reopen %s stream", which);
+            return nullptr;
+        }
+        return stream;
+    }
+
+    // Error thread, deviceLock held, after Oboe closed the output. In duplex
+    // mode no callback can be running now, since the output drives them.
+    void reopenOutput() {
+        AudioStreamBuilder b;
+        configureOutput(b);
+        std::shared_ptr<AudioStream> stream = reopen(b, "output");
+        outputStream = stream;
+        if (!stream)
+            return;
+        burst = stream->getFramesPerBurst();
+        if (!splitCallbacks)
+            stream->setBufferSizeInFrames(std::min(burst * 2, stream->getBufferCapacityInFrames()));
+        lastOutputXruns = 0;
+        stream->requestStart();
+    }
+
+    // Error thread, deviceLock held. onErrorBeforeClose() cleared inputLive
+    // and waited for the duplex callback to leave inputStream, so it can be
+    // swapped here.
+    void reopenInput() {
+        AudioStreamBuilder b;
+        configureInput(b);
+        std::shared_ptr<AudioStream> stream = reopen(b, "input");
+        inputStream = stream;
+        if (!stream)
+            return;
+        stream->requestStart();
+        inputLive.store(true, std::memory_order_release);
+    }
+
+    // Unlike stop(), waits until no callback can still be running.
+    void closeBlocking() {
+        std::lock_guard<std::mutex> lock(deviceLock);
+        running = false;
+        inputLive.store(false, std::memory_order_release);
+        if (outputStream) outputStream->close();
+        if (inputStream) inputStream->close();
+        inputStream.reset();
+        outputStream.reset();
+    }
+
+    std::shared_ptr<AudioStream> inputStream, outputStream;
+    std::vector<float> inputScratch; // sized in start()
+    uint32_t capacity = 0;           // largest callback start() prepared for
+    std::mutex deviceLock;           // start/stop against stream reopening
+    bool running = false;
+    std::atomic<bool> inputLive{false}; // inputStream may be read by the callback
+    std::atomic<bool> inputBusy{false}; // the duplex callback is using inputStream
+    int32_t burst = 0;
+    int32_t lastOutputXruns = 0;
+    bool inputPrimed = false;
 };
 
-static FullDuplex gDuplex;
+static OboeEngine gEngine;
+static nuchat::ProcessingGraph gGraph; // plain loopback; DSP stages are added here
+static nuchat::EchoCanceller gEchoCanceller;
+static nuchat::MetricsExporter gExporter;
 
 extern "C" void Java_com_example_voice_Loopback_start(JNIEnv*, jobject) {
-    gDuplex.start();
+    gEngine.setProcessor(&gGraph);
+    gEngine.setEchoCanceller(&gEchoCanceller);
+    gEngine.start(nuchat::AudioFormat{});
 }
 
 extern "C" void Java_com_example_voice_Loopback_stop(JNIEnv*, jobject) {
-    gDuplex.stop();
+    gEngine.stop();
+}
+
+extern "C" jstring Java_com_example_voice_Loopback_measureLatency(JNIEnv* env, jobject, jint trials) {
+    std::string report = gEngine.measureLatency(trials > 0 ? (uint32_t)trials : 20);
+    return env->NewStringUTF(report.c_str());
+}
+
+// id is the nuchat::Control ordinal, so the Java side mirrors that enum.
+extern "C" jboolean Java_com_example_voice_Loopback_setControl(JNIEnv*, jobject, jint id, jfloat value) {
+    if (id < 0 || id > jint(nuchat::Control::EchoCancel))
+        return JNI_FALSE;
+    return gEngine.post({nuchat::Control(id), value}) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" jboolean Java_com_example_voice_Loopback_control(JNIEnv* env, jobject, jstring line) {
+    const char* text = env->GetStringUTFChars(line, nullptr);
+    if (!text)
+        return JNI_FALSE;
+    bool ok = gEngine.command(text);
+    env->ReleaseStringUTFChars(line, text);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" jstring Java_com_example_voice_Loopback_metrics(JNIEnv* env, jobject) {
+    static bool registered = false;
+    if (!registered) {
+        gExporter.add(&gEngine.captureMetrics());
+        gExporter.add(&gEngine.renderMetrics());
+        gExporter.setBeforeExport([] { gEngine.refreshXruns(); });
+        registered = true;
+    }
+    std::string json = gExporter.render(nuchat::MetricsFormat::Json);
+    return env->NewStringUTF(json.c_str());
 }
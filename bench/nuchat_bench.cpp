@@ -0,0 +1,272 @@
+// nuchat_bench.cpp
+// Microbenchmarks for the realtime core: FIFO, drift resampler, jitter
+// buffer, format conversion, rate conversion, echo cancellation, voice
+// activity detection, processing graph, the server mixer, the session
+// host, the realtime worker handoff and fixed- vs runtime-size kernels,
+// then the ring across threads (ring_suite.cpp).
+//
+// Run: ./nuchat_bench [filter]
+//      ./nuchat_bench --stress [seconds]
+// Each case processes 128-frame blocks, the period the backends ask for.
+// The best of several repetitions is reported as ns per frame, which is what
+// matters against a 20.8 us/frame budget at 48 kHz. The ring/* cases vary
+// the block size and thread placement and add latency and cache misses.
+// --stress checks SpscRing under random producer/consumer interleavings
+// instead, and exits non-zero if any check fails.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "block_dispatch.h"
+#include "control.h"
+#include "drift_resampler.h"
+#include "echo_canceller.h"
+#include "format_convert.h"
+#include "jitter_buffer.h"
+#include "mixer.h"
+#include "polyphase_resampler.h"
+#include "processing_graph.h"
+#include "ring_suite.h"
+#include "rt_workers.h"
+#include "session_host.h"
+#include "spsc_ring.h"
+#include "vad.h"
+
+namespace {
+
+const uint32_t kBlock = 128;
+const int kBlocksPerRep = 20000;
+const int kReps = 7;
+
+// Keeps results observable so the optimiser cannot drop the work.
+volatile float gSink;
+
+void run(const char* filter, const char* name, const std::function<void()>& block) {
+    if (filter && !std::strstr(name, filter)) return;
+    for (int i = 0; i < 1000; ++i) block(); // warm caches and branch predictors
+    double best = 1e300;
+    for (int r = 0; r < kReps; ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < kBlocksPerRep; ++i) block();
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count());
+    }
+    std::printf("%-32s %8.3f ns/frame\n", name, best / (double(kBlocksPerRep) * kBlock));
+}
+
+class Gain : public nuchat::AudioProcessor {
+public:
+    explicit Gain(float g) : g(g) {}
+    void process(const float* in, float* out, uint32_t frames) override {
+        for (uint32_t i = 0; i < frames; ++i) out[i] = in[i] * g;
+    }
+
+private:
+    float g;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc > 1 && !std::strcmp(argv[1], "--stress"))
+        return run_ring_stress(argc > 2 ? std::atof(argv[2]) : 10.0);
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+    std::vector<float> in(kBlock), out(kBlock);
+    for (uint32_t i = 0; i < kBlock; ++i) in[i] = float(i % 64) / 64.0f - 0.5f;
+
+    {
+        nuchat::SpscRing<float> ring(1 << 12);
+        run(filter, "spsc_ring/push_pop", [&] {
+            ring.push(in.data(), kBlock);
+            ring.pop(out.data(), kBlock);
+            gSink = out[0];
+        });
+    }
+    {
+        // Offset indices so every block straddles the wrap point.
+        nuchat::SpscRing<float> ring(256);
+        ring.push(in.data(), 64);
+        run(filter, "spsc_ring/push_pop_wrap", [&] {
+            ring.push(in.data(), kBlock);
+            ring.pop(out.data(), kBlock);
+            gSink = out[0];
+        });
+    }
+    {
+        nuchat::DriftResampler rs(kBlock);
+        const double step = 1.0 + 150e-6;
+        run(filter, "drift_resampler/render", [&] {
+            uint32_t need = rs.framesNeeded(kBlock, step);
+            float* tail = rs.inputTail();
+            for (uint32_t i = 0; i < need; ++i) tail[i] = in[i % kBlock];
+            rs.commit(need);
+            rs.render(out.data(), kBlock, step);
+            gSink = out[0];
+        });
+    }
+    {
+        nuchat::SpscRing<float> ring(1 << 14);
+        nuchat::JitterBuffer jb(ring, {48000.0, 256});
+        run(filter, "jitter_buffer/pull", [&] {
+            ring.push(in.data(), kBlock);
+            jb.pull(out.data(), kBlock);
+            gSink = out[0];
+        });
+    }
+    {
+        // Stereo s16 device <-> mono float, the common USB headset case.
+        nuchat::FormatAdapter adapter;
+        adapter.prepare({nuchat::SampleFormat::Int16, 2, false}, kBlock);
+        std::vector<int16_t> dev(kBlock * 2);
+        void* bufs[1] = {dev.data()};
+        run(filter, "format/s16x2_from_mono", [&] {
+            adapter.fromMono(in.data(), bufs, kBlock);
+            gSink = dev[0];
+        });
+        run(filter, "format/s16x2_to_mono", [&] {
+            gSink = adapter.toMono(bufs, kBlock)[0];
+        });
+    }
+    {
+        // Each kernel at kBlock through its fixed-size instance, and through
+        // the runtime-size one a period without an instance would get.
+        std::vector<float> sum(kBlock, 0.25f);
+        std::vector<int16_t> s16(kBlock, 1000);
+        volatile uint32_t opaque = kBlock; // keeps the generic count out of constant folding
+        const nuchat::Block<0> rt{opaque};
+        run(filter, "kernels/mix_minus", [&] {
+            nuchat::mixk::mix_minus(out.data(), sum.data(), in.data(), kBlock);
+            gSink = out[0];
+        });
+        run(filter, "kernels/mix_minus_generic", [&] {
+            nuchat::mixk::mix_minus(out.data(), sum.data(), in.data(), rt);
+            gSink = out[0];
+        });
+        run(filter, "kernels/s16_to_float", [&] {
+            nuchat::convert::to_float(nuchat::SampleFormat::Int16, s16.data(), out.data(), kBlock);
+            gSink = out[0];
+        });
+        run(filter, "kernels/s16_to_float_generic", [&] {
+            nuchat::convert::to_float(nuchat::SampleFormat::Int16, s16.data(), out.data(), rt);
+            gSink = out[0];
+        });
+        // Alternating targets, so every block ramps.
+        nuchat::GainRamp ramp;
+        bool low = false;
+        run(filter, "kernels/gain_ramp", [&] {
+            ramp.setDb((low = !low) ? -6.0f : 0.0f);
+            ramp.process(in.data(), out.data(), kBlock);
+            gSink = out[0];
+        });
+        run(filter, "kernels/gain_ramp_generic", [&] {
+            ramp.setDb((low = !low) ? -6.0f : 0.0f);
+            ramp.process(in.data(), out.data(), rt);
+            gSink = out[0];
+        });
+    }
+    {
+        // Per input frame, as the capture side sees it.
+        nuchat::PolyphaseResampler up(44100, 48000, kBlock);
+        std::vector<float> res(up.maxOutput(kBlock));
+        run(filter, "resampler/44k1_to_48k", [&] {
+            gSink = float(up.process(in.data(), kBlock, res.data(), uint32_t(res.size())));
+        });
+        nuchat::PolyphaseResampler down(48000, 16000, kBlock);
+        run(filter, "resampler/48k_to_16k", [&] {
+            gSink = float(down.process(in.data(), kBlock, res.data(), uint32_t(res.size())));
+        });
+    }
+    {
+        // Default 80 ms tail at 48 kHz: 60 partitions, two blocks per call.
+        nuchat::EchoCanceller aec;
+        aec.prepare(48000, kBlock);
+        run(filter, "aec/80ms_tail", [&] {
+            aec.render(in.data(), kBlock);
+            aec.capture(in.data(), out.data(), kBlock);
+            gSink = out[0];
+        });
+    }
+    {
+        nuchat::VoiceActivityDetector vad;
+        vad.prepare(48000);
+        run(filter, "vad/process", [&] { gSink = float(vad.process(in.data(), kBlock)); });
+    }
+    {
+        nuchat::AudioFormat fmt;
+        nuchat::ProcessingGraph empty;
+        empty.prepare(fmt, kBlock);
+        run(filter, "processing_graph/empty", [&] {
+            empty.process(in.data(), out.data(), kBlock);
+            gSink = out[0];
+        });
+
+        std::vector<Gain> gains(4, Gain(0.99f));
+        nuchat::ProcessingGraph graph;
+        for (auto& g : gains) graph.add(&g);
+        graph.prepare(fmt, kBlock);
+        run(filter, "processing_graph/4_gain", [&] {
+            graph.process(in.data(), out.data(), kBlock);
+            gSink = out[0];
+        });
+    }
+    {
+        // One room, one worker: a whole 64-party tick per frame, including
+        // the network side's pushes and pulls.
+        nuchat::MixerConfig cfg;
+        cfg.tickFrames = kBlock;
+        cfg.workers = 1;
+        nuchat::MixServer server(cfg);
+        nuchat::MixRoom* room = server.createRoom();
+        std::vector<nuchat::MixParticipant*> party;
+        for (int i = 0; i < 64; ++i) party.push_back(room->join());
+        run(filter, "mixer/64_party_tick", [&] {
+            for (auto* p : party) p->push(in.data(), kBlock);
+            server.runTick();
+            for (auto* p : party) p->pull(out.data(), kBlock);
+            gSink = out[0];
+        });
+    }
+    {
+        // 256 sessions per tick, with the decoder side's pushes and pulls;
+        // divide by 256 for the per-session cost.
+        nuchat::SessionHostConfig cfg;
+        cfg.tickFrames = kBlock;
+        nuchat::SessionHost host(cfg);
+        std::vector<nuchat::VoiceSession*> sessions;
+        for (uint32_t i = 0; i < cfg.maxSessions; ++i) sessions.push_back(host.open());
+        sessions[0]->setGainDb(-6.0f);
+        run(filter, "session_host/256_session_tick", [&] {
+            for (auto* s : sessions) s->push(in.data(), kBlock);
+            host.tick(kBlock);
+            for (auto* s : sessions) s->pull(out.data(), kBlock);
+            gSink = out[0];
+        });
+        if (!filter || std::strstr("session_host/256_session_tick", filter))
+            std::printf("%-32s %8zu bytes/session\n", "session_host/footprint", host.sessionBytes());
+    }
+    if (!filter || std::strstr("rt_workers/submit_wait", filter)) {
+        // Submit one block's gain to a worker and wait for it: the wake-up
+        // and handoff a capture callback pays for, without the DSP.
+        nuchat::RtWorkerConfig cfg;
+        nuchat::RtWorkerPool pool(cfg);
+        nuchat::RtPort* port = pool.connect(0);
+        struct Job { const float* in; float* out; } job{in.data(), out.data()};
+        auto fn = [](void* ctx) {
+            Job& j = *static_cast<Job*>(ctx);
+            for (uint32_t i = 0; i < kBlock; ++i) j.out[i] = j.in[i] * 0.5f;
+        };
+        run(filter, "rt_workers/submit_wait", [&] {
+            port->submit(fn, &job, nuchat::host_now_ns());
+            port->waitIdle();
+            gSink = out[0];
+        });
+    }
+    run_ring_threads(filter);
+    return 0;
+}
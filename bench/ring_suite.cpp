@@ -0,0 +1,521 @@
+// ring_suite.cpp
+// SpscRing with producer and consumer on different threads, which the
+// single-threaded spsc_ring/* cases in nuchat_bench.cpp cannot show.
+//
+// Placements (Linux, from sysfs topology and the process affinity mask):
+//   same_core     both threads pinned to one CPU; every handoff is a switch
+//   smt_sibling   two hyperthreads of one core, sharing L1/L2
+//   cross_core    two cores of one package, sharing the last-level cache
+//   cross_socket  two packages; index and data lines cross the interconnect
+// Placements the machine does not have are skipped. Elsewhere the two
+// threads run unpinned.
+//
+// Layouts, to separate the two things SpscRing does about cache traffic:
+//   shared_line   the old per-backend FloatFIFO layout: both indices on one
+//                 line, the far one reloaded on every call
+//   padded        each index on its own line, still reloaded on every call
+//   spsc_ring     the ring itself: padded, plus a cached copy of the far index
+//
+// Throughput is ns per frame streaming kFramesPerCase frames in blocks of B.
+// Latency is half the round trip of one B-frame block through a pair of
+// rings, p50 and p99. Misses are hardware cache misses of both threads per
+// block (perf_event_open), "-" where the counters are unavailable.
+//
+// Stress (nuchat_bench --stress [seconds]) runs random block sizes, random
+// pop/popOrSilence/skip mixes and random delays over small rings, checking
+// every element's sequence number and checksum and the room/data each call
+// must at least see. On x86 a missing acquire or release seldom changes a
+// value, so also run it from a -DNUCHAT_TSAN=ON build: ThreadSanitizer
+// reports the race on the element storage that a wrong ordering leaves.
+
+#include "ring_suite.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "spsc_ring.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const uint32_t kBlockSizes[] = {1, 16, 128, 1024, 4096};
+const uint32_t kRingFrames = 1 << 14; // four of the largest blocks
+const uint64_t kFramesPerCase = 1 << 20;
+const int kPingPongs = 2000;
+const int kReps = 3;
+
+volatile float gRingSink;
+
+inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Spins briefly, then yields: on a shared core the other side cannot make
+// progress until this thread gives up the CPU.
+struct Backoff {
+    uint32_t spins = 0;
+    void wait() {
+        if (++spins < 64) cpu_relax();
+        else std::this_thread::yield();
+    }
+    void reset() { spins = 0; }
+};
+
+// --- layouts ---
+
+template <bool Padded>
+struct Indices {
+    std::atomic<uint32_t> w{0}, r{0};
+};
+
+template <>
+struct Indices<true> {
+    alignas(nuchat::kCacheLine) std::atomic<uint32_t> w{0};
+    alignas(nuchat::kCacheLine) std::atomic<uint32_t> r{0};
+};
+
+// SpscRing's algorithm without the cached far index, so every call loads
+// the other side's line.
+template <bool Padded>
+class ReloadRing {
+public:
+    explicit ReloadRing(uint32_t capacity) : buf(capacity), mask(capacity - 1) {}
+
+    uint32_t push(const float* src, uint32_t n) {
+        uint32_t wi = ix.w.load(std::memory_order_relaxed);
+        uint32_t freeN = mask + 1 - (wi - ix.r.load(std::memory_order_acquire));
+        if (n > freeN) n = freeN;
+        if (n == 0) return 0;
+        uint32_t at = wi & mask, first = std::min(n, mask + 1 - at);
+        std::memcpy(&buf[at], src, first * sizeof(float));
+        std::memcpy(&buf[0], src + first, (n - first) * sizeof(float));
+        ix.w.store(wi + n, std::memory_order_release);
+        return n;
+    }
+
+    uint32_t pop(float* dst, uint32_t n) {
+        uint32_t ri = ix.r.load(std::memory_order_relaxed);
+        uint32_t avail = ix.w.load(std::memory_order_acquire) - ri;
+        if (n > avail) n = avail;
+        if (n == 0) return 0;
+        uint32_t at = ri & mask, first = std::min(n, mask + 1 - at);
+        std::memcpy(dst, &buf[at], first * sizeof(float));
+        std::memcpy(dst + first, &buf[0], (n - first) * sizeof(float));
+        ix.r.store(ri + n, std::memory_order_release);
+        return n;
+    }
+
+private:
+    Indices<Padded> ix;
+    std::vector<float> buf;
+    uint32_t mask;
+};
+
+// --- placement ---
+
+struct Placement {
+    const char* name;
+    int producer, consumer; // CPU numbers, -1 = unpinned
+};
+
+#if defined(__linux__)
+int read_topology(int cpu, const char* field) {
+    char path[96];
+    std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, field);
+    FILE* f = std::fopen(path, "r");
+    if (!f) return -1;
+    int v = -1;
+    if (std::fscanf(f, "%d", &v) != 1) v = -1;
+    std::fclose(f);
+    return v;
+}
+#endif
+
+std::vector<Placement> find_placements() {
+    std::vector<Placement> out;
+#if defined(__linux__)
+    struct Cpu {
+        int id, core, package;
+    };
+    std::vector<Cpu> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &set))
+                cpus.push_back({c, read_topology(c, "core_id"), read_topology(c, "physical_package_id")});
+    }
+    if (!cpus.empty()) {
+        const Cpu& a = cpus[0];
+        auto other = [&](bool samePackage, bool sameCore) {
+            for (const Cpu& c : cpus)
+                if (c.id != a.id && (c.package == a.package) == samePackage &&
+                    (!samePackage || (c.core == a.core) == sameCore))
+                    return c.id;
+            return -1;
+        };
+        out.push_back({"same_core", a.id, a.id});
+        if (int c = other(true, true); c >= 0) out.push_back({"smt_sibling", a.id, c});
+        if (int c = other(true, false); c >= 0) out.push_back({"cross_core", a.id, c});
+        if (int c = other(false, false); c >= 0) out.push_back({"cross_socket", a.id, c});
+        return out;
+    }
+#endif
+    out.push_back({"unpinned", -1, -1});
+    return out;
+}
+
+bool pin_current_thread(int cpu) {
+    if (cpu < 0) return true;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// Hardware cache misses of the calling thread, user space only.
+class MissCounter {
+public:
+    MissCounter() {
+#if defined(__linux__)
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    ~MissCounter() {
+#if defined(__linux__)
+        if (fd >= 0) close(fd);
+#endif
+    }
+    MissCounter(const MissCounter&) = delete;
+    MissCounter& operator=(const MissCounter&) = delete;
+
+    // -1 when the counter is unavailable.
+    int64_t read() const {
+#if defined(__linux__)
+        uint64_t v;
+        if (fd >= 0 && ::read(fd, &v, sizeof(v)) == ssize_t(sizeof(v))) return int64_t(v);
+#endif
+        return -1;
+    }
+
+private:
+    int fd = -1;
+};
+
+struct PairResult {
+    bool pinned = true;
+    double seconds = 0;
+    int64_t misses = -1; // both threads, -1 if either could not count
+};
+
+// Runs producer() and consumer() on their own threads, placed per `p` and
+// released together once both are ready. The time covers the release to
+// the last thread finishing.
+template <typename P, typename C>
+PairResult run_pair(const Placement& p, P&& producer, C&& consumer) {
+    PairResult res;
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> pinFailed{false};
+    int64_t misses[2] = {-1, -1};
+    auto body = [&](int cpu, int slot, auto& fn) {
+        if (!pin_current_thread(cpu)) pinFailed.store(true);
+        MissCounter counter;
+        ready.fetch_add(1);
+        for (Backoff b; !go.load(std::memory_order_acquire);) b.wait();
+        int64_t m0 = counter.read();
+        if (!pinFailed.load()) fn();
+        int64_t m1 = counter.read();
+        misses[slot] = (m0 < 0 || m1 < 0) ? -1 : m1 - m0;
+    };
+    std::thread tp([&] { body(p.producer, 0, producer); });
+    std::thread tc([&] { body(p.consumer, 1, consumer); });
+    for (Backoff b; ready.load() < 2;) b.wait();
+    auto t0 = Clock::now();
+    go.store(true, std::memory_order_release);
+    tp.join();
+    tc.join();
+    res.seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+    res.pinned = !pinFailed.load();
+    if (misses[0] >= 0 && misses[1] >= 0) res.misses = misses[0] + misses[1];
+    return res;
+}
+
+struct CaseResult {
+    bool pinned = true;
+    double nsPerFrame = 0, p50Ns = 0, p99Ns = 0;
+    double missesPerBlock = -1;
+};
+
+template <typename Ring>
+CaseResult measure(const Placement& p, uint32_t block) {
+    CaseResult out;
+    std::vector<float> src(block, 0.5f), dst(block);
+    const uint64_t total = std::max<uint64_t>(kFramesPerCase, block);
+
+    // Throughput: best of kReps, misses from that repetition.
+    out.nsPerFrame = 1e300;
+    for (int rep = 0; rep < kReps; ++rep) {
+        Ring ring(kRingFrames);
+        PairResult r = run_pair(
+            p,
+            [&] {
+                Backoff b;
+                for (uint64_t sent = 0; sent < total;) {
+                    uint32_t n = ring.push(src.data(), uint32_t(std::min<uint64_t>(block, total - sent)));
+                    if (n) { sent += n; b.reset(); }
+                    else b.wait();
+                }
+            },
+            [&] {
+                Backoff b;
+                for (uint64_t got = 0; got < total;) {
+                    uint32_t n = ring.pop(dst.data(), block);
+                    if (n) { got += n; b.reset(); }
+                    else b.wait();
+                }
+                gRingSink = dst[0];
+            });
+        if (!r.pinned) { out.pinned = false; return out; }
+        double ns = r.seconds * 1e9 / double(total);
+        if (ns < out.nsPerFrame) {
+            out.nsPerFrame = ns;
+            out.missesPerBlock = r.misses < 0 ? -1 : double(r.misses) * block / double(total);
+        }
+    }
+
+    // Latency: the producer side sends one block on `ping` and times its
+    // return on `pong`; warm-up round trips are not recorded.
+    Ring ping(kRingFrames), pong(kRingFrames);
+    const int warmup = kPingPongs / 10;
+    std::vector<double> oneWay;
+    oneWay.reserve(kPingPongs);
+    auto transfer = [block](Ring& ring, float* buf, bool send) {
+        Backoff b;
+        for (uint32_t done = 0; done < block;) {
+            uint32_t n = send ? ring.push(buf + done, block - done) : ring.pop(buf + done, block - done);
+            if (n) { done += n; b.reset(); }
+            else b.wait();
+        }
+    };
+    run_pair(
+        p,
+        [&] {
+            for (int i = 0; i < warmup + kPingPongs; ++i) {
+                auto t0 = Clock::now();
+                transfer(ping, src.data(), true);
+                transfer(pong, src.data(), false);
+                if (i >= warmup)
+                    oneWay.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / 2);
+            }
+        },
+        [&] {
+            for (int i = 0; i < warmup + kPingPongs; ++i) {
+                transfer(ping, dst.data(), false);
+                transfer(pong, dst.data(), true);
+            }
+        });
+    std::sort(oneWay.begin(), oneWay.end());
+    out.p50Ns = oneWay[oneWay.size() / 2];
+    out.p99Ns = oneWay[oneWay.size() * 99 / 100];
+    return out;
+}
+
+void report(const char* filter, const Placement& p, const char* layout, uint32_t block,
+            CaseResult (*fn)(const Placement&, uint32_t)) {
+    char name[64];
+    std::snprintf(name, sizeof(name), "ring/%s/%s/%u", p.name, layout, block);
+    if (filter && !std::strstr(name, filter)) return;
+    CaseResult r = fn(p, block);
+    if (!r.pinned) {
+        std::printf("%-36s skipped, cannot pin to CPUs %d and %d\n", name, p.producer, p.consumer);
+        return;
+    }
+    char misses[24] = "-";
+    if (r.missesPerBlock >= 0) std::snprintf(misses, sizeof(misses), "%.2f", r.missesPerBlock);
+    std::printf("%-36s %8.3f ns/frame  p50 %8.0f ns  p99 %8.0f ns  %8s miss/block\n", name, r.nsPerFrame,
+                r.p50Ns, r.p99Ns, misses);
+}
+
+// --- stress ---
+
+struct Tick {
+    uint32_t seq, check;
+};
+
+inline uint32_t check_of(uint32_t seq) { return (seq * 2654435761u) ^ 0x5bd1e995u; }
+
+struct Rng {
+    uint64_t s;
+    uint32_t next() {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return uint32_t(s >> 32);
+    }
+};
+
+// Random delay between operations, so the interleavings differ run to run.
+void perturb(Rng& rng) {
+    uint32_t r = rng.next();
+    if ((r & 15) == 0) std::this_thread::yield();
+    else if ((r & 3) == 0)
+        for (uint32_t i = r >> 26; i; --i) cpu_relax();
+}
+
+bool stress_ring(const char* name, nuchat::SpscRing<Tick>& ring, double seconds) {
+    const uint32_t cap = ring.capacity();
+    const uint32_t maxBlock = cap + cap / 2; // some requests exceed the ring
+    std::atomic<bool> producing{true}, failed{false};
+    std::atomic<uint32_t> produced{0};
+    std::string problem[2];
+    uint64_t moved = 0, ops = 0;
+    auto fail = [&](int side, const std::string& what) {
+        problem[side] = what;
+        failed.store(true);
+    };
+
+    std::thread producer([&] {
+        Rng rng{0x9e3779b97f4a7c15ull ^ cap};
+        std::vector<Tick> blk(maxBlock);
+        uint32_t seq = 0;
+        auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                           std::chrono::duration<double>(seconds));
+        while (!failed.load(std::memory_order_relaxed) && Clock::now() < deadline) {
+            uint32_t n = 1 + rng.next() % maxBlock;
+            for (uint32_t i = 0; i < n; ++i) blk[i] = {seq + i, check_of(seq + i)};
+            uint32_t room = ring.writeAvailable();
+            uint32_t got = ring.push(blk.data(), n);
+            if (room > cap || got > n || got < std::min(n, room)) {
+                char msg[128];
+                std::snprintf(msg, sizeof(msg), "push(%u) took %u with %u free of %u", n, got, room, cap);
+                fail(0, msg);
+                break;
+            }
+            seq += got;
+            perturb(rng);
+        }
+        produced.store(seq, std::memory_order_relaxed);
+        producing.store(false, std::memory_order_release);
+    });
+
+    Rng rng{0xd1b54a32d192ed03ull ^ cap};
+    std::vector<Tick> blk(maxBlock);
+    uint32_t expect = 0;
+    auto verify = [&](uint32_t got) {
+        for (uint32_t i = 0; i < got; ++i, ++expect) {
+            if (blk[i].seq != expect || blk[i].check != check_of(blk[i].seq)) {
+                char msg[128];
+                std::snprintf(msg, sizeof(msg), "read seq %u (check %08x), expected seq %u", blk[i].seq,
+                              blk[i].check, expect);
+                fail(1, msg);
+                return false;
+            }
+        }
+        return true;
+    };
+    for (;;) {
+        bool last = !producing.load(std::memory_order_acquire);
+        if (failed.load(std::memory_order_relaxed)) break;
+        if (last && expect == produced.load(std::memory_order_relaxed)) break;
+        uint32_t n = 1 + rng.next() % maxBlock, op = rng.next() % 8;
+        uint32_t avail = ring.readAvailable();
+        uint32_t got;
+        if (op == 0) {
+            got = ring.skip(n);
+            expect += got;
+        } else if (op == 1) {
+            std::memset(static_cast<void*>(blk.data()), 0xff, n * sizeof(Tick));
+            got = ring.popOrSilence(blk.data(), n);
+            for (uint32_t i = got; i < n; ++i)
+                if (blk[i].seq || blk[i].check) { fail(1, "popOrSilence left the tail unwritten"); break; }
+            if (failed.load(std::memory_order_relaxed) || !verify(got)) break;
+        } else {
+            got = ring.pop(blk.data(), n);
+            if (!verify(got)) break;
+        }
+        if (avail > cap || got > n || got < std::min(n, avail)) {
+            char msg[128];
+            std::snprintf(msg, sizeof(msg), "read(%u) gave %u with %u of %u available", n, got, avail, cap);
+            fail(1, msg);
+            break;
+        }
+        moved += got;
+        ++ops;
+        perturb(rng);
+    }
+    producer.join();
+    if (failed.load()) {
+        std::printf("%-36s FAILED: %s\n", name, (problem[0].empty() ? problem[1] : problem[0]).c_str());
+        return false;
+    }
+    std::printf("%-36s %12llu elements %10llu reads  ok\n", name, (unsigned long long)moved,
+                (unsigned long long)ops);
+    return true;
+}
+
+} // namespace
+
+void run_ring_threads(const char* filter) {
+    std::vector<Placement> placements = find_placements();
+    for (const Placement& p : placements) {
+        for (uint32_t block : kBlockSizes) {
+            report(filter, p, "shared_line", block, &measure<ReloadRing<false>>);
+            report(filter, p, "padded", block, &measure<ReloadRing<true>>);
+            report(filter, p, "spsc_ring", block, &measure<nuchat::SpscRing<float>>);
+        }
+    }
+}
+
+int run_ring_stress(double seconds) {
+    // Small owned rings wrap constantly; one over caller storage as well.
+    const uint32_t caps[] = {4, 16, 256, 4096};
+    const double each = seconds / (std::size(caps) + 1);
+    bool ok = true;
+    for (uint32_t cap : caps) {
+        nuchat::SpscRing<Tick> ring(cap);
+        char name[48];
+        std::snprintf(name, sizeof(name), "stress/capacity_%u", cap);
+        ok = stress_ring(name, ring, each) && ok;
+    }
+    std::vector<Tick> storage(64);
+    nuchat::SpscRing<Tick> external(storage.data(), 64);
+    ok = stress_ring("stress/external_64", external, each) && ok;
+    std::printf("stress: %s\n", ok ? "all checks held" : "FAILED");
+    return ok ? 0 : 1;
+}
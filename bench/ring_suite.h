@@ -0,0 +1,12 @@
+// ring_suite.h
+// Cross-thread cases for SpscRing, run from nuchat_bench (ring_suite.cpp).
+
+#pragma once
+
+// Producer and consumer on separate threads, per core placement, ring layout
+// and block size: throughput, one-way block latency and cache misses.
+void run_ring_threads(const char* filter);
+
+// Randomised producer/consumer checking of SpscRing for about `seconds`;
+// returns the process exit code (0 when every check held).
+int run_ring_stress(double seconds);
@@ -0,0 +1,161 @@
+// audio_codec.h
+// Payload codecs for UdpTransport: L16 (always available) and Opus (when
+// built with NUCHAT_HAVE_OPUS).
+//
+// A codec works on fixed frames of 2.5, 5, 10 or 20 ms at the processing
+// rate. It is driven only from the transport's I/O thread, which cuts those
+// frames out of the capture ring, so callback sizes (64 frames on macOS, 128
+// on ALSA/WASAPI, whatever Oboe hands over) never reach it and a slow encode
+// cannot make a device callback miss its deadline. prepare() allocates all
+// codec state and scratch; encode/decode/conceal never allocate.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#if defined(NUCHAT_HAVE_OPUS)
+#include <opus.h>
+#endif
+
+namespace nuchat {
+
+class AudioCodec {
+public:
+    virtual ~AudioCodec() = default;
+
+    virtual const char* name() const = 0;
+    virtual uint8_t payloadType() const = 0;
+
+    // Non-realtime. frameSize is the per-packet frame count; false if the
+    // codec cannot run at this rate and size.
+    virtual bool prepare(double sampleRate, uint32_t frameSize) = 0;
+
+    // Encodes one frame of frameSize samples; returns bytes written, or < 0.
+    virtual int encode(const float* pcm, uint8_t* out, size_t maxBytes) = 0;
+
+    // Decodes one packet; returns frames written (<= maxFrames), or < 0.
+    virtual int decode(const uint8_t* data, size_t bytes, float* pcm, uint32_t maxFrames) = 0;
+
+    // Packet loss concealment: synthesises `frames` frames for a packet that
+    // never arrived. `next` is the packet that followed the loss, if already
+    // received, for codecs that carry redundancy for the previous frame.
+    virtual void conceal(float* pcm, uint32_t frames, const uint8_t* next, size_t nextBytes) {
+        (void)next;
+        (void)nextBytes;
+        std::fill(pcm, pcm + frames, 0.0f);
+    }
+};
+
+// RFC 3551 L16: mono big-endian s16, no compression. Loss is concealed with
+// silence.
+class L16Codec : public AudioCodec {
+public:
+    const char* name() const override { return "l16"; }
+    uint8_t payloadType() const override { return 96; }
+
+    bool prepare(double, uint32_t size) override {
+        frameSize = size;
+        return true;
+    }
+
+    int encode(const float* pcm, uint8_t* out, size_t maxBytes) override {
+        if (maxBytes < 2 * size_t(frameSize)) return -1;
+        for (uint32_t i = 0; i < frameSize; ++i) {
+            float s = std::max(-1.0f, std::min(1.0f, pcm[i])) * 32767.0f;
+            int16_t v = int16_t(std::lrintf(s));
+            out[2 * i] = uint8_t(uint16_t(v) >> 8);
+            out[2 * i + 1] = uint8_t(v);
+        }
+        return int(2 * frameSize);
+    }
+
+    int decode(const uint8_t* data, size_t bytes, float* pcm, uint32_t maxFrames) override {
+        uint32_t n = uint32_t(bytes / 2);
+        if (n == 0 || n > maxFrames) return -1;
+        for (uint32_t i = 0; i < n; ++i)
+            pcm[i] = float(int16_t((data[2 * i] << 8) | data[2 * i + 1])) * (1.0f / 32768.0f);
+        return int(n);
+    }
+
+private:
+    uint32_t frameSize = 0;
+};
+
+#if defined(NUCHAT_HAVE_OPUS)
+
+// Opus in VoIP mode. Encoder and decoder live in buffers sized with
+// opus_*_get_size() at prepare(). 2.5 and 5 ms frames run CELT only; at 10
+// and 20 ms SILK's in-band FEC lets conceal() rebuild a lost frame from the
+// packet after it.
+class OpusCodec : public AudioCodec {
+public:
+    explicit OpusCodec(int32_t bitrate = 32000) : bitrate(bitrate) {}
+
+    const char* name() const override { return "opus"; }
+    uint8_t payloadType() const override { return 111; }
+
+    bool prepare(double sampleRate, uint32_t size) override {
+        int32_t rate = int32_t(sampleRate);
+        // Opus runs at 8/12/16/24/48 kHz, frames of 2.5 ms up to 60 ms.
+        if (rate != 8000 && rate != 12000 && rate != 16000 && rate != 24000 && rate != 48000)
+            return false;
+        if (size * 400 != uint32_t(rate) && size * 200 != uint32_t(rate) &&
+            size * 100 != uint32_t(rate) && size * 50 != uint32_t(rate))
+            return false;
+        frameSize = size;
+        encStorage.assign(size_t(opus_encoder_get_size(1)), 0);
+        decStorage.assign(size_t(opus_decoder_get_size(1)), 0);
+        enc = reinterpret_cast<OpusEncoder*>(encStorage.data());
+        dec = reinterpret_cast<OpusDecoder*>(decStorage.data());
+        if (opus_encoder_init(enc, rate, 1, OPUS_APPLICATION_VOIP) != OPUS_OK ||
+            opus_decoder_init(dec, rate, 1) != OPUS_OK)
+            return false;
+        opus_encoder_ctl(enc, OPUS_SET_BITRATE(bitrate));
+        opus_encoder_ctl(enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+        opus_encoder_ctl(enc, OPUS_SET_INBAND_FEC(1));
+        opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(10));
+        return true;
+    }
+
+    int encode(const float* pcm, uint8_t* out, size_t maxBytes) override {
+        return opus_encode_float(enc, pcm, int(frameSize), out, opus_int32(maxBytes));
+    }
+
+    int decode(const uint8_t* data, size_t bytes, float* pcm, uint32_t maxFrames) override {
+        return opus_decode_float(dec, data, opus_int32(bytes), pcm, int(maxFrames), 0);
+    }
+
+    void conceal(float* pcm, uint32_t frames, const uint8_t* next, size_t nextBytes) override {
+        // FEC recovers exactly the frame before `next`; otherwise regular PLC.
+        int got = next ? opus_decode_float(dec, next, opus_int32(nextBytes), pcm, int(frames), 1)
+                       : opus_decode_float(dec, nullptr, 0, pcm, int(frames), 0);
+        if (got < int(frames))
+            std::fill(pcm + std::max(got, 0), pcm + frames, 0.0f);
+    }
+
+private:
+    int32_t bitrate;
+    uint32_t frameSize = 0;
+    std::vector<uint8_t> encStorage, decStorage;
+    OpusEncoder* enc = nullptr;
+    OpusDecoder* dec = nullptr;
+};
+
+#endif // NUCHAT_HAVE_OPUS
+
+// "l16" or "opus"; nullptr if the name is unknown or not built in.
+inline std::unique_ptr<AudioCodec> make_codec(const char* name, int32_t bitrate = 32000) {
+    if (!std::strcmp(name, "l16")) return std::make_unique<L16Codec>();
+#if defined(NUCHAT_HAVE_OPUS)
+    if (!std::strcmp(name, "opus")) return std::make_unique<OpusCodec>(bitrate);
+#endif
+    (void)bitrate;
+    return nullptr;
+}
+
+} // namespace nuchat
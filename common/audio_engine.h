@@ -0,0 +1,682 @@
+// audio_engine.h
+// Common base for the platform backends (ALSA, CoreAudio VPIO, WASAPI, Oboe,
+// iOS VPIO).
+//
+// A backend negotiates the device format, calls prepare() and then forwards
+// its device callbacks here:
+//   - split capture/render callbacks: onCapture() pushes into the shared FIFO,
+//     onRender() pulls through the jitter buffer and runs the processor;
+//   - a single synchronised callback: onDuplex() runs the processor directly.
+// The processor (usually a ProcessingGraph) therefore runs in one place for
+// every platform, always as process(capture, render, frames).
+//
+// With a transport set, capture goes to the network instead of the FIFO and
+// the transport's I/O thread fills the FIFO from the peer; duplex backends
+// then split their callback into the two halves.
+//
+// An EchoCanceller, when set, cleans the capture signal before it goes
+// anywhere, using what onRender()/onDuplex() produced as its reference.
+//
+// With a worker pool (rt_workers.h) the capture callback only copies its
+// block into a staging ring and submits a job; echo cancellation, gain and
+// delivery to the FIFO or transport run on the worker, due one block later.
+// Render and duplex callbacks still process in place: render is pulled on
+// demand and cannot wait for a worker without adding a period of latency.
+//
+// Silence suppression: a VAD (vad.h) classifies each capture block after
+// echo cancellation, which keeps adapting through near-end silence. Silent
+// blocks skip the gain stage and go on as silence: to the transport as a
+// length and a level for its comfort noise, or into the FIFO as zeros, and
+// render then skips the processor and its gain while the jitter buffer
+// hands out only frames captured as silence. setVadConfig() retunes the
+// detector while running, through a Snapshot (control.h).
+//
+// Record taps (call_recorder.h), when set, get a copy of what goes out
+// (capture after echo cancellation and gain) and of what is played (render
+// after gain); the recorder's thread writes them to disk.
+//
+// post() changes gain, mute, the jitter target or the echo canceller bypass
+// while running (control.h). Each callback drains its direction's commands
+// before touching audio, so changes land on period boundaries.
+//
+// Backends that know when their buffers hit the converters pass host-clock
+// timestamps (host_clock.h) with noteCaptureTime()/noteRenderTime(). Capture
+// times follow each block into the FIFO, and render compares them with the
+// presentation time of the frames the jitter buffer hands out: the measured
+// mouth-to-ear latency of the local loop, device buffers included.
+//
+// Internally everything is mono float32 at fmt.sampleRate. Backends whose
+// devices run another layout or rate describe it with setDeviceFormats() and
+// use the on*Device() variants, which convert (and resample) at the boundary.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "call_recorder.h"
+#include "control.h"
+#include "echo_canceller.h"
+#include "format_convert.h"
+#include "host_clock.h"
+#include "jitter_buffer.h"
+#include "latency_probe.h"
+#include "polyphase_resampler.h"
+#include "processing_graph.h"
+#include "rt_workers.h"
+#include "spsc_ring.h"
+#include "stream_metrics.h"
+#include "udp_transport.h"
+#include "vad.h"
+
+namespace nuchat {
+
+class AudioEngine {
+public:
+    explicit AudioEngine(uint32_t fifoSamples = 1 << 16) : fifo(fifoSamples) {}
+    virtual ~AudioEngine() {
+        if (workerPort) workerPort->waitIdle();
+    }
+
+    AudioEngine(const AudioEngine&) = delete;
+    AudioEngine& operator=(const AudioEngine&) = delete;
+
+    // Opens and starts the devices, asking for `want`; the granted format is
+    // available from format() afterwards.
+    virtual bool start(const AudioFormat& want) = 0;
+    virtual void stop() = 0;
+    virtual const char* name() const = 0;
+
+    const AudioFormat& format() const { return fmt; }
+
+    // Configuration; only while stopped.
+    void setProcessor(AudioProcessor* p) { processor = p; }
+    void setLatencyProbe(LatencyProbe* p) { probe = p; }
+    void setJitterTargetMs(double ms) { jitterTargetMs = ms; }
+    void setTransport(UdpTransport* t) { transport = t; }
+    void setEchoCanceller(EchoCanceller* e) { echoCanceller = e; }
+    // On by default.
+    void setSilenceSuppression(bool on) { suppressSilence = on; }
+    // The pool must outlive the engine, or be detached with nullptr first.
+    // Capture work goes to `worker`.
+    void setWorkerPool(RtWorkerPool* p, uint32_t worker = 0) {
+        if (workerPort && p != workers) workerPort->waitIdle();
+        if (p != workers || !workerPort) workerPort = p ? p->connect(worker) : nullptr;
+        workers = workerPort ? p : nullptr;
+    }
+    RtWorkerPool* workerPool() const { return workers; }
+    // Either may be null; taps must stay open while the engine runs.
+    void setRecordTaps(RecordTap* capture, RecordTap* render) {
+        capTap = capture;
+        renTap = render;
+    }
+
+    // Any thread, while running or not. False if that direction's queue is
+    // full (its callbacks have stopped).
+    bool post(const ControlCommand& cmd) {
+        return (is_capture_control(cmd.id) ? capControls : renControls).post(cmd);
+    }
+
+    // Any non-realtime thread, running or not.
+    void setVadConfig(const VadConfig& c) {
+        std::lock_guard<std::mutex> g(vadLock);
+        vadSettings = c;
+        vadConfig.publish(c);
+    }
+
+    VadConfig currentVadConfig() {
+        std::lock_guard<std::mutex> g(vadLock);
+        return vadSettings;
+    }
+
+    // A control line from a CLI or app: a parse_control() command or a
+    // parse_vad_setting() change. False if it is neither.
+    bool command(const char* line) {
+        ControlCommand cmd;
+        if (parse_control(line, cmd)) return post(cmd);
+        VadConfig vad = currentVadConfig();
+        if (!parse_vad_setting(line, vad)) return false;
+        setVadConfig(vad);
+        return true;
+    }
+
+    StreamMetrics& captureMetrics() { return capMetrics; }
+    StreamMetrics& renderMetrics() { return renMetrics; }
+    const JitterBuffer* jitterBuffer() const { return jitter.get(); }
+
+    // Capture-to-presentation time of what render played last, from the
+    // devices' timestamps; 0 without them (or with a transport, whose peer
+    // runs on another host clock).
+    double measuredLatencyMs() const { return renMetrics.lastLatencyNs() / 1e6; }
+
+    // Fixed latency the rate converters add, in processing-rate frames.
+    double resamplerLatencyFrames() const {
+        double total = 0.0;
+        if (capResampler) total += capResampler->latencyFrames();
+        if (renResampler) total += renResampler->latencyFrames() * fmt.sampleRate / renDevice.sampleRate;
+        return total;
+    }
+
+    // End-of-run summary of both streams, worst cases over the whole run
+    // (metrics exports do not reset them). Latency is what the engine itself
+    // buffers (jitter target and resamplers), not the device's own buffers.
+    void report(FILE* out) {
+        StreamMetrics::Snapshot c = capMetrics.totals(), r = renMetrics.totals();
+        auto ull = [](uint64_t v) { return (unsigned long long)v; };
+        double rate = fmt.sampleRate > 0 ? fmt.sampleRate : 1.0;
+        double jitterMs = jitter ? jitter->targetFrames() * 1000.0 / rate : 0.0;
+        std::fprintf(out,
+                     "%s: capture %llu frames in %llu callbacks, %llu xruns, %llu dropped; "
+                     "render %llu frames in %llu callbacks, %llu xruns, %llu underflow frames; "
+                     "worst callback %.2f / %.2f ms; latency %.2f ms jitter target + %.2f ms resampling",
+                     name(), ull(c.frames), ull(c.callbacks), ull(c.xruns), ull(c.overflowDrops), ull(r.frames),
+                     ull(r.callbacks), ull(r.xruns), ull(r.underflowFrames), c.maxCallbackNs / 1e6,
+                     r.maxCallbackNs / 1e6, jitterMs, resamplerLatencyFrames() * 1000.0 / rate);
+        if (jitter) std::fprintf(out, ", drift %+.1f ppm", jitter->driftPpm());
+        if (r.maxLatencyNs)
+            std::fprintf(out, "; measured latency %.2f ms (max %.2f ms)", r.latencyNs / 1e6, r.maxLatencyNs / 1e6);
+        std::fputc('\n', out);
+    }
+
+protected:
+    // Non-realtime, once the device format is known. maxFrames bounds the
+    // render scratch buffer; larger callbacks are processed in pieces.
+    void prepare(const AudioFormat& negotiated, uint32_t maxFrames) {
+        if (workerPort) workerPort->waitIdle(); // a job from the last run may still be going
+        fmt = negotiated;
+        maxBlock = std::max<uint32_t>(maxFrames, fmt.framesPerPeriod);
+        JitterBufferConfig cfg;
+        cfg.sampleRate = fmt.sampleRate;
+        cfg.targetFrames = fmt.framesPerPeriod * 2;
+        if (transport) {
+            // Network jitter dwarfs device jitter: hold three packets.
+            transport->prepare(fmt.sampleRate, &fifo);
+            cfg.targetFrames = std::max(cfg.targetFrames, transport->packetFrames() * 3);
+        }
+        if (jitterTargetMs > 0)
+            cfg.targetFrames = uint32_t(jitterTargetMs * fmt.sampleRate / 1000);
+        cfg.targetFrames = clampJitterFrames(cfg.targetFrames);
+        cfg.maxFrames = std::max(cfg.maxFrames, cfg.targetFrames * 4);
+        cfg.maxBlock = maxBlock * fmt.channels;
+        jitter = std::make_unique<JitterBuffer>(fifo, cfg);
+        renderIn.assign(size_t(maxBlock) * fmt.channels, 0.0f);
+        captureSilence.assign(size_t(maxBlock) * fmt.channels, 0.0f);
+        renderOut.assign(size_t(maxBlock) * fmt.channels, 0.0f);
+        prepareCaptureDevice();
+        prepareRenderDevice();
+        if (processor) processor->prepare(fmt, maxBlock);
+        // The canceller models a single mic and speaker.
+        aec = fmt.channels == 1 ? echoCanceller : nullptr;
+        if (aec) {
+            aec->prepare(fmt.sampleRate, maxBlock);
+            captureClean.assign(maxBlock, 0.0f);
+        }
+        captureGained.assign(size_t(maxBlock) * fmt.channels, 0.0f);
+        vad.prepare(fmt.sampleRate);
+        // Leftovers from a previous run are still in the FIFO ahead of
+        // anything captured now; the new jitter buffer starts counting at 0.
+        fifoWritten = fifo.size();
+        fifoVoiceEnd.store(fifoWritten, std::memory_order_relaxed);
+        capFrames = capDelivered = 0;
+        capPendingNs = renPendingNs = 0;
+        capClock.publish(FrameTime());
+        fifoClock.publish(FrameTime());
+        if (capTap) capTap->setFormat(uint32_t(fmt.sampleRate), fmt.channels);
+        if (renTap) renTap->setFormat(uint32_t(fmt.sampleRate), fmt.channels);
+        if (workers) {
+            // Room for several periods in case the worker falls behind.
+            capStage = std::make_unique<SpscRing<float>>(maxBlock * fmt.channels * 8);
+            capSegments = std::make_unique<SpscRing<StageSegment>>(64);
+            capStaged.assign(size_t(maxBlock) * fmt.channels, 0.0f);
+        }
+    }
+
+    // Non-realtime, before prepare(): the layouts the devices were opened with.
+    void setDeviceFormats(const DeviceFormat& capture, const DeviceFormat& render) {
+        capDevice = capture;
+        renDevice = render;
+    }
+
+    // Non-realtime, after prepare(), while that stream's callbacks are not
+    // running (the other stream may be): its device was reopened after a
+    // hot-plug or default-device change, possibly with another layout or
+    // rate. Only the device-side conversion is rebuilt; the FIFO, jitter
+    // buffer, processor, echo canceller and transport keep their state, so
+    // the stream resumes as soon as the new device delivers its first period.
+    void reopenCapture(const DeviceFormat& capture) {
+        capDevice = capture;
+        prepareCaptureDevice();
+    }
+
+    void reopenRender(const DeviceFormat& render) {
+        renDevice = render;
+        prepareRenderDevice();
+    }
+
+    // Capture thread, before onCaptureDevice(): the device frame index of the
+    // first of `frames` frames (AudioTimeStamp::mSampleTime, the WASAPI
+    // device position, ...). A forward jump means the device dropped frames;
+    // they are sent as silence so RTP timestamps stay on the device clock.
+    // Jumps up to `slack` frames are taken as position jitter and ignored.
+    void noteCapturePosition(uint64_t position, uint32_t frames, uint32_t slack = 0) {
+        if (capPositionValid && position > capNextPosition + slack) {
+            uint64_t limit = capDevice.sampleRate ? capDevice.sampleRate : uint64_t(fmt.sampleRate);
+            onCaptureDevice(nullptr, uint32_t(std::min(position - capNextPosition, limit)));
+        }
+        capNextPosition = position + frames;
+        capPositionValid = true;
+    }
+
+    // Capture thread, after noteCapturePosition() and before
+    // onCaptureDevice(): host time at which the first of the coming frames
+    // reached the converter (AudioTimeStamp::mHostTime, the WASAPI QPC
+    // position, ...), in host_clock.h nanoseconds.
+    void noteCaptureTime(uint64_t hostNs) { capPendingNs = hostNs; }
+
+    // Render thread, before onRenderDevice(): host time at which the first
+    // of the frames about to be rendered will leave the converter.
+    void noteRenderTime(uint64_t hostNs) { renPendingNs = hostNs; }
+
+    // Device-format variants of the callbacks below. bufs holds one pointer
+    // for interleaved data or one per channel for planar data; a null bufs
+    // on capture stands for silence.
+    void onCaptureDevice(const void* const* bufs, uint32_t frames) {
+        if (!bufs) {
+            if (capResampler)
+                frames = uint32_t(uint64_t(frames) * capResampler->upFactor() / capResampler->downFactor());
+            onCapture(nullptr, frames);
+            return;
+        }
+        if (!capResampler && capAdapter.passthrough()) {
+            onCapture(static_cast<const float*>(bufs[0]), frames);
+            return;
+        }
+        const void* cur[kMaxChannels];
+        std::copy(bufs, bufs + (capDevice.planar ? capAdapter.device().channels : 1), cur);
+        while (frames > 0) {
+            uint32_t chunk = std::min(frames, maxBlock);
+            const float* mono = capAdapter.toMono(cur, chunk);
+            if (capResampler) {
+                uint32_t n = capResampler->process(mono, chunk, capResampled.data(), uint32_t(capResampled.size()));
+                onCapture(capResampled.data(), n);
+            } else {
+                onCapture(mono, chunk);
+            }
+            capAdapter.offset(cur, chunk, cur);
+            frames -= chunk;
+        }
+    }
+
+    void onRenderDevice(void* const* bufs, uint32_t frames) {
+        if (!renResampler && renAdapter.passthrough()) {
+            onRender(static_cast<float*>(bufs[0]), frames);
+            return;
+        }
+        void* cur[kMaxChannels];
+        std::copy(bufs, bufs + (renDevice.planar ? renAdapter.device().channels : 1), cur);
+        while (frames > 0) {
+            uint32_t chunk = std::min(frames, maxBlock);
+            if (renResampler) {
+                // Pull exactly what the next chunk of device frames needs.
+                uint32_t need = renResampler->inputFor(chunk);
+                onRender(renderPulled.data(), need);
+                renResampler->process(renderPulled.data(), need, renderOut.data(), chunk);
+            } else {
+                onRender(renderOut.data(), chunk);
+            }
+            renAdapter.fromMono(renderOut.data(), cur, chunk);
+            renAdapter.offset(cur, chunk, const_cast<const void**>(cur));
+            frames -= chunk;
+        }
+    }
+
+    // frames <= the maxFrames given to prepare(). Both devices must run at
+    // the processing rate; duplex backends open them that way.
+    void onDuplexDevice(const void* const* in, void* const* out, uint32_t frames) {
+        onDuplex(capAdapter.toMono(in, frames), renderOut.data(), frames);
+        renAdapter.fromMono(renderOut.data(), out, frames);
+    }
+
+    // Capture thread. A null pointer stands for `frames` of silence.
+    void onCapture(const float* in, uint32_t frames) {
+        CallbackTimer timer(capMetrics, frames, fmt.sampleRate);
+        if (probe) { probe->capture(in, frames * fmt.channels); return; }
+        if (capPendingNs) {
+            // The converter delays the block: its frames were captured earlier.
+            uint64_t delay = capResampler ? frames_to_ns(capResampler->latencyFrames(), fmt.sampleRate) : 0;
+            capClock.publish(FrameTime{capFrames, capPendingNs - delay});
+            capPendingNs = 0;
+        }
+        if (workers) { stageCapture(in, frames); return; }
+        capFrames += frames;
+        processCapture(in, frames);
+    }
+
+    // Render thread: always writes `frames` frames to out.
+    void onRender(float* out, uint32_t frames) {
+        CallbackTimer timer(renMetrics, frames, fmt.sampleRate);
+        applyRenderControls();
+        if (probe) { probe->render(out, frames * fmt.channels); return; }
+        renMetrics.noteFill(fifo.size() / fmt.channels);
+        if (renPendingNs) {
+            notePresentation(renPendingNs);
+            renPendingNs = 0;
+        }
+        while (frames > 0) {
+            uint32_t chunk = std::min(frames, maxBlock);
+            uint32_t n = chunk * fmt.channels;
+            double src = jitter->sourcePosition();
+            renMetrics.addUnderflowFrames(jitter->pull(renderIn.data(), n) / fmt.channels);
+            if (capturedSilent(src)) {
+                std::fill_n(out, n, 0.0f);
+            } else {
+                runProcessor(renderIn.data(), out, chunk);
+                if (!renGain.unity()) renGain.process(out, out, n);
+            }
+            if (renTap) renTap->write(out, chunk);
+            if (aec) aec->render(out, chunk);
+            out += n;
+            frames -= chunk;
+        }
+    }
+
+    // Single callback that owns both directions of a clock-locked stream.
+    void onDuplex(const float* in, float* out, uint32_t frames) {
+        CallbackTimer timer(capMetrics, frames, fmt.sampleRate);
+        renMetrics.addFrames(frames);
+        applyCaptureControls();
+        applyRenderControls();
+        if (probe) {
+            probe->capture(in, frames * fmt.channels);
+            probe->render(out, frames * fmt.channels);
+            return;
+        }
+        if (capPendingNs && renPendingNs && !transport && renPendingNs > capPendingNs)
+            renMetrics.noteLatency(renPendingNs - capPendingNs);
+        capPendingNs = renPendingNs = 0;
+        if (aecActive()) {
+            aec->capture(in, captureClean.data(), frames);
+            in = captureClean.data();
+        }
+        bool voice = voiceActive(in, frames);
+        if (voice && !capGain.unity()) {
+            capGain.process(in, captureGained.data(), frames * fmt.channels);
+            in = captureGained.data();
+        }
+        if (capTap) capTap->write(voice ? in : nullptr, frames);
+        uint32_t n = frames * fmt.channels;
+        if (transport) {
+            // The peer's clock is not ours: render through the jitter buffer.
+            if (voice) transport->send(in, n);
+            else transport->sendSilence(n, capLevelDb);
+            renMetrics.noteFill(fifo.size() / fmt.channels);
+            renMetrics.addUnderflowFrames(jitter->pull(renderIn.data(), n) / fmt.channels);
+            runProcessor(renderIn.data(), out, frames);
+        } else if (voice) {
+            runProcessor(in, out, frames);
+        } else {
+            std::fill_n(out, n, 0.0f);
+        }
+        if ((transport || voice) && !renGain.unity()) renGain.process(out, out, n);
+        if (renTap) renTap->write(out, frames);
+        if (aec) aec->render(out, frames);
+    }
+
+    AudioFormat fmt;
+    StreamMetrics capMetrics{"capture"};
+    StreamMetrics renMetrics{"render"};
+    SpscRing<float> fifo;
+
+private:
+    void prepareCaptureDevice() {
+        capAdapter.prepare(capDevice, maxBlock);
+        capResampler.reset();
+        uint32_t rate = uint32_t(fmt.sampleRate);
+        if (capDevice.sampleRate && capDevice.sampleRate != rate) {
+            capResampler = std::make_unique<PolyphaseResampler>(capDevice.sampleRate, rate, maxBlock);
+            capResampled.assign(capResampler->maxOutput(maxBlock), 0.0f);
+        }
+        capPositionValid = false;
+    }
+
+    void prepareRenderDevice() {
+        renAdapter.prepare(renDevice, maxBlock);
+        renResampler.reset();
+        uint32_t rate = uint32_t(fmt.sampleRate);
+        if (renDevice.sampleRate && renDevice.sampleRate != rate) {
+            uint32_t maxIn = uint32_t(uint64_t(maxBlock) * rate / renDevice.sampleRate) +
+                             PolyphaseResampler::kTaps + 2;
+            renResampler = std::make_unique<PolyphaseResampler>(rate, renDevice.sampleRate, maxIn);
+            renderPulled.assign(maxIn, 0.0f);
+        }
+    }
+
+    // Capture path after the probe: controls, echo cancellation, VAD, gain
+    // and delivery. The capture thread, or the worker with a pool.
+    void processCapture(const float* in, uint32_t frames) {
+        applyCaptureControls();
+        if (!aecActive() && !suppressSilence && (!in || capGain.unity())) {
+            deliverCapture(in, frames, true);
+            return;
+        }
+        while (frames > 0) {
+            uint32_t chunk = std::min(frames, maxBlock);
+            const float* x = in;
+            if (aecActive()) {
+                aec->capture(in, captureClean.data(), chunk);
+                x = captureClean.data();
+            }
+            bool voice = voiceActive(x, chunk);
+            if (voice && x && !capGain.unity()) {
+                capGain.process(x, captureGained.data(), chunk * fmt.channels);
+                x = captureGained.data();
+            }
+            deliverCapture(voice ? x : nullptr, chunk, voice);
+            if (in) in += size_t(chunk) * fmt.channels;
+            frames -= chunk;
+        }
+    }
+
+    // Copy-in for the worker. Every block is queued as a segment; audio also
+    // goes into capStage, silence only as its length, so a gap of any size
+    // (noteCapturePosition() passes up to a second) reaches processCapture()
+    // as it does without workers. An audio block that does not fit is
+    // dropped whole, like frames a full FIFO refuses.
+    void stageCapture(const float* in, uint32_t frames) {
+        uint32_t n = frames * fmt.channels;
+        if (capSegments->writeAvailable() == 0 || (in && capStage->writeAvailable() < n)) {
+            capMetrics.addOverflowDrops(frames);
+        } else {
+            if (in) capStage->push(in, n);
+            StageSegment seg{frames, in == nullptr};
+            capSegments->push(&seg, 1); // after the samples it describes
+            capFrames += frames;
+        }
+        // Due when the next block arrives; if the queue is full, the job
+        // already queued picks these frames up too.
+        uint64_t due = host_now_ns() + uint64_t(frames * 1e9 / fmt.sampleRate);
+        workerPort->submit(&AudioEngine::captureJob, this, due);
+    }
+
+    static void captureJob(void* self) {
+        AudioEngine& e = *static_cast<AudioEngine*>(self);
+        StageSegment seg;
+        while (e.capSegments->pop(&seg, 1)) {
+            if (seg.silence) {
+                e.processCapture(nullptr, seg.frames);
+                continue;
+            }
+            for (uint32_t left = seg.frames * e.fmt.channels; left > 0;) {
+                uint32_t got = e.capStage->pop(e.capStaged.data(), std::min(left, uint32_t(e.capStaged.size())));
+                e.processCapture(e.capStaged.data(), got / e.fmt.channels);
+                left -= got;
+            }
+        }
+    }
+
+    // Bypassed, the canceller still takes the render reference (its ring
+    // trims whatever capture did not consume), so it resumes in sync.
+    bool aecActive() const { return aec && aecEnabled; }
+
+    void applyCaptureControls() {
+        ControlCommand c;
+        while (capControls.pop(c)) {
+            if (c.id == Control::CaptureGainDb) capGain.setDb(c.value);
+            else if (c.id == Control::CaptureMute) capGain.setMuted(c.value != 0.0f);
+            else if (c.id == Control::EchoCancel) aecEnabled = c.value != 0.0f;
+        }
+    }
+
+    void applyRenderControls() {
+        ControlCommand c;
+        while (renControls.pop(c)) {
+            if (c.id == Control::RenderGainDb) renGain.setDb(c.value);
+            else if (c.id == Control::RenderMute) renGain.setMuted(c.value != 0.0f);
+            else if (c.id == Control::JitterTargetMs && jitter && c.value > 0.0f) {
+                double frames = std::min(c.value * fmt.sampleRate / 1000.0, double(UINT32_MAX));
+                jitter->setTargetFrames(clampJitterFrames(uint32_t(frames)));
+            }
+        }
+    }
+
+    // A target the FIFO cannot hold would never finish priming: render would
+    // stay silent while capture overflows. Keep four blocks of headroom.
+    uint32_t clampJitterFrames(uint32_t frames) const {
+        uint32_t capacity = fifo.capacity() / fmt.channels;
+        uint32_t headroom = 4 * maxBlock;
+        return std::min(frames, capacity > 2 * headroom ? capacity - headroom : capacity / 2);
+    }
+
+    // The VAD decision for a block after echo cancellation; always speech
+    // with suppression off. A gap (null) is silence.
+    bool voiceActive(const float* x, uint32_t frames) {
+        if (!suppressSilence) return true;
+        if (vadConfig.update()) vad.setConfig(vadConfig.current());
+        if (!x) {
+            capLevelDb = kGapLevelDb;
+            return false;
+        }
+        bool voice = vad.process(x, frames * fmt.channels);
+        capLevelDb = vad.lastLevelDb();
+        return voice;
+    }
+
+    // Capture after echo cancellation: to the peer, or into the FIFO.
+    // Silence (voice false) has a null in.
+    void deliverCapture(const float* in, uint32_t frames, bool voice) {
+        uint64_t first = capDelivered;
+        capDelivered += frames;
+        if (capTap) capTap->write(in, frames);
+        uint32_t n = frames * fmt.channels;
+        if (transport) {
+            if (voice) transport->send(in, n);
+            else transport->sendSilence(n, capLevelDb);
+            return;
+        }
+        // Before the push, so render never sees speech samples without it.
+        if (voice) fifoVoiceEnd.store(fifoWritten + n, std::memory_order_release);
+        // The block's capture time goes with its position in the FIFO.
+        capClock.update();
+        if (capClock.current().valid())
+            fifoClock.publish(
+                FrameTime{fifoWritten / fmt.channels, capClock.current().at(double(first), fmt.sampleRate)});
+        uint32_t pushed = 0;
+        if (!in) {
+            // Keep the FIFO's timeline: a gap becomes silence, not a skip.
+            for (uint32_t left = n; left > 0;) {
+                uint32_t chunk = std::min(left, uint32_t(captureSilence.size()));
+                pushed += fifo.push(captureSilence.data(), chunk);
+                left -= chunk;
+            }
+        } else {
+            pushed = fifo.push(in, n);
+        }
+        fifoWritten += pushed;
+        capMetrics.addOverflowDrops((n - pushed) / fmt.channels);
+        capMetrics.noteFill(fifo.size() / fmt.channels);
+    }
+
+    // Render thread, before the jitter buffer is pulled: the next frame it
+    // hands out leaves the converter at presentNs; compare with when that
+    // frame was captured.
+    void notePresentation(uint64_t presentNs) {
+        if (transport) return;
+        if (renResampler) presentNs += frames_to_ns(renResampler->latencyFrames(), renDevice.sampleRate);
+        fifoClock.update();
+        double src = jitter->sourcePosition(); // in samples, like fifoWritten
+        if (!fifoClock.current().valid() || src < 0) return;
+        uint64_t capturedNs = fifoClock.current().at(src / fmt.channels, fmt.sampleRate);
+        if (presentNs > capturedNs) renMetrics.noteLatency(presentNs - capturedNs);
+    }
+
+    // Render thread, after pulling from sourcePosition() src: true when
+    // everything pulled was captured as silence (in a local loop).
+    bool capturedSilent(double src) const {
+        if (!suppressSilence || transport || src < 0) return false;
+        // The resampler's window reaches back from its centre.
+        return src - DriftResampler::kTaps / 2 >= double(fifoVoiceEnd.load(std::memory_order_acquire));
+    }
+
+    void runProcessor(const float* in, float* out, uint32_t frames) {
+        if (processor)
+            processor->process(in, out, frames);
+        else
+            std::copy(in, in + size_t(frames) * fmt.channels, out);
+    }
+
+    std::unique_ptr<JitterBuffer> jitter;
+    std::vector<float> renderIn;
+    std::vector<float> captureSilence;
+    std::vector<float> renderOut; // mono render signal for device conversion
+    DeviceFormat capDevice, renDevice;
+    FormatAdapter capAdapter, renAdapter;
+    std::unique_ptr<PolyphaseResampler> capResampler, renResampler; // only when rates differ
+    std::vector<float> capResampled, renderPulled;
+    uint32_t maxBlock = 0;
+    AudioProcessor* processor = nullptr;
+    LatencyProbe* probe = nullptr;
+    UdpTransport* transport = nullptr;
+    EchoCanceller* echoCanceller = nullptr;
+    EchoCanceller* aec = nullptr; // echoCanceller if the format allows it
+    std::vector<float> captureClean;
+    std::vector<float> captureGained;
+    CommandQueue capControls, renControls;
+    GainRamp capGain, renGain;
+    bool aecEnabled = true; // capture path
+    static constexpr double kGapLevelDb = -127.0; // comfort-noise level of dropped frames
+    bool suppressSilence = true;
+    VoiceActivityDetector vad; // capture processing
+    double capLevelDb = kGapLevelDb; // of the last block vad saw
+    Snapshot<VadConfig> vadConfig; // control thread -> capture processing
+    VadConfig vadSettings;         // last published, under vadLock
+    std::mutex vadLock;
+    // FIFO index just past the last speech: producer -> render.
+    std::atomic<uint64_t> fifoVoiceEnd{0};
+    RtWorkerPool* workers = nullptr;
+    RtPort* workerPort = nullptr;
+    struct StageSegment {
+        uint32_t frames;
+        bool silence; // no samples in capStage
+    };
+    std::unique_ptr<SpscRing<float>> capStage; // capture thread -> worker
+    std::unique_ptr<SpscRing<StageSegment>> capSegments;
+    std::vector<float> capStaged;
+    RecordTap* capTap = nullptr;
+    RecordTap* renTap = nullptr;
+    uint64_t capNextPosition = 0;
+    bool capPositionValid = false;
+    // Timestamps: capture thread -> capture processing -> render.
+    uint64_t capPendingNs = 0, renPendingNs = 0; // from the backend, 0: none
+    uint64_t capFrames = 0;     // capture thread: frames taken into processing
+    uint64_t capDelivered = 0;  // processing side: frames delivered
+    uint64_t fifoWritten = 0;   // processing side: samples the FIFO accepted
+    Snapshot<FrameTime> capClock, fifoClock;
+    double jitterTargetMs = 0.0;
+};
+
+} // namespace nuchat
@@ -0,0 +1,76 @@
+// audio_workgroup.h
+// Apple audio workgroups (os_workgroup, macOS 11 / iOS 14).
+//
+// CoreAudio groups a device's IO thread with the threads that do work for
+// it into a workgroup, and schedules the group against the IO deadline:
+// members stay on performance cores when the I/O cycle needs them. Threads
+// that merely raise their own priority are not members and may be demoted
+// to efficiency cores under load. The IO thread itself is a member already;
+// nothing needs to be done on it.
+//
+// join_io_workgroup() fetches the workgroup of an IO unit (VoiceProcessingIO
+// or RemoteIO/HAL output) and hands it to an RtWorkerPool, whose workers
+// then join it. Call it after AudioUnitInitialize() and again after every
+// re-initialization (device or route change), which may bring a new one.
+
+#pragma once
+
+#if defined(__APPLE__)
+
+#include <AudioToolbox/AudioToolbox.h>
+#include <TargetConditionals.h>
+#include <os/workgroup.h>
+
+#include <cstdio>
+
+#include "rt_workers.h"
+
+namespace nuchat {
+
+// periodMs: the IO buffer duration, for the workers' time-constraint policy.
+// False if the OS or the unit has no workgroup; the workers then keep running
+// under their own time-constraint policy only.
+inline bool join_io_workgroup(RtWorkerPool& pool, AudioUnit unit, double periodMs) {
+    if (__builtin_available(macOS 11.0, iOS 14.0, *)) {
+        // The property hands out a retained reference.
+        void* raw = nullptr;
+        UInt32 size = sizeof(raw);
+        OSStatus s = AudioUnitGetProperty(unit, kAudioOutputUnitProperty_OSWorkgroup, kAudioUnitScope_Global, 0,
+                                          &raw, &size);
+#if TARGET_OS_OSX
+        if (s != noErr || !raw) {
+            // Not published by the unit: ask the device it is bound to.
+            AudioObjectID device = kAudioObjectUnknown;
+            UInt32 dsz = sizeof(device);
+            AudioObjectPropertyAddress addr{kAudioDevicePropertyIOThreadOSWorkgroup, kAudioObjectPropertyScopeGlobal,
+                                            kAudioObjectPropertyElementMain};
+            if (AudioUnitGetProperty(unit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &device,
+                                     &dsz) == noErr) {
+                size = sizeof(raw);
+                s = AudioObjectGetPropertyData(device, &addr, 0, nullptr, &size, &raw);
+            }
+        }
+#endif
+        if (s != noErr || !raw) {
+            std::fprintf(stderr, "workgroup: none published by the IO unit (OSStatus %d)\n", (int)s);
+            return false;
+        }
+#if NUCHAT_OS_OBJECT_ARC
+        os_workgroup_t wg = (__bridge_transfer os_workgroup_t)raw;
+        pool.setWorkgroup(wg, periodMs);
+#else
+        os_workgroup_t wg = static_cast<os_workgroup_t>(raw);
+        pool.setWorkgroup(wg, periodMs);
+        os_release(wg);
+#endif
+        return true;
+    }
+    (void)pool;
+    (void)unit;
+    (void)periodMs;
+    return false;
+}
+
+} // namespace nuchat
+
+#endif // __APPLE__
@@ -0,0 +1,39 @@
+// block_dispatch.h
+// Compile-time block sizes for the per-sample kernels.
+//
+// The periods the backends run at are constants (ALSA and WASAPI 128
+// frames, CoreAudio 64, iOS 128, their stereo sample counts twice that),
+// but a kernel written over a runtime n has to keep a remainder loop and
+// cannot unroll its vector loop. Kernels here take a Block<N> instead:
+// count() is the constant N when N != 0, so the compiler unrolls fully and
+// drops the remainder, and the runtime n otherwise. dispatch_block() maps a
+// runtime count to the matching instance, falling back to Block<0>, so
+// callers keep passing plain counts.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nuchat {
+
+template <uint32_t N>
+struct Block {
+    size_t n; // only read when N == 0
+    constexpr size_t count() const { return N ? N : n; }
+};
+
+// f(Block<N>) for the sizes that get their own instance, f(Block<0>) for the
+// rest; every instance must return the same type.
+template <typename F>
+inline decltype(auto) dispatch_block(size_t n, F&& f) {
+    switch (n) {
+    case 64:  return f(Block<64>{n});
+    case 128: return f(Block<128>{n});
+    case 256: return f(Block<256>{n});
+    case 512: return f(Block<512>{n});
+    default:  return f(Block<0>{n});
+    }
+}
+
+} // namespace nuchat
@@ -0,0 +1,381 @@
+// call_recorder.h
+// Call recording for QA: taps on the capture and render paths that stream
+// to WAV files without the audio threads ever touching the disk.
+//
+// A RecordTap is one SPSC ring. The audio thread copies each block into
+// it (RecordTap::write) and a block that does not fit is dropped and
+// counted, never waited for. One writer thread per CallRecorder drains
+// every tap every flushMs. It converts the samples to the file format
+// into a 64 KiB aligned chunk and writes each full chunk with
+// unbuffered I/O: O_DIRECT on Linux, F_NOCACHE on Apple and
+// FILE_FLAG_NO_BUFFERING on Windows. Recording many calls at once
+// therefore costs the callbacks one memcpy each and does not fill the
+// page cache.
+//
+// Files are chunked WAV: the samples start at a 4 KiB offset behind a
+// JUNK-padded header, and the header is rewritten after every chunk. A
+// recording cut off by a crash still plays up to its last full chunk.
+// close() and stop() write the partial last chunk, trim the block
+// padding and give the header the final size.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "format_convert.h"
+#include "spsc_ring.h"
+#include "wav_file.h"
+
+namespace nuchat {
+
+// Output file written in kAlign multiples from kAlign-aligned memory at
+// kAlign-aligned offsets, bypassing the page cache where the filesystem
+// allows it (tmpfs and some network mounts do not; those get buffered I/O).
+class DirectFile {
+public:
+    static constexpr size_t kAlign = 4096;
+
+    DirectFile() = default;
+    ~DirectFile() { close(); }
+
+    DirectFile(const DirectFile&) = delete;
+    DirectFile& operator=(const DirectFile&) = delete;
+
+    bool open(const char* path) {
+        close();
+#if defined(_WIN32)
+        handle = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+        return handle != INVALID_HANDLE_VALUE;
+#else
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+        fd = ::open(path, flags | O_DIRECT, 0644);
+        if (fd < 0 && errno == EINVAL) fd = ::open(path, flags, 0644);
+#else
+        fd = ::open(path, flags, 0644);
+#endif
+#if defined(F_NOCACHE)
+        if (fd >= 0) fcntl(fd, F_NOCACHE, 1);
+#endif
+        return fd >= 0;
+#endif
+    }
+
+    bool isOpen() const {
+#if defined(_WIN32)
+        return handle != INVALID_HANDLE_VALUE;
+#else
+        return fd >= 0;
+#endif
+    }
+
+    // offset and bytes are kAlign multiples, data kAlign-aligned.
+    bool writeAt(uint64_t offset, const void* data, size_t bytes) {
+#if defined(_WIN32)
+        OVERLAPPED at{};
+        at.Offset = DWORD(offset);
+        at.OffsetHigh = DWORD(offset >> 32);
+        DWORD done = 0;
+        return WriteFile(handle, data, DWORD(bytes), &done, &at) && done == bytes;
+#else
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (bytes > 0) {
+            ssize_t n = ::pwrite(fd, p, bytes, off_t(offset));
+#if defined(O_DIRECT)
+            if (n < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+                // Accepted at open but not for this write: drop to buffered.
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+#endif
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            offset += uint64_t(n);
+            bytes -= size_t(n);
+        }
+        return true;
+#endif
+    }
+
+    // Cuts the padding of the last block.
+    bool truncate(uint64_t size) {
+#if defined(_WIN32)
+        LARGE_INTEGER li;
+        li.QuadPart = LONGLONG(size);
+        return SetFilePointerEx(handle, li, nullptr, FILE_BEGIN) && SetEndOfFile(handle);
+#else
+        return ::ftruncate(fd, off_t(size)) == 0;
+#endif
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+        handle = INVALID_HANDLE_VALUE;
+#else
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+struct CallRecorderConfig {
+    SampleFormat sample = SampleFormat::Int16; // on disk: s16, s32 or f32
+    uint32_t ringSamples = 1 << 17;            // per tap; ~2.7 s of mono at 48 kHz
+    double flushMs = 20.0;                     // how often the writer drains the taps
+};
+
+class CallRecorder;
+
+// One recorded stream. write() belongs to a single audio thread; the rest
+// of the tap belongs to the recorder's writer.
+class RecordTap {
+public:
+    // Non-realtime, before the stream's callbacks start (AudioEngine::
+    // prepare does this): the layout of what write() will be given. The
+    // first call fixes the file's format; later ones are ignored.
+    void setFormat(uint32_t sampleRate, uint32_t channels) {
+        if (ready.load(std::memory_order_acquire)) return;
+        format.sampleRate = sampleRate;
+        format.channels = std::max<uint32_t>(1, std::min(channels, kMaxChannels));
+        ready.store(true, std::memory_order_release);
+    }
+
+    // Audio thread, wait-free: frames of interleaved float, null for
+    // silence. A block the ring cannot take whole is dropped.
+    void write(const float* in, uint32_t frames) {
+        uint32_t n = frames * format.channels;
+        if (!ready.load(std::memory_order_acquire) || ring.writeAvailable() < n) {
+            droppedFrames.fetch_add(frames, std::memory_order_relaxed);
+            return;
+        }
+        if (in) {
+            ring.push(in, n);
+            return;
+        }
+        static const float zeros[256] = {};
+        for (uint32_t left = n; left > 0;) left -= ring.push(zeros, std::min<uint32_t>(left, 256));
+    }
+
+    const std::string& path() const { return filePath; }
+    uint64_t frames() const { return writtenFrames.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return droppedFrames.load(std::memory_order_relaxed); }
+
+private:
+    friend class CallRecorder;
+
+    static constexpr size_t kChunkBytes = 64 * 1024;
+    static constexpr size_t kHeaderBytes = DirectFile::kAlign;
+
+    struct AlignedFree {
+        void operator()(uint8_t* p) const { ::operator delete(p, std::align_val_t(DirectFile::kAlign)); }
+    };
+    using AlignedBuffer = std::unique_ptr<uint8_t, AlignedFree>;
+
+    static AlignedBuffer allocate(size_t bytes) {
+        auto* p = static_cast<uint8_t*>(::operator new(bytes, std::align_val_t(DirectFile::kAlign)));
+        std::memset(p, 0, bytes);
+        return AlignedBuffer(p);
+    }
+
+    RecordTap(const char* path, const CallRecorderConfig& cfg)
+        : ring(cfg.ringSamples), filePath(path), chunk(allocate(kChunkBytes)), header(allocate(kHeaderBytes)),
+          scratch(kChunkBytes / bytes_per_sample(cfg.sample)) {
+        format.sample = cfg.sample;
+    }
+
+    // Writer thread: moves what the ring holds into the chunk, writing each
+    // chunk as it fills. False once the file has failed.
+    bool drain() {
+        if (failed || !ready.load(std::memory_order_acquire)) return !failed;
+        if (!file.isOpen()) {
+            if (!file.open(filePath.c_str())) return fail("cannot create");
+            if (!writeHeader(0)) return fail("cannot write");
+        }
+        const uint32_t bps = bytes_per_sample(format.sample);
+        while (uint32_t avail = ring.readAvailable()) {
+            uint32_t room = uint32_t((kChunkBytes - fill) / bps);
+            uint32_t got = ring.pop(scratch.data(), std::min(avail, room));
+            convert::from_float(format.sample, scratch.data(), chunk.get() + fill, got);
+            fill += size_t(got) * bps;
+            writtenFrames.store((flushed + fill) / (bps * format.channels), std::memory_order_relaxed);
+            if (fill < kChunkBytes) continue;
+            if (!file.writeAt(kHeaderBytes + flushed, chunk.get(), kChunkBytes)) return fail("cannot write");
+            flushed += kChunkBytes;
+            fill = 0;
+            if (!writeHeader(flushed)) return fail("cannot write");
+        }
+        return true;
+    }
+
+    // Writer thread, once the audio thread has stopped writing.
+    void finish() {
+        if (!drain() || !file.isOpen()) { file.close(); return; }
+        uint64_t total = flushed + fill;
+        if (fill > 0) {
+            size_t padded = (fill + DirectFile::kAlign - 1) / DirectFile::kAlign * DirectFile::kAlign;
+            std::memset(chunk.get() + fill, 0, padded - fill);
+            if (!file.writeAt(kHeaderBytes + flushed, chunk.get(), padded)) fail("cannot write");
+        }
+        if (!failed && (!writeHeader(total) || !file.truncate(kHeaderBytes + total))) fail("cannot finish");
+        file.close();
+    }
+
+    bool writeHeader(uint64_t bytes) {
+        wav::make_header(header.get(), format, bytes, uint32_t(kHeaderBytes));
+        return file.writeAt(0, header.get(), kHeaderBytes);
+    }
+
+    bool fail(const char* what) {
+        std::fprintf(stderr, "recorder: %s %s\n", what, filePath.c_str());
+        failed = true;
+        return false;
+    }
+
+    SpscRing<float> ring;
+    DeviceFormat format;
+    std::atomic<bool> ready{false};
+    std::atomic<uint64_t> writtenFrames{0}, droppedFrames{0};
+    // Writer-owned.
+    std::string filePath;
+    DirectFile file;
+    AlignedBuffer chunk, header;
+    std::vector<float> scratch;
+    size_t fill = 0;      // bytes pending in chunk
+    uint64_t flushed = 0; // sample bytes on disk
+    bool failed = false;
+    bool closing = false; // under the recorder's lock
+};
+
+class CallRecorder {
+public:
+    explicit CallRecorder(const CallRecorderConfig& config = CallRecorderConfig()) : cfg(config) {
+        if (cfg.sample == SampleFormat::Int24In32) cfg.sample = SampleFormat::Int32;
+    }
+    ~CallRecorder() { stop(); }
+
+    CallRecorder(const CallRecorder&) = delete;
+    CallRecorder& operator=(const CallRecorder&) = delete;
+
+    // Any non-realtime thread. The file is created once the tap has a
+    // format and the writer first runs.
+    RecordTap* open(const char* path) {
+        std::lock_guard<std::mutex> g(mtx);
+        taps.push_back(std::unique_ptr<RecordTap>(new RecordTap(path, cfg)));
+        return taps.back().get();
+    }
+
+    // Any non-realtime thread, once nothing writes to the tap any more:
+    // finishes its file and frees it. Returns when the file is complete.
+    void close(RecordTap* tap) {
+        std::unique_lock<std::mutex> lock(mtx);
+        tap->closing = true;
+        if (!running) {
+            finishLocked(tap);
+            return;
+        }
+        cv.notify_all();
+        done.wait(lock, [&] { return !contains(tap); });
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> g(mtx);
+        if (running) return;
+        running = true;
+        writer = std::thread(&CallRecorder::run, this);
+    }
+
+    // After the audio threads stop: drains and finishes every open file,
+    // printing one line per file (frames written, frames dropped) to stderr.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> g(mtx);
+            running = false;
+        }
+        cv.notify_all();
+        if (writer.joinable()) writer.join();
+        std::lock_guard<std::mutex> g(mtx);
+        while (!taps.empty()) finishLocked(taps.back().get());
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        auto period = std::chrono::duration<double, std::milli>(cfg.flushMs);
+        for (;;) {
+            cv.wait_for(lock, period, [this] { return !running || anyClosing(); });
+            if (!running) return;
+            // Disk I/O without the lock, so open() and close() do not wait
+            // behind it. Only this thread removes taps.
+            std::vector<RecordTap*> live;
+            for (auto& t : taps) live.push_back(t.get());
+            lock.unlock();
+            for (RecordTap* t : live) t->drain();
+            lock.lock();
+            bool finished = false;
+            for (size_t i = taps.size(); i-- > 0;) {
+                if (!taps[i]->closing) continue;
+                finishLocked(taps[i].get());
+                finished = true;
+            }
+            if (finished) done.notify_all();
+        }
+    }
+
+    void finishLocked(RecordTap* tap) {
+        tap->finish();
+        std::fprintf(stderr, "recorder: %s, %llu frames, %llu dropped\n", tap->path().c_str(),
+                     (unsigned long long)tap->frames(), (unsigned long long)tap->dropped());
+        taps.erase(std::find_if(taps.begin(), taps.end(), [tap](const auto& t) { return t.get() == tap; }));
+    }
+
+    bool anyClosing() const {
+        return std::any_of(taps.begin(), taps.end(), [](const auto& t) { return t->closing; });
+    }
+
+    bool contains(RecordTap* tap) const {
+        return std::any_of(taps.begin(), taps.end(), [tap](const auto& t) { return t.get() == tap; });
+    }
+
+    CallRecorderConfig cfg;
+    std::vector<std::unique_ptr<RecordTap>> taps;
+    std::mutex mtx;
+    std::condition_variable cv, done;
+    std::thread writer;
+    bool running = false;
+};
+
+} // namespace nuchat
@@ -0,0 +1,163 @@
+// control.h
+// Runtime control of a running stream: gain, mute, jitter target, echo
+// canceller bypass and DSP settings, changed from any thread and applied by
+// the audio thread at its next period boundary.
+//
+// Two channels, both wait-free and allocation-free on the audio side:
+//   - CommandQueue: small (id, value) commands through an SpscRing. Control
+//     threads serialise on a mutex among themselves (they are never
+//     realtime); the audio thread only pops.
+//   - Snapshot<T>: a triple buffer for configuration blocks too large to
+//     send as one command (e.g. a VadConfig). The writer publishes whole
+//     values, the reader picks up the newest one when it is ready for it;
+//     intermediate values may be skipped, none is ever torn.
+// GainRamp applies gain changes over one block so they never click.
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include "block_dispatch.h"
+#include "spsc_ring.h"
+
+namespace nuchat {
+
+enum class Control : uint8_t {
+    CaptureGainDb,
+    RenderGainDb,
+    CaptureMute,    // 0 or 1
+    RenderMute,     // 0 or 1
+    JitterTargetMs, // render-side jitter buffer fill, capped to what the FIFO holds
+    EchoCancel,     // 0 bypasses the echo canceller
+};
+
+struct ControlCommand {
+    Control id;
+    float value;
+};
+
+// True for commands the capture thread applies; the rest go to render.
+inline bool is_capture_control(Control c) {
+    return c == Control::CaptureGainDb || c == Control::CaptureMute || c == Control::EchoCancel;
+}
+
+// One CLI/console line: "<name> <value>", with on/off accepted for switches.
+//   capture-gain <dB>   render-gain <dB>   mute on|off   render-mute on|off
+//   jitter-ms <ms>      aec on|off
+inline bool parse_control(const char* line, ControlCommand& cmd) {
+    static const struct { const char* name; Control id; } names[] = {
+        {"capture-gain", Control::CaptureGainDb}, {"render-gain", Control::RenderGainDb},
+        {"mute", Control::CaptureMute},           {"render-mute", Control::RenderMute},
+        {"jitter-ms", Control::JitterTargetMs},   {"aec", Control::EchoCancel},
+    };
+    while (*line == ' ' || *line == '\t') ++line;
+    for (const auto& n : names) {
+        size_t len = std::strlen(n.name);
+        if (std::strncmp(line, n.name, len) || (line[len] != ' ' && line[len] != '\t')) continue;
+        const char* arg = line + len;
+        while (*arg == ' ' || *arg == '\t') ++arg;
+        if (!std::strncmp(arg, "on", 2)) cmd.value = 1.0f;
+        else if (!std::strncmp(arg, "off", 3)) cmd.value = 0.0f;
+        else {
+            char* end;
+            cmd.value = std::strtof(arg, &end);
+            if (end == arg) return false;
+        }
+        cmd.id = n.id;
+        return true;
+    }
+    return false;
+}
+
+class CommandQueue {
+public:
+    explicit CommandQueue(uint32_t capacity = 64) : ring(capacity) {}
+
+    // Any non-realtime thread. False if the audio thread has fallen so far
+    // behind that the queue is full.
+    bool post(const ControlCommand& cmd) {
+        std::lock_guard<std::mutex> g(producer);
+        return ring.push(&cmd, 1) == 1;
+    }
+
+    // Audio thread, wait-free.
+    bool pop(ControlCommand& cmd) { return ring.pop(&cmd, 1) == 1; }
+
+private:
+    SpscRing<ControlCommand> ring;
+    std::mutex producer;
+};
+
+// Single writer, single reader. T must be copy-assignable without
+// allocating for update() to be realtime-safe (plain structs).
+template <typename T>
+class Snapshot {
+public:
+    explicit Snapshot(const T& initial = T()) {
+        for (T& s : slots) s = initial;
+    }
+
+    // Writer thread.
+    void publish(const T& value) {
+        slots[back] = value;
+        back = state.exchange(back | kFresh, std::memory_order_acq_rel) & kIndex;
+    }
+
+    // Reader thread: true if a value newer than the last one read was
+    // published, in which case current() now returns it.
+    bool update() {
+        if (!(state.load(std::memory_order_relaxed) & kFresh)) return false;
+        front = state.exchange(front, std::memory_order_acq_rel) & kIndex;
+        return true;
+    }
+
+    const T& current() const { return slots[front]; }
+
+private:
+    static constexpr uint32_t kIndex = 3, kFresh = 4;
+    T slots[3];
+    alignas(kCacheLine) std::atomic<uint32_t> state{1}; // middle slot, fresh bit
+    alignas(kCacheLine) uint32_t back = 2;              // writer-owned
+    alignas(kCacheLine) uint32_t front = 0;             // reader-owned
+};
+
+// Gain for one thread's signal, set from that thread; a new value ramps in
+// linearly across the next block.
+class GainRamp {
+public:
+    void setDb(float db) { gainDb = db; retarget(); }
+    void setMuted(bool m) { muted = m; retarget(); }
+
+    bool unity() const { return current == 1.0f && target == 1.0f; }
+
+    // in may alias out.
+    void process(const float* in, float* out, uint32_t n) {
+        dispatch_block(n, [&](auto blk) { process(in, out, blk); });
+    }
+
+    template <uint32_t N>
+    void process(const float* in, float* out, Block<N> blk) {
+        const int n = int(blk.count());
+        if (current == target) {
+            for (int i = 0; i < n; ++i) out[i] = in[i] * current;
+            return;
+        }
+        float step = (target - current) / float(n);
+        for (int i = 0; i < n; ++i) out[i] = in[i] * (current + step * float(i + 1));
+        current = target;
+    }
+
+private:
+    void retarget() { target = muted ? 0.0f : std::pow(10.0f, gainDb / 20.0f); }
+
+    float gainDb = 0.0f;
+    bool muted = false;
+    float current = 1.0f, target = 1.0f;
+};
+
+} // namespace nuchat
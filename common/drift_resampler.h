@@ -0,0 +1,99 @@
+// drift_resampler.h
+// Small variable-rate resampler for clock-drift correction.
+//
+// Ratios stay within a fraction of a percent of 1.0, so a short windowed-sinc
+// kernel (8 taps, 256 interpolated phases) is enough for transparent quality
+// with 4 frames of group delay. All storage is allocated in the constructor.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace nuchat {
+
+class DriftResampler {
+public:
+    static constexpr int kTaps = 8;
+    static constexpr int kPhases = 256;
+
+    // maxOut: largest block render() will be asked for.
+    // maxStep: largest input/output ratio that will be used.
+    explicit DriftResampler(uint32_t maxOut, double maxStep = 1.01)
+        : hist(static_cast<size_t>(std::ceil(maxOut * maxStep)) + 2 * kTaps, 0.0f),
+          table((kPhases + 1) * kTaps) {
+        const double pi = 3.14159265358979323846;
+        const double cutoff = 0.97; // fraction of Nyquist kept
+        for (int p = 0; p <= kPhases; ++p) {
+            double frac = double(p) / kPhases;
+            double sum = 0.0;
+            float* row = &table[p * kTaps];
+            for (int k = 0; k < kTaps; ++k) {
+                double x = double(k - (kTaps / 2 - 1)) - frac;
+                double s = x == 0.0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+                double t = (x + kTaps / 2) / kTaps; // 0..1 across the window
+                double w = 0.42 - 0.5 * std::cos(2 * pi * t) + 0.08 * std::cos(4 * pi * t);
+                row[k] = float(s * w);
+                sum += s * w;
+            }
+            for (int k = 0; k < kTaps; ++k) row[k] = float(row[k] / sum);
+        }
+        reset();
+    }
+
+    // Drops history and starts again with kTaps-1 frames of silence.
+    void reset() {
+        std::fill(hist.begin(), hist.end(), 0.0f);
+        count = kTaps - 1;
+        pos = 0.0;
+    }
+
+    // Input frames that must be appended before render(outFrames, step).
+    uint32_t framesNeeded(uint32_t outFrames, double step) const {
+        if (outFrames == 0) return 0;
+        uint32_t last = uint32_t(pos + step * (outFrames - 1)) + kTaps;
+        return last > count ? last - count : 0;
+    }
+
+    // Space for n new input frames; call commit(n) after filling it.
+    float* inputTail() { return &hist[count]; }
+    uint32_t inputSpace() const { return uint32_t(hist.size()) - count; }
+    void commit(uint32_t n) { count += n; }
+
+    // Input frames held ahead of the next output's read position.
+    double held() const { return double(count) - pos; }
+
+    // Produces outFrames samples, consuming step input frames per output.
+    // The caller must have supplied framesNeeded() frames first.
+    void render(float* out, uint32_t outFrames, double step) {
+        for (uint32_t i = 0; i < outFrames; ++i) {
+            uint32_t base = uint32_t(pos);
+            double phase = (pos - base) * kPhases;
+            uint32_t p = uint32_t(phase);
+            float f = float(phase - p);
+            const float* a = &table[p * kTaps];
+            const float* b = a + kTaps;
+            const float* x = &hist[base];
+            float acc = 0.0f;
+            for (int k = 0; k < kTaps; ++k)
+                acc += x[k] * (a[k] + f * (b[k] - a[k]));
+            out[i] = acc;
+            pos += step;
+        }
+        uint32_t consumed = uint32_t(pos);
+        if (consumed > count) consumed = count;
+        std::memmove(&hist[0], &hist[consumed], (count - consumed) * sizeof(float));
+        count -= consumed;
+        pos -= consumed;
+    }
+
+private:
+    std::vector<float> hist;  // pending input, oldest first
+    std::vector<float> table; // (kPhases + 1) rows of kTaps coefficients
+    uint32_t count = 0;       // valid frames in hist
+    double pos = 0.0;         // read position relative to hist[0]
+};
+
+} // namespace nuchat
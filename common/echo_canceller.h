@@ -0,0 +1,327 @@
+// echo_canceller.h
+// Acoustic echo canceller for backends without a platform one (ALSA, WASAPI
+// without a communications render stream, Oboe). macOS and iOS use
+// VoiceProcessingIO instead.
+//
+// A partitioned-block frequency-domain NLMS filter (overlap-save, FFT size
+// 2B for B-frame blocks) models the speaker-to-mic path from the render
+// signal and subtracts its estimate from the capture signal:
+//   - the reference is whatever the render callback produced, handed to the
+//     capture thread through an SPSC ring;
+//   - each block costs three FFTs, two for the gradient constraint of one
+//     partition (round robin, as in MDF) and two complex MACs per partition
+//     and bin, so the per-block work is fixed by the tail length;
+//   - adaptation is normalised per bin by the reference energy the whole
+//     filter spans (the newest block alone would blow the step up whenever
+//     the far end goes quiet with its echo still ringing), frozen while a
+//     Geigel detector sees near-end speech and skipped while the far end is
+//     silent;
+//   - a block the filter would make louder is passed through unchanged.
+// Output is delayed by exactly one block. Mono, at the processing rate.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "fft.h"
+#include "format_convert.h"
+#include "spsc_ring.h"
+
+namespace nuchat {
+
+struct EchoCancellerConfig {
+    double tailMs = 80.0;        // echo path plus device latency the filter covers
+    uint32_t blockFrames = 64;   // power of two; also the added latency
+    float stepSize = 0.5f;       // NLMS step, 0..1
+    float doubleTalkRatio = 0.6f; // Geigel threshold: mic peak vs reference peak
+    double doubleTalkHoldMs = 40.0;
+};
+
+struct EchoCancellerStats {
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> doubleTalkBlocks{0};
+    std::atomic<uint64_t> bypassedBlocks{0}; // filter output louder than the mic
+    std::atomic<uint64_t> refUnderruns{0};   // reference frames missing at capture
+    std::atomic<float> erleDb{0.0f};         // smoothed echo return loss enhancement
+};
+
+namespace aeck {
+
+// y += a * b over n complex bins (split re/im).
+inline void cmac(float* yr, float* yi, const float* ar, const float* ai,
+                 const float* br, const float* bi, size_t n) {
+    size_t i = 0;
+#if NUCHAT_AVX2
+    for (; i < n - n % 8; i += 8) {
+        __m256 xr = _mm256_loadu_ps(ar + i), xi = _mm256_loadu_ps(ai + i);
+        __m256 wr = _mm256_loadu_ps(br + i), wi = _mm256_loadu_ps(bi + i);
+        __m256 sr = _mm256_sub_ps(_mm256_mul_ps(xr, wr), _mm256_mul_ps(xi, wi));
+        __m256 si = _mm256_add_ps(_mm256_mul_ps(xr, wi), _mm256_mul_ps(xi, wr));
+        _mm256_storeu_ps(yr + i, _mm256_add_ps(_mm256_loadu_ps(yr + i), sr));
+        _mm256_storeu_ps(yi + i, _mm256_add_ps(_mm256_loadu_ps(yi + i), si));
+    }
+#elif NUCHAT_SSE2
+    for (; i < n - n % 4; i += 4) {
+        __m128 xr = _mm_loadu_ps(ar + i), xi = _mm_loadu_ps(ai + i);
+        __m128 wr = _mm_loadu_ps(br + i), wi = _mm_loadu_ps(bi + i);
+        __m128 sr = _mm_sub_ps(_mm_mul_ps(xr, wr), _mm_mul_ps(xi, wi));
+        __m128 si = _mm_add_ps(_mm_mul_ps(xr, wi), _mm_mul_ps(xi, wr));
+        _mm_storeu_ps(yr + i, _mm_add_ps(_mm_loadu_ps(yr + i), sr));
+        _mm_storeu_ps(yi + i, _mm_add_ps(_mm_loadu_ps(yi + i), si));
+    }
+#elif NUCHAT_NEON
+    for (; i < n - n % 4; i += 4) {
+        float32x4_t xr = vld1q_f32(ar + i), xi = vld1q_f32(ai + i);
+        float32x4_t wr = vld1q_f32(br + i), wi = vld1q_f32(bi + i);
+        vst1q_f32(yr + i, vmlsq_f32(vmlaq_f32(vld1q_f32(yr + i), xr, wr), xi, wi));
+        vst1q_f32(yi + i, vmlaq_f32(vmlaq_f32(vld1q_f32(yi + i), xr, wi), xi, wr));
+    }
+#endif
+    for (; i < n; ++i) {
+        yr[i] += ar[i] * br[i] - ai[i] * bi[i];
+        yi[i] += ar[i] * bi[i] + ai[i] * br[i];
+    }
+}
+
+// y += conj(a) * b over n complex bins (split re/im).
+inline void cmac_conj(float* yr, float* yi, const float* ar, const float* ai,
+                      const float* br, const float* bi, size_t n) {
+    size_t i = 0;
+#if NUCHAT_AVX2
+    for (; i < n - n % 8; i += 8) {
+        __m256 xr = _mm256_loadu_ps(ar + i), xi = _mm256_loadu_ps(ai + i);
+        __m256 gr = _mm256_loadu_ps(br + i), gi = _mm256_loadu_ps(bi + i);
+        __m256 sr = _mm256_add_ps(_mm256_mul_ps(xr, gr), _mm256_mul_ps(xi, gi));
+        __m256 si = _mm256_sub_ps(_mm256_mul_ps(xr, gi), _mm256_mul_ps(xi, gr));
+        _mm256_storeu_ps(yr + i, _mm256_add_ps(_mm256_loadu_ps(yr + i), sr));
+        _mm256_storeu_ps(yi + i, _mm256_add_ps(_mm256_loadu_ps(yi + i), si));
+    }
+#elif NUCHAT_SSE2
+    for (; i < n - n % 4; i += 4) {
+        __m128 xr = _mm_loadu_ps(ar + i), xi = _mm_loadu_ps(ai + i);
+        __m128 gr = _mm_loadu_ps(br + i), gi = _mm_loadu_ps(bi + i);
+        __m128 sr = _mm_add_ps(_mm_mul_ps(xr, gr), _mm_mul_ps(xi, gi));
+        __m128 si = _mm_sub_ps(_mm_mul_ps(xr, gi), _mm_mul_ps(xi, gr));
+        _mm_storeu_ps(yr + i, _mm_add_ps(_mm_loadu_ps(yr + i), sr));
+        _mm_storeu_ps(yi + i, _mm_add_ps(_mm_loadu_ps(yi + i), si));
+    }
+#elif NUCHAT_NEON
+    for (; i < n - n % 4; i += 4) {
+        float32x4_t xr = vld1q_f32(ar + i), xi = vld1q_f32(ai + i);
+        float32x4_t gr = vld1q_f32(br + i), gi = vld1q_f32(bi + i);
+        vst1q_f32(yr + i, vmlaq_f32(vmlaq_f32(vld1q_f32(yr + i), xr, gr), xi, gi));
+        vst1q_f32(yi + i, vmlsq_f32(vmlaq_f32(vld1q_f32(yi + i), xr, gi), xi, gr));
+    }
+#endif
+    for (; i < n; ++i) {
+        yr[i] += ar[i] * br[i] + ai[i] * bi[i];
+        yi[i] += ar[i] * bi[i] - ai[i] * br[i];
+    }
+}
+
+} // namespace aeck
+
+class EchoCanceller {
+public:
+    explicit EchoCanceller(const EchoCancellerConfig& cfg = EchoCancellerConfig()) : cfg(cfg) {}
+
+    EchoCanceller(const EchoCanceller&) = delete;
+    EchoCanceller& operator=(const EchoCanceller&) = delete;
+
+    // Non-realtime. maxFrames bounds one render() call.
+    void prepare(double sampleRate, uint32_t maxFrames) {
+        block = 1;
+        while (block < cfg.blockFrames) block <<= 1;
+        fft.prepare(2 * block);
+        bins = fft.bins();
+        uint32_t tail = uint32_t(cfg.tailMs * sampleRate / 1000.0);
+        partitions = std::max<uint32_t>(1, (tail + block - 1) / block);
+        // The render side may run this far ahead before frames are dropped.
+        maxLead = std::max(partitions * block / 2, maxFrames);
+        ref = std::make_unique<SpscRing<float>>(2 * (maxLead + maxFrames));
+        size_t spectra = size_t(partitions) * bins;
+        wRe.assign(spectra, 0.0f);
+        wIm.assign(spectra, 0.0f);
+        xRe.assign(spectra, 0.0f);
+        xIm.assign(spectra, 0.0f);
+        xPow.assign(spectra, 0.0f);
+        xPeak.assign(partitions, 0.0f);
+        power.assign(bins, 0.0f);
+        yRe.assign(bins, 0.0f);
+        yIm.assign(bins, 0.0f);
+        eRe.assign(bins, 0.0f);
+        eIm.assign(bins, 0.0f);
+        refTime.assign(2 * block, 0.0f);
+        time.assign(2 * block, 0.0f);
+        micBlock.assign(block, 0.0f);
+        refBlock.assign(block, 0.0f);
+        outBlock.assign(block, 0.0f);
+        refChunk.assign(block, 0.0f);
+        pos = 0;
+        head = 0;
+        constrainNext = 0;
+        holdBlocks = uint32_t(cfg.doubleTalkHoldMs * sampleRate / 1000.0 / block);
+        hold = 0;
+        micEnergy = errEnergy = 0.0;
+        // -60 dBFS white noise per bin keeps the step bounded in silence.
+        regularisation = float(2 * block) * 1e-6f;
+    }
+
+    uint32_t latencyFrames() const { return block; }
+    const EchoCancellerStats& stats() const { return stat; }
+
+    // Render thread: the signal as handed to the speaker.
+    void render(const float* x, uint32_t n) { ref->push(x, n); }
+
+    // Capture thread: writes n frames of echo-cancelled capture to out. A
+    // null mic stands for silence. mic and out may alias.
+    void capture(const float* mic, float* out, uint32_t n) {
+        uint32_t lead = ref->readAvailable();
+        if (lead > maxLead + n) ref->skip(lead - maxLead - n);
+        while (n > 0) {
+            uint32_t chunk = std::min(n, block - pos);
+            uint32_t got = ref->popOrSilence(refChunk.data(), chunk);
+            if (got < chunk) stat.refUnderruns.fetch_add(chunk - got, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < chunk; ++i) {
+                float d = mic ? mic[i] : 0.0f;
+                micBlock[pos + i] = d;
+                refBlock[pos + i] = refChunk[i];
+                out[i] = outBlock[pos + i];
+            }
+            pos += chunk;
+            if (pos == block) {
+                processBlock();
+                pos = 0;
+            }
+            if (mic) mic += chunk;
+            out += chunk;
+            n -= chunk;
+        }
+    }
+
+    void report(FILE* f) const {
+        std::fprintf(f, "aec: %u partitions of %u frames, ERLE %.1f dB, %llu blocks, "
+                        "%llu double-talk, %llu bypassed, %llu reference frames missing\n",
+                     partitions, block, double(stat.erleDb.load(std::memory_order_relaxed)),
+                     (unsigned long long)stat.blocks.load(std::memory_order_relaxed),
+                     (unsigned long long)stat.doubleTalkBlocks.load(std::memory_order_relaxed),
+                     (unsigned long long)stat.bypassedBlocks.load(std::memory_order_relaxed),
+                     (unsigned long long)stat.refUnderruns.load(std::memory_order_relaxed));
+    }
+
+private:
+    void processBlock() {
+        stat.blocks.fetch_add(1, std::memory_order_relaxed);
+
+        // Newest reference spectrum over [previous block, this block].
+        head = head == 0 ? partitions - 1 : head - 1;
+        std::copy(refTime.begin() + block, refTime.end(), refTime.begin());
+        std::copy(refBlock.begin(), refBlock.end(), refTime.begin() + block);
+        float* x0r = &xRe[size_t(head) * bins];
+        float* x0i = &xIm[size_t(head) * bins];
+        fft.forward(refTime.data(), x0r, x0i);
+        float* x0p = &xPow[size_t(head) * bins];
+        for (uint32_t k = 0; k < bins; ++k) {
+            float e = x0r[k] * x0r[k] + x0i[k] * x0i[k];
+            power[k] = std::max(power[k] + e - x0p[k], 0.0f);
+            x0p[k] = e;
+        }
+        float refPeak = 0.0f;
+        for (float v : refBlock) refPeak = std::max(refPeak, std::fabs(v));
+        xPeak[head] = refPeak;
+
+        // Echo estimate: sum over partitions of W_p * X_{now - p}.
+        std::fill(yRe.begin(), yRe.end(), 0.0f);
+        std::fill(yIm.begin(), yIm.end(), 0.0f);
+        for (uint32_t p = 0; p < partitions; ++p) {
+            size_t x = size_t((head + p) % partitions) * bins, w = size_t(p) * bins;
+            aeck::cmac(yRe.data(), yIm.data(), &xRe[x], &xIm[x], &wRe[w], &wIm[w], bins);
+        }
+        fft.inverse(yRe.data(), yIm.data(), time.data());
+
+        double dE = 0.0, eE = 0.0;
+        float micPeak = 0.0f;
+        for (uint32_t i = 0; i < block; ++i) {
+            float d = micBlock[i], e = d - time[block + i];
+            micPeak = std::max(micPeak, std::fabs(d));
+            dE += double(d) * d;
+            eE += double(e) * e;
+            time[i] = 0.0f;
+            time[block + i] = e;
+        }
+        bool bypass = eE > dE;
+        if (bypass) stat.bypassedBlocks.fetch_add(1, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < block; ++i) outBlock[i] = bypass ? micBlock[i] : time[block + i];
+
+        // Geigel: near-end speech if the mic peak is a large fraction of
+        // the loudest reference still inside the tail.
+        float farPeak = *std::max_element(xPeak.begin(), xPeak.end());
+        if (micPeak > cfg.doubleTalkRatio * farPeak) hold = holdBlocks + 1;
+        bool doubleTalk = hold > 0 && farPeak > 0.0f;
+        if (hold > 0) --hold;
+        if (doubleTalk) stat.doubleTalkBlocks.fetch_add(1, std::memory_order_relaxed);
+
+        // ERLE over far-end-only blocks, ~0.5 s time constant at 48 kHz.
+        if (!doubleTalk && farPeak > 1e-3f) {
+            micEnergy = 0.995 * micEnergy + dE;
+            errEnergy = 0.995 * errEnergy + std::min(eE, dE);
+            stat.erleDb.store(float(10.0 * std::log10((micEnergy + 1e-12) / (errEnergy + 1e-12))),
+                              std::memory_order_relaxed);
+        }
+
+        if (doubleTalk || farPeak == 0.0f) return;
+
+        // E scaled by the per-bin step, then W_p += conj(X_{now - p}) * E.
+        fft.forward(time.data(), eRe.data(), eIm.data());
+        const float reg = regularisation * float(partitions);
+        for (uint32_t k = 0; k < bins; ++k) {
+            float g = cfg.stepSize / (power[k] + reg);
+            eRe[k] *= g;
+            eIm[k] *= g;
+        }
+        for (uint32_t p = 0; p < partitions; ++p) {
+            size_t x = size_t((head + p) % partitions) * bins, w = size_t(p) * bins;
+            aeck::cmac_conj(&wRe[w], &wIm[w], &xRe[x], &xIm[x], eRe.data(), eIm.data(), bins);
+        }
+
+        // Keep one partition per block a linear (not circular) convolution.
+        size_t w = size_t(constrainNext) * bins;
+        fft.inverse(&wRe[w], &wIm[w], time.data());
+        std::fill(time.begin() + block, time.end(), 0.0f);
+        fft.forward(time.data(), &wRe[w], &wIm[w]);
+        constrainNext = constrainNext + 1 == partitions ? 0 : constrainNext + 1;
+
+        // Once per sweep, rebuild the running power sum to shed float drift.
+        if (constrainNext == 0) {
+            std::fill(power.begin(), power.end(), 0.0f);
+            for (uint32_t p = 0; p < partitions; ++p)
+                for (uint32_t k = 0; k < bins; ++k) power[k] += xPow[size_t(p) * bins + k];
+        }
+    }
+
+    EchoCancellerConfig cfg;
+    EchoCancellerStats stat;
+    RealFft fft;
+    uint32_t block = 64, bins = 0, partitions = 0, maxLead = 0;
+    std::unique_ptr<SpscRing<float>> ref; // render -> capture
+    std::vector<float> wRe, wIm;          // filter, one spectrum per partition
+    std::vector<float> xRe, xIm;          // reference spectra, circular from `head`
+    std::vector<float> xPow;              // |X|^2 of each reference spectrum
+    std::vector<float> xPeak;             // reference peak per partition
+    std::vector<float> power;             // sum of xPow over the partitions
+    std::vector<float> yRe, yIm, eRe, eIm;
+    std::vector<float> refTime, time;
+    std::vector<float> micBlock, refBlock, outBlock, refChunk;
+    uint32_t pos = 0, head = 0, constrainNext = 0;
+    uint32_t hold = 0, holdBlocks = 0;
+    double micEnergy = 0.0, errEnergy = 0.0;
+    float regularisation = 0.0f;
+};
+
+} // namespace nuchat
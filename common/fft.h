@@ -0,0 +1,166 @@
+// fft.h
+// Power-of-two real FFT for block DSP (the echo canceller's partitioned
+// filter).
+//
+// A real transform of n points runs as a complex radix-2 transform of n/2
+// points on even/odd pairs, plus one untangling pass. Spectra are split
+// (separate re and im arrays of n/2 + 1 bins) so per-bin arithmetic
+// vectorises without shuffles. Butterflies use AVX2, SSE2 or NEON once a
+// stage is wide enough; twiddles are tabulated per stage in prepare(), and
+// forward()/inverse() never allocate.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "format_convert.h"
+
+namespace nuchat {
+
+class RealFft {
+public:
+    RealFft() = default;
+    explicit RealFft(uint32_t n) { prepare(n); }
+
+    // Non-realtime. n is a power of two, at least 4.
+    void prepare(uint32_t n) {
+        size = n;
+        half = n / 2;
+        const double pi = 3.14159265358979323846;
+        // Stage with butterfly span h keeps its h twiddles at [h - 1, 2h - 1).
+        twRe.assign(half, 0.0f);
+        twIm.assign(half, 0.0f);
+        for (uint32_t h = 1; h < half; h <<= 1) {
+            for (uint32_t j = 0; j < h; ++j) {
+                twRe[h - 1 + j] = float(std::cos(pi * j / h));
+                twIm[h - 1 + j] = float(-std::sin(pi * j / h));
+            }
+        }
+        rotRe.assign(half + 1, 0.0f);
+        rotIm.assign(half + 1, 0.0f);
+        for (uint32_t k = 0; k <= half; ++k) {
+            rotRe[k] = float(std::cos(2 * pi * k / n));
+            rotIm[k] = float(-std::sin(2 * pi * k / n));
+        }
+        bitrev.assign(half, 0);
+        uint32_t bits = 0;
+        while ((1u << bits) < half) ++bits;
+        for (uint32_t i = 0; i < half; ++i) {
+            uint32_t r = 0;
+            for (uint32_t b = 0; b < bits; ++b)
+                if (i & (1u << b)) r |= 1u << (bits - 1 - b);
+            bitrev[i] = r;
+        }
+        zr.assign(half + 1, 0.0f);
+        zi.assign(half + 1, 0.0f);
+    }
+
+    uint32_t points() const { return size; }
+    uint32_t bins() const { return half + 1; }
+
+    // n real samples -> n/2 + 1 bins, unnormalised.
+    void forward(const float* x, float* re, float* im) {
+        for (uint32_t i = 0; i < half; ++i) {
+            zr[bitrev[i]] = x[2 * i];
+            zi[bitrev[i]] = x[2 * i + 1];
+        }
+        butterflies();
+        // Z = E + iO, with E and O the spectra of the even and odd samples.
+        for (uint32_t k = 0; k <= half; ++k) {
+            uint32_t a = k == half ? 0 : k, b = k == 0 ? 0 : half - k;
+            float er = 0.5f * (zr[a] + zr[b]), ei = 0.5f * (zi[a] - zi[b]);
+            float orr = 0.5f * (zi[a] + zi[b]), oi = -0.5f * (zr[a] - zr[b]);
+            re[k] = er + rotRe[k] * orr - rotIm[k] * oi;
+            im[k] = ei + rotRe[k] * oi + rotIm[k] * orr;
+        }
+    }
+
+    // Exact inverse of forward(): n/2 + 1 bins -> n real samples.
+    void inverse(const float* re, const float* im, float* x) {
+        for (uint32_t k = 0; k < half; ++k) {
+            uint32_t c = half - k;
+            float er = 0.5f * (re[k] + re[c]), ei = 0.5f * (im[k] - im[c]);
+            float dr = 0.5f * (re[k] - re[c]), di = 0.5f * (im[k] + im[c]);
+            // O = D * conj(rot); Z = E + iO, conjugated for the inverse.
+            float orr = dr * rotRe[k] + di * rotIm[k], oi = di * rotRe[k] - dr * rotIm[k];
+            zr[bitrev[k]] = er - oi;
+            zi[bitrev[k]] = -(ei + orr);
+        }
+        butterflies();
+        const float scale = 1.0f / float(half);
+        for (uint32_t i = 0; i < half; ++i) {
+            x[2 * i] = zr[i] * scale;
+            x[2 * i + 1] = -zi[i] * scale;
+        }
+    }
+
+private:
+    // In-place decimation-in-time passes over bit-reversed zr/zi.
+    void butterflies() {
+        float* re = zr.data();
+        float* im = zi.data();
+        for (uint32_t h = 1; h < half; h <<= 1) {
+            const float* wr = &twRe[h - 1];
+            const float* wi = &twIm[h - 1];
+            for (uint32_t k = 0; k < half; k += 2 * h) {
+                float* ar = re + k; float* ai = im + k;
+                float* br = ar + h; float* bi = ai + h;
+                uint32_t j = 0;
+#if NUCHAT_AVX2
+                for (; j + 8 <= h; j += 8) {
+                    __m256 xr = _mm256_loadu_ps(br + j), xi = _mm256_loadu_ps(bi + j);
+                    __m256 cr = _mm256_loadu_ps(wr + j), ci = _mm256_loadu_ps(wi + j);
+                    __m256 tr = _mm256_sub_ps(_mm256_mul_ps(xr, cr), _mm256_mul_ps(xi, ci));
+                    __m256 ti = _mm256_add_ps(_mm256_mul_ps(xr, ci), _mm256_mul_ps(xi, cr));
+                    __m256 yr = _mm256_loadu_ps(ar + j), yi = _mm256_loadu_ps(ai + j);
+                    _mm256_storeu_ps(ar + j, _mm256_add_ps(yr, tr));
+                    _mm256_storeu_ps(ai + j, _mm256_add_ps(yi, ti));
+                    _mm256_storeu_ps(br + j, _mm256_sub_ps(yr, tr));
+                    _mm256_storeu_ps(bi + j, _mm256_sub_ps(yi, ti));
+                }
+#endif
+#if NUCHAT_SSE2
+                for (; j + 4 <= h; j += 4) {
+                    __m128 xr = _mm_loadu_ps(br + j), xi = _mm_loadu_ps(bi + j);
+                    __m128 cr = _mm_loadu_ps(wr + j), ci = _mm_loadu_ps(wi + j);
+                    __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+                    __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+                    __m128 yr = _mm_loadu_ps(ar + j), yi = _mm_loadu_ps(ai + j);
+                    _mm_storeu_ps(ar + j, _mm_add_ps(yr, tr));
+                    _mm_storeu_ps(ai + j, _mm_add_ps(yi, ti));
+                    _mm_storeu_ps(br + j, _mm_sub_ps(yr, tr));
+                    _mm_storeu_ps(bi + j, _mm_sub_ps(yi, ti));
+                }
+#elif NUCHAT_NEON
+                for (; j + 4 <= h; j += 4) {
+                    float32x4_t xr = vld1q_f32(br + j), xi = vld1q_f32(bi + j);
+                    float32x4_t cr = vld1q_f32(wr + j), ci = vld1q_f32(wi + j);
+                    float32x4_t tr = vmlsq_f32(vmulq_f32(xr, cr), xi, ci);
+                    float32x4_t ti = vmlaq_f32(vmulq_f32(xr, ci), xi, cr);
+                    float32x4_t yr = vld1q_f32(ar + j), yi = vld1q_f32(ai + j);
+                    vst1q_f32(ar + j, vaddq_f32(yr, tr));
+                    vst1q_f32(ai + j, vaddq_f32(yi, ti));
+                    vst1q_f32(br + j, vsubq_f32(yr, tr));
+                    vst1q_f32(bi + j, vsubq_f32(yi, ti));
+                }
+#endif
+                for (; j < h; ++j) {
+                    float tr = br[j] * wr[j] - bi[j] * wi[j];
+                    float ti = br[j] * wi[j] + bi[j] * wr[j];
+                    br[j] = ar[j] - tr; bi[j] = ai[j] - ti;
+                    ar[j] += tr; ai[j] += ti;
+                }
+            }
+        }
+    }
+
+    uint32_t size = 0, half = 0;
+    std::vector<float> twRe, twIm;   // per-stage butterfly twiddles
+    std::vector<float> rotRe, rotIm; // e^{-2 pi i k / n} for the untangling pass
+    std::vector<uint32_t> bitrev;
+    std::vector<float> zr, zi;
+};
+
+} // namespace nuchat
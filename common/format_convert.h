@@ -0,0 +1,392 @@
+// format_convert.h
+// Device sample formats and the kernels that move audio between them and the
+// engine's internal format (mono float32).
+//
+// Backends open devices in whatever the hardware offers natively (int16,
+// int24-in-32, int32 or float32; any channel count up to kMaxChannels;
+// interleaved or planar) and convert at the device boundary with a
+// FormatAdapter, so the OS never inserts its own mixer or converter.
+// Conversion loops use AVX2, SSE2 or NEON when the compiler targets them and
+// fall back to scalar code for tails and other targets. Each entry point
+// dispatches on its count (block_dispatch.h), so the usual period sizes run
+// fully unrolled instances without a tail.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "block_dispatch.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NUCHAT_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NUCHAT_SSE2 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NUCHAT_NEON 1
+#endif
+
+namespace nuchat {
+
+static constexpr uint32_t kMaxChannels = 8;
+
+enum class SampleFormat : uint8_t {
+    Float32,
+    Int16,
+    Int24In32, // 24 significant bits in the low bytes of an int32 (ALSA S24_LE)
+    Int32,     // full-scale int32; also 24-in-32 left-justified (WASAPI)
+};
+
+inline uint32_t bytes_per_sample(SampleFormat f) { return f == SampleFormat::Int16 ? 2 : 4; }
+
+inline const char* sample_format_name(SampleFormat f) {
+    switch (f) {
+    case SampleFormat::Int16:     return "s16";
+    case SampleFormat::Int24In32: return "s24_32";
+    case SampleFormat::Int32:     return "s32";
+    default:                      return "f32";
+    }
+}
+
+// Layout of one device stream.
+struct DeviceFormat {
+    SampleFormat sample = SampleFormat::Float32;
+    uint32_t channels = 1;
+    bool planar = false;     // one buffer per channel instead of interleaved frames
+    uint32_t sampleRate = 0; // native device rate; 0 = the engine's processing rate
+};
+
+namespace convert {
+
+// n samples of fmt -> float in [-1, 1).
+template <uint32_t N>
+inline void to_float(SampleFormat fmt, const void* src, float* dst, Block<N> blk) {
+    const size_t n = blk.count();
+    size_t i = 0;
+    switch (fmt) {
+    case SampleFormat::Float32:
+        std::memcpy(dst, src, n * sizeof(float));
+        return;
+    case SampleFormat::Int16: {
+        const int16_t* s = static_cast<const int16_t*>(src);
+        const float k = 1.0f / 32768.0f;
+#if NUCHAT_AVX2
+        const __m256 vk = _mm256_set1_ps(k);
+        for (; i < n - n % 8; i += 8) {
+            __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)));
+            _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vk));
+        }
+#elif NUCHAT_SSE2
+        const __m128 vk = _mm_set1_ps(k);
+        for (; i < n - n % 8; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vk));
+            _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vk));
+        }
+#elif NUCHAT_NEON
+        for (; i < n - n % 8; i += 8) {
+            int16x8_t v = vld1q_s16(s + i);
+            vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), k));
+            vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), k));
+        }
+#endif
+        for (; i < n; ++i) dst[i] = s[i] * k;
+        return;
+    }
+    case SampleFormat::Int24In32:
+    case SampleFormat::Int32: {
+        const int32_t* s = static_cast<const int32_t*>(src);
+        // Int24In32 is sign-extended from bit 23 by shifting it to the top.
+        const int shift = fmt == SampleFormat::Int24In32 ? 8 : 0;
+        const float k = 1.0f / 2147483648.0f;
+#if NUCHAT_AVX2
+        const __m256 vk = _mm256_set1_ps(k);
+        for (; i < n - n % 8; i += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            v = _mm256_sll_epi32(v, _mm_cvtsi32_si128(shift));
+            _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vk));
+        }
+#elif NUCHAT_SSE2
+        const __m128 vk = _mm_set1_ps(k);
+        for (; i < n - n % 4; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            v = _mm_sll_epi32(v, _mm_cvtsi32_si128(shift));
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), vk));
+        }
+#elif NUCHAT_NEON
+        const int32x4_t vs = vdupq_n_s32(shift);
+        for (; i < n - n % 4; i += 4) {
+            int32x4_t v = vshlq_s32(vld1q_s32(s + i), vs);
+            vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(v), k));
+        }
+#endif
+        for (; i < n; ++i) dst[i] = int32_t(uint32_t(s[i]) << shift) * k;
+        return;
+    }
+    }
+}
+
+inline void to_float(SampleFormat fmt, const void* src, float* dst, size_t n) {
+    dispatch_block(n, [&](auto blk) { to_float(fmt, src, dst, blk); });
+}
+
+// n floats -> fmt, clipping to full scale and rounding to nearest.
+template <uint32_t N>
+inline void from_float(SampleFormat fmt, const float* src, void* dst, Block<N> blk) {
+    const size_t n = blk.count();
+    size_t i = 0;
+    switch (fmt) {
+    case SampleFormat::Float32:
+        std::memcpy(dst, src, n * sizeof(float));
+        return;
+    case SampleFormat::Int16: {
+        int16_t* d = static_cast<int16_t*>(dst);
+#if NUCHAT_AVX2
+        const __m256 vk = _mm256_set1_ps(32768.0f);
+        for (; i < n - n % 16; i += 16) {
+            __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i), vk));
+            __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), vk));
+            // packs works per 128-bit lane; restore sample order afterwards.
+            __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), p);
+        }
+#elif NUCHAT_SSE2
+        const __m128 vk = _mm_set1_ps(32768.0f);
+        for (; i < n - n % 8; i += 8) {
+            __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), vk));
+            __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), vk));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_packs_epi32(a, b));
+        }
+#elif NUCHAT_NEON
+        for (; i < n - n % 8; i += 8) {
+            int32x4_t a = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i), 32768.0f));
+            int32x4_t b = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 4), 32768.0f));
+            vst1q_s16(d + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+        }
+#endif
+        for (; i < n; ++i) {
+            float v = std::min(std::max(src[i] * 32768.0f, -32768.0f), 32767.0f);
+            d[i] = int16_t(v < 0 ? v - 0.5f : v + 0.5f);
+        }
+        return;
+    }
+    case SampleFormat::Int24In32:
+    case SampleFormat::Int32: {
+        int32_t* d = static_cast<int32_t*>(dst);
+        const bool is24 = fmt == SampleFormat::Int24In32;
+        const float k = is24 ? 8388608.0f : 2147483648.0f;
+        // Largest float below 2^31 (resp. 2^23) so the conversion cannot wrap.
+        const float hi = is24 ? 8388607.0f : 2147483520.0f;
+        const float lo = -k;
+#if NUCHAT_AVX2
+        const __m256 vk = _mm256_set1_ps(k), vhi = _mm256_set1_ps(hi), vlo = _mm256_set1_ps(lo);
+        for (; i < n - n % 8; i += 8) {
+            __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), vk), vlo), vhi);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), _mm256_cvtps_epi32(v));
+        }
+#elif NUCHAT_SSE2
+        const __m128 vk = _mm_set1_ps(k), vhi = _mm_set1_ps(hi), vlo = _mm_set1_ps(lo);
+        for (; i < n - n % 4; i += 4) {
+            __m128 v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i), vk), vlo), vhi);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_cvtps_epi32(v));
+        }
+#elif NUCHAT_NEON
+        const float32x4_t vhi = vdupq_n_f32(hi), vlo = vdupq_n_f32(lo);
+        for (; i < n - n % 4; i += 4) {
+            float32x4_t v = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(src + i), k), vlo), vhi);
+            vst1q_s32(d + i, vcvtnq_s32_f32(v));
+        }
+#endif
+        for (; i < n; ++i) {
+            float v = std::min(std::max(src[i] * k, lo), hi);
+            d[i] = int32_t(v < 0 ? v - 0.5f : v + 0.5f);
+        }
+        return;
+    }
+    }
+}
+
+inline void from_float(SampleFormat fmt, const float* src, void* dst, size_t n) {
+    dispatch_block(n, [&](auto blk) { from_float(fmt, src, dst, blk); });
+}
+
+// Interleaved float frames -> mono (channel average).
+template <uint32_t N>
+inline void downmix(const float* in, uint32_t channels, float* mono, Block<N> blk) {
+    const size_t frames = blk.count();
+    size_t i = 0;
+    if (channels == 1) {
+        std::memcpy(mono, in, frames * sizeof(float));
+        return;
+    }
+    if (channels == 2) {
+#if NUCHAT_SSE2
+        const __m128 half = _mm_set1_ps(0.5f);
+        for (; i < frames - frames % 4; i += 4) {
+            __m128 a = _mm_loadu_ps(in + 2 * i);     // l0 r0 l1 r1
+            __m128 b = _mm_loadu_ps(in + 2 * i + 4); // l2 r2 l3 r3
+            __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(mono + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+        }
+#elif NUCHAT_NEON
+        for (; i < frames - frames % 4; i += 4) {
+            float32x4x2_t lr = vld2q_f32(in + 2 * i);
+            vst1q_f32(mono + i, vmulq_n_f32(vaddq_f32(lr.val[0], lr.val[1]), 0.5f));
+        }
+#endif
+        for (; i < frames; ++i) mono[i] = 0.5f * (in[2 * i] + in[2 * i + 1]);
+        return;
+    }
+    const float k = 1.0f / channels;
+    for (; i < frames; ++i) {
+        float acc = 0.0f;
+        for (uint32_t c = 0; c < channels; ++c) acc += in[i * channels + c];
+        mono[i] = acc * k;
+    }
+}
+
+inline void downmix(const float* in, uint32_t channels, float* mono, size_t frames) {
+    dispatch_block(frames, [&](auto blk) { downmix(in, channels, mono, blk); });
+}
+
+// Mono -> interleaved float frames, the same signal on every channel.
+template <uint32_t N>
+inline void upmix(const float* mono, uint32_t channels, float* out, Block<N> blk) {
+    const size_t frames = blk.count();
+    size_t i = 0;
+    if (channels == 1) {
+        std::memcpy(out, mono, frames * sizeof(float));
+        return;
+    }
+    if (channels == 2) {
+#if NUCHAT_SSE2
+        for (; i < frames - frames % 4; i += 4) {
+            __m128 m = _mm_loadu_ps(mono + i);
+            _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(m, m));
+            _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(m, m));
+        }
+#elif NUCHAT_NEON
+        for (; i < frames - frames % 4; i += 4) {
+            float32x4_t m = vld1q_f32(mono + i);
+            vst2q_f32(out + 2 * i, float32x4x2_t{{m, m}});
+        }
+#endif
+        for (; i < frames; ++i) out[2 * i] = out[2 * i + 1] = mono[i];
+        return;
+    }
+    for (; i < frames; ++i)
+        for (uint32_t c = 0; c < channels; ++c) out[i * channels + c] = mono[i];
+}
+
+inline void upmix(const float* mono, uint32_t channels, float* out, size_t frames) {
+    dispatch_block(frames, [&](auto blk) { upmix(mono, channels, out, blk); });
+}
+
+// dst += src * gain, for summing planar channels.
+template <uint32_t N>
+inline void accumulate(float* dst, const float* src, float gain, Block<N> blk) {
+    const size_t n = blk.count();
+    size_t i = 0;
+#if NUCHAT_SSE2
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i < n - n % 4; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+#elif NUCHAT_NEON
+    for (; i < n - n % 4; i += 4)
+        vst1q_f32(dst + i, vmlaq_n_f32(vld1q_f32(dst + i), vld1q_f32(src + i), gain));
+#endif
+    for (; i < n; ++i) dst[i] += src[i] * gain;
+}
+
+inline void accumulate(float* dst, const float* src, float gain, size_t n) {
+    dispatch_block(n, [&](auto blk) { accumulate(dst, src, gain, blk); });
+}
+
+} // namespace convert
+
+// Converts between one device stream and mono float. All scratch is sized in
+// prepare(); toMono() and fromMono() are realtime-safe.
+//
+// Device buffers are passed as an array of pointers: one pointer for
+// interleaved data, or one per channel when the format is planar.
+class FormatAdapter {
+public:
+    void prepare(const DeviceFormat& dev, uint32_t maxFrames) {
+        fmt = dev;
+        fmt.channels = std::max<uint32_t>(1, std::min(dev.channels, kMaxChannels));
+        limit = maxFrames;
+        wide.assign(size_t(maxFrames) * fmt.channels, 0.0f);
+        mono.assign(maxFrames, 0.0f);
+    }
+
+    const DeviceFormat& device() const { return fmt; }
+    uint32_t maxFrames() const { return limit; }
+
+    // True when the device already speaks mono float and no copy is needed.
+    bool passthrough() const { return fmt.sample == SampleFormat::Float32 && fmt.channels == 1; }
+
+    // frames <= maxFrames(). The result stays valid until the next call.
+    const float* toMono(const void* const* bufs, uint32_t frames) {
+        if (passthrough()) return static_cast<const float*>(bufs[0]);
+        if (!fmt.planar) {
+            if (fmt.sample == SampleFormat::Float32) {
+                convert::downmix(static_cast<const float*>(bufs[0]), fmt.channels, mono.data(), frames);
+            } else {
+                convert::to_float(fmt.sample, bufs[0], wide.data(), size_t(frames) * fmt.channels);
+                convert::downmix(wide.data(), fmt.channels, mono.data(), frames);
+            }
+            return mono.data();
+        }
+        const float gain = 1.0f / fmt.channels;
+        convert::to_float(fmt.sample, bufs[0], mono.data(), frames);
+        if (fmt.channels == 1) return mono.data();
+        for (uint32_t i = 0; i < frames; ++i) mono[i] *= gain;
+        for (uint32_t c = 1; c < fmt.channels; ++c) {
+            convert::to_float(fmt.sample, bufs[c], wide.data(), frames);
+            convert::accumulate(mono.data(), wide.data(), gain, frames);
+        }
+        return mono.data();
+    }
+
+    // Writes the mono signal to every device channel. frames <= maxFrames().
+    void fromMono(const float* in, void* const* bufs, uint32_t frames) {
+        if (fmt.planar) {
+            // Convert once, then copy the converted samples to the other planes.
+            convert::from_float(fmt.sample, in, bufs[0], frames);
+            size_t bytes = size_t(frames) * bytes_per_sample(fmt.sample);
+            for (uint32_t c = 1; c < fmt.channels; ++c) std::memcpy(bufs[c], bufs[0], bytes);
+            return;
+        }
+        if (fmt.sample == SampleFormat::Float32) {
+            convert::upmix(in, fmt.channels, static_cast<float*>(bufs[0]), frames);
+            return;
+        }
+        convert::upmix(in, fmt.channels, wide.data(), frames);
+        convert::from_float(fmt.sample, wide.data(), bufs[0], size_t(frames) * fmt.channels);
+    }
+
+    // Advances device buffer pointers by `frames`, for processing in pieces.
+    void offset(const void* const* bufs, uint32_t frames, const void** out) const {
+        size_t step = size_t(frames) * bytes_per_sample(fmt.sample) * (fmt.planar ? 1 : fmt.channels);
+        for (uint32_t c = 0; c < (fmt.planar ? fmt.channels : 1); ++c)
+            out[c] = static_cast<const uint8_t*>(bufs[c]) + step;
+    }
+
+private:
+    DeviceFormat fmt;
+    uint32_t limit = 0;
+    std::vector<float> wide; // interleaved or one plane of float scratch
+    std::vector<float> mono;
+};
+
+} // namespace nuchat
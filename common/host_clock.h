@@ -0,0 +1,64 @@
+// host_clock.h
+// The one monotonic clock every timestamp in the engine is expressed in:
+// nanoseconds of std::chrono::steady_clock. That is CLOCK_MONOTONIC on Linux
+// and Android, QueryPerformanceCounter on Windows and mach_absolute_time on
+// Apple platforms, which are also the clocks the audio APIs stamp buffers
+// with; the converters below only change units.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
+namespace nuchat {
+
+inline uint64_t host_now_ns() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count());
+}
+
+// CLOCK_MONOTONIC time (snd_pcm_htimestamp with a monotonic tstamp type,
+// AAudio/Oboe getTimestamp(CLOCK_MONOTONIC)).
+inline uint64_t host_ns_from_timespec(const timespec& ts) {
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+#if defined(_WIN32)
+// WASAPI's u64QPCPosition: QPC time in 100 ns units.
+inline uint64_t host_ns_from_qpc_hns(uint64_t hns) { return hns * 100; }
+#endif
+
+#if defined(__APPLE__)
+// AudioTimeStamp::mHostTime.
+inline uint64_t host_ns_from_mach(uint64_t ticks) {
+    static const mach_timebase_info_data_t tb = [] {
+        mach_timebase_info_data_t t;
+        mach_timebase_info(&t);
+        return t;
+    }();
+    return tb.numer == tb.denom ? ticks : uint64_t(double(ticks) * tb.numer / tb.denom);
+}
+#endif
+
+inline uint64_t frames_to_ns(double frames, double rate) { return uint64_t(frames * 1e9 / rate); }
+
+// Frame `frame` of a stream passed the converter at hostNs (0: unknown).
+// Neighbouring frames are extrapolated at the nominal rate, which is what
+// the anchors are refreshed often enough for.
+struct FrameTime {
+    uint64_t frame = 0;
+    uint64_t hostNs = 0;
+
+    bool valid() const { return hostNs != 0; }
+    uint64_t at(double index, double rate) const {
+        return uint64_t(double(hostNs) + (index - double(frame)) * 1e9 / rate);
+    }
+};
+
+} // namespace nuchat
@@ -0,0 +1,166 @@
+// jitter_buffer.h
+// Render-side consumer of an SpscRing<float> that holds the ring at a target
+// fill level and absorbs clock drift between the capture and render devices.
+//
+// The smoothed fill level drives a PI controller whose output is the resampling
+// step (input frames consumed per output frame). The integral term converges
+// on the steady-state drift between the two clocks, which is exported as
+// driftPpm(). Underflows fade out instead of hard-cutting to zero, and the
+// buffer re-primes to the target before fading back in.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "drift_resampler.h"
+#include "spsc_ring.h"
+
+namespace nuchat {
+
+struct JitterBufferConfig {
+    double sampleRate = 48000.0;
+    uint32_t targetFrames = 256;  // desired steady-state ring fill
+    uint32_t maxFrames = 2048;    // fill above this is trimmed back to target
+    uint32_t maxBlock = 1024;     // largest pull() handled in one pass
+    double settleSeconds = 8.0;   // controller time constant
+    double maxCorrectionPpm = 2000.0;
+};
+
+class JitterBuffer {
+public:
+    JitterBuffer(SpscRing<float>& ring, const JitterBufferConfig& cfg)
+        : ring(ring), cfg(cfg),
+          resampler(cfg.maxBlock, 1.0 + cfg.maxCorrectionPpm * 1e-6),
+          fadeFrames(uint32_t(cfg.sampleRate * 0.002)) {
+        // Critically damped PI loop around the ring's integrating fill level.
+        double tau = cfg.settleSeconds;
+        kp = 1.0 / (tau * cfg.sampleRate);
+        ki = 1.0 / (4.0 * tau * tau * cfg.sampleRate * cfg.sampleRate);
+        smoothFill = cfg.targetFrames;
+    }
+
+    // Consumer side: always writes n frames to out. Returns how many of them
+    // are silence or fade-out filler because the ring ran dry.
+    uint32_t pull(float* out, uint32_t n) {
+        uint32_t filler = 0;
+        while (n > 0) {
+            uint32_t chunk = std::min(n, cfg.maxBlock);
+            filler += pullBlock(out, chunk);
+            out += chunk;
+            n -= chunk;
+        }
+        return filler;
+    }
+
+    // Changes the steady-state fill. Call before streaming starts or from the
+    // consumer thread; the trim threshold is widened to keep 4x headroom.
+    void setTargetFrames(uint32_t frames) {
+        cfg.targetFrames = frames;
+        cfg.maxFrames = std::max(cfg.maxFrames, frames * 4);
+        smoothFill = frames;
+    }
+
+    // Current drift estimate of the capture clock relative to render, in ppm.
+    double driftPpm() const { return drift.load(std::memory_order_relaxed); }
+    uint32_t targetFrames() const { return cfg.targetFrames; }
+    // Consumer side: ring index (frames ever pushed before it) of the input
+    // the next output frame is centred on, fractional; negative while
+    // playback has not started. Pairs with producer-side timestamps.
+    double sourcePosition() const {
+        if (priming) return -1.0;
+        return double(consumed) - resampler.held() + (DriftResampler::kTaps / 2 - 1);
+    }
+
+    uint64_t underflows() const { return underflowCount.load(std::memory_order_relaxed); }
+    uint64_t trims() const { return trimCount.load(std::memory_order_relaxed); }
+
+private:
+    uint32_t pullBlock(float* out, uint32_t n) {
+        uint32_t fill = ring.readAvailable();
+
+        if (fill > cfg.maxFrames) {
+            // Far too much latency (e.g. the render device stalled): drop back
+            // to the target instead of waiting for the controller to catch up.
+            ring.skip(fill - cfg.targetFrames);
+            consumed += fill - cfg.targetFrames;
+            fill = cfg.targetFrames;
+            smoothFill = fill;
+            trimCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (priming) {
+            if (fill < cfg.targetFrames) {
+                std::fill(out, out + n, 0.0f);
+                return n;
+            }
+            priming = false;
+            gain = 0.0f;
+            resampler.reset();
+        }
+
+        double alpha = std::min(1.0, n / (0.25 * cfg.sampleRate));
+        smoothFill += alpha * (double(fill) - smoothFill);
+        double err = smoothFill - double(cfg.targetFrames);
+        double limit = cfg.maxCorrectionPpm * 1e-6;
+        integ = std::clamp(integ + ki * err * n, -limit, limit);
+        double step = 1.0 + std::clamp(kp * err + integ, -limit, limit);
+        drift.store(integ * 1e6, std::memory_order_relaxed);
+
+        uint32_t need = std::min(resampler.framesNeeded(n, step), resampler.inputSpace());
+        uint32_t got = ring.pop(resampler.inputTail(), need);
+        resampler.commit(got);
+        consumed += got;
+
+        if (got < need) {
+            // Not enough input: render what is there, ramp the rest to silence
+            // from the last good sample and re-prime.
+            uint32_t ok = 0;
+            while (ok < n && resampler.framesNeeded(ok + 1, step) == 0) ++ok;
+            resampler.render(out, ok, step);
+            applyGain(out, ok);
+            float last = ok ? out[ok - 1] : 0.0f;
+            uint32_t ramp = std::min(n - ok, fadeFrames);
+            for (uint32_t i = 0; i < ramp; ++i)
+                out[ok + i] = last * (1.0f - float(i + 1) / float(ramp));
+            std::fill(out + ok + ramp, out + n, 0.0f);
+            priming = true;
+            integ = 0.0;
+            smoothFill = cfg.targetFrames;
+            underflowCount.fetch_add(1, std::memory_order_relaxed);
+            return n - ok;
+        }
+
+        resampler.render(out, n, step);
+        applyGain(out, n);
+        return 0;
+    }
+
+    // Fade-in after (re)priming so playback never starts on a step.
+    void applyGain(float* out, uint32_t n) {
+        if (gain >= 1.0f) return;
+        float inc = 1.0f / float(fadeFrames ? fadeFrames : 1);
+        for (uint32_t i = 0; i < n; ++i) {
+            gain = std::min(1.0f, gain + inc);
+            out[i] *= gain;
+        }
+    }
+
+    SpscRing<float>& ring;
+    JitterBufferConfig cfg;
+    DriftResampler resampler;
+    uint32_t fadeFrames;
+    double kp = 0.0, ki = 0.0;
+    double smoothFill = 0.0;
+    double integ = 0.0;
+    bool priming = true;
+    float gain = 0.0f;
+    uint64_t consumed = 0; // frames taken from the ring, consumer side
+    std::atomic<double> drift{0.0};
+    std::atomic<uint64_t> underflowCount{0}, trimCount{0};
+};
+
+} // namespace nuchat
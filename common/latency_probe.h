@@ -0,0 +1,173 @@
+// latency_probe.h
+// Round-trip latency measurement: inject a maximum-length sequence (MLS) into
+// the render stream and locate it in the capture stream by cross-correlation.
+//
+// render() and capture() run on the audio threads and only copy samples and
+// flip an atomic state; the correlation runs in step() on a normal thread.
+// The measured lag is counted from the capture-frame position at the moment
+// the burst was handed to the render callback, so it covers output buffering,
+// the acoustic/electrical path and input buffering, quantised to one capture
+// callback.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace nuchat {
+
+struct LatencyProbeConfig {
+    double sampleRate = 48000.0;
+    uint32_t trials = 20;
+    double windowSeconds = 0.5;  // longest round trip that can be detected
+    double gapSeconds = 0.25;    // quiet time between bursts
+    float amplitude = 0.3f;
+    double minPeakRatio = 8.0;   // peak / mean |corr| needed to accept a trial
+};
+
+struct LatencyStats {
+    uint32_t trials = 0, detected = 0;
+    double minMs = 0, meanMs = 0, p99Ms = 0, maxMs = 0, jitterMs = 0;
+};
+
+class LatencyProbe {
+public:
+    static constexpr int kOrder = 10;                  // 1023-chip sequence
+    static constexpr uint32_t kLength = (1u << kOrder) - 1;
+
+    explicit LatencyProbe(const LatencyProbeConfig& cfg)
+        : cfg(cfg), mls(kLength), window(uint32_t(cfg.windowSeconds * cfg.sampleRate) + kLength),
+          gapFrames(uint32_t(cfg.gapSeconds * cfg.sampleRate)) {
+        // x^10 + x^7 + 1 Fibonacci LFSR.
+        uint32_t lfsr = 1;
+        for (uint32_t i = 0; i < kLength; ++i) {
+            uint32_t bit = ((lfsr >> 9) ^ (lfsr >> 6)) & 1u;
+            mls[i] = (lfsr & 1u) ? cfg.amplitude : -cfg.amplitude;
+            lfsr = ((lfsr << 1) | bit) & kLength;
+        }
+        lagsMs.reserve(cfg.trials);
+    }
+
+    // Render thread: overwrites out with the probe signal (burst or silence).
+    void render(float* out, uint32_t n) {
+        if (state.load(std::memory_order_acquire) == kArmed) {
+            if (quietFrames < gapFrames) {
+                quietFrames += n;
+            } else {
+                captureStart.store(captureFrames.load(std::memory_order_acquire),
+                                   std::memory_order_relaxed);
+                burstPos = 0;
+                recorded = 0;
+                quietFrames = 0;
+                state.store(kRunning, std::memory_order_release);
+            }
+        }
+        for (uint32_t i = 0; i < n; ++i)
+            out[i] = burstPos < kLength ? mls[burstPos++] : 0.0f;
+    }
+
+    // Capture thread: records the window that follows each burst. A null
+    // pointer stands for n frames of silence, keeping the timeline intact.
+    void capture(const float* in, uint32_t n) {
+        uint64_t first = captureFrames.load(std::memory_order_relaxed);
+        if (state.load(std::memory_order_acquire) == kRunning) {
+            uint64_t start = captureStart.load(std::memory_order_relaxed);
+            for (uint32_t i = 0; i < n && recorded < window.size(); ++i) {
+                if (first + i >= start)
+                    window[recorded++] = in ? in[i] : 0.0f;
+            }
+            if (recorded == window.size())
+                state.store(kAnalyzing, std::memory_order_release);
+        }
+        captureFrames.store(first + n, std::memory_order_release);
+    }
+
+    // Non-realtime thread: analyses a finished trial and re-arms the next.
+    // Returns true once every trial has been run.
+    bool step() {
+        int st = state.load(std::memory_order_acquire);
+        if (st == kDone) return true;
+        if (st != kAnalyzing) return false;
+        ++completed;
+        double lag = locate();
+        if (lag >= 0) lagsMs.push_back(lag * 1000.0 / cfg.sampleRate);
+        state.store(completed >= cfg.trials ? kDone : kArmed, std::memory_order_release);
+        return completed >= cfg.trials;
+    }
+
+    bool done() const { return state.load(std::memory_order_acquire) == kDone; }
+
+    LatencyStats stats() const {
+        LatencyStats s;
+        s.trials = completed;
+        s.detected = uint32_t(lagsMs.size());
+        if (lagsMs.empty()) return s;
+        std::vector<double> v(lagsMs);
+        std::sort(v.begin(), v.end());
+        double sum = 0, sq = 0;
+        for (double x : v) sum += x;
+        s.meanMs = sum / v.size();
+        for (double x : v) sq += (x - s.meanMs) * (x - s.meanMs);
+        s.minMs = v.front();
+        s.maxMs = v.back();
+        s.p99Ms = v[std::min<size_t>(v.size() - 1, size_t(std::ceil(0.99 * v.size())) - 1)];
+        s.jitterMs = std::sqrt(sq / v.size());
+        return s;
+    }
+
+    std::string report() const {
+        LatencyStats s = stats();
+        char buf[256];
+        std::snprintf(buf, sizeof(buf),
+                      "round-trip latency over %u/%u trials: min %.2f ms, mean %.2f ms, "
+                      "p99 %.2f ms, max %.2f ms, jitter %.2f ms",
+                      s.detected, s.trials, s.minMs, s.meanMs, s.p99Ms, s.maxMs, s.jitterMs);
+        return buf;
+    }
+
+private:
+    enum { kArmed, kRunning, kAnalyzing, kDone };
+
+    // Lag (frames) of the strongest MLS match in the window, or -1.
+    double locate() const {
+        uint32_t lags = uint32_t(window.size()) - kLength;
+        double best = 0, sumAbs = 0;
+        uint32_t bestLag = 0;
+        for (uint32_t lag = 0; lag < lags; ++lag) {
+            double acc = 0;
+            const float* w = &window[lag];
+            for (uint32_t k = 0; k < kLength; ++k) acc += double(w[k]) * mls[k];
+            acc = std::fabs(acc);
+            sumAbs += acc;
+            if (acc > best) { best = acc; bestLag = lag; }
+        }
+        double mean = sumAbs / lags;
+        return (mean > 0 && best / mean >= cfg.minPeakRatio) ? double(bestLag) : -1.0;
+    }
+
+    LatencyProbeConfig cfg;
+    std::vector<float> mls;
+    std::vector<float> window;
+    uint32_t gapFrames;
+
+    // Render-thread state.
+    uint32_t burstPos = kLength;
+    uint32_t quietFrames = 0;
+    // Capture-thread state.
+    uint32_t recorded = 0;
+
+    std::atomic<int> state{kArmed};
+    std::atomic<uint64_t> captureFrames{0};
+    std::atomic<uint64_t> captureStart{0};
+
+    // Analysis-thread state.
+    uint32_t completed = 0;
+    std::vector<double> lagsMs;
+};
+
+} // namespace nuchat
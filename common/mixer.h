@@ -0,0 +1,364 @@
+// mixer.h
+// Server-side N-party mixer: every participant hears everyone but itself.
+//
+// Each participant has an inbox ring (its decoded voice, filled by the
+// network side) and an outbox ring (its mix-minus-self). Every tick a room
+// pops one block from each inbox, sums all of them once and writes
+// softclip(sum - own) to each outbox, so a room costs O(N) per tick instead
+// of the naive O(N^2). Both kernels are SIMD (AVX2/SSE2/NEON), with unrolled
+// instances for the common tick sizes (block_dispatch.h).
+//
+// Rooms are independent tasks. Each tick MixServer deals them, largest first,
+// onto per-worker deques; a worker drains its own deque from the front and
+// then steals from the back of the others, so one oversized room occupies a
+// single worker while the rest of the rooms keep moving.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "format_convert.h"
+#include "spsc_ring.h"
+
+namespace nuchat {
+
+namespace mixk {
+
+// Sums above kKnee are bent smoothly towards +-1 instead of wrapping or
+// hard clipping: |y| = min(|x|, knee) + (1-knee) * over / ((1-knee) + over),
+// with over = max(|x| - knee, 0). Unity slope at the knee.
+static constexpr float kKnee = 0.8f;
+
+inline float softclip(float x) {
+    const float room = 1.0f - kKnee;
+    float a = std::fabs(x);
+    float over = std::max(a - kKnee, 0.0f);
+    float y = std::min(a, kKnee) + room * over / (room + over);
+    return x < 0 ? -y : y;
+}
+
+// out[i] = softclip(sum[i] - self[i])
+template <uint32_t N>
+inline void mix_minus(float* out, const float* sum, const float* self, Block<N> blk) {
+    const size_t n = blk.count();
+    size_t i = 0;
+    const float room = 1.0f - kKnee;
+#if NUCHAT_AVX2
+    const __m256 sign = _mm256_set1_ps(-0.0f), knee = _mm256_set1_ps(kKnee);
+    const __m256 vroom = _mm256_set1_ps(room), zero = _mm256_setzero_ps();
+    for (; i < n - n % 8; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(sum + i), _mm256_loadu_ps(self + i));
+        __m256 s = _mm256_and_ps(d, sign);
+        __m256 a = _mm256_andnot_ps(sign, d);
+        __m256 over = _mm256_max_ps(_mm256_sub_ps(a, knee), zero);
+        __m256 bent = _mm256_div_ps(_mm256_mul_ps(vroom, over), _mm256_add_ps(vroom, over));
+        _mm256_storeu_ps(out + i, _mm256_or_ps(_mm256_add_ps(_mm256_min_ps(a, knee), bent), s));
+    }
+#elif NUCHAT_SSE2
+    const __m128 sign = _mm_set1_ps(-0.0f), knee = _mm_set1_ps(kKnee);
+    const __m128 vroom = _mm_set1_ps(room), zero = _mm_setzero_ps();
+    for (; i < n - n % 4; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(sum + i), _mm_loadu_ps(self + i));
+        __m128 s = _mm_and_ps(d, sign);
+        __m128 a = _mm_andnot_ps(sign, d);
+        __m128 over = _mm_max_ps(_mm_sub_ps(a, knee), zero);
+        __m128 bent = _mm_div_ps(_mm_mul_ps(vroom, over), _mm_add_ps(vroom, over));
+        _mm_storeu_ps(out + i, _mm_or_ps(_mm_add_ps(_mm_min_ps(a, knee), bent), s));
+    }
+#elif NUCHAT_NEON
+    const float32x4_t knee = vdupq_n_f32(kKnee), vroom = vdupq_n_f32(room), zero = vdupq_n_f32(0.0f);
+    for (; i < n - n % 4; i += 4) {
+        float32x4_t d = vsubq_f32(vld1q_f32(sum + i), vld1q_f32(self + i));
+        float32x4_t a = vabsq_f32(d);
+        float32x4_t over = vmaxq_f32(vsubq_f32(a, knee), zero);
+        // Reciprocal estimate plus one Newton step; vdivq_f32 is AArch64 only.
+        float32x4_t den = vaddq_f32(vroom, over);
+        float32x4_t r = vrecpeq_f32(den);
+        r = vmulq_f32(r, vrecpsq_f32(den, r));
+        float32x4_t y = vaddq_f32(vminq_f32(a, knee), vmulq_f32(vmulq_f32(vroom, over), r));
+        vst1q_f32(out + i, vbslq_f32(vcltq_f32(d, zero), vnegq_f32(y), y));
+    }
+#endif
+    for (; i < n; ++i) out[i] = softclip(sum[i] - self[i]);
+}
+
+inline void mix_minus(float* out, const float* sum, const float* self, size_t n) {
+    dispatch_block(n, [&](auto blk) { mix_minus(out, sum, self, blk); });
+}
+
+} // namespace mixk
+
+// One voice in a room. push() and pull() are each single-threaded (usually
+// the network thread that owns this participant's socket); the mixer is the
+// other side of both rings.
+class MixParticipant {
+public:
+    MixParticipant(uint32_t tickFrames, uint32_t ringFrames)
+        : inbox(ringFrames), outbox(ringFrames), own(tickFrames, 0.0f), mix(tickFrames, 0.0f),
+          backlog(std::max(ringFrames / 2, tickFrames * 2)) {}
+
+    // Producer: this participant's decoded voice.
+    uint32_t push(const float* in, uint32_t n) { return inbox.push(in, n); }
+    // Consumer: everyone else, mixed. Returns frames read.
+    uint32_t pull(float* out, uint32_t n) { return outbox.pop(out, n); }
+
+    uint64_t underflows() const { return underflowFrames.load(std::memory_order_relaxed); }
+    uint64_t overflows() const { return overflowFrames.load(std::memory_order_relaxed); }
+
+private:
+    friend class MixRoom;
+
+    // Mixer side: next block of this voice, silence if it has not arrived.
+    // A backlog beyond `backlog` frames (a burst after a stall) is trimmed
+    // so this voice cannot drift behind the others.
+    bool take(uint32_t frames) {
+        uint32_t avail = inbox.readAvailable();
+        if (avail > backlog + frames) inbox.skip(avail - backlog);
+        uint32_t got = inbox.popOrSilence(own.data(), frames);
+        if (got < frames) underflowFrames.fetch_add(frames - got, std::memory_order_relaxed);
+        return got > 0;
+    }
+
+    void deliver(uint32_t frames) {
+        uint32_t pushed = outbox.push(mix.data(), frames);
+        if (pushed < frames) overflowFrames.fetch_add(frames - pushed, std::memory_order_relaxed);
+    }
+
+    SpscRing<float> inbox, outbox;
+    std::vector<float> own, mix; // this tick's block in and out
+    uint32_t backlog;
+    std::atomic<uint64_t> underflowFrames{0}, overflowFrames{0};
+};
+
+class MixRoom {
+public:
+    MixRoom(uint32_t tickFrames, uint32_t ringFrames)
+        : frames(tickFrames), ringFrames(ringFrames), sum(tickFrames, 0.0f) {}
+
+    // Any thread. The participant stays valid until leave().
+    MixParticipant* join() {
+        auto p = std::make_unique<MixParticipant>(frames, ringFrames);
+        MixParticipant* raw = p.get();
+        std::lock_guard<std::mutex> g(lock);
+        members.push_back(std::move(p));
+        count.store(uint32_t(members.size()), std::memory_order_relaxed);
+        return raw;
+    }
+
+    void leave(MixParticipant* p) {
+        std::lock_guard<std::mutex> g(lock);
+        members.erase(std::remove_if(members.begin(), members.end(),
+                                     [p](const std::unique_ptr<MixParticipant>& m) { return m.get() == p; }),
+                      members.end());
+        count.store(uint32_t(members.size()), std::memory_order_relaxed);
+    }
+
+    uint32_t size() const { return count.load(std::memory_order_relaxed); }
+
+    // One worker at a time; joins and leaves wait for the tick to finish.
+    void tick() {
+        std::lock_guard<std::mutex> g(lock);
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        for (auto& m : members)
+            if (m->take(frames)) convert::accumulate(sum.data(), m->own.data(), 1.0f, frames);
+        for (auto& m : members) {
+            mixk::mix_minus(m->mix.data(), sum.data(), m->own.data(), frames);
+            m->deliver(frames);
+        }
+    }
+
+private:
+    const uint32_t frames, ringFrames;
+    std::mutex lock;
+    std::vector<std::unique_ptr<MixParticipant>> members;
+    std::atomic<uint32_t> count{0};
+    std::vector<float> sum;
+};
+
+struct MixerConfig {
+    double sampleRate = 48000.0;
+    uint32_t tickFrames = 480;  // 10 ms
+    uint32_t ringFrames = 4096; // per participant and direction
+    uint32_t workers = 0;       // 0 = one per hardware thread
+};
+
+class MixServer {
+public:
+    explicit MixServer(const MixerConfig& cfg)
+        : cfg(cfg), queues(cfg.workers ? cfg.workers : std::max(1u, std::thread::hardware_concurrency())) {
+        // Worker 0 is whichever thread calls runTick().
+        for (uint32_t w = 1; w < queues.size(); ++w) helpers.emplace_back(&MixServer::workerLoop, this, w);
+    }
+
+    ~MixServer() {
+        stop();
+        {
+            std::lock_guard<std::mutex> g(wakeLock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto& t : helpers) t.join();
+    }
+
+    MixServer(const MixServer&) = delete;
+    MixServer& operator=(const MixServer&) = delete;
+
+    const MixerConfig& config() const { return cfg; }
+    uint32_t workerCount() const { return uint32_t(queues.size()); }
+
+    // Any thread; rooms are destroyed between ticks.
+    MixRoom* createRoom() {
+        std::lock_guard<std::mutex> g(roomsLock);
+        rooms.push_back(std::make_unique<MixRoom>(cfg.tickFrames, cfg.ringFrames));
+        return rooms.back().get();
+    }
+
+    void destroyRoom(MixRoom* r) {
+        std::lock_guard<std::mutex> g(roomsLock);
+        rooms.erase(std::remove_if(rooms.begin(), rooms.end(),
+                                   [r](const std::unique_ptr<MixRoom>& m) { return m.get() == r; }),
+                    rooms.end());
+    }
+
+    // Mixes one tick of every room across all workers and returns when all
+    // of them are done.
+    void runTick() {
+        std::lock_guard<std::mutex> g(roomsLock);
+        order.clear();
+        for (auto& r : rooms) order.push_back(r.get());
+        // Largest first, dealt round-robin: big rooms start immediately on
+        // different workers and the small ones fill in around them.
+        std::sort(order.begin(), order.end(), [](MixRoom* a, MixRoom* b) { return a->size() > b->size(); });
+        for (size_t i = 0; i < order.size(); ++i) {
+            Queue& q = queues[i % queues.size()];
+            std::lock_guard<std::mutex> ql(q.lock);
+            q.rooms.push_back(order[i]);
+        }
+        pending.store(uint32_t(order.size()), std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> wg(wakeLock);
+            ++generation;
+        }
+        wake.notify_all();
+        drain(0);
+        std::unique_lock<std::mutex> wl(wakeLock);
+        done.wait(wl, [this] { return pending.load(std::memory_order_acquire) == 0; });
+    }
+
+    // Runs runTick() every tickFrames on a clock thread.
+    void start() {
+        if (running) return;
+        running = true;
+        clock = std::thread([this] {
+            auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(cfg.tickFrames / cfg.sampleRate));
+            auto next = std::chrono::steady_clock::now();
+            while (running.load(std::memory_order_relaxed)) {
+                auto t0 = std::chrono::steady_clock::now();
+                runTick();
+                auto t1 = std::chrono::steady_clock::now();
+                uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+                ticks.fetch_add(1, std::memory_order_relaxed);
+                if (ns > maxTickNs.load(std::memory_order_relaxed)) maxTickNs.store(ns, std::memory_order_relaxed);
+                next += period;
+                if (t1 > next) {
+                    // Overran the tick: count it and restart the schedule
+                    // rather than bursting to catch up.
+                    lateTicks.fetch_add(1, std::memory_order_relaxed);
+                    next = t1;
+                }
+                std::this_thread::sleep_until(next);
+            }
+        });
+    }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        clock.join();
+    }
+
+    uint64_t tickCount() const { return ticks.load(std::memory_order_relaxed); }
+    uint64_t lateTickCount() const { return lateTicks.load(std::memory_order_relaxed); }
+    uint64_t maxTickNanos() const { return maxTickNs.load(std::memory_order_relaxed); }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<MixRoom*> rooms;
+    };
+
+    MixRoom* popOwn(uint32_t w) {
+        Queue& q = queues[w];
+        std::lock_guard<std::mutex> g(q.lock);
+        if (q.rooms.empty()) return nullptr;
+        MixRoom* r = q.rooms.front();
+        q.rooms.pop_front();
+        return r;
+    }
+
+    MixRoom* steal(uint32_t w) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue& q = queues[(w + k) % queues.size()];
+            std::lock_guard<std::mutex> g(q.lock);
+            if (q.rooms.empty()) continue;
+            MixRoom* r = q.rooms.back();
+            q.rooms.pop_back();
+            return r;
+        }
+        return nullptr;
+    }
+
+    void drain(uint32_t w) {
+        for (;;) {
+            MixRoom* r = popOwn(w);
+            if (!r) r = steal(w);
+            if (!r) return;
+            r->tick();
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> g(wakeLock);
+                done.notify_all();
+            }
+        }
+    }
+
+    void workerLoop(uint32_t w) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> wl(wakeLock);
+                wake.wait(wl, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            drain(w);
+        }
+    }
+
+    MixerConfig cfg;
+    std::mutex roomsLock;
+    std::vector<std::unique_ptr<MixRoom>> rooms;
+    std::vector<MixRoom*> order;
+    std::vector<Queue> queues;
+    std::vector<std::thread> helpers;
+    std::atomic<uint32_t> pending{0};
+    std::mutex wakeLock;
+    std::condition_variable wake, done;
+    uint64_t generation = 0;
+    bool quit = false;
+    std::atomic<bool> running{false};
+    std::thread clock;
+    std::atomic<uint64_t> ticks{0}, lateTicks{0}, maxTickNs{0};
+};
+
+} // namespace nuchat
@@ -0,0 +1,169 @@
+// polyphase_resampler.h
+// Fixed-ratio sample-rate converter between a device's native rate and the
+// engine's processing rate (e.g. 44.1k or 16k <-> 48k).
+//
+// The ratio is reduced to L/M and realised as an L-phase polyphase FIR with
+// kTaps taps per phase, so every output costs one kTaps-long dot product
+// (SSE/AVX/NEON where available). Group delay is fixed at about kTaps / 2
+// input frames. All storage is allocated in the constructor.
+//
+// Works both ways: push input and collect what becomes available (capture),
+// or ask inputFor(n) how much input the next n outputs need (render).
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace nuchat {
+
+class PolyphaseResampler {
+public:
+    static constexpr int kTaps = 32;
+
+    // maxIn: largest input block process() will be given.
+    PolyphaseResampler(uint32_t inRate, uint32_t outRate, uint32_t maxIn) {
+        uint32_t g = gcd(inRate, outRate);
+        up = outRate / g;
+        down = inRate / g;
+        hist.assign(maxIn + 2 * kTaps + size_t(down) + 1, 0.0f);
+        design();
+        reset();
+    }
+
+    bool identity() const { return up == down; }
+    uint32_t upFactor() const { return up; }
+    uint32_t downFactor() const { return down; }
+
+    // Fixed group delay, in output frames.
+    double latencyFrames() const { return (double(kTaps) * up - 1) / (2.0 * down); }
+
+    // Upper bound on outputs produced by process(in, n).
+    uint32_t maxOutput(uint32_t n) const {
+        return uint32_t((uint64_t(n + kTaps) * up + down - 1) / down) + 1;
+    }
+
+    // Input frames to push before the next outFrames outputs are all
+    // available.
+    uint32_t inputFor(uint32_t outFrames) const {
+        if (outFrames == 0) return 0;
+        uint64_t last = base + (uint64_t(phase) + uint64_t(outFrames - 1) * down) / up + kTaps;
+        return last > count ? uint32_t(last - count) : 0;
+    }
+
+    // Drops history and restarts from kTaps-1 frames of silence.
+    void reset() {
+        std::fill(hist.begin(), hist.end(), 0.0f);
+        count = kTaps - 1;
+        base = 0;
+        phase = 0;
+    }
+
+    // Appends n input frames (n <= maxIn) and writes up to maxOut outputs.
+    // Input not yet consumed is kept for the next call.
+    uint32_t process(const float* in, uint32_t n, float* out, uint32_t maxOut) {
+        std::memcpy(&hist[count], in, n * sizeof(float));
+        count += n;
+        uint32_t produced = 0;
+        while (produced < maxOut && base + kTaps <= count) {
+            out[produced++] = dot(&hist[base], &table[size_t(phase) * kTaps]);
+            phase += down;
+            base += phase / up;
+            phase %= up;
+        }
+        // Keep the unconsumed tail at the front for the next block.
+        uint32_t keep = count - std::min(base, count);
+        std::memmove(hist.data(), &hist[count - keep], keep * sizeof(float));
+        base -= count - keep;
+        count = keep;
+        return produced;
+    }
+
+private:
+    static uint32_t gcd(uint32_t a, uint32_t b) {
+        while (b) { uint32_t t = a % b; a = b; b = t; }
+        return a;
+    }
+
+    // Kaiser-windowed sinc prototype at up x the input rate, cut off just below
+    // the lower of the two Nyquist frequencies. Phase rows are stored reversed
+    // so each output is a forward dot product over the history.
+    void design() {
+        const double pi = 3.14159265358979323846;
+        const double beta = 7.0;
+        const int len = kTaps * int(up);
+        const double fc = 0.46 * std::min(1.0, double(up) / down) / up; // cycles/sample at up x rate
+        const double center = (len - 1) * 0.5;
+        auto bessel0 = [](double x) {
+            double sum = 1.0, term = 1.0;
+            for (int k = 1; k < 30; ++k) {
+                term *= (x / (2 * k)) * (x / (2 * k));
+                sum += term;
+            }
+            return sum;
+        };
+        std::vector<double> h(len);
+        for (int k = 0; k < len; ++k) {
+            double x = k - center;
+            double s = x == 0.0 ? 2 * fc : std::sin(2 * pi * fc * x) / (pi * x);
+            double r = x / (center + 0.5);
+            h[k] = s * bessel0(beta * std::sqrt(std::max(0.0, 1.0 - r * r))) / bessel0(beta);
+        }
+        table.assign(size_t(up) * kTaps, 0.0f);
+        for (uint32_t p = 0; p < up; ++p) {
+            double sum = 0.0;
+            for (int j = 0; j < kTaps; ++j) sum += h[p + size_t(j) * up];
+            for (int j = 0; j < kTaps; ++j)
+                table[size_t(p) * kTaps + (kTaps - 1 - j)] = float(h[p + size_t(j) * up] / sum);
+        }
+    }
+
+    static float dot(const float* x, const float* c) {
+#if defined(__AVX__)
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < kTaps; k += 8)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + k), _mm256_loadu_ps(c + k)));
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+#elif defined(__SSE__) || defined(_M_X64)
+        __m128 acc = _mm_setzero_ps();
+        for (int k = 0; k < kTaps; k += 4)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_loadu_ps(c + k)));
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+        return _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        float32x4_t acc = vdupq_n_f32(0.0f);
+        for (int k = 0; k < kTaps; k += 4)
+            acc = vmlaq_f32(acc, vld1q_f32(x + k), vld1q_f32(c + k));
+        float32x2_t s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+        return vget_lane_f32(vpadd_f32(s, s), 0);
+#else
+        float acc = 0.0f;
+        for (int k = 0; k < kTaps; ++k) acc += x[k] * c[k];
+        return acc;
+#endif
+    }
+
+    uint32_t up = 1, down = 1;
+    std::vector<float> table; // up rows of kTaps coefficients
+    std::vector<float> hist;
+    uint32_t count = 0; // valid frames in hist
+    uint32_t base = 0;  // first history frame of the next output
+    uint32_t phase = 0; // 0..up-1
+};
+
+} // namespace nuchat
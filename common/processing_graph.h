@@ -0,0 +1,76 @@
+// processing_graph.h
+// DSP stages run from the device callback, and a fixed-capacity chain of them.
+//
+// Stages are added and prepared while the stream is stopped; process() then
+// runs them in order through two preallocated ping-pong buffers with no
+// allocation, locking or virtual dispatch beyond one call per stage.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace nuchat {
+
+struct AudioFormat {
+    double sampleRate = 48000.0;
+    uint32_t channels = 1;
+    uint32_t framesPerPeriod = 128;
+};
+
+class AudioProcessor {
+public:
+    virtual ~AudioProcessor() = default;
+
+    // Non-realtime: allocate everything process() will need.
+    virtual void prepare(const AudioFormat& fmt, uint32_t maxFrames) { (void)fmt; (void)maxFrames; }
+
+    // Realtime: in is the capture signal, out the render signal, both
+    // interleaved with fmt.channels channels. in and out never alias.
+    virtual void process(const float* in, float* out, uint32_t frames) = 0;
+};
+
+class ProcessingGraph : public AudioProcessor {
+public:
+    static constexpr int kMaxStages = 16;
+
+    // Non-realtime, before prepare(). Returns false when the graph is full.
+    bool add(AudioProcessor* stage) {
+        if (count == kMaxStages) return false;
+        stages[count++] = stage;
+        return true;
+    }
+
+    int size() const { return count; }
+
+    void prepare(const AudioFormat& fmt, uint32_t maxFrames) override {
+        channels = fmt.channels;
+        scratch[0].assign(size_t(maxFrames) * channels, 0.0f);
+        scratch[1].assign(size_t(maxFrames) * channels, 0.0f);
+        for (int i = 0; i < count; ++i) stages[i]->prepare(fmt, maxFrames);
+    }
+
+    // An empty graph is a straight copy, i.e. plain loopback.
+    void process(const float* in, float* out, uint32_t frames) override {
+        if (count == 0) {
+            std::memcpy(out, in, size_t(frames) * channels * sizeof(float));
+            return;
+        }
+        const float* src = in;
+        for (int i = 0; i < count; ++i) {
+            float* dst = i == count - 1 ? out : scratch[i & 1].data();
+            stages[i]->process(src, dst, frames);
+            src = dst;
+        }
+    }
+
+private:
+    AudioProcessor* stages[kMaxStages] = {};
+    int count = 0;
+    uint32_t channels = 1;
+    std::vector<float> scratch[2];
+};
+
+} // namespace nuchat
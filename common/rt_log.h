@@ -0,0 +1,90 @@
+// rt_log.h
+// Realtime-safe error reporting: audio threads post fixed-size records into a
+// bounded lock-free queue and a normal thread formats and prints them.
+//
+// post() never blocks, allocates or makes a syscall; when the queue is full the
+// record is counted as dropped. Multiple audio threads may post concurrently
+// (per-slot sequence numbers, Vyukov-style); only one thread may drain.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "spsc_ring.h"
+
+namespace nuchat {
+
+struct RtLogEntry {
+    const char* where;  // must point at a string literal / static storage
+    int64_t code;
+};
+
+class RtLog {
+public:
+    explicit RtLog(uint32_t minCapacity = 256) {
+        uint32_t sz = 1;
+        while (sz < minCapacity) sz <<= 1;
+        slots = std::vector<Slot>(sz);
+        for (uint32_t i = 0; i < sz; ++i)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        mask = sz - 1;
+    }
+
+    // Safe to call from any realtime thread.
+    bool post(const char* where, int64_t code) {
+        uint32_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& s = slots[pos & mask];
+            uint32_t seq = s.seq.load(std::memory_order_acquire);
+            int32_t diff = int32_t(seq - pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.entry = RtLogEntry{where, code};
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Calls fn(const RtLogEntry&) for each pending record; returns how many.
+    // Call from a single non-realtime thread.
+    template <typename Fn>
+    uint32_t drain(Fn&& fn) {
+        uint32_t n = 0;
+        for (;;) {
+            Slot& s = slots[tail & mask];
+            if (s.seq.load(std::memory_order_acquire) != tail + 1) break;
+            RtLogEntry e = s.entry;
+            s.seq.store(tail + mask + 1, std::memory_order_release);
+            ++tail;
+            fn(e);
+            ++n;
+        }
+        return n;
+    }
+
+    // Records lost because the queue was full; resets the count.
+    uint64_t takeDropped() { return dropped.exchange(0, std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> seq{0};
+        RtLogEntry entry{nullptr, 0};
+    };
+
+    std::vector<Slot> slots;
+    uint32_t mask = 0;
+    alignas(kCacheLine) std::atomic<uint32_t> head{0};
+    alignas(kCacheLine) uint32_t tail = 0;
+    std::atomic<uint64_t> dropped{0};
+};
+
+} // namespace nuchat
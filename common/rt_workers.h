@@ -0,0 +1,436 @@
+// rt_workers.h
+// Realtime worker threads that take DSP off the device callback.
+//
+// A callback copies its block into a ring it owns and submits a job (a
+// function, its context and a deadline) through its RtPort, an SPSC queue
+// bound to one worker; the worker runs whatever is queued on its ports
+// earliest deadline first. Jobs from one port always run on the same worker,
+// in order with respect to each other. Submitting never blocks, allocates
+// or takes a lock: the job goes into the ring and the worker is woken
+// through a semaphore whose post is realtime-safe on every platform.
+//
+// Workers are pinned to the configured cores and run at the platform's
+// realtime class: SCHED_FIFO on Linux and Android, MMCSS "Pro Audio" on
+// Windows, a time-constraint policy on Apple platforms (which do not allow
+// pinning). onThreadStart runs on each worker after that.
+//
+// On Apple platforms setWorkgroup() hands the workers the device's audio
+// workgroup (audio_workgroup.h fetches it from the IO unit): each worker
+// joins it, so the scheduler treats their jobs as part of the IO cycle and
+// keeps them on performance cores against its deadline. When the device
+// changes, setting the new workgroup makes each worker leave the old one and
+// join the new one the next time it wakes.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#include <avrt.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "avrt")
+#endif
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#include <os/workgroup.h>
+#include <pthread.h>
+#include <mutex>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#endif
+
+#include "host_clock.h"
+#include "spsc_ring.h"
+
+// Whether OS objects (os_workgroup_t, dispatch_semaphore_t) are
+// reference-counted by ARC here, as in Objective-C++ built with -fobjc-arc,
+// or by hand with os_retain/os_release and dispatch_release. Every manual
+// retain or release of one must sit behind !NUCHAT_OS_OBJECT_ARC;
+// macOS/apple_headers.cpp builds these headers in both modes.
+#if defined(__APPLE__) && defined(__OBJC__)
+#if __has_feature(objc_arc)
+#define NUCHAT_OS_OBJECT_ARC 1
+#endif
+#endif
+#ifndef NUCHAT_OS_OBJECT_ARC
+#define NUCHAT_OS_OBJECT_ARC 0
+#endif
+
+namespace nuchat {
+
+// Counting semaphore whose post() may be called from a realtime thread.
+class RtSemaphore {
+public:
+#if defined(_WIN32)
+    RtSemaphore() : h(CreateSemaphoreW(nullptr, 0, 0x7FFFFFFF, nullptr)) {}
+    ~RtSemaphore() { CloseHandle(h); }
+    void post() { ReleaseSemaphore(h, 1, nullptr); }
+    void wait() { WaitForSingleObject(h, INFINITE); }
+#elif defined(__APPLE__)
+    RtSemaphore() : s(dispatch_semaphore_create(0)) {}
+    ~RtSemaphore() {
+#if !NUCHAT_OS_OBJECT_ARC
+        dispatch_release(s); // under ARC the member is released with the object
+#endif
+    }
+    void post() { dispatch_semaphore_signal(s); }
+    void wait() { dispatch_semaphore_wait(s, DISPATCH_TIME_FOREVER); }
+#else
+    RtSemaphore() { sem_init(&s, 0, 0); }
+    ~RtSemaphore() { sem_destroy(&s); }
+    void post() { sem_post(&s); }
+    void wait() { while (sem_wait(&s) != 0) {} }
+#endif
+
+    RtSemaphore(const RtSemaphore&) = delete;
+    RtSemaphore& operator=(const RtSemaphore&) = delete;
+
+private:
+#if defined(_WIN32)
+    HANDLE h;
+#elif defined(__APPLE__)
+    dispatch_semaphore_t s;
+#else
+    sem_t s;
+#endif
+};
+
+struct RtJob {
+    void (*fn)(void* ctx);
+    void* ctx;
+    uint64_t deadlineNs; // host_now_ns() clock: when the result is needed
+};
+
+struct RtWorkerConfig {
+    uint32_t workers = 1;
+    std::vector<int> cores;    // worker i runs on cores[i % size]; empty = unpinned
+    int priority = 70;         // SCHED_FIFO priority (Linux/Android)
+    double periodMs = 2.7;     // IO period, for Apple's time-constraint policy
+    uint32_t queueDepth = 64;  // jobs per port
+    std::function<void(uint32_t worker)> onThreadStart;
+};
+
+// Cores a worker can be pinned to are 0 .. kMaxCores - 1: the bits of an
+// affinity mask on Windows (within processor group 0), a cpu_set_t on Linux.
+// Apple platforms do not pin.
+#if defined(_WIN32)
+static constexpr int kMaxCores = int(sizeof(DWORD_PTR) * 8);
+#elif defined(__APPLE__)
+static constexpr int kMaxCores = 1024;
+#else
+static constexpr int kMaxCores = CPU_SETSIZE;
+#endif
+
+// "2,3" -> {2, 3}, one worker per listed core. False on anything else,
+// including cores this platform cannot pin to.
+inline bool parse_core_list(const char* list, std::vector<int>& cores) {
+    cores.clear();
+    for (const char* p = list;;) {
+        char* end;
+        long core = std::strtol(p, &end, 10);
+        if (end == p || core < 0 || core >= kMaxCores) return false;
+        cores.push_back(int(core));
+        if (*end == '\0') return true;
+        if (*end != ',') return false;
+        p = end + 1;
+    }
+}
+
+class RtWorkerPool;
+
+// One submitting thread's queue to its worker. Created by RtWorkerPool::
+// connect() and owned by the pool.
+class RtPort {
+public:
+    // Realtime, from the port's one producer thread. False if the queue is
+    // full (the job is dropped; its data stays wherever the producer put it).
+    bool submit(void (*fn)(void*), void* ctx, uint64_t deadlineNs) {
+        RtJob job{fn, ctx, deadlineNs};
+        if (jobs.push(&job, 1) != 1) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        submitted.fetch_add(1, std::memory_order_release);
+        wake.post();
+        return true;
+    }
+
+    // Non-realtime: returns once every job submitted so far has run, e.g.
+    // before freeing what the jobs point at.
+    void waitIdle() const {
+        uint64_t target = submitted.load(std::memory_order_acquire);
+        while (completed.load(std::memory_order_acquire) < target) std::this_thread::yield();
+    }
+
+    uint32_t worker() const { return owner; }
+    uint64_t rejectedJobs() const { return rejected.load(std::memory_order_relaxed); }
+
+private:
+    friend class RtWorkerPool;
+    RtPort(uint32_t depth, uint32_t owner, RtSemaphore& wake) : jobs(depth), owner(owner), wake(wake) {}
+
+    SpscRing<RtJob> jobs;
+    uint32_t owner;
+    RtSemaphore& wake;
+    std::atomic<uint64_t> submitted{0}, completed{0}, rejected{0};
+};
+
+class RtWorkerPool {
+public:
+    static constexpr uint32_t kMaxPorts = 16; // per worker
+
+    explicit RtWorkerPool(const RtWorkerConfig& config) : cfg(config) {
+        uint32_t n = std::max(1u, cfg.workers);
+        for (uint32_t i = 0; i < n; ++i) workers.emplace_back(new Worker(cfg.queueDepth * kMaxPorts));
+        for (uint32_t i = 0; i < n; ++i) workers[i]->thread = std::thread(&RtWorkerPool::workerLoop, this, i);
+    }
+
+    ~RtWorkerPool() {
+        quit.store(true, std::memory_order_release);
+        for (auto& w : workers) {
+            w->wake.post();
+            w->thread.join();
+        }
+#if defined(__APPLE__) && !NUCHAT_OS_OBJECT_ARC
+        if (workgroup) os_release(workgroup);
+#endif
+    }
+
+    RtWorkerPool(const RtWorkerPool&) = delete;
+    RtWorkerPool& operator=(const RtWorkerPool&) = delete;
+
+    uint32_t size() const { return uint32_t(workers.size()); }
+
+    // Non-realtime: a new port on worker (mod size()). Null once that worker
+    // has kMaxPorts. Ports live as long as the pool.
+    RtPort* connect(uint32_t worker) {
+        Worker& w = *workers[worker % workers.size()];
+        uint32_t n = w.portCount.load(std::memory_order_relaxed);
+        if (n == kMaxPorts) return nullptr;
+        w.ports[n].reset(new RtPort(cfg.queueDepth, worker % size(), w.wake));
+        w.portCount.store(n + 1, std::memory_order_release);
+        return w.ports[n].get();
+    }
+
+#if defined(__APPLE__)
+    // Non-realtime. Workers join wg (null: leave the current one) at their
+    // next wakeup, under a time-constraint policy for periodMs (the device's
+    // IO period; 0 keeps the current one). The pool keeps its own reference.
+    void setWorkgroup(os_workgroup_t wg, double periodMs = 0) {
+        std::lock_guard<std::mutex> g(workgroupLock);
+#if !NUCHAT_OS_OBJECT_ARC
+        if (wg) os_retain(wg);
+        if (workgroup) os_release(workgroup);
+#endif
+        workgroup = wg;
+        if (periodMs > 0) cfg.periodMs = periodMs;
+        workgroupGen.fetch_add(1, std::memory_order_release);
+        for (auto& w : workers) w->wake.post();
+    }
+#endif
+
+    uint64_t jobsRun() const { return sum(&Worker::ran); }
+    uint64_t deadlineMisses() const { return sum(&Worker::missed); }
+    uint64_t maxLatenessNs() const {
+        uint64_t m = 0;
+        for (auto& w : workers) m = std::max(m, w->maxLateNs.load(std::memory_order_relaxed));
+        return m;
+    }
+
+    void report(FILE* out) const {
+        std::fprintf(out, "workers: %u threads, %llu jobs, %llu past deadline (worst by %.1f us)\n", size(),
+                     (unsigned long long)jobsRun(), (unsigned long long)deadlineMisses(), maxLatenessNs() / 1e3);
+#if defined(__APPLE__)
+        if (uint64_t n = sum(&Worker::joinFailures))
+            std::fprintf(out, "workers: %llu audio workgroup joins refused\n", (unsigned long long)n);
+#endif
+    }
+
+private:
+    struct Worker {
+        explicit Worker(uint32_t capacity) : heap(capacity) {}
+        RtSemaphore wake;
+        std::unique_ptr<RtPort> ports[kMaxPorts];
+        std::atomic<uint32_t> portCount{0};
+        // Min-heap on deadline; the port each job came from rides along.
+        struct Entry { RtJob job; RtPort* port; };
+        std::vector<Entry> heap;
+        uint32_t queued = 0;
+        std::atomic<uint64_t> ran{0}, missed{0}, maxLateNs{0};
+        std::thread thread;
+#if defined(__APPLE__)
+        os_workgroup_t joined = nullptr; // worker thread only
+        os_workgroup_join_token_s token{};
+        uint64_t seenGen = 0;
+        std::atomic<uint64_t> joinFailures{0};
+#endif
+    };
+
+    uint64_t sum(std::atomic<uint64_t> Worker::*field) const {
+        uint64_t t = 0;
+        for (auto& w : workers) t += ((*w).*field).load(std::memory_order_relaxed);
+        return t;
+    }
+
+    void setupThread(uint32_t index) {
+        int core = cfg.cores.empty() ? -1 : cfg.cores[index % cfg.cores.size()];
+        if (core >= kMaxCores) {
+            std::fprintf(stderr, "workers: core %d out of range, worker %u left unpinned\n", core, index);
+            core = -1;
+        }
+#if defined(_WIN32)
+        if (core >= 0) SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+        DWORD task = 0;
+        if (!AvSetMmThreadCharacteristicsW(L"Pro Audio", &task))
+            std::fprintf(stderr, "workers: MMCSS unavailable for worker %u\n", index);
+#elif defined(__APPLE__)
+        (void)core;
+        double periodMs;
+        {
+            std::lock_guard<std::mutex> g(workgroupLock);
+            periodMs = cfg.periodMs;
+        }
+        if (!setTimeConstraint(periodMs))
+            std::fprintf(stderr, "workers: time-constraint policy refused for worker %u\n", index);
+#else
+        if (core >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(core, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+                std::fprintf(stderr, "workers: cannot pin worker %u to core %d\n", index, core);
+        }
+        sched_param sp{};
+        sp.sched_priority = cfg.priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+            std::fprintf(stderr, "workers: SCHED_FIFO unavailable for worker %u\n", index);
+#endif
+        if (cfg.onThreadStart) cfg.onThreadStart(index);
+    }
+
+#if defined(__APPLE__)
+    // Apple's guidance for workgroup members: period and constraint are the
+    // IO period, computation the share of it one job may take.
+    static bool setTimeConstraint(double periodMs) {
+        mach_timebase_info_data_t tb;
+        mach_timebase_info(&tb);
+        double ticksPerMs = 1e6 * tb.denom / tb.numer;
+        thread_time_constraint_policy_data_t p;
+        p.period = uint32_t(periodMs * ticksPerMs);
+        p.computation = uint32_t(periodMs * 0.5 * ticksPerMs);
+        p.constraint = uint32_t(periodMs * ticksPerMs);
+        p.preemptible = 1;
+        return thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY,
+                                 reinterpret_cast<thread_policy_t>(&p),
+                                 THREAD_TIME_CONSTRAINT_POLICY_COUNT) == KERN_SUCCESS;
+    }
+
+    // Worker thread, after a wakeup: follows setWorkgroup(). The lock is
+    // only ever contended by another setWorkgroup(), i.e. a device change.
+    void syncWorkgroup(Worker& w) {
+        uint64_t gen = workgroupGen.load(std::memory_order_acquire);
+        if (gen == w.seenGen) return;
+        w.seenGen = gen;
+        if (__builtin_available(macOS 11.0, iOS 14.0, *)) {
+            std::lock_guard<std::mutex> g(workgroupLock);
+            if (w.joined) {
+                os_workgroup_leave(w.joined, &w.token);
+                w.joined = nullptr;
+            }
+            setTimeConstraint(cfg.periodMs);
+            if (workgroup) {
+                if (os_workgroup_join(workgroup, &w.token) == 0) w.joined = workgroup;
+                else w.joinFailures.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void leaveWorkgroup(Worker& w) {
+        if (__builtin_available(macOS 11.0, iOS 14.0, *)) {
+            std::lock_guard<std::mutex> g(workgroupLock);
+            if (w.joined) os_workgroup_leave(w.joined, &w.token);
+            w.joined = nullptr;
+        }
+    }
+#endif
+
+    static bool later(const Worker::Entry& a, const Worker::Entry& b) { return a.job.deadlineNs > b.job.deadlineNs; }
+
+    // Moves everything the ports hold into the heap.
+    void gather(Worker& w) {
+        uint32_t ports = w.portCount.load(std::memory_order_acquire);
+        for (uint32_t p = 0; p < ports; ++p) {
+            RtPort* port = w.ports[p].get();
+            RtJob job;
+            while (w.queued < w.heap.size() && port->jobs.pop(&job, 1)) {
+                w.heap[w.queued++] = {job, port};
+                std::push_heap(w.heap.begin(), w.heap.begin() + w.queued, later);
+            }
+        }
+    }
+
+    void workerLoop(uint32_t index) {
+        setupThread(index);
+        Worker& w = *workers[index];
+        for (;;) {
+            w.wake.wait();
+            if (quit.load(std::memory_order_acquire)) {
+#if defined(__APPLE__)
+                leaveWorkgroup(w);
+#endif
+                return;
+            }
+#if defined(__APPLE__)
+            syncWorkgroup(w);
+#endif
+            // One post per job, so the loop below may see jobs whose posts
+            // are still pending; those wakeups then find nothing, harmlessly.
+            gather(w);
+            while (w.queued > 0) {
+                std::pop_heap(w.heap.begin(), w.heap.begin() + w.queued, later);
+                Worker::Entry e = w.heap[--w.queued];
+                e.job.fn(e.job.ctx);
+                uint64_t now = host_now_ns();
+                w.ran.fetch_add(1, std::memory_order_relaxed);
+                if (now > e.job.deadlineNs) {
+                    uint64_t late = now - e.job.deadlineNs;
+                    w.missed.fetch_add(1, std::memory_order_relaxed);
+                    if (late > w.maxLateNs.load(std::memory_order_relaxed))
+                        w.maxLateNs.store(late, std::memory_order_relaxed);
+                }
+                e.port->completed.fetch_add(1, std::memory_order_release);
+                // A job that arrived meanwhile may be due sooner than the rest.
+                gather(w);
+            }
+        }
+    }
+
+    RtWorkerConfig cfg;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> quit{false};
+#if defined(__APPLE__)
+    std::mutex workgroupLock;      // workgroup and cfg.periodMs after construction
+    os_workgroup_t workgroup = nullptr;
+    std::atomic<uint64_t> workgroupGen{0};
+#endif
+};
+
+} // namespace nuchat
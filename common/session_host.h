@@ -0,0 +1,247 @@
+// session_host.h
+// Per-session gain, mute and voice detection for many lightweight sessions
+// in one process, all serviced by a single device callback or timer tick:
+// the conditioning stage of a gateway whose sessions arrive already decoded,
+// de-jittered and at the host's rate.
+//
+// It is not the engine pipeline. A session has no jitter buffer, no rate
+// conversion and no echo canceller; its inbox is trimmed when it runs ahead
+// and padded with silence when it runs dry, nothing more. Anything facing a
+// device, or a peer on another clock, still needs an AudioEngine of its own
+// (file_voice_loopback --streams runs one per stream).
+//
+// One allocation holds every session: maxSessions fixed-size slots, each
+// a cache-aligned VoiceSession header followed by its inbox and outbox
+// samples, so a tick walks memory front to back and a session costs one
+// stride (tens of kilobytes with the default rings) instead of a process.
+// Opening a session takes a slot from a free list; nothing is allocated
+// afterwards.
+//
+// Per tick and session: pop one block from the inbox (silence if it did not
+// arrive), apply the session's gain/mute, classify it with the VAD and push
+// it to the outbox. The tick itself takes no locks: sessions become visible
+// to it through an atomic state, and close() waits for any tick that could
+// still see the session before its slot is reused.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "control.h"
+#include "spsc_ring.h"
+#include "vad.h"
+
+namespace nuchat {
+
+struct SessionHostConfig {
+    double sampleRate = 48000.0;
+    uint32_t tickFrames = 480;  // largest block one tick processes (10 ms)
+    uint32_t ringFrames = 2048; // per session and direction, rounded to a power of two
+    uint32_t maxSessions = 256;
+    bool detectVoice = true;
+};
+
+// One voice. push() and pull() are each single-threaded (usually the thread
+// that owns the session's decoder); the host is the other side of both
+// rings. Setters are any-thread and take effect at the next tick.
+class VoiceSession {
+public:
+    uint32_t push(const float* in, uint32_t n) { return inbox.push(in, n); }
+    uint32_t pull(float* out, uint32_t n) { return outbox.pop(out, n); }
+
+    void setGainDb(float db) { gainDb.store(db, std::memory_order_relaxed); }
+    void setMuted(bool m) { muted.store(m, std::memory_order_relaxed); }
+
+    // Whether the last tick's block was speech (false without detectVoice).
+    bool talking() const { return speech.load(std::memory_order_relaxed); }
+    uint32_t slot() const { return index; }
+    uint64_t underflows() const { return underflowFrames.load(std::memory_order_relaxed); }
+    uint64_t overflows() const { return overflowFrames.load(std::memory_order_relaxed); }
+
+    void* user = nullptr; // owner's context, untouched by the host
+
+private:
+    friend class SessionHost;
+
+    VoiceSession(float* storage, uint32_t ringFrames, uint32_t index, double rate)
+        : inbox(storage, ringFrames), outbox(storage + ringFrames, ringFrames), index(index),
+          backlog(ringFrames / 2) {
+        vad.prepare(rate);
+    }
+
+    // Host side, one tick.
+    void process(float* block, uint32_t frames, bool detectVoice) {
+        float db = gainDb.load(std::memory_order_relaxed);
+        bool m = muted.load(std::memory_order_relaxed);
+        if (db != appliedDb) { gain.setDb(db); appliedDb = db; }
+        if (m != appliedMute) { gain.setMuted(m); appliedMute = m; }
+
+        // A burst after a producer stall is trimmed so this session cannot
+        // drift behind its clock.
+        uint32_t avail = inbox.readAvailable();
+        if (avail > backlog + frames) inbox.skip(avail - backlog);
+        uint32_t got = inbox.popOrSilence(block, frames);
+        if (got < frames) underflowFrames.fetch_add(frames - got, std::memory_order_relaxed);
+        if (!gain.unity()) gain.process(block, block, frames);
+        if (detectVoice) speech.store(vad.process(block, frames), std::memory_order_relaxed);
+        uint32_t pushed = outbox.push(block, frames);
+        if (pushed < frames) overflowFrames.fetch_add(frames - pushed, std::memory_order_relaxed);
+    }
+
+    SpscRing<float> inbox, outbox;
+    GainRamp gain;
+    VoiceActivityDetector vad;
+    std::atomic<float> gainDb{0.0f};
+    std::atomic<bool> muted{false}, speech{false};
+    std::atomic<uint64_t> underflowFrames{0}, overflowFrames{0};
+    float appliedDb = 0.0f;
+    bool appliedMute = false;
+    uint32_t index;
+    uint32_t backlog;
+};
+
+class SessionHost {
+public:
+    explicit SessionHost(const SessionHostConfig& config) : cfg(config) {
+        uint32_t ring = 1;
+        while (ring < cfg.ringFrames) ring <<= 1;
+        cfg.ringFrames = ring;
+        headerBytes = roundUp(sizeof(VoiceSession));
+        stride = headerBytes + roundUp(size_t(2) * ring * sizeof(float));
+        arena.reset(static_cast<uint8_t*>(::operator new(stride * cfg.maxSessions, std::align_val_t(kCacheLine))));
+        states.reset(new std::atomic<uint32_t>[cfg.maxSessions]);
+        for (uint32_t i = 0; i < cfg.maxSessions; ++i) states[i].store(kFree, std::memory_order_relaxed);
+        block.assign(cfg.tickFrames, 0.0f);
+        freeSlots.reserve(cfg.maxSessions);
+        for (uint32_t i = cfg.maxSessions; i-- > 0;) freeSlots.push_back(i);
+    }
+
+    ~SessionHost() {
+        stop();
+        for (uint32_t i = 0; i < cfg.maxSessions; ++i)
+            if (states[i].load(std::memory_order_relaxed) != kFree) at(i)->~VoiceSession();
+    }
+
+    SessionHost(const SessionHost&) = delete;
+    SessionHost& operator=(const SessionHost&) = delete;
+
+    const SessionHostConfig& config() const { return cfg; }
+    // Memory one session occupies, header and rings.
+    size_t sessionBytes() const { return stride; }
+    uint32_t sessionCount() const { return live.load(std::memory_order_relaxed); }
+
+    // Any thread. Null when all maxSessions slots are taken.
+    VoiceSession* open() {
+        std::lock_guard<std::mutex> g(lock);
+        if (freeSlots.empty()) return nullptr;
+        uint32_t i = freeSlots.back();
+        freeSlots.pop_back();
+        uint8_t* slot = arena.get() + size_t(i) * stride;
+        VoiceSession* s = new (slot) VoiceSession(reinterpret_cast<float*>(slot + headerBytes), cfg.ringFrames, i,
+                                                  cfg.sampleRate);
+        states[i].store(kLive, std::memory_order_release);
+        if (i >= slotsInUse.load(std::memory_order_relaxed)) slotsInUse.store(i + 1, std::memory_order_release);
+        live.fetch_add(1, std::memory_order_relaxed);
+        return s;
+    }
+
+    // Any thread but the ticking one. Returns once no tick can touch s.
+    void close(VoiceSession* s) {
+        uint32_t i = s->index;
+        states[i].store(kClosing, std::memory_order_seq_cst);
+        // A tick that started before the store may still be inside s.
+        uint64_t entered = ticksEntered.load(std::memory_order_seq_cst);
+        while (ticksDone.load(std::memory_order_seq_cst) < entered)
+            std::this_thread::yield();
+        std::lock_guard<std::mutex> g(lock);
+        s->~VoiceSession();
+        states[i].store(kFree, std::memory_order_relaxed);
+        freeSlots.push_back(i);
+        live.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Device callback or timer thread, one at a time: processes `frames`
+    // (at most tickFrames) for every live session, in slot order.
+    void tick(uint32_t frames) {
+        ticksEntered.fetch_add(1, std::memory_order_seq_cst);
+        frames = std::min(frames, cfg.tickFrames);
+        uint32_t n = slotsInUse.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; ++i) {
+            // seq_cst pairs with close(): either it sees this tick entered
+            // or this tick sees the session closing.
+            if (states[i].load(std::memory_order_seq_cst) == kLive)
+                at(i)->process(block.data(), frames, cfg.detectVoice);
+        }
+        ticksDone.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // Without a device to hang off: tick() every tickFrames on a thread.
+    void start() {
+        if (running) return;
+        running = true;
+        clock = std::thread([this] {
+            auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(cfg.tickFrames / cfg.sampleRate));
+            auto next = std::chrono::steady_clock::now();
+            while (running.load(std::memory_order_relaxed)) {
+                auto t0 = std::chrono::steady_clock::now();
+                tick(cfg.tickFrames);
+                auto t1 = std::chrono::steady_clock::now();
+                uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+                if (ns > maxTickNs.load(std::memory_order_relaxed)) maxTickNs.store(ns, std::memory_order_relaxed);
+                next += period;
+                if (t1 > next) {
+                    lateTicks.fetch_add(1, std::memory_order_relaxed);
+                    next = t1;
+                }
+                std::this_thread::sleep_until(next);
+            }
+        });
+    }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        clock.join();
+    }
+
+    uint64_t tickCount() const { return ticksDone.load(std::memory_order_relaxed); }
+    uint64_t lateTickCount() const { return lateTicks.load(std::memory_order_relaxed); }
+    uint64_t maxTickNanos() const { return maxTickNs.load(std::memory_order_relaxed); }
+
+private:
+    struct ArenaFree {
+        void operator()(uint8_t* p) const { ::operator delete(p, std::align_val_t(kCacheLine)); }
+    };
+
+    enum : uint32_t { kFree, kLive, kClosing };
+
+    static size_t roundUp(size_t n) { return (n + kCacheLine - 1) / kCacheLine * kCacheLine; }
+
+    VoiceSession* at(uint32_t i) { return reinterpret_cast<VoiceSession*>(arena.get() + size_t(i) * stride); }
+
+    SessionHostConfig cfg;
+    size_t headerBytes = 0, stride = 0;
+    std::unique_ptr<uint8_t, ArenaFree> arena;
+    std::unique_ptr<std::atomic<uint32_t>[]> states; // per slot, scanned by tick()
+    std::vector<float> block; // one tick of one session, hot in L1 across sessions
+    std::mutex lock;          // open/close only
+    std::vector<uint32_t> freeSlots;
+    std::atomic<uint32_t> slotsInUse{0}; // high-water mark the tick scans up to
+    std::atomic<uint32_t> live{0};
+    std::atomic<uint64_t> ticksEntered{0}, ticksDone{0};
+    std::atomic<bool> running{false};
+    std::thread clock;
+    std::atomic<uint64_t> lateTicks{0}, maxTickNs{0};
+};
+
+} // namespace nuchat
@@ -0,0 +1,125 @@
+// shutdown.h
+// Process lifecycle for the command-line backends: a stop flag raised by
+// Ctrl+C / SIGTERM (console control events on Windows) or by a --duration
+// timer, so main() can leave its wait, stop the engine and print a summary.
+//
+// The handler only stores to a lock-free atomic, which is async-signal-safe.
+// It is installed one-shot: a second Ctrl+C while shutdown hangs gets the
+// default action and kills the process.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace nuchat {
+
+inline std::atomic<bool> gStopRequested{false};
+
+inline void request_stop() { gStopRequested.store(true, std::memory_order_relaxed); }
+inline bool stop_requested() { return gStopRequested.load(std::memory_order_relaxed); }
+
+#if defined(_WIN32)
+inline BOOL WINAPI on_console_event(DWORD event) {
+    if (event != CTRL_C_EVENT && event != CTRL_BREAK_EVENT && event != CTRL_CLOSE_EVENT) return FALSE;
+    if (stop_requested() && event != CTRL_CLOSE_EVENT) return FALSE; // second Ctrl+C: default, terminate
+    request_stop();
+    // The process ends as soon as a close handler returns; give main() the
+    // few seconds Windows allows to stop the streams.
+    if (event == CTRL_CLOSE_EVENT) Sleep(3000);
+    return TRUE;
+}
+
+inline void install_stop_handlers() { SetConsoleCtrlHandler(on_console_event, TRUE); }
+#else
+inline void on_stop_signal(int) { request_stop(); }
+
+// SA_RESTART is left off so a blocking read of stdin returns (EINTR).
+inline void install_stop_handlers() {
+    struct sigaction sa {};
+    sa.sa_handler = on_stop_signal;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+#endif
+
+// Main thread. Returns once a stop is requested or `seconds` have passed
+// (never, if seconds <= 0), with the flag set either way. Meanwhile each line
+// typed on stdin goes to onLine, on this thread; none is delivered after the
+// stop, so onLine may use objects torn down right after this returns. EOF on
+// stdin (e.g. </dev/null under a test harness) just ends the input.
+inline void run_console_until_stop(double seconds, const std::function<void(const char*)>& onLine) {
+#if defined(_WIN32)
+    // Console reads cannot be polled portably (pipes vs. consoles): a reader
+    // thread blocks in getline and is never joined.
+    auto pending = std::make_shared<std::pair<std::mutex, std::vector<std::string>>>();
+    std::thread([pending] {
+        std::string line;
+        while (std::getline(std::cin, line) && !stop_requested()) {
+            std::lock_guard<std::mutex> g(pending->first);
+            pending->second.push_back(line);
+        }
+    }).detach();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                            std::chrono::duration<double>(seconds));
+    while (!stop_requested() && (seconds <= 0 || std::chrono::steady_clock::now() < deadline)) {
+        std::vector<std::string> lines;
+        {
+            std::lock_guard<std::mutex> g(pending->first);
+            lines.swap(pending->second);
+        }
+        for (auto& l : lines)
+            if (!l.empty()) onLine(l.c_str());
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+#else
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                            std::chrono::duration<double>(seconds));
+    std::string buffered;
+    bool open = true;
+    while (!stop_requested() && (seconds <= 0 || std::chrono::steady_clock::now() < deadline)) {
+        pollfd pfd{STDIN_FILENO, POLLIN, 0};
+        if (!open || poll(&pfd, 1, 20) <= 0) {
+            if (!open) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            continue;
+        }
+        char chunk[256];
+        ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { open = false; continue; } // EOF: keep running until stopped
+        buffered.append(chunk, size_t(n));
+        for (size_t nl; (nl = buffered.find('\n')) != std::string::npos;) {
+            std::string line = buffered.substr(0, nl);
+            buffered.erase(0, nl + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) onLine(line.c_str());
+        }
+    }
+#endif
+    request_stop();
+}
+
+} // namespace nuchat
@@ -0,0 +1,157 @@
+// spsc_ring.h
+// Single-producer/single-consumer ring buffer shared by every nuChat backend.
+//
+// Indices are unmasked and increase monotonically (wrapping at 2^32), so the
+// full capacity is usable and "empty" and "full" are never confused. Each side
+// keeps a private copy of the other side's index and only reloads the shared
+// atomic when that copy says there is not enough room/data, which keeps the
+// producer and consumer cache lines from ping-ponging on every call.
+// Copies that do not straddle the wrap point are dispatched on their length
+// (block_dispatch.h), so period-sized blocks copy with inlined fixed-size
+// moves instead of a library memcpy.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "block_dispatch.h"
+
+namespace nuchat {
+
+#if defined(__APPLE__) && defined(__aarch64__)
+static constexpr size_t kCacheLine = 128;
+#else
+static constexpr size_t kCacheLine = 64;
+#endif
+
+template <typename T>
+class SpscRing {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SpscRing copies elements with memcpy");
+
+public:
+    // Largest power of two a uint32_t capacity can be.
+    static constexpr uint32_t kMaxCapacity = 1u << 31;
+
+    // Capacity is rounded up to a power of two, at most kMaxCapacity.
+    explicit SpscRing(uint32_t minCapacity) {
+        assert(minCapacity <= kMaxCapacity);
+        uint32_t sz = 1;
+        while (sz < minCapacity && sz < kMaxCapacity) sz <<= 1;
+        owned.resize(sz);
+        buf = owned.data();
+        mask = sz - 1;
+    }
+
+    // Over caller-owned storage (an arena slot, shared memory) of
+    // `capacity` elements, a power of two; it must outlive the ring.
+    SpscRing(T* storage, uint32_t capacity) : buf(storage), mask(capacity - 1) {
+        assert(capacity && !(capacity & (capacity - 1)));
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    uint32_t capacity() const { return mask + 1; }
+
+    // Approximate fill level; exact when called from either owning thread.
+    uint32_t size() const {
+        return writeIdx.load(std::memory_order_acquire) -
+               readIdx.load(std::memory_order_acquire);
+    }
+
+    // --- producer side ---
+
+    uint32_t writeAvailable() {
+        cachedRead = readIdx.load(std::memory_order_acquire);
+        return capacity() - (writeIdx.load(std::memory_order_relaxed) - cachedRead);
+    }
+
+    // Copies up to n elements in; returns how many were accepted.
+    uint32_t push(const T* src, uint32_t n) {
+        uint32_t wi = writeIdx.load(std::memory_order_relaxed);
+        uint32_t freeN = capacity() - (wi - cachedRead);
+        if (freeN < n) {
+            cachedRead = readIdx.load(std::memory_order_acquire);
+            freeN = capacity() - (wi - cachedRead);
+            if (n > freeN) n = freeN;
+        }
+        if (n == 0) return 0;
+        uint32_t at = wi & mask;
+        uint32_t first = capacity() - at;
+        if (first > n) first = n;
+        copy(&buf[at], src, first);
+        if (n > first)
+            copy(&buf[0], src + first, n - first);
+        writeIdx.store(wi + n, std::memory_order_release);
+        return n;
+    }
+
+    // --- consumer side ---
+
+    uint32_t readAvailable() {
+        cachedWrite = writeIdx.load(std::memory_order_acquire);
+        return cachedWrite - readIdx.load(std::memory_order_relaxed);
+    }
+
+    // Copies up to n elements out; returns how many were read.
+    uint32_t pop(T* dst, uint32_t n) {
+        uint32_t ri = readIdx.load(std::memory_order_relaxed);
+        uint32_t avail = cachedWrite - ri;
+        if (avail < n) {
+            cachedWrite = writeIdx.load(std::memory_order_acquire);
+            avail = cachedWrite - ri;
+            if (n > avail) n = avail;
+        }
+        if (n == 0) return 0;
+        uint32_t at = ri & mask;
+        uint32_t first = capacity() - at;
+        if (first > n) first = n;
+        copy(dst, &buf[at], first);
+        if (n > first)
+            copy(dst + first, &buf[0], n - first);
+        readIdx.store(ri + n, std::memory_order_release);
+        return n;
+    }
+
+    // Like pop(), but value-initialises whatever could not be read so the
+    // destination is always fully written (silence for audio samples).
+    uint32_t popOrSilence(T* dst, uint32_t n) {
+        uint32_t got = pop(dst, n);
+        if (got < n)
+            std::memset(static_cast<void*>(dst + got), 0, (n - got) * sizeof(T));
+        return got;
+    }
+
+    // Discards up to n elements without copying them; returns how many.
+    uint32_t skip(uint32_t n) {
+        uint32_t ri = readIdx.load(std::memory_order_relaxed);
+        uint32_t avail = readAvailable();
+        if (n > avail) n = avail;
+        readIdx.store(ri + n, std::memory_order_release);
+        return n;
+    }
+
+private:
+    static void copy(T* dst, const T* src, uint32_t n) {
+        dispatch_block(n, [&](auto blk) { std::memcpy(dst, src, blk.count() * sizeof(T)); });
+    }
+
+    // Producer-owned line.
+    alignas(kCacheLine) std::atomic<uint32_t> writeIdx{0};
+    uint32_t cachedRead = 0;
+    // Consumer-owned line.
+    alignas(kCacheLine) std::atomic<uint32_t> readIdx{0};
+    uint32_t cachedWrite = 0;
+    // Read-only after construction.
+    alignas(kCacheLine) T* buf = nullptr;
+    uint32_t mask = 0;
+    std::vector<T> owned; // empty over external storage
+};
+
+} // namespace nuchat
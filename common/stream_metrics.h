@@ -0,0 +1,264 @@
+// stream_metrics.h
+// Realtime-safe per-stream counters plus a background exporter.
+//
+// Audio threads only do relaxed atomic increments and a CAS for the fill
+// watermarks. Telling device starvation from CPU starvation: xruns with a
+// callback-load histogram far below 1.0 point at the device or driver; xruns
+// with load near or above 1.0 mean the callback itself ran out of time.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace nuchat {
+
+class StreamMetrics {
+public:
+    // Load buckets are callback time / period deadline, by powers of two:
+    // 1/64, 1/32, ... 1, 2, +Inf.
+    static constexpr int kLoadBuckets = 9;
+    static constexpr int kMinLoadLog2 = -6;
+
+    explicit StreamMetrics(const char* name) : name(name) {}
+
+    const char* streamName() const { return name; }
+
+    // --- audio thread ---
+
+    void addFrames(uint64_t n) { frames.fetch_add(n, std::memory_order_relaxed); }
+    void addXrun() { xruns.fetch_add(1, std::memory_order_relaxed); }
+    void addOverflowDrops(uint64_t n) { if (n) overflowDrops.fetch_add(n, std::memory_order_relaxed); }
+    void addUnderflowFrames(uint64_t n) { if (n) underflowFrames.fetch_add(n, std::memory_order_relaxed); }
+
+    void noteFill(uint32_t fill) {
+        raise(fillHigh, fill);
+        lower(fillLow, fill);
+        raise(runFillHigh, fill);
+        lower(runFillLow, fill);
+    }
+
+    void noteCallback(uint64_t elapsedNs, uint64_t deadlineNs) {
+        callbacks.fetch_add(1, std::memory_order_relaxed);
+        raise(maxCallbackNs, elapsedNs);
+        raise(runMaxCallbackNs, elapsedNs);
+        int b = 0;
+        // Smallest b with elapsed <= deadline * 2^(kMinLoadLog2 + b).
+        uint64_t edge = deadlineNs >> -kMinLoadLog2;
+        while (b < kLoadBuckets - 1 && elapsedNs > edge) { edge <<= 1; ++b; }
+        loadHist[b].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Capture-to-presentation time of the audio in this callback, from the
+    // devices' timestamps.
+    void noteLatency(uint64_t ns) {
+        latencyNs.store(ns, std::memory_order_relaxed);
+        raise(maxLatencyNs, ns);
+        raise(runMaxLatencyNs, ns);
+    }
+
+    // Setter for counters kept by the platform (e.g. Oboe getXRunCount()).
+    void setXruns(uint64_t n) { xruns.store(n, std::memory_order_relaxed); }
+
+    // --- exporter ---
+
+    struct Snapshot {
+        uint64_t callbacks, frames, xruns, overflowDrops, underflowFrames, maxCallbackNs;
+        uint64_t latencyNs, maxLatencyNs; // 0 until timestamps are available
+        uint32_t fillHigh, fillLow;
+        uint64_t loadHist[kLoadBuckets];
+    };
+
+    uint64_t totalFrames() const { return frames.load(std::memory_order_relaxed); }
+    uint64_t lastLatencyNs() const { return latencyNs.load(std::memory_order_relaxed); }
+
+    // Counters are cumulative; watermarks and max duration restart per call.
+    Snapshot snapshot() {
+        Snapshot s = counters();
+        s.maxCallbackNs = maxCallbackNs.exchange(0, std::memory_order_relaxed);
+        s.maxLatencyNs = maxLatencyNs.exchange(0, std::memory_order_relaxed);
+        s.fillHigh = fillHigh.exchange(0, std::memory_order_relaxed);
+        s.fillLow = fillLow.exchange(UINT32_MAX, std::memory_order_relaxed);
+        if (s.fillLow == UINT32_MAX) s.fillLow = 0;
+        return s;
+    }
+
+    // The same counters with watermarks and maxima over the whole run, for
+    // end-of-run summaries; unaffected by snapshot().
+    Snapshot totals() const {
+        Snapshot s = counters();
+        s.maxCallbackNs = runMaxCallbackNs.load(std::memory_order_relaxed);
+        s.maxLatencyNs = runMaxLatencyNs.load(std::memory_order_relaxed);
+        s.fillHigh = runFillHigh.load(std::memory_order_relaxed);
+        s.fillLow = runFillLow.load(std::memory_order_relaxed);
+        if (s.fillLow == UINT32_MAX) s.fillLow = 0;
+        return s;
+    }
+
+private:
+    template <typename T>
+    static void raise(std::atomic<T>& a, T v) {
+        T cur = a.load(std::memory_order_relaxed);
+        while (v > cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+    }
+    template <typename T>
+    static void lower(std::atomic<T>& a, T v) {
+        T cur = a.load(std::memory_order_relaxed);
+        while (v < cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+    }
+
+    Snapshot counters() const {
+        Snapshot s{};
+        s.callbacks = callbacks.load(std::memory_order_relaxed);
+        s.frames = frames.load(std::memory_order_relaxed);
+        s.xruns = xruns.load(std::memory_order_relaxed);
+        s.overflowDrops = overflowDrops.load(std::memory_order_relaxed);
+        s.underflowFrames = underflowFrames.load(std::memory_order_relaxed);
+        s.latencyNs = latencyNs.load(std::memory_order_relaxed);
+        for (int i = 0; i < kLoadBuckets; ++i)
+            s.loadHist[i] = loadHist[i].load(std::memory_order_relaxed);
+        return s;
+    }
+
+    const char* name;
+    std::atomic<uint64_t> callbacks{0}, frames{0}, xruns{0};
+    std::atomic<uint64_t> overflowDrops{0}, underflowFrames{0};
+    std::atomic<uint64_t> maxCallbackNs{0}, runMaxCallbackNs{0};
+    std::atomic<uint64_t> latencyNs{0}, maxLatencyNs{0}, runMaxLatencyNs{0};
+    std::atomic<uint32_t> fillHigh{0}, fillLow{UINT32_MAX};
+    std::atomic<uint32_t> runFillHigh{0}, runFillLow{UINT32_MAX};
+    std::atomic<uint64_t> loadHist[kLoadBuckets] = {};
+};
+
+// Times one callback and records it against the period deadline on exit.
+class CallbackTimer {
+public:
+    CallbackTimer(StreamMetrics& m, uint32_t frames, double sampleRate)
+        : m(m), deadlineNs(uint64_t(frames * 1e9 / sampleRate)),
+          start(std::chrono::steady_clock::now()) {
+        m.addFrames(frames);
+    }
+    ~CallbackTimer() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        m.noteCallback(uint64_t(ns), deadlineNs);
+    }
+
+private:
+    StreamMetrics& m;
+    uint64_t deadlineNs;
+    std::chrono::steady_clock::time_point start;
+};
+
+enum class MetricsFormat { Json, Prometheus };
+
+// Periodically renders a set of StreamMetrics to a FILE* from its own thread.
+class MetricsExporter {
+public:
+    static constexpr int kMaxStreams = 16;
+
+    void add(StreamMetrics* m) { if (count < kMaxStreams) streams[count++] = m; }
+
+    // Runs on the exporter thread just before each export, e.g. to copy
+    // platform-maintained counters into the metrics.
+    void setBeforeExport(std::function<void()> fn) { beforeExport = std::move(fn); }
+
+    std::string render(MetricsFormat fmt) {
+        if (beforeExport) beforeExport();
+        std::string out;
+        char line[384];
+        if (fmt == MetricsFormat::Json) out += "{\"streams\":[";
+        for (int i = 0; i < count; ++i) {
+            StreamMetrics::Snapshot s = streams[i]->snapshot();
+            const char* n = streams[i]->streamName();
+            if (fmt == MetricsFormat::Json) {
+                std::snprintf(line, sizeof(line),
+                              "%s{\"stream\":\"%s\",\"callbacks\":%llu,\"frames\":%llu,\"xruns\":%llu,"
+                              "\"overflow_drops\":%llu,\"underflow_frames\":%llu,\"fill_high\":%u,"
+                              "\"fill_low\":%u,\"max_callback_us\":%.1f,\"latency_ms\":%.2f,"
+                              "\"max_latency_ms\":%.2f,\"callback_load\":[",
+                              i ? "," : "", n, ull(s.callbacks), ull(s.frames), ull(s.xruns),
+                              ull(s.overflowDrops), ull(s.underflowFrames), s.fillHigh, s.fillLow,
+                              s.maxCallbackNs / 1000.0, s.latencyNs / 1e6, s.maxLatencyNs / 1e6);
+                out += line;
+                for (int b = 0; b < StreamMetrics::kLoadBuckets; ++b) {
+                    std::snprintf(line, sizeof(line), "%s%llu", b ? "," : "", ull(s.loadHist[b]));
+                    out += line;
+                }
+                out += "]}";
+            } else {
+                struct { const char* key; uint64_t v; } counters[] = {
+                    {"callbacks_total", s.callbacks}, {"frames_total", s.frames},
+                    {"xruns_total", s.xruns}, {"overflow_drops_total", s.overflowDrops},
+                    {"underflow_frames_total", s.underflowFrames},
+                    {"fifo_fill_high", s.fillHigh}, {"fifo_fill_low", s.fillLow},
+                    {"callback_max_ns", s.maxCallbackNs},
+                    {"latency_ns", s.latencyNs}, {"latency_max_ns", s.maxLatencyNs},
+                };
+                for (auto& c : counters) {
+                    std::snprintf(line, sizeof(line), "nuchat_%s{stream=\"%s\"} %llu\n", c.key, n, ull(c.v));
+                    out += line;
+                }
+                uint64_t cum = 0;
+                for (int b = 0; b < StreamMetrics::kLoadBuckets; ++b) {
+                    cum += s.loadHist[b];
+                    if (b == StreamMetrics::kLoadBuckets - 1)
+                        std::snprintf(line, sizeof(line), "nuchat_callback_load_bucket{stream=\"%s\",le=\"+Inf\"} %llu\n",
+                                      n, ull(cum));
+                    else
+                        std::snprintf(line, sizeof(line), "nuchat_callback_load_bucket{stream=\"%s\",le=\"%g\"} %llu\n",
+                                      n, double(1u << b) / (1u << -StreamMetrics::kMinLoadLog2), ull(cum));
+                    out += line;
+                }
+            }
+        }
+        if (fmt == MetricsFormat::Json) out += "]}\n";
+        return out;
+    }
+
+    void start(MetricsFormat fmt, double intervalSeconds, FILE* sink) {
+        stop();
+        running = true;
+        worker = std::thread([this, fmt, intervalSeconds, sink] {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto period = std::chrono::duration<double>(intervalSeconds);
+            while (!cv.wait_for(lock, period, [this] { return !running; })) {
+                std::string text = render(fmt);
+                std::fputs(text.c_str(), sink);
+                std::fflush(sink);
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            running = false;
+        }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    ~MetricsExporter() { stop(); }
+
+private:
+    static unsigned long long ull(uint64_t v) { return static_cast<unsigned long long>(v); }
+
+    StreamMetrics* streams[kMaxStreams] = {};
+    int count = 0;
+    std::function<void()> beforeExport;
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool running = false;
+};
+
+} // namespace nuchat
@@ -0,0 +1,632 @@
+// udp_transport.h
+// Network stage that replaces the local loopback FIFO: captured audio is
+// framed as RTP over UDP and sent to a peer, and the peer's packets are
+// unpacked into the ring the jitter buffer reads.
+//
+// Audio threads never touch the socket. Capture pushes samples into txRing
+// and returns; a non-blocking I/O thread cuts fixed-size packets out of it,
+// sends them, drains the socket and pushes received audio into the jitter
+// buffer's ring, so the I/O thread is that ring's only producer. On Linux
+// both directions are batched with sendmmsg/recvmmsg.
+//
+// RTP timestamps count frames at the processing rate. The capture side keeps
+// them on the device clock by sending silence for frames the device dropped
+// (AudioEngine::noteCapturePosition). On receive, sequence numbers order the
+// stream: late and duplicate packets are dropped, and a gap is concealed for
+// as many frames as the timestamps say are missing, through the codec's
+// loss concealment. The jitter buffer then absorbs network jitter and the
+// drift between the two peers' clocks.
+//
+// Payloads come from an AudioCodec (audio_codec.h), L16 unless setCodec()
+// picks another. Encoding and decoding both run on the I/O thread.
+//
+// Silence suppression: the engine's VAD (vad.h) has already classified the
+// capture signal, and silence arrives through sendSilence() as a length and
+// a level, with no samples. Packets with no speech in them are neither
+// encoded nor sent; instead an RFC 3389 comfort-noise descriptor (the noise
+// level) goes out when silence starts and every 200 ms. Timestamps keep
+// advancing, and the first packet of each talkspurt carries the marker bit.
+// The receiver keeps the jitter buffer's ring fed with noise at that level
+// in real time, so the buffer timeline stays intact.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "audio_codec.h"
+#include "spsc_ring.h"
+
+namespace nuchat {
+
+#if defined(_WIN32)
+using socket_t = SOCKET;
+static const socket_t kNoSocket = INVALID_SOCKET;
+#else
+using socket_t = int;
+static const socket_t kNoSocket = -1;
+#endif
+
+struct RtpHeader {
+    uint8_t payloadType = 0;
+    bool marker = false;
+    uint16_t seq = 0;
+    uint32_t timestamp = 0;
+    uint32_t ssrc = 0;
+};
+
+static constexpr size_t kRtpHeaderBytes = 12;
+static constexpr uint8_t kComfortNoisePayloadType = 13; // RFC 3389 CN
+
+// Writes a 12-byte header with no CSRCs or extension; returns its size.
+inline size_t rtp_write(const RtpHeader& h, uint8_t* p) {
+    p[0] = 0x80; // V=2
+    p[1] = uint8_t((h.marker ? 0x80 : 0) | (h.payloadType & 0x7f));
+    p[2] = uint8_t(h.seq >> 8);
+    p[3] = uint8_t(h.seq);
+    for (int i = 0; i < 4; ++i) {
+        p[4 + i] = uint8_t(h.timestamp >> (24 - 8 * i));
+        p[8 + i] = uint8_t(h.ssrc >> (24 - 8 * i));
+    }
+    return kRtpHeaderBytes;
+}
+
+// Parses a packet, skipping CSRCs, a header extension and padding. On
+// success payload/payloadBytes describe what is left.
+inline bool rtp_read(const uint8_t* p, size_t len, RtpHeader& h, const uint8_t*& payload,
+                     size_t& payloadBytes) {
+    if (len < kRtpHeaderBytes || (p[0] >> 6) != 2) return false;
+    size_t off = kRtpHeaderBytes + 4 * size_t(p[0] & 0x0f);
+    if (p[0] & 0x10) {
+        if (len < off + 4) return false;
+        off += 4 + 4 * ((size_t(p[off + 2]) << 8) | p[off + 3]);
+    }
+    size_t pad = (p[0] & 0x20) ? p[len - 1] : 0;
+    if (len < off + pad) return false;
+    h.marker = (p[1] & 0x80) != 0;
+    h.payloadType = p[1] & 0x7f;
+    h.seq = uint16_t((p[2] << 8) | p[3]);
+    h.timestamp = (uint32_t(p[4]) << 24) | (uint32_t(p[5]) << 16) | (uint32_t(p[6]) << 8) | p[7];
+    h.ssrc = (uint32_t(p[8]) << 24) | (uint32_t(p[9]) << 16) | (uint32_t(p[10]) << 8) | p[11];
+    payload = p + off;
+    payloadBytes = len - off - pad;
+    return true;
+}
+
+struct TransportConfig {
+    std::string peer;         // "host:port", "[v6addr]:port"
+    uint16_t localPort = 0;   // 0 = the peer's port
+    double packetMs = 5.0;    // rounded to 2.5, 5, 10 or 20
+};
+
+struct TransportStats {
+    std::atomic<uint64_t> sent{0}, received{0};
+    std::atomic<uint64_t> lost{0};            // packets never received
+    std::atomic<uint64_t> late{0};            // reordered or duplicate, dropped
+    std::atomic<uint64_t> invalid{0};         // not RTP, wrong payload type or size
+    std::atomic<uint64_t> concealedFrames{0};
+    std::atomic<uint64_t> codecErrors{0};     // frames that failed to encode
+    std::atomic<uint64_t> suppressedFrames{0}; // silence not sent
+    std::atomic<uint64_t> comfortSent{0}, comfortReceived{0}; // CN descriptors
+    std::atomic<uint64_t> txDrops{0};         // frames the I/O thread fell behind on
+    std::atomic<uint64_t> rxDrops{0};         // frames the jitter ring had no room for
+};
+
+class UdpTransport {
+public:
+    static constexpr uint32_t kMaxPacketFrames = 960;   // 20 ms at 48k
+    static constexpr uint32_t kMaxConcealFrames = 9600; // larger gaps resync instead
+    static constexpr int kBatch = 16;
+    static constexpr size_t kMaxPacketBytes = kRtpHeaderBytes + 2 * kMaxPacketFrames;
+
+    explicit UdpTransport(const TransportConfig& cfg) : cfg(cfg), txRing(1 << 14), txSegments(256) {}
+    ~UdpTransport() { stop(); }
+
+    UdpTransport(const UdpTransport&) = delete;
+    UdpTransport& operator=(const UdpTransport&) = delete;
+
+    // Non-realtime: resolves the peer, binds the local port and connects the
+    // socket to the peer so only its packets are received.
+    bool open() {
+#if defined(_WIN32)
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+        wsaStarted = true;
+#endif
+        size_t colon = cfg.peer.rfind(':');
+        if (colon == std::string::npos || colon + 1 == cfg.peer.size()) {
+            std::fprintf(stderr, "udp: peer must be host:port, got '%s'\n", cfg.peer.c_str());
+            return false;
+        }
+        std::string host = cfg.peer.substr(0, colon), port = cfg.peer.substr(colon + 1);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+            std::fprintf(stderr, "udp: cannot resolve %s: %s\n", host.c_str(), gai_strerror(err));
+            return false;
+        }
+        bool ok = bindAndConnect(res, cfg.localPort ? cfg.localPort : uint16_t(std::atoi(port.c_str())));
+        freeaddrinfo(res);
+        if (!ok) return false;
+
+        std::random_device rd;
+        ssrc = rd();
+        txSeq = uint16_t(rd());
+        txTimestamp = rd();
+        return true;
+    }
+
+    // Non-realtime, before prepare(). The codec must outlive the transport;
+    // nullptr restores L16.
+    void setCodec(AudioCodec* c) { codec = c ? c : &l16; }
+
+    const AudioCodec& currentCodec() const { return *codec; }
+
+    // Non-realtime, from AudioEngine::prepare(): sizes the packet buffers,
+    // prepares the codec and starts the I/O thread feeding rx. Later calls
+    // (a backend re-preparing after a route change) keep the running thread.
+    void prepare(double sampleRate, SpscRing<float>* rx) {
+        if (running) return;
+        rxRing = rx;
+        const double durations[] = {2.5, 5.0, 10.0, 20.0};
+        double ms = durations[0];
+        for (double d : durations)
+            if (std::fabs(d - cfg.packetMs) < std::fabs(ms - cfg.packetMs)) ms = d;
+        frames = std::min<uint32_t>(kMaxPacketFrames, uint32_t(sampleRate * ms / 1000.0 + 0.5));
+        if (!codec->prepare(sampleRate, frames)) {
+            std::fprintf(stderr, "udp: %s cannot run at %.0f Hz with %u-frame packets; using l16\n",
+                         codec->name(), sampleRate, unsigned(frames));
+            codec = &l16;
+            l16.prepare(sampleRate, frames);
+        }
+        rxLastFrames = frames;
+        rate = sampleRate;
+        comfortInterval = uint32_t(sampleRate * 0.2);
+        txSilent = false;
+        txFill = txSegmentLeft = 0;
+        txVoice = false;
+        rxComfort = false;
+        txAudio.assign(frames, 0.0f);
+        rxAudio.assign(kMaxPacketFrames, 0.0f);
+        silence.assign(kMaxPacketFrames, 0.0f);
+        txBuf.assign(kBatch * kMaxPacketBytes, 0);
+        rxBuf.assign(kBatch * kMaxPacketBytes, 0);
+        txFirst = true;
+        rxSynced = false;
+        running = true;
+        io = std::thread(&UdpTransport::run, this);
+    }
+
+    void stop() {
+        if (running) {
+            running = false;
+            io.join();
+        }
+        if (fd != kNoSocket) {
+#if defined(_WIN32)
+            closesocket(fd);
+#else
+            close(fd);
+#endif
+            fd = kNoSocket;
+        }
+#if defined(_WIN32)
+        if (wsaStarted) WSACleanup();
+        wsaStarted = false;
+#endif
+    }
+
+    // Capture thread: queues speech for the I/O thread to encode and send;
+    // a null pointer queues zeros to send as they are. Never blocks; frames
+    // that do not fit are counted.
+    void send(const float* in, uint32_t n) {
+        uint32_t pushed = 0;
+        if (txSegments.writeAvailable() > 0) {
+            while (pushed < n) {
+                uint32_t chunk = in ? n - pushed : std::min<uint32_t>(n - pushed, uint32_t(silence.size()));
+                uint32_t got = txRing.push(in ? in + pushed : silence.data(), chunk);
+                pushed += got;
+                if (got < chunk) break;
+            }
+            TxSegment seg{pushed, 0.0f, false};
+            if (pushed) txSegments.push(&seg, 1); // after its samples
+        }
+        if (pushed < n) stat.txDrops.fetch_add(n - pushed, std::memory_order_relaxed);
+    }
+
+    // Capture thread: n frames the VAD found silent, at levelDb (dBFS).
+    // Only the length and level are queued; they advance the timestamps
+    // and set the comfort-noise level.
+    void sendSilence(uint32_t n, double levelDb) {
+        TxSegment seg{n, float(levelDb), true};
+        if (!txSegments.push(&seg, 1)) stat.txDrops.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint32_t packetFrames() const { return frames; }
+    const TransportStats& stats() const { return stat; }
+
+    void report(FILE* out) const {
+        auto v = [](const std::atomic<uint64_t>& a) { return (unsigned long long)a.load(std::memory_order_relaxed); };
+        std::fprintf(out,
+                     "udp: sent %llu, received %llu, lost %llu, late %llu, invalid %llu, "
+                     "concealed %llu frames, %llu codec errors, dropped %llu tx / %llu rx frames, "
+                     "suppressed %llu frames, comfort noise %llu sent / %llu received\n",
+                     v(stat.sent), v(stat.received), v(stat.lost), v(stat.late), v(stat.invalid),
+                     v(stat.concealedFrames), v(stat.codecErrors), v(stat.txDrops), v(stat.rxDrops),
+                     v(stat.suppressedFrames), v(stat.comfortSent), v(stat.comfortReceived));
+    }
+
+private:
+    bool bindAndConnect(const addrinfo* peer, uint16_t localPort) {
+        fd = socket(peer->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd == kNoSocket) {
+            std::fprintf(stderr, "udp: cannot create socket\n");
+            return false;
+        }
+        sockaddr_storage local{};
+        socklen_t localLen;
+        if (peer->ai_family == AF_INET6) {
+            auto* a = reinterpret_cast<sockaddr_in6*>(&local);
+            a->sin6_family = AF_INET6;
+            a->sin6_addr = in6addr_any;
+            a->sin6_port = htons(localPort);
+            localLen = sizeof(*a);
+        } else {
+            auto* a = reinterpret_cast<sockaddr_in*>(&local);
+            a->sin_family = AF_INET;
+            a->sin_addr.s_addr = htonl(INADDR_ANY);
+            a->sin_port = htons(localPort);
+            localLen = sizeof(*a);
+        }
+        if (bind(fd, reinterpret_cast<sockaddr*>(&local), localLen) != 0) {
+            std::fprintf(stderr, "udp: cannot bind port %u\n", unsigned(localPort));
+            return false;
+        }
+        if (connect(fd, peer->ai_addr, socklen_t(peer->ai_addrlen)) != 0) {
+            std::fprintf(stderr, "udp: cannot connect to %s\n", cfg.peer.c_str());
+            return false;
+        }
+#if defined(_WIN32)
+        u_long nonBlocking = 1;
+        ioctlsocket(fd, FIONBIO, &nonBlocking);
+#else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        // Expedited forwarding, as for any interactive voice stream.
+        int tos = 0xb8;
+        if (peer->ai_family == AF_INET6)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+        else
+            setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+#endif
+        return true;
+    }
+
+    // Wakes for incoming packets and at least every millisecond to flush
+    // whatever capture has queued.
+    void run() {
+        while (running.load(std::memory_order_relaxed)) {
+#if defined(_WIN32)
+            WSAPOLLFD p{fd, POLLRDNORM, 0};
+            WSAPoll(&p, 1, 1);
+#else
+            pollfd p{fd, POLLIN, 0};
+            poll(&p, 1, 1);
+#endif
+            receive();
+            if (rxComfort) comfortNoise();
+            transmit();
+        }
+    }
+
+    // Cuts the next packet out of the queued segments into txAudio, silence
+    // as zeros; false until a whole packet is queued. txVoice is set if any
+    // of it is speech, txLevelDb to the level of its silence.
+    bool nextPacket() {
+        while (txFill < frames) {
+            if (txSegmentLeft == 0) {
+                if (!txSegments.pop(&txSegment, 1)) return false;
+                txSegmentLeft = txSegment.samples;
+            }
+            uint32_t n = std::min(txSegmentLeft, frames - txFill);
+            if (txSegment.silent) {
+                std::fill_n(&txAudio[txFill], n, 0.0f);
+                txLevelDb = txSegment.levelDb;
+            } else {
+                txRing.pop(&txAudio[txFill], n);
+                txVoice = true;
+            }
+            txFill += n;
+            txSegmentLeft -= n;
+        }
+        txFill = 0;
+        return true;
+    }
+
+    void transmit() {
+        for (;;) {
+            int n = 0;
+            while (n < kBatch && nextPacket()) {
+                bool voice = txVoice;
+                txVoice = false;
+                uint8_t* p = &txBuf[size_t(n) * kMaxPacketBytes];
+                RtpHeader h;
+                h.timestamp = txTimestamp;
+                h.ssrc = ssrc;
+                txTimestamp += frames;
+                if (!voice) {
+                    stat.suppressedFrames.fetch_add(frames, std::memory_order_relaxed);
+                    if (!txSilent) {
+                        txSilent = true;
+                        comfortCountdown = 0;
+                    }
+                    if (comfortCountdown == 0) {
+                        h.payloadType = kComfortNoisePayloadType;
+                        h.seq = txSeq++;
+                        size_t len = rtp_write(h, p);
+                        // Noise level in -dBov.
+                        p[len++] = uint8_t(std::min(127.0, std::max(0.0, std::round(-txLevelDb))));
+                        txLen[n++] = len;
+                        stat.comfortSent.fetch_add(1, std::memory_order_relaxed);
+                        comfortCountdown = comfortInterval;
+                    }
+                    comfortCountdown -= std::min(comfortCountdown, frames);
+                    continue;
+                }
+                h.payloadType = codec->payloadType();
+                h.marker = txFirst || txSilent; // start of a talkspurt
+                h.seq = txSeq++;
+                txSilent = false;
+                size_t len = rtp_write(h, p);
+                int bytes = codec->encode(txAudio.data(), p + len, kMaxPacketBytes - len);
+                if (bytes <= 0) {
+                    // Not sent, but seq and timestamp still advance so the
+                    // peer conceals one packet instead of losing sync.
+                    stat.codecErrors.fetch_add(frames, std::memory_order_relaxed);
+                    continue;
+                }
+                txLen[n++] = len + size_t(bytes);
+                txFirst = false;
+            }
+            if (n == 0) return;
+            int sent = sendBatch(n);
+            stat.sent.fetch_add(uint64_t(sent), std::memory_order_relaxed);
+            if (sent < n) {
+                // Socket buffer full: these packets are late already, drop them.
+                stat.txDrops.fetch_add(uint64_t(n - sent) * frames, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    int sendBatch(int n) {
+#if defined(__linux__)
+        mmsghdr msgs[kBatch];
+        iovec iov[kBatch];
+        std::memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < n; ++i) {
+            iov[i].iov_base = &txBuf[size_t(i) * kMaxPacketBytes];
+            iov[i].iov_len = txLen[i];
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int done = 0;
+        while (done < n) {
+            int r = sendmmsg(fd, msgs + done, unsigned(n - done), 0);
+            if (r <= 0) break;
+            done += r;
+        }
+        return done;
+#else
+        int done = 0;
+        for (; done < n; ++done) {
+            const char* p = reinterpret_cast<const char*>(&txBuf[size_t(done) * kMaxPacketBytes]);
+            if (::send(fd, p, int(txLen[done]), 0) < 0) break;
+        }
+        return done;
+#endif
+    }
+
+    void receive() {
+#if defined(__linux__)
+        mmsghdr msgs[kBatch];
+        iovec iov[kBatch];
+        std::memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < kBatch; ++i) {
+            iov[i].iov_base = &rxBuf[size_t(i) * kMaxPacketBytes];
+            iov[i].iov_len = kMaxPacketBytes;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        for (;;) {
+            int got = recvmmsg(fd, msgs, kBatch, MSG_DONTWAIT, nullptr);
+            if (got <= 0) return; // EAGAIN, or ECONNREFUSED while the peer is not up yet
+            for (int i = 0; i < got; ++i)
+                handlePacket(&rxBuf[size_t(i) * kMaxPacketBytes], msgs[i].msg_len);
+            if (got < kBatch) return;
+        }
+#else
+        for (;;) {
+            int got = int(recv(fd, reinterpret_cast<char*>(rxBuf.data()), int(kMaxPacketBytes), 0));
+            if (got < 0) return;
+            handlePacket(rxBuf.data(), size_t(got));
+        }
+#endif
+    }
+
+    void handlePacket(const uint8_t* data, size_t len) {
+        RtpHeader h;
+        const uint8_t* payload;
+        size_t bytes;
+        bool comfort = false;
+        if (!rtp_read(data, len, h, payload, bytes) || bytes == 0 ||
+            (h.payloadType != codec->payloadType() && !(comfort = h.payloadType == kComfortNoisePayloadType))) {
+            stat.invalid.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (!rxSynced || h.ssrc != rxSsrc) {
+            // First packet, or the peer restarted with a new SSRC.
+            rxSsrc = h.ssrc;
+            rxSeq = h.seq;
+            rxTimestamp = h.timestamp;
+            rxSynced = true;
+        }
+        int16_t ahead = int16_t(h.seq - rxSeq);
+        if (ahead < 0) {
+            stat.late.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (ahead > 0) stat.lost.fetch_add(uint64_t(ahead), std::memory_order_relaxed);
+        // Frames between what was delivered and this packet: lost packets,
+        // or the rest of a silence the comfort noise has not covered yet.
+        int32_t gap = int32_t(h.timestamp - rxTimestamp);
+        if (gap > 0 && uint32_t(gap) <= kMaxConcealFrames) {
+            if (rxComfort)
+                deliverNoise(uint32_t(gap));
+            else if (ahead > 0)
+                conceal(uint32_t(gap), comfort ? nullptr : payload, comfort ? 0 : bytes);
+        }
+        rxSeq = uint16_t(h.seq + 1);
+        if (comfort) {
+            // Level updates while silent keep the noise running; the first
+            // descriptor starts it.
+            comfortAmplitude = float(std::pow(10.0, -double(payload[0] & 0x7f) / 20.0) * std::sqrt(3.0));
+            stat.comfortReceived.fetch_add(1, std::memory_order_relaxed);
+            if (!rxComfort || gap > 0) rxTimestamp = h.timestamp;
+            if (!rxComfort) {
+                rxComfort = true;
+                comfortStart = std::chrono::steady_clock::now();
+                comfortFrames = 0;
+            }
+            return;
+        }
+        rxComfort = false;
+        int n = codec->decode(payload, bytes, rxAudio.data(), uint32_t(rxAudio.size()));
+        if (n <= 0) {
+            stat.invalid.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        deliver(rxAudio.data(), uint32_t(n));
+        stat.received.fetch_add(1, std::memory_order_relaxed);
+        rxTimestamp = h.timestamp + uint32_t(n);
+        rxLastFrames = uint32_t(n);
+    }
+
+    // Conceals n frames one sender-sized packet at a time; the last one may
+    // be rebuilt from redundancy in `next`, the packet after the loss.
+    void conceal(uint32_t n, const uint8_t* next, size_t nextBytes) {
+        stat.concealedFrames.fetch_add(n, std::memory_order_relaxed);
+        while (n > 0) {
+            uint32_t chunk = std::min(n, std::min<uint32_t>(rxLastFrames, uint32_t(rxAudio.size())));
+            bool last = chunk == n;
+            codec->conceal(rxAudio.data(), chunk, last ? next : nullptr, last ? nextBytes : 0);
+            deliver(rxAudio.data(), chunk);
+            n -= chunk;
+        }
+    }
+
+    // While the peer is silent: noise at the signalled level, paced by our
+    // clock from the first descriptor. The jitter buffer absorbs the drift
+    // against the sender's clock as usual.
+    void comfortNoise() {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - comfortStart).count();
+        uint64_t due = uint64_t(elapsed * rate);
+        if (due > comfortFrames) {
+            uint32_t n = uint32_t(std::min<uint64_t>(due - comfortFrames, kMaxConcealFrames));
+            deliverNoise(n);
+            comfortFrames = due;
+        }
+    }
+
+    void deliverNoise(uint32_t n) {
+        rxTimestamp += n;
+        while (n > 0) {
+            uint32_t chunk = std::min<uint32_t>(n, uint32_t(rxAudio.size()));
+            for (uint32_t i = 0; i < chunk; ++i) {
+                noiseState = noiseState * 1664525u + 1013904223u;
+                rxAudio[i] = comfortAmplitude * (float(noiseState >> 8) * (2.0f / 16777216.0f) - 1.0f);
+            }
+            deliver(rxAudio.data(), chunk);
+            n -= chunk;
+        }
+    }
+
+    void deliver(const float* audio, uint32_t n) {
+        uint32_t pushed = rxRing->push(audio, n);
+        if (pushed < n) stat.rxDrops.fetch_add(n - pushed, std::memory_order_relaxed);
+    }
+
+    TransportConfig cfg;
+    L16Codec l16;
+    AudioCodec* codec = &l16;
+    double rate = 48000.0;
+    socket_t fd = kNoSocket;
+#if defined(_WIN32)
+    bool wsaStarted = false;
+#endif
+    // Capture thread -> I/O thread: speech samples, and the order of speech
+    // and silence.
+    struct TxSegment {
+        uint32_t samples;
+        float levelDb; // silence only
+        bool silent;   // no samples in txRing
+    };
+    SpscRing<float> txRing;
+    SpscRing<TxSegment> txSegments;
+    SpscRing<float>* rxRing = nullptr; // I/O thread -> jitter buffer
+    std::atomic<bool> running{false};
+    std::thread io;
+    TransportStats stat;
+    uint32_t frames = 0; // per packet
+
+    // I/O thread only.
+    std::vector<float> txAudio, rxAudio, silence;
+    std::vector<uint8_t> txBuf, rxBuf; // kBatch packets each
+    size_t txLen[kBatch] = {};
+    uint32_t ssrc = 0, txTimestamp = 0;
+    uint16_t txSeq = 0;
+    bool txFirst = true;
+    bool rxSynced = false;
+    uint32_t rxSsrc = 0, rxTimestamp = 0;
+    uint32_t rxLastFrames = 0; // size of the peer's last packet
+    TxSegment txSegment{};
+    uint32_t txSegmentLeft = 0, txFill = 0; // samples: of txSegment, in txAudio
+    bool txVoice = false;
+    double txLevelDb = -127.0;
+    bool txSilent = false;
+    uint32_t comfortInterval = 0, comfortCountdown = 0;
+    bool rxComfort = false;
+    float comfortAmplitude = 0.0f;
+    std::chrono::steady_clock::time_point comfortStart;
+    uint64_t comfortFrames = 0;
+    uint32_t noiseState = 22222;
+    uint16_t rxSeq = 0;
+};
+
+} // namespace nuchat
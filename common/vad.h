@@ -0,0 +1,123 @@
+// vad.h
+// Cheap voice activity detector for silence suppression.
+//
+// Two features per block: the energy in the 300-3400 Hz speech band against
+// an adaptive noise floor, and the share of the block's energy that falls in
+// that band (spectral, but without an FFT: one biquad band-pass). Steady
+// hum, hiss and rumble fail the second test even when they are loud. A
+// hangover keeps the detector active through the short pauses inside speech
+// so word endings are not clipped.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "block_dispatch.h"
+
+namespace nuchat {
+
+struct VadConfig {
+    double marginDb = 10.0;     // speech band must exceed the noise floor by this
+    double minLevelDb = -60.0;  // dBFS; anything quieter is silence
+    double minBandRatio = 0.35; // fraction of energy in the speech band
+    double hangoverMs = 200.0;
+    double floorRiseDbPerSec = 1.0;
+};
+
+// One settings line, "<name> <value>", applied to cfg:
+//   vad-margin <dB>  vad-min-level <dBFS>  vad-band-ratio <0-1>  vad-hangover <ms>
+inline bool parse_vad_setting(const char* line, VadConfig& cfg) {
+    static const struct { const char* name; double VadConfig::*field; } names[] = {
+        {"vad-margin", &VadConfig::marginDb},         {"vad-min-level", &VadConfig::minLevelDb},
+        {"vad-band-ratio", &VadConfig::minBandRatio}, {"vad-hangover", &VadConfig::hangoverMs},
+    };
+    while (*line == ' ' || *line == '\t') ++line;
+    for (const auto& n : names) {
+        size_t len = std::strlen(n.name);
+        if (std::strncmp(line, n.name, len) || (line[len] != ' ' && line[len] != '\t')) continue;
+        char* end;
+        double v = std::strtod(line + len, &end);
+        if (end == line + len) return false;
+        cfg.*n.field = v;
+        return true;
+    }
+    return false;
+}
+
+class VoiceActivityDetector {
+public:
+    explicit VoiceActivityDetector(const VadConfig& cfg = VadConfig()) : cfg(cfg) {}
+
+    // Non-realtime.
+    void prepare(double sampleRate) {
+        rate = sampleRate;
+        // RBJ band-pass (constant peak gain) centred on the speech band.
+        const double pi = 3.14159265358979323846;
+        double f0 = std::sqrt(300.0 * 3400.0), q = f0 / (3400.0 - 300.0);
+        double w = 2 * pi * f0 / sampleRate, alpha = std::sin(w) / (2 * q), a0 = 1 + alpha;
+        b0 = float(alpha / a0);
+        a1 = float(-2 * std::cos(w) / a0);
+        a2 = float((1 - alpha) / a0);
+        z1 = z2 = 0.0f;
+        floorDb = cfg.minLevelDb;
+        hangover = 0;
+        active = false;
+    }
+
+    // Classifies one block; returns true while speech (or its hangover) lasts.
+    bool process(const float* x, uint32_t n) {
+        return dispatch_block(n, [&](auto blk) { return process(x, blk); });
+    }
+
+    template <uint32_t N>
+    bool process(const float* x, Block<N> blk) {
+        const uint32_t n = uint32_t(blk.count());
+        if (n == 0) return active;
+        double full = 0.0, band = 0.0;
+        for (uint32_t i = 0; i < n; ++i) {
+            // Transposed direct form II; b1 = 0 and b2 = -b0 for this band-pass.
+            float y = b0 * x[i] + z1;
+            z1 = -a1 * y + z2;
+            z2 = -b0 * x[i] - a2 * y;
+            full += double(x[i]) * x[i];
+            band += double(y) * y;
+        }
+        levelDb = 10.0 * std::log10(full / n + 1e-12);
+        double bandDb = 10.0 * std::log10(band / n + 1e-12);
+
+        // The floor follows quiet blocks down at once and rises slowly, so a
+        // few seconds of speech do not lift it into the speech itself.
+        if (bandDb < floorDb) floorDb = bandDb;
+        else floorDb += cfg.floorRiseDbPerSec * n / rate;
+        floorDb = std::max(floorDb, cfg.minLevelDb - 20.0);
+
+        bool speech = bandDb > floorDb + cfg.marginDb && levelDb > cfg.minLevelDb &&
+                      band > cfg.minBandRatio * full;
+        if (speech) hangover = uint32_t(cfg.hangoverMs * rate / 1000.0);
+        else hangover -= std::min(hangover, n);
+        active = speech || hangover > 0;
+        return active;
+    }
+
+    // Realtime: new thresholds from the next block on; the band-pass and
+    // the noise floor estimate are kept.
+    void setConfig(const VadConfig& c) { cfg = c; }
+
+    bool isActive() const { return active; }
+    // Level of the last block in dBFS, e.g. for comfort-noise descriptors.
+    double lastLevelDb() const { return levelDb; }
+
+private:
+    VadConfig cfg;
+    double rate = 48000.0;
+    float b0 = 0, a1 = 0, a2 = 0, z1 = 0, z2 = 0;
+    double floorDb = -60.0, levelDb = -120.0;
+    uint32_t hangover = 0;
+    bool active = false;
+};
+
+} // namespace nuchat
@@ -0,0 +1,178 @@
+// wav_file.h
+// Minimal RIFF/WAVE support for the offline file backend (and anything else
+// that needs to get audio in or out without a device).
+//
+// parse_wav() works on an image already in memory (typically a mapped file)
+// and points into it rather than copying. WavWriter streams frames through a
+// buffered FILE and patches the chunk sizes on close(); the recorder
+// (call_recorder.h) shares its header layout. Both handle the
+// sample formats the engine converts natively: s16, s32 and f32, any channel
+// count up to kMaxChannels, interleaved.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "format_convert.h"
+
+namespace nuchat {
+
+struct WavData {
+    DeviceFormat format;             // interleaved; sampleRate from the header
+    const uint8_t* samples = nullptr;
+    uint64_t frames = 0;
+};
+
+namespace wav {
+
+inline uint16_t le16(const uint8_t* p) { return uint16_t(p[0] | p[1] << 8); }
+inline uint32_t le32(const uint8_t* p) { return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24; }
+
+inline void put16(uint8_t* p, uint32_t v) { p[0] = uint8_t(v); p[1] = uint8_t(v >> 8); }
+inline void put32(uint8_t* p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static constexpr uint16_t kPcm = 1;
+static constexpr uint16_t kFloat = 3;
+static constexpr uint16_t kExtensible = 0xFFFE;
+
+// Header for `bytes` of interleaved samples in fmt, headerBytes long: 44 for
+// the canonical layout, or more (at least 52) with a JUNK chunk padding the
+// samples out to an aligned offset.
+inline void make_header(uint8_t* h, const DeviceFormat& fmt, uint64_t bytes, uint32_t headerBytes = 44) {
+    uint32_t block = fmt.channels * bytes_per_sample(fmt.sample);
+    uint32_t limit = 0xFFFFFFFFu - headerBytes + 8;
+    uint32_t data = bytes > limit ? limit : uint32_t(bytes);
+    std::memcpy(h, "RIFF", 4);
+    put32(h + 4, headerBytes - 8 + data);
+    std::memcpy(h + 8, "WAVEfmt ", 8);
+    put32(h + 16, 16);
+    put16(h + 20, fmt.sample == SampleFormat::Float32 ? kFloat : kPcm);
+    put16(h + 22, fmt.channels);
+    put32(h + 24, fmt.sampleRate);
+    put32(h + 28, fmt.sampleRate * block);
+    put16(h + 32, block);
+    put16(h + 34, 8 * bytes_per_sample(fmt.sample));
+    uint8_t* d = h + 36;
+    if (headerBytes > 44) {
+        std::memcpy(d, "JUNK", 4);
+        put32(d + 4, headerBytes - 52);
+        std::memset(d + 8, 0, headerBytes - 52);
+        d = h + headerBytes - 8;
+    }
+    std::memcpy(d, "data", 4);
+    put32(d + 4, data);
+}
+
+} // namespace wav
+
+// Parses a WAVE image of `size` bytes. On failure prints why and returns false.
+inline bool parse_wav(const uint8_t* p, size_t size, WavData& out) {
+    if (size < 12 || std::memcmp(p, "RIFF", 4) || std::memcmp(p + 8, "WAVE", 4)) {
+        std::fprintf(stderr, "wav: not a RIFF/WAVE file\n");
+        return false;
+    }
+    bool haveFmt = false;
+    uint16_t tag = 0, channels = 0, bits = 0;
+    uint32_t rate = 0;
+    for (size_t off = 12; off + 8 <= size;) {
+        const uint8_t* chunk = p + off;
+        uint32_t len = wav::le32(chunk + 4);
+        const uint8_t* body = chunk + 8;
+        size_t avail = size - off - 8;
+        if (!std::memcmp(chunk, "fmt ", 4) && len >= 16 && avail >= 16) {
+            tag = wav::le16(body);
+            channels = wav::le16(body + 2);
+            rate = wav::le32(body + 4);
+            bits = wav::le16(body + 14);
+            // WAVE_FORMAT_EXTENSIBLE keeps the real tag at the start of the GUID.
+            if (tag == wav::kExtensible && len >= 40 && avail >= 40) tag = wav::le16(body + 24);
+            haveFmt = true;
+        } else if (!std::memcmp(chunk, "data", 4)) {
+            if (!haveFmt) break;
+            SampleFormat sample;
+            if (tag == wav::kFloat && bits == 32) sample = SampleFormat::Float32;
+            else if (tag == wav::kPcm && bits == 16) sample = SampleFormat::Int16;
+            else if (tag == wav::kPcm && bits == 32) sample = SampleFormat::Int32;
+            else {
+                std::fprintf(stderr, "wav: unsupported encoding (tag %u, %u bits); use s16, s32 or f32\n",
+                             tag, bits);
+                return false;
+            }
+            if (channels == 0 || channels > kMaxChannels || rate == 0) {
+                std::fprintf(stderr, "wav: unsupported layout (%u channels at %u Hz)\n", channels, rate);
+                return false;
+            }
+            // Writers that could not seek leave the size at 0 or ~0: take the rest.
+            uint64_t bytes = len && len <= avail ? len : avail;
+            out.format.sample = sample;
+            out.format.channels = channels;
+            out.format.planar = false;
+            out.format.sampleRate = rate;
+            out.samples = body;
+            out.frames = bytes / (uint64_t(channels) * bytes_per_sample(sample));
+            return true;
+        }
+        off += 8 + size_t(len) + (len & 1);
+    }
+    std::fprintf(stderr, "wav: no %s chunk\n", haveFmt ? "data" : "fmt");
+    return false;
+}
+
+class WavWriter {
+public:
+    WavWriter() = default;
+    ~WavWriter() { close(); }
+
+    WavWriter(const WavWriter&) = delete;
+    WavWriter& operator=(const WavWriter&) = delete;
+
+    // fmt must be interleaved s16, s32 or f32.
+    bool open(const char* path, const DeviceFormat& fmt) {
+        close();
+        if (fmt.planar || fmt.sample == SampleFormat::Int24In32) {
+            std::fprintf(stderr, "wav: cannot write %s%s\n", fmt.planar ? "planar " : "",
+                         sample_format_name(fmt.sample));
+            return false;
+        }
+        file = std::fopen(path, "wb");
+        if (!file) {
+            std::fprintf(stderr, "wav: cannot create %s\n", path);
+            return false;
+        }
+        std::setvbuf(file, nullptr, _IOFBF, 1 << 16);
+        format = fmt;
+        bytes = 0;
+        return writeHeader();
+    }
+
+    // Interleaved frames in the format given to open().
+    void write(const void* data, uint32_t frames) {
+        if (!file) return;
+        size_t n = size_t(frames) * format.channels * bytes_per_sample(format.sample);
+        bytes += std::fwrite(data, 1, n, file);
+    }
+
+    uint64_t frames() const { return bytes / (uint64_t(format.channels) * bytes_per_sample(format.sample)); }
+
+    void close() {
+        if (!file) return;
+        if (std::fseek(file, 0, SEEK_SET) == 0) writeHeader();
+        std::fclose(file);
+        file = nullptr;
+    }
+
+private:
+    bool writeHeader() {
+        uint8_t h[44];
+        wav::make_header(h, format, bytes);
+        return std::fwrite(h, 1, sizeof(h), file) == sizeof(h);
+    }
+
+    FILE* file = nullptr;
+    DeviceFormat format;
+    uint64_t bytes = 0;
+};
+
+} // namespace nuchat
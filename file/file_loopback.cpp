@@ -0,0 +1,459 @@
+// file_loopback.cpp
+// Offline backend: the same engine, FIFO and DSP path as the device
+// backends, with a file instead of a sound card.
+//
+// Build: cmake -S .. -B build && cmake --build build --target file_voice_loopback
+// Run:   ./file_voice_loopback input.wav [-o output.wav] [--out-rate 44100]
+//        [--raw s16|s32|f32 --raw-rate 48000 --raw-channels 1]
+//        [--period 128] [--period-jitter 0] [--late-ms 0] [--paced] [--seed 1]
+//        [--streams 1] [--jitter-ms 5.3] [--no-aec] [--no-vad] [--metrics json|prom]
+//        [--workers CORE[,CORE...]]
+//
+// Capture reads the memory-mapped input (WAV, or headerless samples with
+// --raw) in its own layout and rate, so the engine's converters and
+// resamplers run exactly as they would behind a device. Render output goes
+// to -o as a WAV in the input's layout, at --out-rate if given.
+//
+// Both streams are driven from one thread by a virtual device clock: each
+// callback is due when its last frame would have been captured or played,
+// and the earlier of the two runs next. By default callbacks run back to
+// back, as fast as the pipeline allows; --paced sleeps until each is due.
+//   --period N          device frames per callback
+//   --period-jitter K   each callback is N +- K frames (like Oboe, CoreAudio)
+//   --late-ms J         each callback fires up to J ms after it is due
+// The variation comes from a fixed-seed generator (--seed), so a run is
+// bit-for-bit repeatable on every platform.
+//
+// --streams N runs N independent engines on N threads over the same input
+// (only the first writes -o) and reports throughput as streams per core:
+// seconds of audio per CPU second of each stream's thread. --metrics prints
+// the first stream's FIFO, underflow and callback counters at the end.
+//
+// --workers 2,3 hands each stream's capture DSP to a realtime worker pinned
+// to one of those cores (stream s on worker s mod N), as the device
+// backends do. Capture then completes asynchronously: output is only
+// guaranteed repeatable with --paced, which is also the only mode in which
+// the deadline counters mean anything. CPU per stream excludes the workers.
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h> // before windows.h, which would pull in winsock 1
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../common/audio_engine.h"
+#include "../common/echo_canceller.h"
+#include "../common/processing_graph.h"
+#include "../common/shutdown.h"
+#include "../common/stream_metrics.h"
+#include "../common/wav_file.h"
+
+static const unsigned int SAMPLE_RATE = 48000;
+static const unsigned int CHANNELS = 1;
+static const uint32_t PERIOD_FRAMES = 128;
+
+// Read-only mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char* path) {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER len;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &len) || len.QuadPart == 0)
+            return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return false;
+        base = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        length = size_t(len.QuadPart);
+#else
+        fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+            return false;
+        void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) return false;
+        madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+        base = static_cast<const uint8_t*>(p);
+        length = size_t(st.st_size);
+#endif
+        return base != nullptr;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base) munmap(const_cast<uint8_t*>(base), length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    const uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    const uint8_t* base = nullptr;
+    size_t length = 0;
+};
+
+static double thread_cpu_seconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user);
+    auto ticks = [](const FILETIME& t) { return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return double(ticks(kernel) + ticks(user)) * 1e-7;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+#endif
+}
+
+// splitmix64: tiny, and unlike <random> distributions the same everywhere.
+class Variation {
+public:
+    explicit Variation(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() { return double(next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    // Uniform in [-k, k].
+    int32_t spread(uint32_t k) { return k ? int32_t(next() % (2 * uint64_t(k) + 1)) - int32_t(k) : 0; }
+
+private:
+    uint64_t state;
+};
+
+struct FileStreamConfig {
+    uint32_t period = PERIOD_FRAMES; // device frames per callback
+    uint32_t periodJitter = 0;       // +- frames per callback
+    double lateMs = 0.0;             // a callback fires up to this late
+    bool paced = false;
+    uint64_t seed = 1;
+};
+
+class FileEngine : public nuchat::AudioEngine {
+public:
+    FileEngine(const nuchat::WavData& input, const nuchat::DeviceFormat& output,
+               const FileStreamConfig& cfg, nuchat::WavWriter* writer)
+        : input(input), output(output), cfg(cfg), writer(writer) {}
+
+    const char* name() const override { return cfg.paced ? "file-paced" : "file"; }
+
+    bool start(const nuchat::AudioFormat& want) override {
+        uint32_t maxPeriod = cfg.period + cfg.periodJitter;
+        nuchat::AudioFormat granted = want;
+        granted.channels = 1;
+        granted.framesPerPeriod = std::max<uint32_t>(1, uint32_t(uint64_t(cfg.period) * uint32_t(want.sampleRate) /
+                                                                 input.format.sampleRate));
+        setDeviceFormats(input.format, output);
+        prepare(granted, maxPeriod);
+        size_t outBytes = size_t(maxPeriod) * output.channels * nuchat::bytes_per_sample(output.sample);
+        renderBuf.assign((outBytes + sizeof(float) - 1) / sizeof(float), 0.0f);
+        running = true;
+        done = false;
+        thread = std::thread(&FileEngine::run, this);
+        return true;
+    }
+
+    void stop() override {
+        running = false;
+        if (thread.joinable()) thread.join();
+    }
+
+    bool finished() const { return done; }
+    double wallSeconds() const { return wall; }
+    double cpuSeconds() const { return cpu; }
+
+private:
+    // One direction of the virtual device.
+    struct Clock {
+        double rate;
+        uint64_t pos = 0, end;
+        uint32_t next = 0; // size of the pending callback
+        double due = 0.0;  // seconds since start at which it fires
+    };
+
+    void schedule(Clock& c, Variation& v) {
+        int64_t n = int64_t(cfg.period) + v.spread(cfg.periodJitter);
+        c.next = uint32_t(std::min<int64_t>(std::max<int64_t>(n, 1), int64_t(c.end - c.pos)));
+        c.due = double(c.pos + c.next) / c.rate + v.uniform() * cfg.lateMs / 1000.0;
+    }
+
+    void run() {
+        const uint32_t inFrameBytes = input.format.channels * nuchat::bytes_per_sample(input.format.sample);
+        Clock cap{double(input.format.sampleRate), 0, input.frames};
+        Clock ren{double(output.sampleRate), 0, input.frames * output.sampleRate / input.format.sampleRate};
+        Variation capVar(cfg.seed), renVar(cfg.seed ^ 0xA5A5A5A5A5A5A5A5ull);
+        if (cap.end) schedule(cap, capVar);
+        if (ren.end) schedule(ren, renVar);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        // Virtual device timestamps: capture frame pos is sampled at
+        // pos / rate, render frame pos plays one period of device buffer
+        // after it is due.
+        const uint64_t t0ns = nuchat::host_now_ns();
+        const double cpu0 = thread_cpu_seconds();
+        while (running && (cap.pos < cap.end || ren.pos < ren.end)) {
+            // Capture wins ties, as a device delivers input before asking for output.
+            bool capture = cap.pos < cap.end && (ren.pos >= ren.end || cap.due <= ren.due);
+            Clock& c = capture ? cap : ren;
+            if (cfg.paced)
+                std::this_thread::sleep_until(t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                       std::chrono::duration<double>(c.due)));
+            if (capture) {
+                const void* bufs[1] = {input.samples + size_t(cap.pos) * inFrameBytes};
+                noteCapturePosition(cap.pos, cap.next);
+                noteCaptureTime(t0ns + nuchat::frames_to_ns(double(cap.pos), cap.rate));
+                onCaptureDevice(bufs, cap.next);
+            } else {
+                void* bufs[1] = {renderBuf.data()};
+                noteRenderTime(t0ns + nuchat::frames_to_ns(double(ren.pos + cfg.period), ren.rate));
+                onRenderDevice(bufs, ren.next);
+                if (writer) writer->write(renderBuf.data(), ren.next);
+            }
+            c.pos += c.next;
+            if (c.pos < c.end) schedule(c, capture ? capVar : renVar);
+        }
+        cpu = thread_cpu_seconds() - cpu0;
+        wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        done = true;
+    }
+
+    nuchat::WavData input;
+    nuchat::DeviceFormat output;
+    FileStreamConfig cfg;
+    nuchat::WavWriter* writer;
+    std::vector<float> renderBuf; // device-format render period
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<bool> done{false};
+    double wall = 0.0, cpu = 0.0;
+};
+
+// One engine with its own DSP chain.
+struct Session {
+    Session(const nuchat::WavData& input, const nuchat::DeviceFormat& output, const FileStreamConfig& cfg,
+            nuchat::WavWriter* writer)
+        : engine(input, output, cfg, writer) {}
+    FileEngine engine;
+    nuchat::ProcessingGraph graph;
+    nuchat::EchoCanceller aec;
+};
+
+static bool parse_sample_format(const char* s, nuchat::SampleFormat& f) {
+    if (!std::strcmp(s, "s16")) f = nuchat::SampleFormat::Int16;
+    else if (!std::strcmp(s, "s32")) f = nuchat::SampleFormat::Int32;
+    else if (!std::strcmp(s, "f32")) f = nuchat::SampleFormat::Float32;
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* inputPath = nullptr;
+    const char* outputPath = nullptr;
+    const char* rawFormat = nullptr;
+    uint32_t rawRate = SAMPLE_RATE, rawChannels = 1, outRate = 0, streams = 1;
+    double jitterMs = 0.0;
+    const char* metricsFormat = nullptr;
+    bool echoCancel = true;
+    bool suppressSilence = true;
+    std::unique_ptr<nuchat::RtWorkerPool> workers; // outlives the sessions
+    FileStreamConfig cfg;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-o") && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (!std::strcmp(argv[i], "--out-rate") && i + 1 < argc)
+            outRate = static_cast<uint32_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--raw") && i + 1 < argc)
+            rawFormat = argv[++i];
+        else if (!std::strcmp(argv[i], "--raw-rate") && i + 1 < argc)
+            rawRate = static_cast<uint32_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--raw-channels") && i + 1 < argc)
+            rawChannels = static_cast<uint32_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--period") && i + 1 < argc)
+            cfg.period = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+        else if (!std::strcmp(argv[i], "--period-jitter") && i + 1 < argc)
+            cfg.periodJitter = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+        else if (!std::strcmp(argv[i], "--late-ms") && i + 1 < argc)
+            cfg.lateMs = std::max(0.0, std::atof(argv[++i]));
+        else if (!std::strcmp(argv[i], "--paced"))
+            cfg.paced = true;
+        else if (!std::strcmp(argv[i], "--seed") && i + 1 < argc)
+            cfg.seed = std::strtoull(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--streams") && i + 1 < argc)
+            streams = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+        else if (!std::strcmp(argv[i], "--jitter-ms") && i + 1 < argc)
+            jitterMs = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--no-aec"))
+            echoCancel = false;
+        else if (!std::strcmp(argv[i], "--no-vad"))
+            suppressSilence = false;
+        else if (!std::strcmp(argv[i], "--metrics") && i + 1 < argc)
+            metricsFormat = argv[++i];
+        else if (!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+            nuchat::RtWorkerConfig wc;
+            if (!nuchat::parse_core_list(argv[++i], wc.cores)) {
+                std::cerr << "Bad core list '" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+            wc.workers = static_cast<uint32_t>(wc.cores.size());
+            workers = std::make_unique<nuchat::RtWorkerPool>(wc);
+        }
+        else if (argv[i][0] != '-' && !inputPath)
+            inputPath = argv[i];
+        else {
+            std::cerr << "Unknown option " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+    if (!inputPath) {
+        std::cerr << "usage: " << argv[0] << " input.wav [-o output.wav] [options]" << std::endl;
+        return 1;
+    }
+
+    MappedFile file;
+    if (!file.open(inputPath)) {
+        std::cerr << "Cannot map " << inputPath << std::endl;
+        return 1;
+    }
+    nuchat::WavData input;
+    if (rawFormat) {
+        if (!parse_sample_format(rawFormat, input.format.sample) || rawChannels == 0 ||
+            rawChannels > nuchat::kMaxChannels || rawRate == 0) {
+            std::cerr << "--raw needs s16|s32|f32, a rate and 1-" << nuchat::kMaxChannels << " channels"
+                      << std::endl;
+            return 1;
+        }
+        input.format.channels = rawChannels;
+        input.format.sampleRate = rawRate;
+        input.samples = file.data();
+        input.frames = file.size() / (rawChannels * nuchat::bytes_per_sample(input.format.sample));
+    } else if (!nuchat::parse_wav(file.data(), file.size(), input)) {
+        return 1;
+    }
+    // The converters read whole samples; a data chunk at an odd offset
+    // is copied out rather than read unaligned.
+    std::vector<float> aligned;
+    if (reinterpret_cast<uintptr_t>(input.samples) % nuchat::bytes_per_sample(input.format.sample)) {
+        size_t bytes = size_t(input.frames) * input.format.channels * nuchat::bytes_per_sample(input.format.sample);
+        aligned.resize((bytes + sizeof(float) - 1) / sizeof(float));
+        std::memcpy(aligned.data(), input.samples, bytes);
+        input.samples = reinterpret_cast<const uint8_t*>(aligned.data());
+    }
+
+    nuchat::DeviceFormat output = input.format;
+    if (outRate) output.sampleRate = outRate;
+    nuchat::WavWriter writer;
+    if (outputPath && !writer.open(outputPath, output))
+        return 1;
+
+    nuchat::AudioFormat want;
+    want.sampleRate = SAMPLE_RATE;
+    want.channels = CHANNELS;
+    want.framesPerPeriod = cfg.period;
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    for (uint32_t s = 0; s < streams; ++s) {
+        FileStreamConfig sc = cfg;
+        sc.seed = cfg.seed + s;
+        sessions.push_back(std::make_unique<Session>(input, output, sc, s == 0 && outputPath ? &writer : nullptr));
+        Session& session = *sessions.back();
+        if (jitterMs > 0) session.engine.setJitterTargetMs(jitterMs);
+        if (echoCancel) session.engine.setEchoCanceller(&session.aec);
+        session.engine.setSilenceSuppression(suppressSilence);
+        if (workers) session.engine.setWorkerPool(workers.get(), s % workers->size());
+        // Plain loopback; DSP stages are added to the graph here.
+        session.engine.setProcessor(&session.graph);
+    }
+    double audioSeconds = double(input.frames) / input.format.sampleRate;
+    std::cout << "Processing " << audioSeconds << " s of " << nuchat::sample_format_name(input.format.sample)
+              << " x" << input.format.channels << " at " << input.format.sampleRate << " Hz, " << streams
+              << " stream(s), " << cfg.period << "+-" << cfg.periodJitter << "-frame callbacks"
+              << (cfg.paced ? ", paced" : "") << "..." << std::endl;
+    for (auto& s : sessions) {
+        if (!s->engine.start(want))
+            return 1;
+    }
+
+    // Ctrl+C ends a long --paced run early, with a valid (shorter) output.
+    nuchat::install_stop_handlers();
+    for (auto& s : sessions) {
+        while (!s->engine.finished() && !nuchat::stop_requested())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        s->engine.stop();
+    }
+    writer.close();
+
+    double wall = 0.0, cpu = 0.0;
+    for (auto& s : sessions) {
+        wall = std::max(wall, s->engine.wallSeconds());
+        cpu += s->engine.cpuSeconds();
+    }
+    cpu /= streams;
+    // Interrupted: rate what the first stream got through instead.
+    if (nuchat::stop_requested())
+        audioSeconds = sessions.front()->engine.captureMetrics().totalFrames() / double(SAMPLE_RATE);
+    std::printf("%.3f s wall, %.1fx realtime per stream; %.3f s CPU per stream, %.1f streams per core\n", wall,
+                wall > 0 ? audioSeconds / wall : 0.0, cpu, cpu > 0 ? audioSeconds / cpu : 0.0);
+
+    FileEngine& first = sessions.front()->engine;
+    if (metricsFormat) {
+        nuchat::MetricsExporter exporter;
+        exporter.add(&first.captureMetrics());
+        exporter.add(&first.renderMetrics());
+        std::fputs(exporter.render(std::strcmp(metricsFormat, "prom") ? nuchat::MetricsFormat::Json
+                                                                      : nuchat::MetricsFormat::Prometheus)
+                       .c_str(),
+                   stdout);
+    }
+    first.report(stderr);
+    if (echoCancel)
+        sessions.front()->aec.report(stderr);
+    if (workers)
+        workers->report(stderr);
+    return 0;
+}
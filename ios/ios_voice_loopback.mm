@@ -1,145 +1,350 @@
 // ios_voice_loopback.mm
 // Minimal low-latency VoiceProcessingIO example for iOS.
 // Compile inside an iOS app target (e.g., ViewController.mm).
+//
+// MeasureVoiceLoopbackLatency() blocks while it runs; call it off the main
+// queue. VoiceLoopbackMetrics() returns a JSON snapshot of the stream counters.
+// SetVoiceLoopbackWorkers(n) before starting moves capture DSP onto n
+// realtime workers that join the unit's audio workgroup (iOS 14 and later).
 
 #import <AVFoundation/AVFoundation.h>
 #import <AudioToolbox/AudioToolbox.h>
 #import <atomic>
 #import <vector>
+#import <memory>
+#import <thread>
+
+#include "../common/audio_engine.h"
+#include "../common/audio_workgroup.h"
+#include "../common/latency_probe.h"
+#include "../common/processing_graph.h"
+#include "../common/stream_metrics.h"
 
-static AudioUnit gAudioUnit = nullptr;
 static const Float64 kSampleRate = 48000.0;
 static const UInt32 kChannels = 1;
 static const UInt32 kFramesPerBuffer = 128;
+static const UInt32 kMaxFramesPerSlice = 4096; // covers the screen-locked slice size
+
+class IosVpioEngine : public nuchat::AudioEngine
+{
+public:
+    IosVpioEngine() : nuchat::AudioEngine(1 << 15) {}
+
+    bool bypassVoiceProcessing = false;
+
+    const char *name() const override { return "ios-vpio"; }
+
+    bool start(const nuchat::AudioFormat &want) override
+    {
+        // 1. Configure AVAudioSession
+        AVAudioSession *session = [AVAudioSession sharedInstance];
+        [session setCategory:AVAudioSessionCategoryPlayAndRecord
+                 withOptions:AVAudioSessionCategoryOptionDefaultToSpeaker
+                       error:nil];
+        [session setMode:AVAudioSessionModeVoiceChat error:nil];
+        [session setPreferredSampleRate:want.sampleRate error:nil];
+        [session setPreferredIOBufferDuration:want.framesPerPeriod / want.sampleRate error:nil];
+        [session setActive:YES error:nil];
+
+        // 2. Create and configure the AudioUnit
+        AudioComponentDescription desc = {
+            kAudioUnitType_Output,
+            kAudioUnitSubType_VoiceProcessingIO,
+            kAudioUnitManufacturer_Apple,
+            0, 0
+        };
+        AudioComponent comp = AudioComponentFindNext(NULL, &desc);
+        if (!comp || AudioComponentInstanceNew(comp, &audioUnit) != noErr)
+            return false;
+
+        UInt32 enable = 1;
+        AudioUnitSetProperty(audioUnit, kAudioOutputUnitProperty_EnableIO,
+                             kAudioUnitScope_Input, 1, &enable, sizeof(enable));
+        AudioUnitSetProperty(audioUnit, kAudioOutputUnitProperty_EnableIO,
+                             kAudioUnitScope_Output, 0, &enable, sizeof(enable));
+
+        // The session may not grant the preferred rate (Bluetooth HFP runs
+        // at 16k); the client formats follow whatever it did grant.
+        setClientRate(session.sampleRate);
+
+        if (bypassVoiceProcessing) {
+            UInt32 bypass = 1;
+            AudioUnitSetProperty(audioUnit, kAUVoiceIOProperty_BypassVoiceProcessing,
+                                 kAudioUnitScope_Global, 0, &bypass, sizeof(bypass));
+        }
+
+        // 3. Register callbacks
+        AURenderCallbackStruct inCb = { InputCallback, this };
+        AudioUnitSetProperty(audioUnit, kAudioOutputUnitProperty_SetInputCallback,
+                             kAudioUnitScope_Global, 0, &inCb, sizeof(inCb));
+        AURenderCallbackStruct outCb = { RenderCallback, this };
+        AudioUnitSetProperty(audioUnit, kAudioUnitProperty_SetRenderCallback,
+                             kAudioUnitScope_Input, 0, &outCb, sizeof(outCb));
+
+        // 4. Initialize and start
+        UInt32 maxFrames = kMaxFramesPerSlice;
+        AudioUnitSetProperty(audioUnit, kAudioUnitProperty_MaximumFramesPerSlice,
+                             kAudioUnitScope_Global, 0, &maxFrames, sizeof(maxFrames));
+        AudioUnitInitialize(audioUnit);
+        joinWorkgroup();
+        granted = want;
+        granted.channels = kChannels;
+        prepareAtRate(session.sampleRate);
+        AudioOutputUnitStart(audioUnit);
+
+        // Route changes can raise the slice size; resize off the IO thread.
+        routeObserver = [[NSNotificationCenter defaultCenter]
+            addObserverForName:AVAudioSessionRouteChangeNotification
+                        object:nil
+                         queue:[NSOperationQueue mainQueue]
+                    usingBlock:^(NSNotification *) { this->onRouteChange(); }];
+
+        NSLog(@"VoiceProcessingIO started: low-latency loopback running");
+        return true;
+    }
+
+    void stop() override
+    {
+        if (routeObserver) {
+            [[NSNotificationCenter defaultCenter] removeObserver:routeObserver];
+            routeObserver = nil;
+        }
+        if (audioUnit) {
+            AudioOutputUnitStop(audioUnit);
+            AudioUnitUninitialize(audioUnit);
+            AudioComponentInstanceDispose(audioUnit);
+            audioUnit = nullptr;
+        }
+    }
+
+private:
+    static OSStatus InputCallback(void *inRefCon,
+                                  AudioUnitRenderActionFlags *ioActionFlags,
+                                  const AudioTimeStamp *inTimeStamp,
+                                  UInt32 inBusNumber,
+                                  UInt32 inNumberFrames,
+                                  AudioBufferList *ioData)
+    {
+        IosVpioEngine *self = static_cast<IosVpioEngine *>(inRefCon);
+        if (inNumberFrames * kChannels > self->inputScratch.size()) {
+            self->capMetrics.addXrun();
+            return kAudioUnitErr_TooManyFramesToProcess;
+        }
+        AudioBufferList abl;
+        abl.mNumberBuffers = 1;
+        abl.mBuffers[0].mData = self->inputScratch.data();
+        abl.mBuffers[0].mDataByteSize = inNumberFrames * kChannels * sizeof(float);
+        abl.mBuffers[0].mNumberChannels = kChannels;
+
+        OSStatus status = AudioUnitRender(self->audioUnit, ioActionFlags,
+                                          inTimeStamp, 1, inNumberFrames, &abl);
+        if (status != noErr)
+            self->capMetrics.addXrun();
+        else
+        {
+            if (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid)
+                self->noteCapturePosition((uint64_t)inTimeStamp->mSampleTime, inNumberFrames);
+            if (inTimeStamp->mFlags & kAudioTimeStampHostTimeValid)
+                self->noteCaptureTime(nuchat::host_ns_from_mach(inTimeStamp->mHostTime) -
+                                      self->inLatencyNs.load(std::memory_order_relaxed));
+            const void *bufs[1] = { self->inputScratch.data() };
+            self->onCaptureDevice(bufs, inNumberFrames);
+        }
+        return status;
+    }
+
+    static OSStatus RenderCallback(void *inRefCon,
+                                   AudioUnitRenderActionFlags *ioActionFlags,
+                                   const AudioTimeStamp *inTimeStamp,
+                                   UInt32 inBusNumber,
+                                   UInt32 inNumberFrames,
+                                   AudioBufferList *ioData)
+    {
+        IosVpioEngine *self = static_cast<IosVpioEngine *>(inRefCon);
+        if (inTimeStamp->mFlags & kAudioTimeStampHostTimeValid)
+            self->noteRenderTime(nuchat::host_ns_from_mach(inTimeStamp->mHostTime) +
+                                 self->outLatencyNs.load(std::memory_order_relaxed));
+        void *bufs[1] = { ioData->mBuffers[0].mData };
+        self->onRenderDevice(bufs, inNumberFrames);
+        return noErr;
+    }
 
-struct FloatFIFO {
-    std::vector<float> buf;
-    std::atomic<uint32_t> w{0}, r{0};
-    uint32_t mask;
-    FloatFIFO(uint32_t sz) {
-        uint32_t p = 1; while (p < sz) p <<= 1;
-        buf.resize(p);
-        mask = p - 1;
+    // Client formats on both sides of the unit, at the session's hardware
+    // rate so the unit does no rate conversion; AudioEngine resamples to the
+    // processing rate. Only while the unit is uninitialized.
+    void setClientRate(Float64 rate)
+    {
+        AudioStreamBasicDescription asbd = {0};
+        asbd.mSampleRate       = rate;
+        asbd.mFormatID         = kAudioFormatLinearPCM;
+        asbd.mFormatFlags      = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+        asbd.mChannelsPerFrame = kChannels;
+        asbd.mBitsPerChannel   = 32;
+        asbd.mBytesPerFrame    = 4;
+        asbd.mFramesPerPacket  = 1;
+        asbd.mBytesPerPacket   = 4;
+
+        AudioUnitSetProperty(audioUnit, kAudioUnitProperty_StreamFormat,
+                             kAudioUnitScope_Output, 1, &asbd, sizeof(asbd));
+        AudioUnitSetProperty(audioUnit, kAudioUnitProperty_StreamFormat,
+                             kAudioUnitScope_Input, 0, &asbd, sizeof(asbd));
+    }
+
+    void prepareAtRate(Float64 rate)
+    {
+        deviceRate = rate;
+        nuchat::DeviceFormat dev{nuchat::SampleFormat::Float32, kChannels, false, (uint32_t)rate};
+        setDeviceFormats(dev, dev);
+        prepare(granted, sizeInputScratch());
+        readRouteLatency();
     }
-    void push(const float* src, uint32_t n) {
-        uint32_t wi = w.load(); uint32_t ri = r.load();
-        uint32_t free = ((mask + 1) - (wi - ri)) & mask;
-        if (n > free) n = free;
-        for (uint32_t i = 0; i < n; ++i)
-            buf[(wi + i) & mask] = src[i];
-        w.store((wi + n) & mask);
+
+    // The session's input and output latency for the current route; the IO
+    // thread adds them to the units' host timestamps.
+    void readRouteLatency()
+    {
+        AVAudioSession *session = [AVAudioSession sharedInstance];
+        inLatencyNs.store(uint64_t(session.inputLatency * 1e9), std::memory_order_relaxed);
+        outLatencyNs.store(uint64_t(session.outputLatency * 1e9), std::memory_order_relaxed);
+    }
+
+    // Helper threads join the IO thread's workgroup, which may change each
+    // time the unit is initialized; the IO thread is a member already.
+    void joinWorkgroup()
+    {
+        if (nuchat::RtWorkerPool *pool = workerPool())
+            nuchat::join_io_workgroup(*pool, audioUnit,
+                                      [AVAudioSession sharedInstance].IOBufferDuration * 1000.0);
     }
-    void pop(float* dst, uint32_t n) {
-        uint32_t wi = w.load(); uint32_t ri = r.load();
-        uint32_t avail = (wi - ri) & mask;
-        uint32_t got = n < avail ? n : avail;
-        for (uint32_t i = 0; i < got; ++i)
-            dst[i] = buf[(ri + i) & mask];
-        r.store((ri + got) & mask);
-        if (got < n)
-            memset(dst + got, 0, (n - got) * sizeof(float));
+
+    // Sizes the input render buffer from the unit's MaximumFramesPerSlice.
+    // Only while the unit is stopped. Returns the slice size.
+    UInt32 sizeInputScratch()
+    {
+        UInt32 maxFrames = 0, size = sizeof(maxFrames);
+        if (AudioUnitGetProperty(audioUnit, kAudioUnitProperty_MaximumFramesPerSlice,
+                                 kAudioUnitScope_Global, 0, &maxFrames, &size) != noErr || maxFrames == 0)
+            maxFrames = kMaxFramesPerSlice;
+        inputScratch.assign(maxFrames * kChannels, 0.0f);
+        return maxFrames;
+    }
+
+    // After a route change: only the device-side conversion follows the new
+    // rate; FIFO, jitter buffer and DSP state carry over.
+    void reopenAtRate(Float64 rate)
+    {
+        deviceRate = rate;
+        nuchat::DeviceFormat dev{nuchat::SampleFormat::Float32, kChannels, false, (uint32_t)rate};
+        sizeInputScratch();
+        reopenCapture(dev);
+        reopenRender(dev);
+    }
+
+    // Main queue. Stops the unit around the resize so the IO thread never
+    // sees the buffer change underneath it. A new hardware rate (e.g. a
+    // Bluetooth headset) reconfigures the unit and the resamplers.
+    void onRouteChange()
+    {
+        if (!audioUnit)
+            return;
+        readRouteLatency();
+        Float64 rate = [AVAudioSession sharedInstance].sampleRate;
+        if (rate != deviceRate) {
+            AudioOutputUnitStop(audioUnit);
+            AudioUnitUninitialize(audioUnit);
+            setClientRate(rate);
+            AudioUnitInitialize(audioUnit);
+            joinWorkgroup();
+            reopenAtRate(rate);
+            AudioOutputUnitStart(audioUnit);
+            NSLog(@"VoiceProcessingIO: hardware rate now %.0f Hz", rate);
+            return;
+        }
+        UInt32 maxFrames = 0, size = sizeof(maxFrames);
+        AudioUnitGetProperty(audioUnit, kAudioUnitProperty_MaximumFramesPerSlice,
+                             kAudioUnitScope_Global, 0, &maxFrames, &size);
+        if (maxFrames * kChannels <= inputScratch.size())
+            return;
+        AudioOutputUnitStop(audioUnit);
+        sizeInputScratch();
+        AudioOutputUnitStart(audioUnit);
+        NSLog(@"VoiceProcessingIO: input buffer resized to %u frames", (unsigned)maxFrames);
     }
+
+    AudioUnit audioUnit = nullptr;
+    nuchat::AudioFormat granted;
+    Float64 deviceRate = 0;
+    std::vector<float> inputScratch; // sized from MaximumFramesPerSlice
+    std::atomic<uint64_t> inLatencyNs{0}, outLatencyNs{0}; // route changes update them while running
+    id routeObserver = nil;
 };
 
-static FloatFIFO gFifo(1 << 15);
+static std::unique_ptr<nuchat::RtWorkerPool> gWorkers; // outlives gEngine
+static IosVpioEngine gEngine;
+static nuchat::ProcessingGraph gGraph; // plain loopback; DSP stages are added here
 
-static OSStatus InputCallback(void *inRefCon,
-                              AudioUnitRenderActionFlags *ioActionFlags,
-                              const AudioTimeStamp *inTimeStamp,
-                              UInt32 inBusNumber,
-                              UInt32 inNumberFrames,
-                              AudioBufferList *ioData)
+static nuchat::AudioFormat default_format()
 {
-    AudioBufferList abl;
-    float buf[kFramesPerBuffer];
-    abl.mNumberBuffers = 1;
-    abl.mBuffers[0].mData = buf;
-    abl.mBuffers[0].mDataByteSize = inNumberFrames * sizeof(float);
-    abl.mBuffers[0].mNumberChannels = 1;
-
-    OSStatus status = AudioUnitRender(gAudioUnit, ioActionFlags,
-                                      inTimeStamp, 1, inNumberFrames, &abl);
-    if (status == noErr)
-        gFifo.push(buf, inNumberFrames);
-    return status;
+    nuchat::AudioFormat fmt;
+    fmt.sampleRate = kSampleRate;
+    fmt.channels = kChannels;
+    fmt.framesPerPeriod = kFramesPerBuffer;
+    return fmt;
 }
 
-static OSStatus RenderCallback(void *inRefCon,
-                               AudioUnitRenderActionFlags *ioActionFlags,
-                               const AudioTimeStamp *inTimeStamp,
-                               UInt32 inBusNumber,
-                               UInt32 inNumberFrames,
-                               AudioBufferList *ioData)
+void StartVoiceLoopback()
 {
-    float *out = (float*)ioData->mBuffers[0].mData;
-    gFifo.pop(out, inNumberFrames);
-    return noErr;
+    gEngine.setProcessor(&gGraph);
+    gEngine.start(default_format());
 }
 
-void StartVoiceLoopback()
+void StopVoiceLoopback()
 {
-    // 1. Configure AVAudioSession
-    AVAudioSession *session = [AVAudioSession sharedInstance];
-    [session setCategory:AVAudioSessionCategoryPlayAndRecord
-             withOptions:AVAudioSessionCategoryOptionDefaultToSpeaker
-                   error:nil];
-    [session setMode:AVAudioSessionModeVoiceChat error:nil];
-    [session setPreferredSampleRate:kSampleRate error:nil];
-    [session setPreferredIOBufferDuration:0.0027 error:nil];
-    [session setActive:YES error:nil];
-
-    // 2. Create and configure the AudioUnit
-    AudioComponentDescription desc = {
-        kAudioUnitType_Output,
-        kAudioUnitSubType_VoiceProcessingIO,
-        kAudioUnitManufacturer_Apple,
-        0, 0
-    };
-    AudioComponent comp = AudioComponentFindNext(NULL, &desc);
-    AudioComponentInstanceNew(comp, &gAudioUnit);
-
-    UInt32 enable = 1;
-    AudioUnitSetProperty(gAudioUnit, kAudioOutputUnitProperty_EnableIO,
-                         kAudioUnitScope_Input, 1, &enable, sizeof(enable));
-    AudioUnitSetProperty(gAudioUnit, kAudioOutputUnitProperty_EnableIO,
-                         kAudioUnitScope_Output, 0, &enable, sizeof(enable));
-
-    AudioStreamBasicDescription asbd = {0};
-    asbd.mSampleRate       = kSampleRate;
-    asbd.mFormatID         = kAudioFormatLinearPCM;
-    asbd.mFormatFlags      = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
-    asbd.mChannelsPerFrame = kChannels;
-    asbd.mBitsPerChannel   = 32;
-    asbd.mBytesPerFrame    = 4;
-    asbd.mFramesPerPacket  = 1;
-    asbd.mBytesPerPacket   = 4;
-
-    AudioUnitSetProperty(gAudioUnit, kAudioUnitProperty_StreamFormat,
-                         kAudioUnitScope_Output, 1, &asbd, sizeof(asbd));
-    AudioUnitSetProperty(gAudioUnit, kAudioUnitProperty_StreamFormat,
-                         kAudioUnitScope_Input, 0, &asbd, sizeof(asbd));
-
-    // 3. Register callbacks
-    AURenderCallbackStruct inCb = { InputCallback, nullptr };
-    AudioUnitSetProperty(gAudioUnit, kAudioOutputUnitProperty_SetInputCallback,
-                         kAudioUnitScope_Global, 0, &inCb, sizeof(inCb));
-    AURenderCallbackStruct outCb = { RenderCallback, nullptr };
-    AudioUnitSetProperty(gAudioUnit, kAudioUnitProperty_SetRenderCallback,
-                         kAudioUnitScope_Input, 0, &outCb, sizeof(outCb));
-
-    // 4. Initialize and start
-    AudioUnitInitialize(gAudioUnit);
-    AudioOutputUnitStart(gAudioUnit);
-
-    NSLog(@"VoiceProcessingIO started: low-latency loopback running");
+    gEngine.stop();
 }
 
-void StopVoiceLoopback()
+// Only while stopped; 0 processes capture on the IO thread again.
+void SetVoiceLoopbackWorkers(int count)
 {
-    if (gAudioUnit) {
-        AudioOutputUnitStop(gAudioUnit);
-        AudioUnitUninitialize(gAudioUnit);
-        AudioComponentInstanceDispose(gAudioUnit);
-        gAudioUnit = nullptr;
+    gEngine.setWorkerPool(nullptr);
+    gWorkers.reset();
+    if (count <= 0)
+        return;
+    nuchat::RtWorkerConfig cfg;
+    cfg.workers = (uint32_t)count;
+    cfg.periodMs = kFramesPerBuffer * 1000.0 / kSampleRate;
+    gWorkers = std::make_unique<nuchat::RtWorkerPool>(cfg);
+    gEngine.setWorkerPool(gWorkers.get());
+}
+
+NSString *MeasureVoiceLoopbackLatency(int trials)
+{
+    StopVoiceLoopback();
+    nuchat::LatencyProbeConfig cfg;
+    cfg.sampleRate = kSampleRate;
+    cfg.trials = trials > 0 ? (uint32_t)trials : 20;
+    nuchat::LatencyProbe probe(cfg);
+    gEngine.setLatencyProbe(&probe);
+    // The echo canceller would remove the probe burst from the capture path.
+    gEngine.bypassVoiceProcessing = true;
+    if (gEngine.start(default_format())) {
+        while (!probe.step())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+    StopVoiceLoopback();
+    gEngine.bypassVoiceProcessing = false;
+    gEngine.setLatencyProbe(nullptr);
+    return [NSString stringWithUTF8String:probe.report().c_str()];
+}
+
+NSString *VoiceLoopbackMetrics()
+{
+    static nuchat::MetricsExporter exporter;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        exporter.add(&gEngine.captureMetrics());
+        exporter.add(&gEngine.renderMetrics());
+    });
+    std::string json = exporter.render(nuchat::MetricsFormat::Json);
+    return [NSString stringWithUTF8String:json.c_str()];
 }
@@ -2,117 +2,830 @@
 // Minimal low-latency ALSA full-duplex loopback for Linux.
 // Captures microphone and plays it back with minimal latency.
 //
-// Build: g++ -std=c++17 alsa_loopback.cpp -lasound -lpthread -o alsa_loopback
-// Run:   ./alsa_loopback
+// Build: cmake -S .. -B build && cmake --build build --target alsa_voice_loopback
+//    or: g++ -std=c++17 -O3 alsa_loopback.cpp -lasound -lpthread -o alsa_loopback
+// Run:   ./alsa_loopback [--jitter-ms 5.3] [--mmap | --duplex] [--measure-latency N] [--no-aec]
+//        [--workers CORE[,CORE...]] [--duration S] [--record PREFIX] [--no-vad]
+//        [--peer host:port [--listen port] [--packet-ms 5]
+//        [--codec l16|opus] [--bitrate 32000]]
+//
+// Each PCM is opened in the first sample format it supports natively (float,
+// s32, s24-in-32, s16), mono if possible, interleaved or not, at the rate
+// nearest 48 kHz the hardware runs without plugin resampling. Conversion to
+// the engine's mono float at 48 kHz happens here instead of in an ALSA plugin.
+//
+// --mmap moves frames directly between the device DMA area and the FIFO
+// (SND_PCM_ACCESS_MMAP_*) instead of going through readi/writei.
+//
+// --duplex links capture and playback (snd_pcm_link) and services both from
+// one SCHED_FIFO thread that wakes on their poll descriptors and moves exactly
+// one period in and one period out per wakeup. Playback is primed with two
+// periods of silence, so the round trip is a fixed two periods. Requires both
+// PCMs on the same card; otherwise the two-thread engine is used.
+//
+// The capture signal goes through the common echo canceller, with whatever is
+// played as its reference; --no-aec turns it off.
+//
+// --workers 2,3 moves capture DSP off the capture thread onto SCHED_FIFO
+// workers pinned to those cores (rt_workers.h); the capture thread then only
+// reads the device and queues the block.
+//
+// --record calls/qa writes what is sent to calls/qa-capture.wav and what is
+// played to calls/qa-render.wav (s16 at the processing rate) from a writer
+// thread; the stream threads only copy into its rings (call_recorder.h).
+//
+// --measure-latency N replaces the loopback with N MLS bursts and reports the
+// round-trip latency statistics of whichever engine was selected.
+//
+// --metrics json|prom [--metrics-interval S] prints xrun, FIFO and callback
+// timing counters for both streams to stdout every S seconds (default 5).
+//
+// A stream whose device disappears (USB headset unplugged) waits for udev to
+// announce a sound device and reopens "default"; only that stream restarts
+// (both in --duplex mode), and the FIFO and DSP keep their state.
+//
+// --peer streams the microphone to another nuChat peer as RTP over UDP and
+// plays what it sends back, instead of looping back locally. Both ends bind
+// --listen (default: the peer's port); --packet-ms sets the packet duration.
+// Silence is not sent (comfort noise instead), and locally it skips the
+// gain and DSP stages and plays as silence, unless --no-vad is given.
+//
+// While running, lines on stdin change the stream without restarting it:
+// capture-gain/render-gain <dB>, mute/render-mute on|off, jitter-ms <ms>,
+// aec on|off and the vad-* settings (common/vad.h).
+//
+// Ctrl+C, SIGTERM or the end of --duration S stops the streams, closes the
+// PCMs and prints a summary of frames, xruns and buffering (plus the echo
+// canceller, transport and worker reports) to stderr.
 
 #include <alsa/asoundlib.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <atomic>
 #include <vector>
 #include <thread>
 #include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+
+#include "../common/audio_codec.h"
+#include "../common/audio_engine.h"
+#include "../common/call_recorder.h"
+#include "../common/echo_canceller.h"
+#include "../common/latency_probe.h"
+#include "../common/processing_graph.h"
+#include "../common/shutdown.h"
+#include "../common/stream_metrics.h"
+#include "../common/udp_transport.h"
 
 static const unsigned int SAMPLE_RATE = 48000;
-static const snd_pcm_format_t FORMAT = SND_PCM_FORMAT_FLOAT_LE;
-static const unsigned int CHANNELS = 1;
+static const unsigned int CHANNELS = 1; // preferred; the device may insist on more
 static const snd_pcm_uframes_t BUFFER_FRAMES = 128;
+static const int RT_PRIORITY = 70;
+static const snd_pcm_uframes_t DUPLEX_PERIODS = 2;
+
+// Native sample formats in order of preference.
+static const struct {
+    snd_pcm_format_t alsa;
+    nuchat::SampleFormat sample;
+} kFormats[] = {
+    {SND_PCM_FORMAT_FLOAT_LE, nuchat::SampleFormat::Float32},
+    {SND_PCM_FORMAT_S32_LE, nuchat::SampleFormat::Int32},
+    {SND_PCM_FORMAT_S24_LE, nuchat::SampleFormat::Int24In32},
+    {SND_PCM_FORMAT_S16_LE, nuchat::SampleFormat::Int16},
+};
 
-struct FloatFIFO {
-    std::vector<float> buf;
-    std::atomic<uint32_t> w{0}, r{0};
-    uint32_t mask;
-    explicit FloatFIFO(uint32_t sz) {
-        uint32_t p = 1; while (p < sz) p <<= 1;
-        buf.resize(p);
-        mask = p - 1;
-    }
-    void push(const float* src, uint32_t n) {
-        uint32_t wi = w.load(); uint32_t ri = r.load();
-        uint32_t free = ((mask + 1) - (wi - ri)) & mask;
-        if (n > free) n = free;
-        for (uint32_t i = 0; i < n; ++i)
-            buf[(wi + i) & mask] = src[i];
-        w.store((wi + n) & mask);
-    }
-    void pop(float* dst, uint32_t n) {
-        uint32_t wi = w.load(); uint32_t ri = r.load();
-        uint32_t avail = (wi - ri) & mask;
-        uint32_t got = n < avail ? n : avail;
-        for (uint32_t i = 0; i < got; ++i)
-            dst[i] = buf[(ri + i) & mask];
-        r.store((ri + got) & mask);
-        if (got < n)
-            memset(dst + got, 0, (n - got) * sizeof(float));
+// Device-format scratch for read/write access: one interleaved block, or one
+// block per channel for non-interleaved access.
+struct PcmBuffer {
+    PcmBuffer(const nuchat::DeviceFormat& dev, snd_pcm_uframes_t frames)
+        : data(frames * dev.channels * nuchat::bytes_per_sample(dev.sample), 0) {
+        size_t plane = frames * nuchat::bytes_per_sample(dev.sample);
+        for (uint32_t c = 0; c < dev.channels; ++c)
+            ptrs[c] = data.data() + (dev.planar ? c * plane : 0);
     }
+    std::vector<uint8_t> data;
+    void* ptrs[nuchat::kMaxChannels];
 };
 
-static FloatFIFO gFifo(1 << 16);
-static bool gRunning = true;
+static snd_pcm_sframes_t pcm_read(snd_pcm_t* h, const nuchat::DeviceFormat& dev, PcmBuffer& b,
+                                  snd_pcm_uframes_t n) {
+    return dev.planar ? snd_pcm_readn(h, b.ptrs, n) : snd_pcm_readi(h, b.ptrs[0], n);
+}
 
-void captureThread(snd_pcm_t* captureHandle) {
-    std::vector<float> buf(BUFFER_FRAMES);
-    while (gRunning) {
-        snd_pcm_sframes_t frames = snd_pcm_readi(captureHandle, buf.data(), BUFFER_FRAMES);
-        if (frames < 0) {
-            snd_pcm_prepare(captureHandle);
-            continue;
+static snd_pcm_sframes_t pcm_write(snd_pcm_t* h, const nuchat::DeviceFormat& dev, PcmBuffer& b,
+                                   snd_pcm_uframes_t n) {
+    return dev.planar ? snd_pcm_writen(h, b.ptrs, n) : snd_pcm_writei(h, b.ptrs[0], n);
+}
+
+// Frame `offset` of an mmap area: one pointer when interleaved, else one
+// per channel.
+static void mmap_frames(const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset,
+                        const nuchat::DeviceFormat& dev, void** ptrs) {
+    for (uint32_t c = 0; c < (dev.planar ? dev.channels : 1); ++c)
+        ptrs[c] = static_cast<char*>(areas[c].addr) + (areas[c].first + offset * areas[c].step) / 8;
+}
+
+// Chooses access, sample format, channel count and rate the device supports
+// natively and applies the hw params. mmapAccess is cleared if mmap is
+// unavailable.
+static bool configure_pcm(snd_pcm_t* handle, unsigned int rate, snd_pcm_uframes_t bufferFrames,
+                          bool& mmapAccess, nuchat::DeviceFormat& dev) {
+    snd_pcm_hw_params_t* hwParams;
+    snd_pcm_hw_params_malloc(&hwParams);
+    snd_pcm_hw_params_any(handle, hwParams);
+
+    const snd_pcm_access_t mmapModes[] = {SND_PCM_ACCESS_MMAP_INTERLEAVED, SND_PCM_ACCESS_MMAP_NONINTERLEAVED};
+    const snd_pcm_access_t rwModes[] = {SND_PCM_ACCESS_RW_INTERLEAVED, SND_PCM_ACCESS_RW_NONINTERLEAVED};
+    bool accessSet = false;
+    for (int pass = mmapAccess ? 0 : 1; pass < 2 && !accessSet; ++pass) {
+        for (snd_pcm_access_t a : pass == 0 ? mmapModes : rwModes) {
+            if (snd_pcm_hw_params_set_access(handle, hwParams, a) == 0) {
+                dev.planar = a == SND_PCM_ACCESS_MMAP_NONINTERLEAVED || a == SND_PCM_ACCESS_RW_NONINTERLEAVED;
+                mmapAccess = pass == 0;
+                accessSet = true;
+                break;
+            }
         }
-        gFifo.push(buf.data(), frames);
+        if (pass == 0 && !accessSet)
+            std::cerr << "Device does not support mmap access, using read/write" << std::endl;
     }
-}
 
-void playbackThread(snd_pcm_t* playbackHandle) {
-    std::vector<float> buf(BUFFER_FRAMES);
-    while (gRunning) {
-        gFifo.pop(buf.data(), BUFFER_FRAMES);
-        snd_pcm_sframes_t frames = snd_pcm_writei(playbackHandle, buf.data(), BUFFER_FRAMES);
-        if (frames < 0) {
-            snd_pcm_prepare(playbackHandle);
-            continue;
+    bool formatSet = false;
+    for (const auto& f : kFormats) {
+        if (snd_pcm_hw_params_set_format(handle, hwParams, f.alsa) == 0) {
+            dev.sample = f.sample;
+            formatSet = true;
+            break;
         }
     }
+
+    unsigned int maxChannels = nuchat::kMaxChannels, channels = CHANNELS;
+    snd_pcm_hw_params_set_channels_max(handle, hwParams, &maxChannels);
+    snd_pcm_hw_params_set_channels_near(handle, hwParams, &channels);
+    dev.channels = channels;
+
+    snd_pcm_hw_params_set_rate_resample(handle, hwParams, 0);
+    snd_pcm_hw_params_set_rate_near(handle, hwParams, &rate, 0);
+    dev.sampleRate = rate;
+    snd_pcm_hw_params_set_buffer_size(handle, hwParams, bufferFrames);
+    snd_pcm_hw_params_set_period_size(handle, hwParams, BUFFER_FRAMES, 0);
+    int err = snd_pcm_hw_params(handle, hwParams);
+    snd_pcm_hw_params_free(hwParams);
+    return accessSet && formatSet && err == 0;
 }
 
-int main() {
-    snd_pcm_t *captureHandle, *playbackHandle;
-    snd_pcm_hw_params_t *hwParams;
+static void report_pcm(const char* which, const nuchat::DeviceFormat& dev, bool mmapAccess) {
+    std::cout << which << ": " << nuchat::sample_format_name(dev.sample) << " x" << dev.channels
+              << (dev.planar ? " non-interleaved" : " interleaved") << " @ " << dev.sampleRate << " Hz"
+              << (mmapAccess ? ", mmap" : "")
+              << std::endl;
+}
 
-    // Open playback and capture devices
-    if (snd_pcm_open(&captureHandle, "default", SND_PCM_STREAM_CAPTURE, 0) < 0) {
-        std::cerr << "Cannot open capture device" << std::endl;
-        return 1;
+// Makes snd_pcm_htimestamp() report the time of each hardware pointer update.
+static void enable_timestamps(snd_pcm_t* handle) {
+    snd_pcm_sw_params_t* swParams;
+    snd_pcm_sw_params_malloc(&swParams);
+    snd_pcm_sw_params_current(handle, swParams);
+    snd_pcm_sw_params_set_tstamp_mode(handle, swParams, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(handle, swParams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    snd_pcm_sw_params(handle, swParams);
+    snd_pcm_sw_params_free(swParams);
+}
+
+static void set_start_threshold(snd_pcm_t* handle, snd_pcm_uframes_t frames) {
+    snd_pcm_sw_params_t* swParams;
+    snd_pcm_sw_params_malloc(&swParams);
+    snd_pcm_sw_params_current(handle, swParams);
+    snd_pcm_sw_params_set_start_threshold(handle, swParams, frames);
+    snd_pcm_sw_params_set_avail_min(handle, swParams, BUFFER_FRAMES);
+    snd_pcm_sw_params(handle, swParams);
+    snd_pcm_sw_params_free(swParams);
+}
+
+// Locks memory and switches the calling thread to SCHED_FIFO. Done once,
+// before the I/O loop starts.
+static void setup_realtime_thread() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        std::cerr << "mlockall failed; page faults may cause xruns" << std::endl;
+    sched_param sp{};
+    sp.sched_priority = RT_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+        std::cerr << "SCHED_FIFO unavailable (needs CAP_SYS_NICE or rtprio limit)" << std::endl;
+}
+
+// Kernel uevents for the sound subsystem, the same ones udev acts on, read
+// from a netlink socket so no libudev is needed. Without the socket (e.g. in
+// a container) wait() just sleeps, and reopening falls back to polling.
+// Each reopen loop opens its own: the kernel gives every socket its own copy
+// of each event, so the capture and playback threads cannot take each
+// other's, and nothing queues up while the streams are healthy.
+class HotplugMonitor {
+public:
+    HotplugMonitor() {
+        fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (fd < 0) return;
+        sockaddr_nl addr{};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1; // kernel broadcast group
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
     }
-    if (snd_pcm_open(&playbackHandle, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
-        std::cerr << "Cannot open playback device" << std::endl;
-        return 1;
+    ~HotplugMonitor() { if (fd >= 0) close(fd); }
+
+    // Discards whatever is queued, so wait() only reports what comes after.
+    void drain() {
+        char msg[4096];
+        while (fd >= 0 && recv(fd, msg, sizeof(msg), MSG_DONTWAIT) > 0) {}
+    }
+
+    // Waits up to timeoutMs; true if a sound device was added or changed.
+    bool wait(int timeoutMs) {
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            return false;
+        }
+        pollfd p{fd, POLLIN, 0};
+        bool sound = false;
+        while (poll(&p, 1, sound ? 0 : timeoutMs) > 0) {
+            char msg[4096];
+            ssize_t n = recv(fd, msg, sizeof(msg) - 1, 0);
+            if (n <= 0) break;
+            msg[n] = 0;
+            // "ACTION@DEVPATH\0KEY=VALUE\0..."
+            bool add = !std::strncmp(msg, "add@", 4) || !std::strncmp(msg, "change@", 7);
+            for (ssize_t i = 0; i < n && add; i += std::strlen(msg + i) + 1)
+                if (!std::strcmp(msg + i, "SUBSYSTEM=sound")) sound = true;
+        }
+        return sound;
+    }
+
+private:
+    int fd = -1;
+};
+
+class AlsaEngine : public nuchat::AudioEngine {
+public:
+    bool useMmap = false;
+    bool useDuplex = false;
+
+    const char* name() const override { return useDuplex ? "alsa-duplex" : "alsa"; }
+
+    bool start(const nuchat::AudioFormat& want) override {
+        if (useDuplex && useMmap) {
+            std::cerr << "--duplex uses read/write access; ignoring --mmap" << std::endl;
+            useMmap = false;
+        }
+        // Access and format are decided per stream, so one device lacking
+        // mmap support or float samples does not force the other to follow.
+        captureMmap = playbackMmap = useMmap;
+        bufferFrames = BUFFER_FRAMES * (useDuplex ? DUPLEX_PERIODS : 4);
+        if (!openPcm(true, (unsigned int)want.sampleRate, true))
+            return false;
+        if (!openPcm(false, (unsigned int)want.sampleRate, true)) {
+            snd_pcm_close(captureHandle);
+            return false;
+        }
+
+        // The duplex loop moves periods 1:1 with no rate conversion.
+        bool nativeRate = captureDev.sampleRate == (unsigned int)want.sampleRate &&
+                          playbackDev.sampleRate == (unsigned int)want.sampleRate;
+        if (useDuplex && (!nativeRate || snd_pcm_link(captureHandle, playbackHandle) < 0)) {
+            std::cerr << (nativeRate ? "Cannot link capture and playback"
+                                     : "Duplex needs both devices at the processing rate")
+                      << "; using two-thread engine" << std::endl;
+            useDuplex = false;
+            set_start_threshold(captureHandle, 1);
+            set_start_threshold(playbackHandle, 1);
+        }
+
+        nuchat::AudioFormat granted = want;
+        granted.channels = 1;
+        granted.framesPerPeriod = BUFFER_FRAMES;
+        setDeviceFormats(captureDev, playbackDev);
+        prepare(granted, BUFFER_FRAMES * 4);
+
+        running = true;
+        if (useDuplex) {
+            threads.emplace_back(&AlsaEngine::duplexThread, this);
+        } else {
+            threads.emplace_back(&AlsaEngine::captureThread, this);
+            threads.emplace_back(&AlsaEngine::playbackThread, this);
+        }
+        return true;
+    }
+
+    void stop() override {
+        running = false;
+        for (auto& t : threads) t.join();
+        threads.clear();
+        if (useDuplex && captureHandle) snd_pcm_unlink(captureHandle);
+        if (captureHandle) snd_pcm_close(captureHandle);
+        if (playbackHandle) snd_pcm_close(playbackHandle);
+        captureHandle = playbackHandle = nullptr;
+    }
+
+private:
+    // Opens "default" for one direction and applies hw and sw params.
+    bool openPcm(bool isCapture, unsigned int rate, bool verbose) {
+        const char* which = isCapture ? "capture" : "playback";
+        snd_pcm_t*& handle = isCapture ? captureHandle : playbackHandle;
+        bool& mmapAccess = isCapture ? captureMmap : playbackMmap;
+        nuchat::DeviceFormat& dev = isCapture ? captureDev : playbackDev;
+        if (snd_pcm_open(&handle, "default", isCapture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+            if (verbose) std::cerr << "Cannot open " << which << " device" << std::endl;
+            handle = nullptr;
+            return false;
+        }
+        if (!configure_pcm(handle, rate, bufferFrames, mmapAccess, dev)) {
+            if (verbose) std::cerr << "Cannot configure " << which << " device" << std::endl;
+            snd_pcm_close(handle);
+            handle = nullptr;
+            return false;
+        }
+        report_pcm(which, dev, mmapAccess);
+        enable_timestamps(handle);
+        if (!isCapture) {
+            snd_pcm_uframes_t period;
+            if (snd_pcm_get_params(handle, &playbackBuffer, &period) < 0) playbackBuffer = bufferFrames;
+        }
+        // Duplex mode must not auto-start: duplexRestart starts both at once.
+        if (useDuplex)
+            set_start_threshold(handle, BUFFER_FRAMES * DUPLEX_PERIODS * 2);
+        snd_pcm_prepare(handle);
+        return true;
     }
 
-    // Configure both devices
-    for (auto handle : {captureHandle, playbackHandle}) {
-        snd_pcm_hw_params_malloc(&hwParams);
-        snd_pcm_hw_params_any(handle, hwParams);
-        snd_pcm_hw_params_set_access(handle, hwParams, SND_PCM_ACCESS_RW_INTERLEAVED);
-        snd_pcm_hw_params_set_format(handle, hwParams, FORMAT);
-        snd_pcm_hw_params_set_channels(handle, hwParams, CHANNELS);
-        snd_pcm_hw_params_set_rate(handle, hwParams, SAMPLE_RATE, 0);
-        snd_pcm_hw_params_set_buffer_size(handle, hwParams, BUFFER_FRAMES * 4);
-        snd_pcm_hw_params_set_period_size(handle, hwParams, BUFFER_FRAMES, 0);
-        snd_pcm_hw_params(handle, hwParams);
-        snd_pcm_hw_params_free(hwParams);
+    // Stream thread, once its device is gone: closes the PCM and reopens
+    // "default" whenever a sound device appears (or every 500 ms), then
+    // swaps only this side's conversion in the engine. False on stop().
+    bool reopenPcm(bool isCapture) {
+        snd_pcm_t*& handle = isCapture ? captureHandle : playbackHandle;
+        if (handle) snd_pcm_close(handle);
+        handle = nullptr;
+        std::cerr << (isCapture ? "capture" : "playback") << ": device lost, waiting for it" << std::endl;
+        HotplugMonitor hotplug; // before the first attempt, so no add is missed
+        hotplug.drain();
+        while (running) {
+            if (openPcm(isCapture, (unsigned int)fmt.sampleRate, false)) {
+                if (isCapture) reopenCapture(captureDev);
+                else reopenRender(playbackDev);
+                return true;
+            }
+            hotplug.wait(500);
+        }
+        return false;
+    }
+
+    // Duplex counterpart: the linked pair is lost and reopened together, and
+    // only a pair that can still run 1:1 at the processing rate is accepted.
+    bool reopenDuplex() {
+        snd_pcm_unlink(captureHandle);
+        snd_pcm_close(captureHandle);
+        snd_pcm_close(playbackHandle);
+        captureHandle = playbackHandle = nullptr;
+        std::cerr << "duplex: device lost, waiting for it" << std::endl;
+        const unsigned int rate = (unsigned int)fmt.sampleRate;
+        HotplugMonitor hotplug;
+        hotplug.drain();
+        while (running) {
+            if (openPcm(true, rate, false)) {
+                if (openPcm(false, rate, false)) {
+                    if (captureDev.sampleRate == rate && playbackDev.sampleRate == rate &&
+                        snd_pcm_link(captureHandle, playbackHandle) == 0) {
+                        reopenCapture(captureDev);
+                        reopenRender(playbackDev);
+                        return true;
+                    }
+                    snd_pcm_close(playbackHandle);
+                }
+                snd_pcm_close(captureHandle);
+                captureHandle = playbackHandle = nullptr;
+            }
+            hotplug.wait(500);
+        }
+        return false;
+    }
+
+    static bool disconnected(snd_pcm_t* handle) {
+        return snd_pcm_state(handle) == SND_PCM_STATE_DISCONNECTED;
+    }
+
+    // Brings a stream back after an xrun or suspend; mirrors snd_pcm_recover
+    // without its stderr chatter. False if the device has gone away.
+    static bool recover(snd_pcm_t* handle, int err, nuchat::StreamMetrics& metrics) {
+        if (err == -ENODEV || disconnected(handle))
+            return false;
+        metrics.addXrun();
+        if (err == -ESTRPIPE) {
+            while ((err = snd_pcm_resume(handle)) == -EAGAIN)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
         snd_pcm_prepare(handle);
+        return true;
+    }
+
+    // Each stream thread runs its loop until the device goes away, then
+    // reopens it and starts over with buffers for the new layout.
+    void captureThread() {
+        while (running) {
+            if (captureMmap) captureLoopMmap();
+            else captureLoop();
+            if (running && !reopenPcm(true)) break;
+        }
     }
 
-    std::thread tCap(captureThread, captureHandle);
-    std::thread tPlay(playbackThread, playbackHandle);
+    void playbackThread() {
+        while (running) {
+            if (playbackMmap) playbackLoopMmap();
+            else playbackLoop();
+            if (running && !reopenPcm(false)) break;
+        }
+    }
 
-    std::cout << "Running... speak into the mic; you should hear yourself." << std::endl;
-    std::cout << "Press Ctrl+C to exit." << std::endl;
-    while (true) std::this_thread::sleep_for(std::chrono::seconds(1));
+    // Device frame index of the oldest frame not yet read, and the host time
+    // it was captured at, from the time of the last hardware pointer update.
+    // Being derived from the system clock the index wanders against the
+    // audio clock, so callers allow a period of slack.
+    bool capturePosition(uint64_t& position, uint64_t& hostNs) {
+        snd_pcm_uframes_t avail;
+        snd_htimestamp_t ts;
+        if (snd_pcm_htimestamp(captureHandle, &avail, &ts) < 0 || (ts.tv_sec == 0 && ts.tv_nsec == 0))
+            return false;
+        uint64_t rate = captureDev.sampleRate;
+        uint64_t now = uint64_t(ts.tv_sec) * rate + uint64_t(ts.tv_nsec) * rate / 1000000000ull;
+        position = now - avail;
+        hostNs = nuchat::host_ns_from_timespec(ts) - nuchat::frames_to_ns(double(avail), double(rate));
+        return true;
+    }
 
-    gRunning = false;
-    tCap.join();
-    tPlay.join();
+    // Host time at which the next frame written will play: what is queued
+    // at the last pointer update drains first.
+    bool playbackTime(uint64_t& hostNs) {
+        snd_pcm_uframes_t avail;
+        snd_htimestamp_t ts;
+        if (snd_pcm_htimestamp(playbackHandle, &avail, &ts) < 0 || (ts.tv_sec == 0 && ts.tv_nsec == 0))
+            return false;
+        double queued = avail < playbackBuffer ? double(playbackBuffer - avail) : 0.0;
+        hostNs = nuchat::host_ns_from_timespec(ts) + nuchat::frames_to_ns(queued, double(playbackDev.sampleRate));
+        return true;
+    }
+
+    void captureLoop() {
+        PcmBuffer buf(captureDev, BUFFER_FRAMES);
+        while (running) {
+            snd_pcm_sframes_t frames = pcm_read(captureHandle, captureDev, buf, BUFFER_FRAMES);
+            if (frames < 0) {
+                if (!recover(captureHandle, (int)frames, capMetrics)) return;
+                continue;
+            }
+            uint64_t position, hostNs;
+            if (capturePosition(position, hostNs)) {
+                noteCapturePosition(position - frames, static_cast<uint32_t>(frames), BUFFER_FRAMES);
+                noteCaptureTime(hostNs - nuchat::frames_to_ns(double(frames), captureDev.sampleRate));
+            }
+            onCaptureDevice(buf.ptrs, static_cast<uint32_t>(frames));
+        }
+    }
+
+    // Copies each contiguous chunk of captured frames from the DMA area
+    // straight into the FIFO.
+    void captureLoopMmap() {
+        snd_pcm_start(captureHandle);
+        while (running) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(captureHandle);
+            if (avail < 0) {
+                if (!recover(captureHandle, (int)avail, capMetrics)) return;
+                snd_pcm_start(captureHandle);
+                continue;
+            }
+            if (avail < (snd_pcm_sframes_t)BUFFER_FRAMES) {
+                int err = snd_pcm_wait(captureHandle, 1000);
+                if (err < 0) {
+                    if (!recover(captureHandle, err, capMetrics)) return;
+                    snd_pcm_start(captureHandle);
+                }
+                continue;
+            }
+            uint64_t position, hostNs;
+            if (capturePosition(position, hostNs)) {
+                noteCapturePosition(position, static_cast<uint32_t>(avail), BUFFER_FRAMES);
+                noteCaptureTime(hostNs);
+            }
+            snd_pcm_uframes_t left = avail;
+            while (left > 0) {
+                const snd_pcm_channel_area_t* areas;
+                snd_pcm_uframes_t offset, frames = left;
+                int err = snd_pcm_mmap_begin(captureHandle, &areas, &offset, &frames);
+                if (err < 0) {
+                    if (!recover(captureHandle, err, capMetrics)) return;
+                    snd_pcm_start(captureHandle);
+                    break;
+                }
+                void* ptrs[nuchat::kMaxChannels];
+                mmap_frames(areas, offset, captureDev, ptrs);
+                onCaptureDevice(ptrs, static_cast<uint32_t>(frames));
+                snd_pcm_sframes_t done = snd_pcm_mmap_commit(captureHandle, offset, frames);
+                if (done < 0 || (snd_pcm_uframes_t)done != frames) {
+                    if (!recover(captureHandle, done < 0 ? (int)done : -EPIPE, capMetrics)) return;
+                    snd_pcm_start(captureHandle);
+                    break;
+                }
+                left -= frames;
+            }
+        }
+    }
+
+    // Renders directly into the device's DMA area.
+    void playbackLoopMmap() {
+        while (running) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(playbackHandle);
+            if (avail < 0) {
+                if (!recover(playbackHandle, (int)avail, renMetrics)) return;
+                continue;
+            }
+            if (avail < (snd_pcm_sframes_t)BUFFER_FRAMES) {
+                if (snd_pcm_state(playbackHandle) == SND_PCM_STATE_PREPARED)
+                    snd_pcm_start(playbackHandle);
+                int err = snd_pcm_wait(playbackHandle, 1000);
+                if (err < 0 && !recover(playbackHandle, err, renMetrics)) return;
+                continue;
+            }
+            uint64_t hostNs;
+            if (playbackTime(hostNs)) noteRenderTime(hostNs);
+            snd_pcm_uframes_t left = avail;
+            while (left > 0) {
+                const snd_pcm_channel_area_t* areas;
+                snd_pcm_uframes_t offset, frames = left;
+                int err = snd_pcm_mmap_begin(playbackHandle, &areas, &offset, &frames);
+                if (err < 0) {
+                    if (!recover(playbackHandle, err, renMetrics)) return;
+                    break;
+                }
+                void* ptrs[nuchat::kMaxChannels];
+                mmap_frames(areas, offset, playbackDev, ptrs);
+                onRenderDevice(ptrs, static_cast<uint32_t>(frames));
+                snd_pcm_sframes_t done = snd_pcm_mmap_commit(playbackHandle, offset, frames);
+                if (done < 0 || (snd_pcm_uframes_t)done != frames) {
+                    if (!recover(playbackHandle, done < 0 ? (int)done : -EPIPE, renMetrics)) return;
+                    break;
+                }
+                left -= frames;
+            }
+        }
+    }
+
+    void playbackLoop() {
+        PcmBuffer buf(playbackDev, BUFFER_FRAMES);
+        while (running) {
+            // The write below blocks until there is room, so the figure is
+            // stale by up to a period on a full buffer; it holds on average.
+            uint64_t hostNs;
+            if (playbackTime(hostNs)) noteRenderTime(hostNs);
+            onRenderDevice(buf.ptrs, BUFFER_FRAMES);
+            snd_pcm_sframes_t frames = pcm_write(playbackHandle, playbackDev, buf, BUFFER_FRAMES);
+            if (frames < 0 && !recover(playbackHandle, (int)frames, renMetrics))
+                return;
+        }
+    }
+
+    // Stops both linked streams, queues DUPLEX_PERIODS of silence for
+    // playback and restarts them together. Capture follows via the link.
+    void duplexRestart(PcmBuffer& silence) {
+        snd_pcm_drop(playbackHandle);
+        snd_pcm_prepare(playbackHandle);
+        if (snd_pcm_state(captureHandle) != SND_PCM_STATE_PREPARED)
+            snd_pcm_prepare(captureHandle);
+        for (snd_pcm_uframes_t p = 0; p < DUPLEX_PERIODS; ++p)
+            pcm_write(playbackHandle, playbackDev, silence, BUFFER_FRAMES);
+        snd_pcm_start(playbackHandle);
+    }
 
-    snd_pcm_close(captureHandle);
-    snd_pcm_close(playbackHandle);
+    void duplexThread() {
+        setup_realtime_thread();
+        while (running) {
+            duplexLoop();
+            if (running && !reopenDuplex()) break;
+        }
+    }
+
+    // Runs the linked pair until either device goes away.
+    void duplexLoop() {
+        PcmBuffer in(captureDev, BUFFER_FRAMES), out(playbackDev, BUFFER_FRAMES);
+        PcmBuffer silence(playbackDev, BUFFER_FRAMES); // all-zero bytes in every format
+        int nCap = snd_pcm_poll_descriptors_count(captureHandle);
+        int nPlay = snd_pcm_poll_descriptors_count(playbackHandle);
+        std::vector<pollfd> fds(nCap + nPlay);
+        snd_pcm_poll_descriptors(captureHandle, fds.data(), nCap);
+        snd_pcm_poll_descriptors(playbackHandle, fds.data() + nCap, nPlay);
+
+        duplexRestart(silence);
+        while (running) {
+            if (poll(fds.data(), fds.size(), 1000) <= 0)
+                continue;
+            unsigned short capEv = 0, playEv = 0;
+            snd_pcm_poll_descriptors_revents(captureHandle, fds.data(), nCap, &capEv);
+            snd_pcm_poll_descriptors_revents(playbackHandle, fds.data() + nCap, nPlay, &playEv);
+            if ((capEv | playEv) & POLLERR) {
+                if (disconnected(captureHandle) || disconnected(playbackHandle)) return;
+                capMetrics.addXrun();
+                duplexRestart(silence);
+                continue;
+            }
+
+            snd_pcm_sframes_t capAvail = snd_pcm_avail_update(captureHandle);
+            snd_pcm_sframes_t playAvail = snd_pcm_avail_update(playbackHandle);
+            if (capAvail < 0 || playAvail < 0) {
+                if (capAvail == -ENODEV || playAvail == -ENODEV) return;
+                (capAvail < 0 ? capMetrics : renMetrics).addXrun();
+                duplexRestart(silence);
+                continue;
+            }
+            if (capAvail < (snd_pcm_sframes_t)BUFFER_FRAMES || playAvail < (snd_pcm_sframes_t)BUFFER_FRAMES)
+                continue;
+
+            // One period in, one period out: the streams share a clock, so
+            // there is no FIFO and no drift correction on this path.
+            snd_pcm_sframes_t got = pcm_read(captureHandle, captureDev, in, BUFFER_FRAMES);
+            if (got != (snd_pcm_sframes_t)BUFFER_FRAMES) {
+                if (got == -ENODEV) return;
+                capMetrics.addXrun();
+                duplexRestart(silence);
+                continue;
+            }
+            uint64_t position, hostNs;
+            if (capturePosition(position, hostNs)) {
+                noteCapturePosition(position - BUFFER_FRAMES, BUFFER_FRAMES, BUFFER_FRAMES);
+                noteCaptureTime(hostNs - nuchat::frames_to_ns(BUFFER_FRAMES, captureDev.sampleRate));
+            }
+            if (playbackTime(hostNs)) noteRenderTime(hostNs);
+            onDuplexDevice(in.ptrs, out.ptrs, BUFFER_FRAMES);
+            snd_pcm_sframes_t put = pcm_write(playbackHandle, playbackDev, out, BUFFER_FRAMES);
+            if (put != (snd_pcm_sframes_t)BUFFER_FRAMES) {
+                if (put == -ENODEV) return;
+                renMetrics.addXrun();
+                duplexRestart(silence);
+            }
+        }
+    }
+
+    snd_pcm_t* captureHandle = nullptr;
+    snd_pcm_t* playbackHandle = nullptr;
+    nuchat::DeviceFormat captureDev, playbackDev;
+    bool captureMmap = false, playbackMmap = false;
+    snd_pcm_uframes_t bufferFrames = 0;
+    snd_pcm_uframes_t playbackBuffer = 0; // as granted
+    std::atomic<bool> running{false};
+    std::vector<std::thread> threads;
+};
+
+int main(int argc, char** argv) {
+    std::unique_ptr<nuchat::RtWorkerPool> workers; // outlives the engine
+    nuchat::CallRecorder recorder;                 // likewise
+    AlsaEngine engine;
+    nuchat::LatencyProbeConfig probeConfig;
+    probeConfig.sampleRate = SAMPLE_RATE;
+    probeConfig.trials = 0;
+    const char* metricsFormat = nullptr;
+    double metricsInterval = 5.0;
+    nuchat::TransportConfig net;
+    const char* codecName = "l16";
+    int32_t bitrate = 32000;
+    bool echoCancel = true;
+    double duration = 0.0;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--jitter-ms") && i + 1 < argc)
+            engine.setJitterTargetMs(std::atof(argv[++i]));
+        else if (!std::strcmp(argv[i], "--duration") && i + 1 < argc)
+            duration = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--mmap"))
+            engine.useMmap = true;
+        else if (!std::strcmp(argv[i], "--duplex"))
+            engine.useDuplex = true;
+        else if (!std::strcmp(argv[i], "--measure-latency") && i + 1 < argc)
+            probeConfig.trials = static_cast<uint32_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--metrics") && i + 1 < argc)
+            metricsFormat = argv[++i];
+        else if (!std::strcmp(argv[i], "--metrics-interval") && i + 1 < argc)
+            metricsInterval = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--peer") && i + 1 < argc)
+            net.peer = argv[++i];
+        else if (!std::strcmp(argv[i], "--listen") && i + 1 < argc)
+            net.localPort = static_cast<uint16_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--packet-ms") && i + 1 < argc)
+            net.packetMs = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--no-vad"))
+            engine.setSilenceSuppression(false);
+        else if (!std::strcmp(argv[i], "--no-aec"))
+            echoCancel = false;
+        else if (!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+            nuchat::RtWorkerConfig wc;
+            if (!nuchat::parse_core_list(argv[++i], wc.cores)) {
+                std::cerr << "Bad core list '" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+            wc.workers = static_cast<uint32_t>(wc.cores.size());
+            wc.periodMs = BUFFER_FRAMES * 1000.0 / SAMPLE_RATE;
+            workers = std::make_unique<nuchat::RtWorkerPool>(wc);
+            engine.setWorkerPool(workers.get());
+        }
+        else if (!std::strcmp(argv[i], "--record") && i + 1 < argc) {
+            std::string prefix = argv[++i];
+            engine.setRecordTaps(recorder.open((prefix + "-capture.wav").c_str()),
+                                 recorder.open((prefix + "-render.wav").c_str()));
+        }
+        else if (!std::strcmp(argv[i], "--codec") && i + 1 < argc)
+            codecName = argv[++i];
+        else if (!std::strcmp(argv[i], "--bitrate") && i + 1 < argc)
+            bitrate = static_cast<int32_t>(std::atoi(argv[++i]));
+    }
+
+    std::unique_ptr<nuchat::AudioCodec> codec = nuchat::make_codec(codecName, bitrate);
+    if (!codec) {
+        std::cerr << "Unknown or unavailable codec '" << codecName << "'" << std::endl;
+        return 1;
+    }
+    std::unique_ptr<nuchat::UdpTransport> transport;
+    if (!net.peer.empty()) {
+        transport = std::make_unique<nuchat::UdpTransport>(net);
+        transport->setCodec(codec.get());
+        if (!transport->open())
+            return 1;
+        engine.setTransport(transport.get());
+    }
+
+    std::unique_ptr<nuchat::LatencyProbe> probe;
+    if (probeConfig.trials > 0) {
+        probe = std::make_unique<nuchat::LatencyProbe>(probeConfig);
+        engine.setLatencyProbe(probe.get());
+    }
+
+    nuchat::EchoCanceller aec;
+    if (echoCancel)
+        engine.setEchoCanceller(&aec);
+
+    // Plain loopback; DSP stages are added to the graph here.
+    nuchat::ProcessingGraph graph;
+    engine.setProcessor(&graph);
+
+    nuchat::install_stop_handlers();
+    nuchat::AudioFormat want;
+    want.sampleRate = SAMPLE_RATE;
+    want.channels = CHANNELS;
+    want.framesPerPeriod = BUFFER_FRAMES;
+    if (!engine.start(want))
+        return 1;
+    recorder.start();
+
+    nuchat::MetricsExporter exporter;
+    exporter.add(&engine.captureMetrics());
+    exporter.add(&engine.renderMetrics());
+    if (metricsFormat) {
+        exporter.start(std::strcmp(metricsFormat, "prom") ? nuchat::MetricsFormat::Json
+                                                          : nuchat::MetricsFormat::Prometheus,
+                       metricsInterval, stdout);
+    }
+
+    if (probe) {
+        std::cout << "Measuring round-trip latency (" << probeConfig.trials << " trials)..." << std::endl;
+        while (!probe->step() && !nuchat::stop_requested())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::cout << probe->report() << std::endl;
+    } else {
+        if (transport)
+            std::cout << "Streaming to " << net.peer << " (" << transport->currentCodec().name() << ", "
+                      << transport->packetFrames() << "-frame packets)..." << std::endl;
+        else
+            std::cout << "Running... speak into the mic; you should hear yourself." << std::endl;
+        std::cout << "Press Ctrl+C to exit." << std::endl;
+        // Control lines on stdin while running, e.g. "mute on", "jitter-ms 20".
+        nuchat::run_console_until_stop(duration, [&engine](const char* line) {
+            if (!engine.command(line))
+                std::cerr << "Unknown control '" << line << "'" << std::endl;
+        });
+    }
+
+    exporter.stop();
+    engine.stop();
+    recorder.stop();
+    engine.report(stderr);
+    if (transport) {
+        transport->stop();
+        transport->report(stderr);
+    }
+    if (echoCancel)
+        aec.report(stderr);
+    if (workers)
+        workers->report(stderr);
     return 0;
 }
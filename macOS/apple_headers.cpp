@@ -0,0 +1,21 @@
+// apple_headers.cpp
+// Compile-only: instantiates the Apple-specific parts of the shared headers
+// so both reference-counting modes are built (see macOS/CMakeLists.txt).
+// apple_headers_arc.mm includes this file as Objective-C++ under -fobjc-arc.
+
+#include "../common/audio_engine.h"
+#include "../common/audio_workgroup.h"
+#include "../common/rt_workers.h"
+
+namespace nuchat {
+
+bool apple_headers_check(AudioUnit unit) {
+    RtWorkerConfig cfg;
+    RtWorkerPool pool(cfg);
+    RtSemaphore sem;
+    sem.post();
+    sem.wait();
+    return join_io_workgroup(pool, unit, 2.7);
+}
+
+} // namespace nuchat
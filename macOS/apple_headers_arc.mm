@@ -0,0 +1,5 @@
+// apple_headers_arc.mm
+// apple_headers.cpp as Objective-C++ under ARC, where NUCHAT_OS_OBJECT_ARC
+// is 1 and the manual os_release/dispatch_release calls must not appear.
+
+#include "apple_headers.cpp"
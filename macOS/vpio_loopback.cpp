@@ -1,6 +1,26 @@
 // File: vpio_loopback.cpp
 // Build: clang++ -std=c++17 vpio_loopback.cpp -framework AudioToolbox -framework AudioUnit -framework CoreAudio -o vpio_loopback
-// Run:   ./vpio_loopback
+// Run:   ./vpio_loopback [--jitter-ms 5.3] [--measure-latency N] [--metrics json|prom]
+//        [--metrics-interval S] [--peer host:port [--listen port] [--packet-ms 5]
+//        [--codec l16|opus] [--bitrate 32000]] [--workers N] [--duration S]
+//        [--record PREFIX] [--no-vad]
+// --peer streams the mic to another nuChat peer as RTP over UDP instead of
+// looping back locally; see common/udp_transport.h. --no-vad turns the VAD
+// off: silence is then processed and sent as audio instead of comfort-noise
+// descriptors.
+// Changing the default input or output device (or unplugging it) moves the
+// session to the new default without restarting the process. If the unit
+// cannot be brought up on the new pair, it says so and retries every 100 ms.
+// --workers N moves capture DSP onto N realtime worker threads
+// (common/rt_workers.h) that join the IO unit's audio workgroup, so the
+// scheduler runs them on performance cores against the IO deadline.
+// --record calls/qa writes what is sent to calls/qa-capture.wav and what is
+// played to calls/qa-render.wav from a writer thread (common/call_recorder.h);
+// the IO thread only copies into its rings.
+// Lines typed while running are control commands (common/control.h), e.g.
+// "capture-gain -6", "mute on", "jitter-ms 20".
+// Ctrl+C, SIGTERM or the end of --duration S stops the unit and prints a
+// summary of frames, xruns and buffering to stderr.
 // Note: First run will prompt for Microphone access on macOS.
 
 #include <AudioUnit/AudioUnit.h>
@@ -10,57 +30,28 @@
 #include <vector>
 #include <cstdio>
 #include <cstring>
-#include <pthread.h>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <algorithm>
+
+#include "../common/audio_codec.h"
+#include "../common/audio_engine.h"
+#include "../common/audio_workgroup.h"
+#include "../common/call_recorder.h"
+#include "../common/latency_probe.h"
+#include "../common/processing_graph.h"
+#include "../common/rt_log.h"
+#include "../common/shutdown.h"
+#include "../common/stream_metrics.h"
+#include "../common/udp_transport.h"
 
-static AudioUnit gAU = nullptr;
 static const double kSampleRate = 48000.0;
 static const UInt32 kChannels = 1;
 static const UInt32 kFramesPerSliceTarget = 64; // try 64 for low latency
 
-// --- Simple lock-free-ish single-producer/single-consumer float FIFO ---
-struct FloatFIFO {
-    std::vector<float> buf;
-    std::atomic<uint32_t> w{0}, r{0}; // indices in frames
-    uint32_t mask; // size-1 (power of two)
-
-    explicit FloatFIFO(uint32_t framesPow2) {
-        uint32_t sz = 1;
-        while (sz < framesPow2) sz <<= 1;
-        buf.resize(sz);
-        mask = sz - 1;
-    }
-    uint32_t push(const float* src, uint32_t n) {
-        uint32_t wi = w.load(std::memory_order_relaxed);
-        uint32_t ri = r.load(std::memory_order_acquire);
-        uint32_t freeFrames = ((mask + 1) - (wi - ri)) & mask;
-        if (n > freeFrames) n = freeFrames;
-        for (uint32_t i = 0; i < n; ++i)
-            buf[(wi + i) & mask] = src[i];
-        w.store((wi + n) & mask, std::memory_order_release);
-        return n;
-    }
-    uint32_t pop(float* dst, uint32_t n) {
-        uint32_t wi = w.load(std::memory_order_acquire);
-        uint32_t ri = r.load(std::memory_order_relaxed);
-        uint32_t avail = (wi - ri) & mask;
-        uint32_t got = (n <= avail) ? n : avail;
-        for (uint32_t i = 0; i < got; ++i)
-            dst[i] = buf[(ri + i) & mask];
-        r.store((ri + got) & mask, std::memory_order_release);
-        if (got < n) {
-            std::memset(dst + got, 0, (n - got) * sizeof(float));
-        }
-        return got;
-    }
-};
-
-static FloatFIFO gFifo(1 << 16); // 65536 frames (~1.36 s @ 48k)
-static void rt_set_realtime() {
-    pthread_t t = pthread_self();
-    struct sched_param sp {};
-    sp.sched_priority = 46;
-    pthread_setschedparam(t, SCHED_RR, &sp);
-}
+static nuchat::RtLog gLog; // errors raised on the IO thread
 
 static void print_error(const char* where, OSStatus s) {
     char cc[5]; *(UInt32*)cc = CFSwapInt32HostToBig(s); cc[4] = 0;
@@ -70,43 +61,53 @@ static void print_error(const char* where, OSStatus s) {
         std::fprintf(stderr, "%s: OSStatus %d\n", where, (int)s);
 }
 
-static OSStatus InputCallback(void*, AudioUnitRenderActionFlags* ioActionFlags,
-                              const AudioTimeStamp* inTimeStamp,
-                              UInt32, UInt32 inNumberFrames, AudioBufferList*) {
-    rt_set_realtime();
-    std::vector<float> temp(inNumberFrames);
-    AudioBufferList abl{};
-    abl.mNumberBuffers = 1;
-    abl.mBuffers[0].mNumberChannels = kChannels;
-    abl.mBuffers[0].mData = temp.data();
-    abl.mBuffers[0].mDataByteSize = inNumberFrames * sizeof(float);
-    OSStatus s = AudioUnitRender(gAU, ioActionFlags, inTimeStamp, 1, inNumberFrames, &abl);
-    if (s != noErr) { print_error("AudioUnitRender (input)", s); return s; }
-    gFifo.push(temp.data(), inNumberFrames);
-    return noErr;
+// Analyses finished latency trials on the main run loop and stops it once
+// all of them have run.
+static void step_probe(CFRunLoopTimerRef, void* probe) {
+    if (static_cast<nuchat::LatencyProbe*>(probe)->step()) CFRunLoopStop(CFRunLoopGetMain());
 }
 
-static OSStatus RenderCallback(void*, AudioUnitRenderActionFlags*,
-                               const AudioTimeStamp*, UInt32, UInt32 inNumberFrames,
-                               AudioBufferList* ioData) {
-    rt_set_realtime();
-    float* out = static_cast<float*>(ioData->mBuffers[0].mData);
-    gFifo.pop(out, inNumberFrames);
-    return noErr;
+// Main run loop: leaves it once Ctrl+C or the end of --duration asked to.
+static void check_stop(CFRunLoopTimerRef, void*) {
+    if (nuchat::stop_requested()) CFRunLoopStop(CFRunLoopGetMain());
 }
 
-static void try_set_device_buffer(UInt32 frames) {
-    AudioObjectID outDev = kAudioObjectUnknown, inDev = kAudioObjectUnknown;
-    UInt32 sz = sizeof(AudioObjectID);
-    AudioObjectPropertyAddress addrDev {
-        kAudioHardwarePropertyDefaultOutputDevice,
+// Runs on the main run loop, never on the IO thread.
+static void drain_rt_log(CFRunLoopTimerRef, void*) {
+    gLog.drain([](const nuchat::RtLogEntry& e) { print_error(e.where, (OSStatus)e.code); });
+    if (uint64_t lost = gLog.takeDropped())
+        std::fprintf(stderr, "(%llu realtime log records dropped)\n", (unsigned long long)lost);
+}
+
+static AudioObjectID default_device(AudioObjectPropertySelector which) {
+    AudioObjectID dev = kAudioObjectUnknown;
+    UInt32 sz = sizeof(dev);
+    AudioObjectPropertyAddress addr {
+        which,
+        kAudioObjectPropertyScopeGlobal,
+        kAudioObjectPropertyElementMain
+    };
+    AudioObjectGetPropertyData(kAudioObjectSystemObject, &addr, 0, nullptr, &sz, &dev);
+    return dev;
+}
+
+static Float64 nominal_rate(AudioObjectID dev) {
+    Float64 rate = 0;
+    UInt32 sz = sizeof(rate);
+    AudioObjectPropertyAddress addr {
+        kAudioDevicePropertyNominalSampleRate,
         kAudioObjectPropertyScopeGlobal,
         kAudioObjectPropertyElementMain
     };
-    AudioObjectGetPropertyData(kAudioObjectSystemObject, &addrDev, 0, nullptr, &sz, &outDev);
-    addrDev.mSelector = kAudioHardwarePropertyDefaultInputDevice;
-    sz = sizeof(AudioObjectID);
-    AudioObjectGetPropertyData(kAudioObjectSystemObject, &addrDev, 0, nullptr, &sz, &inDev);
+    if (dev == kAudioObjectUnknown ||
+        AudioObjectGetPropertyData(dev, &addr, 0, nullptr, &sz, &rate) != noErr)
+        return 0;
+    return rate;
+}
+
+static void try_set_device_buffer(UInt32 frames) {
+    AudioObjectID outDev = default_device(kAudioHardwarePropertyDefaultOutputDevice);
+    AudioObjectID inDev = default_device(kAudioHardwarePropertyDefaultInputDevice);
 
     AudioObjectPropertyAddress addr {
         kAudioDevicePropertyBufferFrameSize,
@@ -119,44 +120,479 @@ static void try_set_device_buffer(UInt32 frames) {
         AudioObjectSetPropertyData(inDev, &addr, 0, nullptr, sizeof(frames), &frames);
 }
 
-int main() {
-    try_set_device_buffer(kFramesPerSliceTarget);
-    AudioComponentDescription desc{};
-    desc.componentType = kAudioUnitType_Output;
-    desc.componentSubType = kAudioUnitSubType_VoiceProcessingIO;
-    desc.componentManufacturer = kAudioUnitManufacturer_Apple;
-
-    AudioComponent comp = AudioComponentFindNext(nullptr, &desc);
-    if (!comp) { std::fprintf(stderr, "VoiceProcessingIO not found.\n"); return 1; }
-    if (AudioComponentInstanceNew(comp, &gAU) != noErr) return 1;
-
-    UInt32 one = 1;
-    AudioUnitSetProperty(gAU, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Input, 1, &one, sizeof(one));
-    AudioUnitSetProperty(gAU, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Output, 0, &one, sizeof(one));
-
-    AudioStreamBasicDescription asbd{};
-    asbd.mSampleRate = kSampleRate;
-    asbd.mFormatID = kAudioFormatLinearPCM;
-    asbd.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
-    asbd.mChannelsPerFrame = kChannels;
-    asbd.mBitsPerChannel = 32;
-    asbd.mFramesPerPacket = 1;
-    asbd.mBytesPerFrame = 4;
-    asbd.mBytesPerPacket = 4;
-    AudioUnitSetProperty(gAU, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &asbd, sizeof(asbd));
-    AudioUnitSetProperty(gAU, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &asbd, sizeof(asbd));
-
-    AURenderCallbackStruct inCb{InputCallback, nullptr};
-    AudioUnitSetProperty(gAU, kAudioOutputUnitProperty_SetInputCallback, kAudioUnitScope_Global, 0, &inCb, sizeof(inCb));
-    AURenderCallbackStruct outCb{RenderCallback, nullptr};
-    AudioUnitSetProperty(gAU, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &outCb, sizeof(outCb));
-
-    AudioUnitInitialize(gAU);
-    AudioOutputUnitStart(gAU);
-    std::puts("Running… speak into the mic; you should hear near-instant playback. Press Ctrl+C to quit.");
+static UInt32 device_buffer_frames(AudioObjectID dev) {
+    UInt32 frames = 0, sz = sizeof(frames);
+    AudioObjectPropertyAddress addr {
+        kAudioDevicePropertyBufferFrameSize,
+        kAudioObjectPropertyScopeGlobal,
+        kAudioObjectPropertyElementMain
+    };
+    if (dev == kAudioObjectUnknown ||
+        AudioObjectGetPropertyData(dev, &addr, 0, nullptr, &sz, &frames) != noErr)
+        return 0;
+    return frames;
+}
+
+// Frames between a buffer's timestamp and the converter, on one side of the
+// device: its own latency plus the safety offset the HAL keeps.
+static UInt32 device_latency_frames(AudioObjectID dev, AudioObjectPropertyScope scope) {
+    UInt32 total = 0;
+    for (AudioObjectPropertySelector sel : {kAudioDevicePropertyLatency, kAudioDevicePropertySafetyOffset}) {
+        UInt32 frames = 0, sz = sizeof(frames);
+        AudioObjectPropertyAddress addr{sel, scope, kAudioObjectPropertyElementMain};
+        if (dev != kAudioObjectUnknown && AudioObjectGetPropertyData(dev, &addr, 0, nullptr, &sz, &frames) == noErr)
+            total += frames;
+    }
+    return total;
+}
+
+// HAL overload notifications are the closest thing CoreAudio has to an xrun
+// report; they arrive on a HAL notification thread.
+static const AudioObjectPropertyAddress kOverloadAddr {
+    kAudioDeviceProcessorOverload,
+    kAudioObjectPropertyScopeGlobal,
+    kAudioObjectPropertyElementMain
+};
+
+static OSStatus on_overload(AudioObjectID, UInt32, const AudioObjectPropertyAddress*, void* metrics) {
+    static_cast<nuchat::StreamMetrics*>(metrics)->addXrun();
+    return noErr;
+}
+
+static const AudioObjectPropertyAddress kDefaultInputAddr {
+    kAudioHardwarePropertyDefaultInputDevice,
+    kAudioObjectPropertyScopeGlobal,
+    kAudioObjectPropertyElementMain
+};
+static const AudioObjectPropertyAddress kDefaultOutputAddr {
+    kAudioHardwarePropertyDefaultOutputDevice,
+    kAudioObjectPropertyScopeGlobal,
+    kAudioObjectPropertyElementMain
+};
+
+// HAL notification thread: hands the change to the main run loop, where the
+// unit may safely be reconfigured.
+static OSStatus on_default_device(AudioObjectID, UInt32, const AudioObjectPropertyAddress*, void* source) {
+    CFRunLoopSourceSignal(static_cast<CFRunLoopSourceRef>(source));
+    CFRunLoopWakeUp(CFRunLoopGetMain());
+    return noErr;
+}
+
+class VpioEngine : public nuchat::AudioEngine {
+public:
+    bool bypassVoiceProcessing = false;
+
+    const char* name() const override { return "vpio"; }
+
+    bool start(const nuchat::AudioFormat& want) override {
+        try_set_device_buffer(want.framesPerPeriod);
+        AudioComponentDescription desc{};
+        desc.componentType = kAudioUnitType_Output;
+        desc.componentSubType = kAudioUnitSubType_VoiceProcessingIO;
+        desc.componentManufacturer = kAudioUnitManufacturer_Apple;
+
+        AudioComponent comp = AudioComponentFindNext(nullptr, &desc);
+        if (!comp) { std::fprintf(stderr, "VoiceProcessingIO not found.\n"); return false; }
+        if (AudioComponentInstanceNew(comp, &au) != noErr) return false;
+
+        UInt32 one = 1;
+        AudioUnitSetProperty(au, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Input, 1, &one, sizeof(one));
+        AudioUnitSetProperty(au, kAudioOutputUnitProperty_EnableIO, kAudioUnitScope_Output, 0, &one, sizeof(one));
+
+        Float64 devRate = setClientRate(want.sampleRate);
+
+        if (bypassVoiceProcessing) {
+            UInt32 bypass = 1;
+            AudioUnitSetProperty(au, kAUVoiceIOProperty_BypassVoiceProcessing, kAudioUnitScope_Global, 0,
+                                 &bypass, sizeof(bypass));
+        }
+
+        AURenderCallbackStruct inCb{InputCallback, this};
+        AudioUnitSetProperty(au, kAudioOutputUnitProperty_SetInputCallback, kAudioUnitScope_Global, 0, &inCb, sizeof(inCb));
+        AURenderCallbackStruct outCb{RenderCallback, this};
+        AudioUnitSetProperty(au, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &outCb, sizeof(outCb));
+
+        OSStatus s = AudioUnitInitialize(au);
+        if (s != noErr) { print_error("AudioUnitInitialize", s); return false; }
+        joinWorkgroup(devRate);
+        measureDeviceLatency(devRate);
+
+        UInt32 maxFrames = sizeInputScratch();
+
+        nuchat::AudioFormat granted = want;
+        granted.channels = kChannels;
+        nuchat::DeviceFormat dev{nuchat::SampleFormat::Float32, kChannels, false, (uint32_t)devRate};
+        setDeviceFormats(dev, dev);
+        prepare(granted, maxFrames);
+        if (devRate != want.sampleRate)
+            std::fprintf(stderr, "Device at %.0f Hz, resampling to %.0f Hz\n", devRate, want.sampleRate);
+
+        watchOverloads();
+
+        CFRunLoopSourceContext ctx{};
+        ctx.info = this;
+        ctx.perform = [](void* self) { static_cast<VpioEngine*>(self)->onDefaultDeviceChanged(); };
+        deviceSource = CFRunLoopSourceCreate(nullptr, 0, &ctx);
+        CFRunLoopAddSource(CFRunLoopGetMain(), deviceSource, kCFRunLoopCommonModes);
+        AudioObjectAddPropertyListener(kAudioObjectSystemObject, &kDefaultInputAddr, on_default_device, deviceSource);
+        AudioObjectAddPropertyListener(kAudioObjectSystemObject, &kDefaultOutputAddr, on_default_device, deviceSource);
+
+        s = AudioOutputUnitStart(au);
+        if (s != noErr) { print_error("AudioOutputUnitStart", s); return false; }
+        return true;
+    }
+
+    void stop() override {
+        if (!au) return;
+        cancelRetry();
+        if (deviceSource) {
+            AudioObjectRemovePropertyListener(kAudioObjectSystemObject, &kDefaultInputAddr, on_default_device, deviceSource);
+            AudioObjectRemovePropertyListener(kAudioObjectSystemObject, &kDefaultOutputAddr, on_default_device, deviceSource);
+            CFRunLoopSourceInvalidate(deviceSource);
+            CFRelease(deviceSource);
+            deviceSource = nullptr;
+        }
+        if (!down) {
+            AudioOutputUnitStop(au);
+            unwatchOverloads();
+        }
+        down = false;
+        AudioUnitUninitialize(au);
+        AudioComponentInstanceDispose(au);
+        au = nullptr;
+    }
+
+private:
+    // Both client formats run at the output device's nominal rate so the
+    // unit does no rate conversion of its own; AudioEngine resamples to the
+    // processing rate with its polyphase stage instead. Only while the unit
+    // is uninitialized. Returns the rate.
+    Float64 setClientRate(Float64 fallback) {
+        Float64 devRate = nominal_rate(default_device(kAudioHardwarePropertyDefaultOutputDevice));
+        if (devRate <= 0) devRate = fallback;
+        AudioStreamBasicDescription asbd{};
+        asbd.mSampleRate = devRate;
+        asbd.mFormatID = kAudioFormatLinearPCM;
+        asbd.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+        asbd.mChannelsPerFrame = kChannels;
+        asbd.mBitsPerChannel = 32;
+        asbd.mFramesPerPacket = 1;
+        asbd.mBytesPerFrame = 4;
+        asbd.mBytesPerPacket = 4;
+        AudioUnitSetProperty(au, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 1, &asbd, sizeof(asbd));
+        AudioUnitSetProperty(au, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &asbd, sizeof(asbd));
+        return devRate;
+    }
+
+    // The IO thread runs CoreAudio's own time-constraint policy and is in
+    // the device's workgroup already; only helper threads need to join.
+    // Once per initialization, since a new device brings a new workgroup.
+    void joinWorkgroup(Float64 devRate) {
+        nuchat::RtWorkerPool* pool = workerPool();
+        if (!pool) return;
+        UInt32 frames = device_buffer_frames(default_device(kAudioHardwarePropertyDefaultOutputDevice));
+        if (frames == 0) frames = kFramesPerSliceTarget;
+        nuchat::join_io_workgroup(*pool, au, frames * 1000.0 / devRate);
+    }
+
+    // For the timestamps: input was at the converter this long before
+    // mHostTime, output reaches it this long after. Only while stopped.
+    void measureDeviceLatency(Float64 devRate) {
+        auto ns = [devRate](UInt32 frames) { return nuchat::frames_to_ns(frames, devRate); };
+        inLatencyNs = ns(device_latency_frames(default_device(kAudioHardwarePropertyDefaultInputDevice),
+                                               kAudioObjectPropertyScopeInput));
+        outLatencyNs = ns(device_latency_frames(default_device(kAudioHardwarePropertyDefaultOutputDevice),
+                                                kAudioObjectPropertyScopeOutput));
+    }
+
+    // The largest slice the unit may hand us; the input callback renders
+    // into this buffer and never allocates. Only while the unit is stopped.
+    UInt32 sizeInputScratch() {
+        UInt32 maxFrames = 0, sz = sizeof(maxFrames);
+        OSStatus s = AudioUnitGetProperty(au, kAudioUnitProperty_MaximumFramesPerSlice,
+                                          kAudioUnitScope_Global, 0, &maxFrames, &sz);
+        if (s != noErr || maxFrames == 0) maxFrames = 4096;
+        inputScratch.assign(maxFrames * kChannels, 0.0f);
+        return maxFrames;
+    }
+
+    void watchOverloads() {
+        outDev = default_device(kAudioHardwarePropertyDefaultOutputDevice);
+        inDev = default_device(kAudioHardwarePropertyDefaultInputDevice);
+        AudioObjectAddPropertyListener(outDev, &kOverloadAddr, on_overload, &renMetrics);
+        AudioObjectAddPropertyListener(inDev, &kOverloadAddr, on_overload, &capMetrics);
+    }
+
+    void unwatchOverloads() {
+        AudioObjectRemovePropertyListener(outDev, &kOverloadAddr, on_overload, &renMetrics);
+        AudioObjectRemovePropertyListener(inDev, &kOverloadAddr, on_overload, &capMetrics);
+    }
+
+    // Main run loop. VoiceProcessingIO drives both directions from one unit
+    // and binds the default devices when it is initialized, so a change on
+    // either side re-initializes the unit on the new pair. Only the device
+    // side of the engine is rebuilt (AudioEngine::reopenCapture/Render):
+    // FIFO, jitter buffer and DSP state carry over.
+    void onDefaultDeviceChanged() {
+        if (!au) return;
+        AudioObjectID newOut = default_device(kAudioHardwarePropertyDefaultOutputDevice);
+        AudioObjectID newIn = default_device(kAudioHardwarePropertyDefaultInputDevice);
+        if (!down && newOut == outDev && newIn == inDev) return;
+        rebind();
+    }
+
+    // Main run loop: re-initializes the unit on the current default pair.
+    // If that fails the unit is left uninitialized and a timer retries every
+    // kRetrySeconds, since another device notification may never come; the
+    // stream is down (and logged as such) until a retry succeeds.
+    void rebind() {
+        if (!au) return;
+        if (!down) {
+            AudioOutputUnitStop(au);
+            unwatchOverloads();
+        }
+        AudioUnitUninitialize(au);
+        try_set_device_buffer(fmt.framesPerPeriod);
+        Float64 devRate = setClientRate(fmt.sampleRate);
+        OSStatus s = AudioUnitInitialize(au);
+        if (s != noErr) { streamDown("AudioUnitInitialize (device change)", s); return; }
+        joinWorkgroup(devRate);
+        measureDeviceLatency(devRate);
+        sizeInputScratch();
+        nuchat::DeviceFormat dev{nuchat::SampleFormat::Float32, kChannels, false, (uint32_t)devRate};
+        reopenCapture(dev);
+        reopenRender(dev);
+        watchOverloads();
+        s = AudioOutputUnitStart(au);
+        if (s != noErr) {
+            unwatchOverloads();
+            AudioUnitUninitialize(au);
+            streamDown("AudioOutputUnitStart (device change)", s);
+            return;
+        }
+        bool recovered = down;
+        down = false;
+        cancelRetry();
+        std::fprintf(stderr, recovered ? "Audio stream restored; now at %.0f Hz\n"
+                                       : "Default device changed; now at %.0f Hz\n", devRate);
+    }
+
+    void streamDown(const char* where, OSStatus s) {
+        if (!down) {
+            print_error(where, s);
+            std::fprintf(stderr, "Audio stream down; retrying every %.0f ms\n", kRetrySeconds * 1000);
+        }
+        down = true;
+        if (retryTimer) return;
+        CFRunLoopTimerContext ctx{0, this, nullptr, nullptr, nullptr};
+        auto retry = [](CFRunLoopTimerRef, void* self) { static_cast<VpioEngine*>(self)->rebind(); };
+        retryTimer = CFRunLoopTimerCreate(nullptr, CFAbsoluteTimeGetCurrent() + kRetrySeconds, kRetrySeconds, 0, 0,
+                                          retry, &ctx);
+        CFRunLoopAddTimer(CFRunLoopGetMain(), retryTimer, kCFRunLoopCommonModes);
+    }
+
+    void cancelRetry() {
+        if (!retryTimer) return;
+        CFRunLoopTimerInvalidate(retryTimer);
+        CFRelease(retryTimer);
+        retryTimer = nullptr;
+    }
+
+    static OSStatus InputCallback(void* inRefCon, AudioUnitRenderActionFlags* ioActionFlags,
+                                  const AudioTimeStamp* inTimeStamp,
+                                  UInt32, UInt32 inNumberFrames, AudioBufferList*) {
+        auto* self = static_cast<VpioEngine*>(inRefCon);
+        if (inNumberFrames * kChannels > self->inputScratch.size()) {
+            gLog.post("InputCallback: slice exceeds MaximumFramesPerSlice", kAudioUnitErr_TooManyFramesToProcess);
+            return kAudioUnitErr_TooManyFramesToProcess;
+        }
+        AudioBufferList abl{};
+        abl.mNumberBuffers = 1;
+        abl.mBuffers[0].mNumberChannels = kChannels;
+        abl.mBuffers[0].mData = self->inputScratch.data();
+        abl.mBuffers[0].mDataByteSize = inNumberFrames * kChannels * sizeof(float);
+        OSStatus s = AudioUnitRender(self->au, ioActionFlags, inTimeStamp, 1, inNumberFrames, &abl);
+        if (s != noErr) {
+            self->capMetrics.addXrun();
+            gLog.post("AudioUnitRender (input)", s);
+            return s;
+        }
+        if (inTimeStamp->mFlags & kAudioTimeStampSampleTimeValid)
+            self->noteCapturePosition((uint64_t)inTimeStamp->mSampleTime, inNumberFrames);
+        if (inTimeStamp->mFlags & kAudioTimeStampHostTimeValid)
+            self->noteCaptureTime(nuchat::host_ns_from_mach(inTimeStamp->mHostTime) - self->inLatencyNs);
+        const void* bufs[1] = {self->inputScratch.data()};
+        self->onCaptureDevice(bufs, inNumberFrames);
+        return noErr;
+    }
+
+    static OSStatus RenderCallback(void* inRefCon, AudioUnitRenderActionFlags*,
+                                   const AudioTimeStamp* inTimeStamp, UInt32, UInt32 inNumberFrames,
+                                   AudioBufferList* ioData) {
+        auto* self = static_cast<VpioEngine*>(inRefCon);
+        if (inTimeStamp->mFlags & kAudioTimeStampHostTimeValid)
+            self->noteRenderTime(nuchat::host_ns_from_mach(inTimeStamp->mHostTime) + self->outLatencyNs);
+        void* bufs[1] = {ioData->mBuffers[0].mData};
+        self->onRenderDevice(bufs, inNumberFrames);
+        return noErr;
+    }
+
+    AudioUnit au = nullptr;
+    AudioObjectID outDev = kAudioObjectUnknown, inDev = kAudioObjectUnknown;
+    CFRunLoopSourceRef deviceSource = nullptr; // signalled on default-device changes
+    static constexpr double kRetrySeconds = 0.1;
+    CFRunLoopTimerRef retryTimer = nullptr; // while down
+    bool down = false; // a rebind failed: uninitialized, overloads not watched
+    std::vector<float> inputScratch; // sized from MaximumFramesPerSlice
+    uint64_t inLatencyNs = 0, outLatencyNs = 0;
+};
+
+int main(int argc, char** argv) {
+    std::unique_ptr<nuchat::RtWorkerPool> workers; // outlives the engine
+    nuchat::CallRecorder recorder;                 // likewise
+    VpioEngine engine;
+    nuchat::LatencyProbeConfig probeConfig;
+    probeConfig.sampleRate = kSampleRate;
+    probeConfig.trials = 0;
+    const char* metricsFormat = nullptr;
+    double metricsInterval = 5.0;
+    double jitterMs = 0.0;
+    nuchat::TransportConfig net;
+    const char* codecName = "l16";
+    int32_t bitrate = 32000;
+    double duration = 0.0;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--jitter-ms") && i + 1 < argc)
+            jitterMs = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--duration") && i + 1 < argc)
+            duration = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--measure-latency") && i + 1 < argc)
+            probeConfig.trials = static_cast<uint32_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--metrics") && i + 1 < argc)
+            metricsFormat = argv[++i];
+        else if (!std::strcmp(argv[i], "--metrics-interval") && i + 1 < argc)
+            metricsInterval = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--peer") && i + 1 < argc)
+            net.peer = argv[++i];
+        else if (!std::strcmp(argv[i], "--listen") && i + 1 < argc)
+            net.localPort = static_cast<uint16_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--packet-ms") && i + 1 < argc)
+            net.packetMs = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--no-vad"))
+            engine.setSilenceSuppression(false);
+        else if (!std::strcmp(argv[i], "--record") && i + 1 < argc) {
+            std::string prefix = argv[++i];
+            engine.setRecordTaps(recorder.open((prefix + "-capture.wav").c_str()),
+                                 recorder.open((prefix + "-render.wav").c_str()));
+        }
+        else if (!std::strcmp(argv[i], "--codec") && i + 1 < argc)
+            codecName = argv[++i];
+        else if (!std::strcmp(argv[i], "--bitrate") && i + 1 < argc)
+            bitrate = static_cast<int32_t>(std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+            // Apple platforms do not pin threads; the workgroup steers them.
+            nuchat::RtWorkerConfig wc;
+            wc.workers = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+            wc.periodMs = kFramesPerSliceTarget * 1000.0 / kSampleRate;
+            workers = std::make_unique<nuchat::RtWorkerPool>(wc);
+            engine.setWorkerPool(workers.get());
+        }
+    }
+    // Local loopback defaults to ~5.3 ms; network mode sizes the jitter
+    // buffer from the packet duration.
+    if (jitterMs <= 0 && net.peer.empty())
+        jitterMs = kFramesPerSliceTarget * 4 * 1000.0 / kSampleRate;
+    engine.setJitterTargetMs(jitterMs);
+
+    std::unique_ptr<nuchat::AudioCodec> codec = nuchat::make_codec(codecName, bitrate);
+    if (!codec) {
+        std::fprintf(stderr, "Unknown or unavailable codec '%s'\n", codecName);
+        return 1;
+    }
+    std::unique_ptr<nuchat::UdpTransport> transport;
+    if (!net.peer.empty()) {
+        transport = std::make_unique<nuchat::UdpTransport>(net);
+        transport->setCodec(codec.get());
+        if (!transport->open()) return 1;
+        engine.setTransport(transport.get());
+    }
+    std::unique_ptr<nuchat::LatencyProbe> probe;
+    if (probeConfig.trials > 0) {
+        probe = std::make_unique<nuchat::LatencyProbe>(probeConfig);
+        engine.setLatencyProbe(probe.get());
+        // The echo canceller would remove the probe burst from the capture path.
+        engine.bypassVoiceProcessing = true;
+    }
+
+    // Plain loopback; DSP stages are added to the graph here.
+    nuchat::ProcessingGraph graph;
+    engine.setProcessor(&graph);
+
+    CFRunLoopTimerRef logTimer = CFRunLoopTimerCreate(nullptr, CFAbsoluteTimeGetCurrent(), 0.1,
+                                                      0, 0, drain_rt_log, nullptr);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), logTimer, kCFRunLoopCommonModes);
+    nuchat::install_stop_handlers();
+    CFRunLoopTimerRef stopTimer = CFRunLoopTimerCreate(nullptr, CFAbsoluteTimeGetCurrent(), 0.05,
+                                                       0, 0, check_stop, nullptr);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), stopTimer, kCFRunLoopCommonModes);
+
+    nuchat::AudioFormat want;
+    want.sampleRate = kSampleRate;
+    want.channels = kChannels;
+    want.framesPerPeriod = kFramesPerSliceTarget;
+    if (!engine.start(want)) { engine.stop(); return 1; }
+    recorder.start();
+
+    nuchat::MetricsExporter exporter;
+    exporter.add(&engine.captureMetrics());
+    exporter.add(&engine.renderMetrics());
+    if (metricsFormat) {
+        exporter.start(std::strcmp(metricsFormat, "prom") ? nuchat::MetricsFormat::Json
+                                                          : nuchat::MetricsFormat::Prometheus,
+                       metricsInterval, stdout);
+    }
+
+    CFRunLoopTimerRef probeTimer = nullptr;
+    if (probe) {
+        std::printf("Measuring round-trip latency (%u trials)...\n", probeConfig.trials);
+        CFRunLoopTimerContext ctx{0, probe.get(), nullptr, nullptr, nullptr};
+        probeTimer = CFRunLoopTimerCreate(nullptr, CFAbsoluteTimeGetCurrent(), 0.01, 0, 0, step_probe, &ctx);
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), probeTimer, kCFRunLoopCommonModes);
+    } else if (transport) {
+        std::printf("Streaming to %s (%s, %u-frame packets). Press Ctrl+C to quit.\n", net.peer.c_str(),
+                    transport->currentCodec().name(), transport->packetFrames());
+    } else {
+        std::puts("Running… speak into the mic; you should hear near-instant playback. Press Ctrl+C to quit.");
+    }
+    // The main thread belongs to the run loop; stdin and --duration get
+    // their own, which raises the stop flag that check_stop() acts on.
+    std::thread console([&engine, duration] {
+        nuchat::run_console_until_stop(duration, [&engine](const char* line) {
+            if (!engine.command(line))
+                std::fprintf(stderr, "Unknown control '%s'\n", line);
+        });
+    });
     CFRunLoopRun();
-    AudioOutputUnitStop(gAU);
-    AudioUnitUninitialize(gAU);
-    AudioComponentInstanceDispose(gAU);
+    nuchat::request_stop(); // when the probe ended the run loop instead
+    console.join();
+    if (probeTimer) {
+        CFRunLoopTimerInvalidate(probeTimer);
+        CFRelease(probeTimer);
+        std::puts(probe->report().c_str());
+    }
+    engine.stop();
+    recorder.stop();
+    exporter.stop();
+    engine.report(stderr);
+    if (transport) {
+        transport->stop();
+        transport->report(stderr);
+    }
+    if (workers) workers->report(stderr);
+    CFRunLoopTimerInvalidate(stopTimer);
+    CFRelease(stopTimer);
+    CFRunLoopTimerInvalidate(logTimer);
+    CFRelease(logTimer);
+    drain_rt_log(nullptr, nullptr);
     return 0;
 }
@@ -3,148 +3,716 @@
 // Captures mic input and plays back to default output in real time.
 //
 // Build:
-//   cl /EHsc /std:c++17 wasapi_loopback.cpp /link ole32.lib avrt.lib
+//   cmake -S .. -B build && cmake --build build --config Release --target wasapi_voice_loopback
+// or
+//   cl /EHsc /O2 /std:c++17 wasapi_loopback.cpp /link ole32.lib avrt.lib ws2_32.lib
 //
 // Run:
-//   ./wasapi_loopback.exe
+//   ./wasapi_loopback.exe [--jitter-ms 10] [--mode shared|low-latency|exclusive]
+//                         [--measure-latency N] [--metrics json|prom] [--metrics-interval S] [--no-aec]
+//                         [--workers CORE[,CORE...]] [--duration S] [--record PREFIX] [--no-vad]
+//                         [--peer host:port [--listen port] [--packet-ms 5]
+//                         [--codec l16|opus] [--bitrate 32000]]
+//
+// Modes:
+//   shared       classic shared-mode stream; the engine period is ~10 ms.
+//   low-latency  IAudioClient3::InitializeSharedAudioStream at the engine's
+//                minimum period (typically 128 frames / 2.67 ms at 48 kHz).
+//   exclusive    event-driven exclusive stream at the device minimum period,
+//                after IsFormatSupported negotiation.
+// Each mode falls back to the next more conservative one if the device or
+// driver refuses it. The granted period per device is printed at startup.
+//
+// Unplugging an endpoint or changing the default device reopens just that
+// stream on the new default (IMMNotificationClient); the session keeps going.
+//
+// Capture runs through the common echo canceller (eCommunications capture
+// only gets the system AEC with a communications render stream); --no-aec
+// turns it off.
+//
+// --workers 2,3 runs capture DSP on MMCSS "Pro Audio" workers pinned to
+// those cores (common/rt_workers.h) instead of on the capture thread.
+//
+// --record calls\qa writes what is sent to calls\qa-capture.wav and what is
+// played to calls\qa-render.wav from a writer thread (common/call_recorder.h);
+// the stream threads only copy into its rings.
+//
+// --peer streams the mic to another nuChat peer as RTP over UDP instead of
+// looping back locally; see common/udp_transport.h. --no-vad turns the VAD
+// off: silence is then processed and sent as audio instead of comfort-noise
+// descriptors.
+//
+// Lines typed while running are control commands (common/control.h), e.g.
+// "capture-gain -6", "mute on", "jitter-ms 20", "aec off".
+//
+// Ctrl+C, closing the console or the end of --duration S stops both streams
+// and prints a summary of frames, xruns and buffering to stderr.
 
 #define _WIN32_DCOM
+#define NOMINMAX
+#include <winsock2.h> // before windows.h, which would pull in winsock 1
 #include <windows.h>
 #include <mmdeviceapi.h>
 #include <audioclient.h>
+#include <mmreg.h>
+#include <ksmedia.h>
 #include <avrt.h>
+#include <algorithm>
 #include <atomic>
 #include <vector>
 #include <thread>
 #include <iostream>
+#include <string>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "../common/audio_codec.h"
+#include "../common/audio_engine.h"
+#include "../common/call_recorder.h"
+#include "../common/echo_canceller.h"
+#include "../common/latency_probe.h"
+#include "../common/processing_graph.h"
+#include "../common/shutdown.h"
+#include "../common/stream_metrics.h"
+#include "../common/udp_transport.h"
 
 static const REFERENCE_TIME HNS_PER_SEC = 10000000; // 100ns units
 static const UINT32 SAMPLE_RATE = 48000;
-static const UINT32 CHANNELS = 1;
+static const UINT32 CHANNELS = 1; // internal; endpoints keep their own layout
 static const UINT32 BUFFER_FRAMES = 128;
 
-struct FloatFIFO {
-    std::vector<float> buf;
-    std::atomic<uint32_t> w{0}, r{0};
-    uint32_t mask;
-    explicit FloatFIFO(uint32_t framesPow2) {
-        uint32_t sz = 1; while (sz < framesPow2) sz <<= 1;
-        buf.resize(sz);
-        mask = sz - 1;
-    }
-    void push(const float* src, uint32_t n) {
-        uint32_t wi = w.load(std::memory_order_relaxed);
-        uint32_t ri = r.load(std::memory_order_acquire);
-        uint32_t freeFrames = ((mask + 1) - (wi - ri)) & mask;
-        if (n > freeFrames) n = freeFrames;
-        for (uint32_t i = 0; i < n; ++i)
-            buf[(wi + i) & mask] = src[i];
-        w.store((wi + n) & mask, std::memory_order_release);
-    }
-    void pop(float* dst, uint32_t n) {
-        uint32_t wi = w.load(std::memory_order_acquire);
-        uint32_t ri = r.load(std::memory_order_relaxed);
-        uint32_t avail = (wi - ri) & mask;
-        uint32_t got = (n <= avail) ? n : avail;
-        for (uint32_t i = 0; i < got; ++i)
-            dst[i] = buf[(ri + i) & mask];
-        r.store((ri + got) & mask, std::memory_order_release);
-        if (got < n)
-            std::fill(dst + got, dst + n, 0.0f);
-    }
+enum class StreamMode { Shared, LowLatency, Exclusive };
+
+// What the engine actually granted for one endpoint.
+struct StreamInfo {
+    StreamMode mode = StreamMode::Shared;
+    UINT32 periodFrames = 0;
+    UINT32 bufferFrames = 0;
+    nuchat::DeviceFormat device; // sample layout of the endpoint buffer
 };
 
-static FloatFIFO gFifo(1 << 16);
+static const char* mode_name(StreamMode m) {
+    switch (m) {
+    case StreamMode::LowLatency: return "low-latency shared (IAudioClient3)";
+    case StreamMode::Exclusive:  return "exclusive";
+    default:                     return "shared";
+    }
+}
+
+// Maps a WAVEFORMATEX(TENSIBLE) onto the layouts nuchat::FormatAdapter can
+// convert. WASAPI buffers are always interleaved.
+static bool device_format_of(const WAVEFORMATEX* w, nuchat::DeviceFormat& dev) {
+    bool isFloat = w->wFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+    bool isPcm = w->wFormatTag == WAVE_FORMAT_PCM;
+    if (w->wFormatTag == WAVE_FORMAT_EXTENSIBLE && w->cbSize >= 22) {
+        const WAVEFORMATEXTENSIBLE* x = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(w);
+        isFloat = x->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+        isPcm = x->SubFormat == KSDATAFORMAT_SUBTYPE_PCM;
+    }
+    if (w->nChannels == 0 || w->nChannels > nuchat::kMaxChannels) return false;
+    dev.channels = w->nChannels;
+    dev.planar = false;
+    dev.sampleRate = w->nSamplesPerSec;
+    if (isFloat && w->wBitsPerSample == 32)
+        dev.sample = nuchat::SampleFormat::Float32;
+    else if (isPcm && w->wBitsPerSample == 32) // 24-in-32 is left-justified, so reads as s32
+        dev.sample = nuchat::SampleFormat::Int32;
+    else if (isPcm && w->wBitsPerSample == 16)
+        dev.sample = nuchat::SampleFormat::Int16;
+    else
+        return false;
+    return true;
+}
 
-void renderThread(IAudioClient* renderClient, IAudioRenderClient* render, WAVEFORMATEX* fmt) {
-    HANDLE hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-    renderClient->SetEventHandle(hEvent);
-    HANDLE hTask = AvSetMmThreadCharacteristics(L"Pro Audio", NULL);
-    renderClient->Start();
+// Exclusive streams bypass the engine, so the format must be spelled out in
+// full for the driver.
+static WAVEFORMATEXTENSIBLE make_format(nuchat::SampleFormat sample, WORD validBits, WORD channels,
+                                        DWORD channelMask, DWORD rate) {
+    WAVEFORMATEXTENSIBLE f{};
+    WORD bytes = (WORD)nuchat::bytes_per_sample(sample);
+    f.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+    f.Format.nChannels = channels;
+    f.Format.nSamplesPerSec = rate;
+    f.Format.wBitsPerSample = bytes * 8;
+    f.Format.nBlockAlign = channels * bytes;
+    f.Format.nAvgBytesPerSec = rate * f.Format.nBlockAlign;
+    f.Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+    f.Samples.wValidBitsPerSample = validBits;
+    f.dwChannelMask = channelMask;
+    f.SubFormat = sample == nuchat::SampleFormat::Float32 ? KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+                                                          : KSDATAFORMAT_SUBTYPE_PCM;
+    return f;
+}
 
-    UINT32 bufferFrames;
-    renderClient->GetBufferSize(&bufferFrames);
+// The endpoint's channel layout comes from the mix format; the sample format
+// is the first of float32, s24-in-32, s32 and s16 the driver accepts, at
+// SAMPLE_RATE if possible and otherwise at the mix rate.
+static IAudioClient* open_exclusive(IMMDevice* dev, const WAVEFORMATEX* mix, StreamInfo& info) {
+    IAudioClient* client = nullptr;
+    if (FAILED(dev->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&client)))
+        return nullptr;
+    DWORD mask = mix->wFormatTag == WAVE_FORMAT_EXTENSIBLE
+                     ? reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(mix)->dwChannelMask
+                     : (mix->nChannels == 1 ? SPEAKER_FRONT_CENTER : SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT);
+    const struct { nuchat::SampleFormat sample; WORD validBits; } candidates[] = {
+        {nuchat::SampleFormat::Float32, 32},
+        {nuchat::SampleFormat::Int32, 24},
+        {nuchat::SampleFormat::Int32, 32},
+        {nuchat::SampleFormat::Int16, 16},
+    };
+    const DWORD rates[] = {SAMPLE_RATE, mix->nSamplesPerSec};
+    WAVEFORMATEXTENSIBLE fmt{};
+    bool supported = false;
+    for (DWORD rate : rates) {
+        for (const auto& c : candidates) {
+            fmt = make_format(c.sample, c.validBits, mix->nChannels, mask, rate);
+            if (client->IsFormatSupported(AUDCLNT_SHAREMODE_EXCLUSIVE, &fmt.Format, NULL) == S_OK &&
+                device_format_of(&fmt.Format, info.device)) {
+                supported = true;
+                break;
+            }
+        }
+        if (supported) break;
+    }
+    if (!supported) {
+        client->Release();
+        return nullptr;
+    }
+    REFERENCE_TIME defPeriod = 0, minPeriod = 0;
+    client->GetDevicePeriod(&defPeriod, &minPeriod);
+    HRESULT hr = client->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE, AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                                    minPeriod, minPeriod, &fmt.Format, NULL);
+    if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+        // Retry with the aligned size the driver reports, on a fresh client.
+        UINT32 aligned = 0;
+        client->GetBufferSize(&aligned);
+        client->Release();
+        client = nullptr;
+        if (FAILED(dev->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&client)))
+            return nullptr;
+        minPeriod = (REFERENCE_TIME)((double)HNS_PER_SEC * aligned / fmt.Format.nSamplesPerSec + 0.5);
+        hr = client->Initialize(AUDCLNT_SHAREMODE_EXCLUSIVE, AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                                minPeriod, minPeriod, &fmt.Format, NULL);
+    }
+    if (FAILED(hr)) {
+        client->Release();
+        return nullptr;
+    }
+    info.mode = StreamMode::Exclusive;
+    client->GetBufferSize(&info.bufferFrames);
+    info.periodFrames = info.bufferFrames;
+    return client;
+}
 
-    while (true) {
-        WaitForSingleObject(hEvent, INFINITE);
-        UINT32 padding = 0;
-        renderClient->GetCurrentPadding(&padding);
-        UINT32 frames = bufferFrames - padding;
-        if (frames == 0) continue;
+// Shared streams use the mix format unchanged, rate included, to stay off the
+// audio engine's converter; AudioEngine resamples to SAMPLE_RATE instead.
+static IAudioClient* open_low_latency(IMMDevice* dev, WAVEFORMATEX* mix, StreamInfo& info) {
+    if (!device_format_of(mix, info.device))
+        return nullptr;
+    IAudioClient3* client3 = nullptr;
+    if (FAILED(dev->Activate(__uuidof(IAudioClient3), CLSCTX_ALL, NULL, (void**)&client3)))
+        return nullptr;
+    UINT32 defFrames = 0, fundFrames = 0, minFrames = 0, maxFrames = 0;
+    if (FAILED(client3->GetSharedModeEnginePeriod(mix, &defFrames, &fundFrames, &minFrames, &maxFrames)) ||
+        FAILED(client3->InitializeSharedAudioStream(AUDCLNT_STREAMFLAGS_EVENTCALLBACK, minFrames, mix, NULL))) {
+        client3->Release();
+        return nullptr;
+    }
+    WAVEFORMATEX* cur = nullptr;
+    info.mode = StreamMode::LowLatency;
+    if (FAILED(client3->GetCurrentSharedModeEnginePeriod(&cur, &info.periodFrames)))
+        info.periodFrames = minFrames;
+    CoTaskMemFree(cur);
+    client3->GetBufferSize(&info.bufferFrames);
+    return client3; // IAudioClient3 derives from IAudioClient
+}
 
-        BYTE* pData;
-        render->GetBuffer(frames, &pData);
-        gFifo.pop(reinterpret_cast<float*>(pData), frames);
-        render->ReleaseBuffer(frames, 0);
+// Uses the mix format as is, at the mix rate. Only a layout we cannot convert
+// goes through the audio engine's converter (AUTOCONVERTPCM), as stereo float
+// at the mix rate.
+static IAudioClient* open_shared(IMMDevice* dev, WAVEFORMATEX* mix, StreamInfo& info) {
+    IAudioClient* client = nullptr;
+    if (FAILED(dev->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&client)))
+        return nullptr;
+    DWORD flags = AUDCLNT_STREAMFLAGS_EVENTCALLBACK;
+    WAVEFORMATEXTENSIBLE fallback{};
+    WAVEFORMATEX* fmt = mix;
+    if (!device_format_of(mix, info.device)) {
+        fallback = make_format(nuchat::SampleFormat::Float32, 32, 2, SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT,
+                               mix->nSamplesPerSec);
+        fmt = &fallback.Format;
+        device_format_of(fmt, info.device);
+        flags |= AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+    }
+    REFERENCE_TIME hnsBuffer = (REFERENCE_TIME)((double)HNS_PER_SEC * BUFFER_FRAMES / fmt->nSamplesPerSec);
+    if (FAILED(client->Initialize(AUDCLNT_SHAREMODE_SHARED, flags, hnsBuffer, 0, fmt, NULL))) {
+        client->Release();
+        return nullptr;
     }
-    AvRevertMmThreadCharacteristics(hTask);
+    REFERENCE_TIME defPeriod = 0;
+    client->GetDevicePeriod(&defPeriod, NULL);
+    info.mode = StreamMode::Shared;
+    info.periodFrames = (UINT32)(defPeriod * fmt->nSamplesPerSec / HNS_PER_SEC);
+    client->GetBufferSize(&info.bufferFrames);
+    return client;
+}
+
+// Opens dev in the requested mode, falling back exclusive -> low-latency ->
+// shared until one succeeds. Formats are derived from the device's own mix
+// format rather than imposed.
+static IAudioClient* open_stream(IMMDevice* dev, StreamMode want, StreamInfo& info) {
+    IAudioClient* mixClient = nullptr;
+    if (FAILED(dev->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&mixClient)))
+        return nullptr;
+    WAVEFORMATEX* mix = nullptr;
+    HRESULT hr = mixClient->GetMixFormat(&mix);
+    mixClient->Release();
+    if (FAILED(hr)) return nullptr;
+
+    IAudioClient* client = nullptr;
+    if (want == StreamMode::Exclusive)
+        client = open_exclusive(dev, mix, info);
+    if (!client && want != StreamMode::Shared)
+        client = open_low_latency(dev, mix, info);
+    if (!client)
+        client = open_shared(dev, mix, info);
+    CoTaskMemFree(mix);
+    return client;
 }
 
-void captureThread(IAudioClient* captureClient, IAudioCaptureClient* capture, WAVEFORMATEX* fmt) {
-    HANDLE hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-    captureClient->SetEventHandle(hEvent);
-    HANDLE hTask = AvSetMmThreadCharacteristics(L"Pro Audio", NULL);
-    captureClient->Start();
-
-    while (true) {
-        WaitForSingleObject(hEvent, INFINITE);
-        UINT32 packetFrames = 0;
-        BYTE* pData = nullptr;
-        DWORD flags = 0;
-        capture->GetNextPacketSize(&packetFrames);
-        while (packetFrames > 0) {
-            capture->GetBuffer(&pData, &packetFrames, &flags, NULL, NULL);
-            if (!(flags & AUDCLNT_BUFFERFLAGS_SILENT)) {
-                gFifo.push(reinterpret_cast<float*>(pData), packetFrames);
+static void report_stream(const char* which, const StreamInfo& info) {
+    std::cout << which << ": " << mode_name(info.mode) << ", "
+              << nuchat::sample_format_name(info.device.sample) << " x" << info.device.channels
+              << " @ " << info.device.sampleRate << " Hz, period " << info.periodFrames
+              << " frames (" << info.periodFrames * 1000.0 / info.device.sampleRate << " ms), buffer "
+              << info.bufferFrames << " frames\n";
+}
+
+// Default-endpoint changes arrive on an MMDevice notification thread, which
+// must not call back into the audio API: the callback only flags the stream
+// and wakes the engine's device thread. The object lives as long as the
+// engine, so reference counting is nominal.
+class EndpointWatcher : public IMMNotificationClient {
+public:
+    std::atomic<bool> captureChanged{false}, renderChanged{false};
+    HANDLE wake = nullptr;
+
+    void flag(std::atomic<bool>& which) {
+        which = true;
+        SetEvent(wake);
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&refs); }
+    ULONG STDMETHODCALLTYPE Release() override { return InterlockedDecrement(&refs); }
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** out) override {
+        if (iid == __uuidof(IUnknown) || iid == __uuidof(IMMNotificationClient)) {
+            *out = static_cast<IMMNotificationClient*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *out = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    // The engine follows the communications capture and console render
+    // defaults, the roles it opened.
+    HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR) override {
+        if (flow == eCapture && role == eCommunications) flag(captureChanged);
+        else if (flow == eRender && role == eConsole) flag(renderChanged);
+        return S_OK;
+    }
+    HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR, DWORD) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR, const PROPERTYKEY) override { return S_OK; }
+
+private:
+    LONG refs = 1;
+};
+
+// Each endpoint stream has its own thread, client and event. When its
+// endpoint is invalidated (unplugged) or the default changes, the device
+// thread tears down and reopens only that stream on the new default; the
+// other stream keeps running and the FIFO, jitter buffer and DSP keep their
+// state (AudioEngine::reopenCapture/reopenRender).
+class WasapiEngine : public nuchat::AudioEngine {
+public:
+    StreamMode mode = StreamMode::Shared;
+
+    const char* name() const override { return "wasapi"; }
+
+    bool start(const nuchat::AudioFormat& want) override {
+        CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, IID_PPV_ARGS(&devEnum));
+        if (!devEnum) return false;
+        IMMDevice* inDev = nullptr, * outDev = nullptr;
+        devEnum->GetDefaultAudioEndpoint(eCapture, eCommunications, &inDev);
+        devEnum->GetDefaultAudioEndpoint(eRender, eConsole, &outDev);
+        if (!inDev || !outDev) {
+            std::cerr << "No default capture or render endpoint\n";
+            return false;
+        }
+
+        StreamInfo outInfo, inInfo;
+        outClient = open_stream(outDev, mode, outInfo);
+        inClient = open_stream(inDev, mode, inInfo);
+        outDev->Release();
+        inDev->Release();
+        if (!outClient || !inClient) {
+            std::cerr << "Cannot initialize audio clients\n";
+            return false;
+        }
+        report_stream("render", outInfo);
+        report_stream("capture", inInfo);
+
+        outClient->GetService(IID_PPV_ARGS(&render));
+        inClient->GetService(IID_PPV_ARGS(&capture));
+
+        // The jitter buffer holds two of the larger granted periods, counted
+        // at the processing rate, unless --jitter-ms says otherwise.
+        auto internal_frames = [&](const StreamInfo& i) {
+            return (UINT32)((uint64_t)i.periodFrames * want.sampleRate / i.device.sampleRate);
+        };
+        nuchat::AudioFormat granted = want;
+        granted.channels = 1;
+        granted.framesPerPeriod = std::max(internal_frames(outInfo), internal_frames(inInfo));
+        setDeviceFormats(inInfo.device, outInfo.device);
+        prepare(granted, std::max(outInfo.bufferFrames, inInfo.bufferFrames));
+
+        renderEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        captureEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        outClient->SetEventHandle(renderEvent);
+        inClient->SetEventHandle(captureEvent);
+
+        watcher.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        devEnum->RegisterEndpointNotificationCallback(&watcher);
+
+        running = true;
+        renderLive = captureLive = true;
+        renderExclusive = outInfo.mode == StreamMode::Exclusive;
+        renderRate = outInfo.device.sampleRate;
+        tOut = std::thread(&WasapiEngine::renderThread, this);
+        tIn = std::thread(&WasapiEngine::captureThread, this);
+        tDevice = std::thread(&WasapiEngine::deviceThread, this);
+        return true;
+    }
+
+    void stop() override {
+        running = false;
+        if (watcher.wake) SetEvent(watcher.wake);
+        if (tDevice.joinable()) tDevice.join();
+        if (devEnum) devEnum->UnregisterEndpointNotificationCallback(&watcher);
+        stopStream(false);
+        stopStream(true);
+        if (devEnum) { devEnum->Release(); devEnum = nullptr; }
+        if (renderEvent) { CloseHandle(renderEvent); renderEvent = nullptr; }
+        if (captureEvent) { CloseHandle(captureEvent); captureEvent = nullptr; }
+        if (watcher.wake) { CloseHandle(watcher.wake); watcher.wake = nullptr; }
+    }
+
+private:
+    // Joins the stream's thread and releases its client.
+    void stopStream(bool isCapture) {
+        (isCapture ? captureLive : renderLive) = false;
+        HANDLE event = isCapture ? captureEvent : renderEvent;
+        if (event) SetEvent(event);
+        std::thread& t = isCapture ? tIn : tOut;
+        if (t.joinable()) t.join();
+        IAudioClient*& client = isCapture ? inClient : outClient;
+        if (client) client->Stop();
+        if (isCapture && capture) { capture->Release(); capture = nullptr; }
+        if (!isCapture && render) { render->Release(); render = nullptr; }
+        if (client) { client->Release(); client = nullptr; }
+    }
+
+    // Device thread: opens the new default endpoint for the stream and
+    // restarts it. With no endpoint to open, the stream stays down until the
+    // next default change (e.g. the device being plugged back in).
+    void reopenStream(bool isCapture) {
+        stopStream(isCapture);
+        IMMDevice* dev = nullptr;
+        devEnum->GetDefaultAudioEndpoint(isCapture ? eCapture : eRender,
+                                         isCapture ? eCommunications : eConsole, &dev);
+        StreamInfo info;
+        IAudioClient* client = dev ? open_stream(dev, mode, info) : nullptr;
+        if (dev) dev->Release();
+        const char* which = isCapture ? "capture" : "render";
+        if (!client) {
+            std::cerr << which << ": no usable default endpoint; waiting for a device change\n";
+            return;
+        }
+        report_stream(which, info);
+        if (isCapture) {
+            inClient = client;
+            inClient->GetService(IID_PPV_ARGS(&capture));
+            inClient->SetEventHandle(captureEvent);
+            reopenCapture(info.device);
+            captureLive = true;
+            tIn = std::thread(&WasapiEngine::captureThread, this);
+        } else {
+            outClient = client;
+            outClient->GetService(IID_PPV_ARGS(&render));
+            outClient->SetEventHandle(renderEvent);
+            reopenRender(info.device);
+            renderExclusive = info.mode == StreamMode::Exclusive;
+            renderRate = info.device.sampleRate;
+            renderLive = true;
+            tOut = std::thread(&WasapiEngine::renderThread, this);
+        }
+    }
+
+    void deviceThread() {
+        CoInitializeEx(NULL, COINIT_MULTITHREADED);
+        while (running) {
+            WaitForSingleObject(watcher.wake, INFINITE);
+            if (!running) break;
+            if (watcher.renderChanged.exchange(false)) reopenStream(false);
+            if (watcher.captureChanged.exchange(false)) reopenStream(true);
+        }
+        CoUninitialize();
+    }
+
+    void renderThread() {
+        HANDLE hTask = AvSetMmThreadCharacteristics(L"Pro Audio", NULL);
+        outClient->Start();
+
+        UINT32 bufferFrames;
+        outClient->GetBufferSize(&bufferFrames);
+        bool exclusive = renderExclusive;
+        bool started = false;
+
+        while (renderLive) {
+            // Events stop when the endpoint goes away; the timeout lets the
+            // loop notice.
+            DWORD wait = WaitForSingleObject(renderEvent, 200);
+            if (!renderLive) break;
+            // Exclusive event mode hands us a whole buffer per event; shared
+            // mode only has room for what the engine has already consumed.
+            UINT32 padding = 0;
+            HRESULT hr = (!exclusive || wait == WAIT_TIMEOUT) ? outClient->GetCurrentPadding(&padding) : S_OK;
+            if (hr == AUDCLNT_E_DEVICE_INVALIDATED) break;
+            if (wait == WAIT_TIMEOUT) continue;
+            UINT32 frames = bufferFrames - padding;
+            if (frames == 0) continue;
+            // A shared-mode engine that has drained our whole buffer glitched.
+            if (!exclusive && started && padding == 0)
+                renMetrics.addXrun();
+            started = true;
+
+            BYTE* pData;
+            hr = render->GetBuffer(frames, &pData);
+            if (hr == AUDCLNT_E_DEVICE_INVALIDATED) break;
+            if (FAILED(hr)) {
+                renMetrics.addXrun();
+                continue;
             }
-            capture->ReleaseBuffer(packetFrames);
-            capture->GetNextPacketSize(&packetFrames);
+            // These frames play once the queued ones have; in exclusive mode
+            // that is the other half of the double buffer.
+            UINT32 queued = exclusive ? bufferFrames : padding;
+            noteRenderTime(nuchat::host_now_ns() + nuchat::frames_to_ns(queued, renderRate));
+            void* bufs[1] = {pData};
+            onRenderDevice(bufs, frames);
+            render->ReleaseBuffer(frames, 0);
+        }
+        if (renderLive) {
+            std::cerr << "render: endpoint lost\n";
+            watcher.flag(watcher.renderChanged);
         }
+        AvRevertMmThreadCharacteristics(hTask);
     }
-    AvRevertMmThreadCharacteristics(hTask);
-}
 
-int main() {
-    CoInitializeEx(NULL, COINIT_MULTITHREADED);
-    IMMDeviceEnumerator* devEnum = nullptr;
-    CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, IID_PPV_ARGS(&devEnum));
-
-    IMMDevice* inDev = nullptr, * outDev = nullptr;
-    devEnum->GetDefaultAudioEndpoint(eCapture, eCommunications, &inDev);
-    devEnum->GetDefaultAudioEndpoint(eRender, eConsole, &outDev);
-
-    IAudioClient* inClient = nullptr, * outClient = nullptr;
-    inDev->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&inClient);
-    outDev->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&outClient);
-
-    WAVEFORMATEX* wfx = nullptr;
-    outClient->GetMixFormat(&wfx);
-    wfx->nSamplesPerSec = SAMPLE_RATE;
-    wfx->nChannels = CHANNELS;
-    wfx->wBitsPerSample = 32;
-    wfx->nBlockAlign = CHANNELS * 4;
-    wfx->nAvgBytesPerSec = SAMPLE_RATE * wfx->nBlockAlign;
-    wfx->wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
-
-    REFERENCE_TIME hnsBuffer = (REFERENCE_TIME)((double)HNS_PER_SEC * BUFFER_FRAMES / SAMPLE_RATE);
-
-    outClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-                          AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
-                          hnsBuffer, 0, wfx, NULL);
-    inClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-                         AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
-                         hnsBuffer, 0, wfx, NULL);
+    void captureThread() {
+        HANDLE hTask = AvSetMmThreadCharacteristics(L"Pro Audio", NULL);
+        inClient->Start();
 
+        HRESULT hr = S_OK;
+        while (captureLive) {
+            WaitForSingleObject(captureEvent, 200);
+            UINT32 packetFrames = 0;
+            BYTE* pData = nullptr;
+            DWORD flags = 0;
+            UINT64 position = 0, qpc = 0;
+            hr = capture->GetNextPacketSize(&packetFrames);
+            while (captureLive && SUCCEEDED(hr) && packetFrames > 0) {
+                hr = capture->GetBuffer(&pData, &packetFrames, &flags, &position, &qpc);
+                if (FAILED(hr)) {
+                    capMetrics.addXrun();
+                    break;
+                }
+                noteCapturePosition(position, packetFrames);
+                // The QPC time the packet's first frame was recorded.
+                if (!(flags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR))
+                    noteCaptureTime(nuchat::host_ns_from_qpc_hns(qpc));
+                if (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+                    capMetrics.addXrun();
+                const void* bufs[1] = {pData};
+                bool silent = (flags & AUDCLNT_BUFFERFLAGS_SILENT) != 0;
+                onCaptureDevice(silent ? nullptr : bufs, packetFrames);
+                capture->ReleaseBuffer(packetFrames);
+                hr = capture->GetNextPacketSize(&packetFrames);
+            }
+            if (hr == AUDCLNT_E_DEVICE_INVALIDATED) break;
+        }
+        if (captureLive) {
+            std::cerr << "capture: endpoint lost\n";
+            watcher.flag(watcher.captureChanged);
+        }
+        AvRevertMmThreadCharacteristics(hTask);
+    }
+
+    IMMDeviceEnumerator* devEnum = nullptr;
+    IAudioClient* outClient = nullptr;
+    IAudioClient* inClient = nullptr;
     IAudioRenderClient* render = nullptr;
-    outClient->GetService(IID_PPV_ARGS(&render));
     IAudioCaptureClient* capture = nullptr;
-    inClient->GetService(IID_PPV_ARGS(&capture));
+    HANDLE renderEvent = nullptr, captureEvent = nullptr;
+    EndpointWatcher watcher;
+    std::atomic<bool> running{false};
+    std::atomic<bool> renderLive{false}, captureLive{false}; // cleared to stop one stream
+    bool renderExclusive = false;
+    uint32_t renderRate = 48000; // device side, for presentation times
+    std::thread tOut, tIn, tDevice;
+};
 
-    std::thread tOut(renderThread, outClient, render, wfx);
-    std::thread tIn(captureThread, inClient, capture, wfx);
+int main(int argc, char** argv) {
+    std::unique_ptr<nuchat::RtWorkerPool> workers; // outlives the engine
+    nuchat::CallRecorder recorder;                 // likewise
+    WasapiEngine engine;
+    nuchat::LatencyProbeConfig probeConfig;
+    probeConfig.sampleRate = SAMPLE_RATE;
+    probeConfig.trials = 0;
+    const char* metricsFormat = nullptr;
+    double metricsInterval = 5.0;
+    nuchat::TransportConfig net;
+    const char* codecName = "l16";
+    int32_t bitrate = 32000;
+    bool echoCancel = true;
+    double duration = 0.0;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--jitter-ms") && i + 1 < argc) {
+            engine.setJitterTargetMs(std::atof(argv[++i]));
+        } else if (!std::strcmp(argv[i], "--duration") && i + 1 < argc) {
+            duration = std::atof(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--mode") && i + 1 < argc) {
+            const char* m = argv[++i];
+            if (!std::strcmp(m, "exclusive")) engine.mode = StreamMode::Exclusive;
+            else if (!std::strcmp(m, "low-latency")) engine.mode = StreamMode::LowLatency;
+            else engine.mode = StreamMode::Shared;
+        } else if (!std::strcmp(argv[i], "--measure-latency") && i + 1 < argc) {
+            probeConfig.trials = (UINT32)std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metricsFormat = argv[++i];
+        } else if (!std::strcmp(argv[i], "--metrics-interval") && i + 1 < argc) {
+            metricsInterval = std::atof(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--peer") && i + 1 < argc) {
+            net.peer = argv[++i];
+        } else if (!std::strcmp(argv[i], "--listen") && i + 1 < argc) {
+            net.localPort = (uint16_t)std::atoi(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--packet-ms") && i + 1 < argc) {
+            net.packetMs = std::atof(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--no-vad")) {
+            engine.setSilenceSuppression(false);
+        } else if (!std::strcmp(argv[i], "--no-aec")) {
+            echoCancel = false;
+        } else if (!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+            nuchat::RtWorkerConfig wc;
+            if (!nuchat::parse_core_list(argv[++i], wc.cores)) {
+                std::cerr << "Bad core list '" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+            wc.workers = (uint32_t)wc.cores.size();
+            workers = std::make_unique<nuchat::RtWorkerPool>(wc);
+            engine.setWorkerPool(workers.get());
+        } else if (!std::strcmp(argv[i], "--record") && i + 1 < argc) {
+            std::string prefix = argv[++i];
+            engine.setRecordTaps(recorder.open((prefix + "-capture.wav").c_str()),
+                                 recorder.open((prefix + "-render.wav").c_str()));
+        } else if (!std::strcmp(argv[i], "--codec") && i + 1 < argc) {
+            codecName = argv[++i];
+        } else if (!std::strcmp(argv[i], "--bitrate") && i + 1 < argc) {
+            bitrate = (int32_t)std::atoi(argv[++i]);
+        }
+    }
+    std::unique_ptr<nuchat::AudioCodec> codec = nuchat::make_codec(codecName, bitrate);
+    if (!codec) {
+        std::cerr << "Unknown or unavailable codec '" << codecName << "'" << std::endl;
+        return 1;
+    }
+    std::unique_ptr<nuchat::UdpTransport> transport;
+    if (!net.peer.empty()) {
+        transport = std::make_unique<nuchat::UdpTransport>(net);
+        transport->setCodec(codec.get());
+        if (!transport->open())
+            return 1;
+        engine.setTransport(transport.get());
+    }
+    std::unique_ptr<nuchat::LatencyProbe> probe;
+    if (probeConfig.trials > 0) {
+        probe = std::make_unique<nuchat::LatencyProbe>(probeConfig);
+        engine.setLatencyProbe(probe.get());
+    }
+
+    nuchat::EchoCanceller aec;
+    if (echoCancel)
+        engine.setEchoCanceller(&aec);
+
+    // Plain loopback; DSP stages are added to the graph here.
+    nuchat::ProcessingGraph graph;
+    engine.setProcessor(&graph);
+
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    nuchat::AudioFormat want;
+    want.sampleRate = SAMPLE_RATE;
+    want.channels = CHANNELS;
+    want.framesPerPeriod = BUFFER_FRAMES;
+    nuchat::install_stop_handlers();
+    if (!engine.start(want)) {
+        engine.stop();
+        CoUninitialize();
+        return 1;
+    }
+    recorder.start();
 
-    std::cout << "Running... speak into mic, you'll hear yourself with low latency.\n";
-    tOut.join();
-    tIn.join();
+    nuchat::MetricsExporter exporter;
+    exporter.add(&engine.captureMetrics());
+    exporter.add(&engine.renderMetrics());
+    if (metricsFormat) {
+        exporter.start(std::strcmp(metricsFormat, "prom") ? nuchat::MetricsFormat::Json
+                                                          : nuchat::MetricsFormat::Prometheus,
+                       metricsInterval, stdout);
+    }
+
+    if (probe) {
+        std::cout << "Measuring round-trip latency (" << probeConfig.trials << " trials)...\n";
+        while (!probe->step() && !nuchat::stop_requested())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::cout << probe->report() << std::endl;
+    } else {
+        if (transport)
+            std::cout << "Streaming to " << net.peer << " (" << transport->currentCodec().name() << ", "
+                      << transport->packetFrames() << "-frame packets)...\n";
+        else
+            std::cout << "Running... speak into mic, you'll hear yourself with low latency.\n";
+        // Control lines on stdin while running, e.g. "mute on", "jitter-ms 20".
+        nuchat::run_console_until_stop(duration, [&engine](const char* line) {
+            if (!engine.command(line))
+                std::cerr << "Unknown control '" << line << "'" << std::endl;
+        });
+    }
+
+    exporter.stop();
+    engine.stop();
+    recorder.stop();
+    engine.report(stderr);
+    if (transport) {
+        transport->stop();
+        transport->report(stderr);
+    }
+    if (echoCancel)
+        aec.report(stderr);
+    if (workers)
+        workers->report(stderr);
+    CoUninitialize();
+    return 0;
 }